@@ -0,0 +1,586 @@
+#define _GNU_SOURCE
+#include "block_cache.h"
+#include "compression_reader.h"
+
+/* Block index of a cache entry holding nothing */
+#define NO_BLOCK    UINT64_MAX
+
+/*****************************************************************************/
+/************************* Private struct functions **************************/
+/*****************************************************************************/
+
+/* Moves a cache entry to start of linked list */
+static void move_to_cache_head(BlockCache *cache, BlockCacheEntry *entry) {
+    if (cache->first != entry) {
+        if (entry->next) {
+            entry->next->prev = entry->prev;
+        } else {
+            assert(entry == cache->last);
+            cache->last = entry->prev;
+        }
+        entry->prev->next = entry->next;
+
+        entry->prev = NULL;
+        entry->next = cache->first;
+        entry->next->prev = entry;
+        cache->first = entry;
+    }
+}
+
+/* Allocates memory for a decompressed block.  Blocks live in their own
+ * memfd where available, so that they can be handed out by file descriptor
+ * and spliced by the kernel. */
+static uint8_t *alloc_block_buffer(BlockCache *cache, size_t size, int *fd) {
+    *fd = -1;
+
+#ifdef MFD_CLOEXEC
+    int memfd = memfd_create(cache->name, MFD_CLOEXEC);
+    if (memfd >= 0) {
+        if (ftruncate(memfd, size) == 0) {
+            void *data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    memfd, 0);
+            if (data != MAP_FAILED) {
+                *fd = memfd;
+                return (uint8_t *) data;
+            }
+        }
+        close(memfd);
+    }
+#else
+    UNUSED(cache);
+#endif
+
+    return (uint8_t *) malloc(sizeof(uint8_t) * size);
+}
+
+/* Frees memory from alloc_block_buffer */
+static void free_block_buffer(uint8_t *data, size_t size, int fd) {
+    if (fd >= 0) {
+        munmap(data, size);
+        close(fd);
+    } else {
+        free(data);
+    }
+}
+
+/* Finds cache entry holding a block, and marks it most recently used */
+static BlockCacheEntry *find_cache_entry(BlockCache *cache, uint64_t block) {
+    for (BlockCacheEntry *entry = cache->first; entry; entry = entry->next) {
+        if (entry->block == block) {
+            move_to_cache_head(cache, entry);
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* Marks an entry as read, or not, since it was prefetched */
+static void set_prefetched(BlockCache *cache, BlockCacheEntry *entry,
+        uint8_t prefetched) {
+    if (entry->prefetched != prefetched) {
+        cache->num_prefetched += prefetched ? 1 : -1;
+        entry->prefetched = prefetched;
+    }
+}
+
+/* Adds an empty entry for a block about to be decompressed, using LRU cache
+ * replacement policy.  Entries with references out are never evicted, if
+ * all of them are NULL is returned.  NULL is returned for prefetched blocks
+ * too once BLOCK_CACHE_PREFETCH of them are waiting to be read. */
+static BlockCacheEntry *add_new_block(BlockCache *cache, uint64_t block,
+        off_t offset, size_t size, uint8_t prefetched) {
+
+    BlockCacheEntry *entry;
+
+    if (BLOCK_CACHE_ENTRIES == 0) {
+        return NULL;
+    }
+
+    if (prefetched && cache->num_prefetched >= BLOCK_CACHE_PREFETCH) {
+        return NULL;
+    }
+
+    if (cache->num_entries < BLOCK_CACHE_ENTRIES) {
+        entry = (BlockCacheEntry *) malloc(sizeof(BlockCacheEntry));
+        assert(entry != NULL);
+
+        if (entry == NULL) {
+            return NULL;
+        }
+
+        entry->refs = 0;
+        entry->prefetched = FALSE;
+
+        entry->prev = NULL;
+        entry->next = cache->first;
+        if (cache->first) {
+            cache->first->prev = entry;
+        }
+        cache->first = entry;
+        if (cache->last == NULL) {
+            assert(cache->num_entries == 0);
+            cache->last = entry;
+        }
+        cache->num_entries++;
+
+    } else {
+        entry = cache->last;
+        while (entry && entry->refs) {
+            entry = entry->prev;
+        }
+        if (entry == NULL) {
+            return NULL;
+        }
+
+        move_to_cache_head(cache, entry);
+        free_block_buffer(entry->data, entry->size, entry->fd);
+    }
+
+    entry->block = block;
+    entry->offset = offset;
+    entry->size = size;
+    entry->data = NULL;
+    entry->fd = -1;
+    entry->decoding = TRUE;
+    set_prefetched(cache, entry, prefetched);
+    return entry;
+}
+
+/* Free cache entries */
+static void free_cache_entries(BlockCache *cache) {
+    uint64_t count = 0;
+    BlockCacheEntry *current = cache->first;
+    BlockCacheEntry *temp_prev;
+
+    if (current) {
+        assert(current->prev == NULL);
+        assert(cache->last->next == NULL);
+    }
+
+    while (current) {
+        temp_prev = current;
+        current = current->next;
+
+        if (current) {
+            assert(temp_prev == current->prev);
+        }
+
+        free_block_buffer(temp_prev->data, temp_prev->size, temp_prev->fd);
+        free(temp_prev);
+
+        count++;
+    }
+
+    assert(count == cache->num_entries);
+    cache->num_entries = 0;
+    cache->num_prefetched = 0;
+    cache->first = NULL;
+    cache->last = NULL;
+}
+
+/*****************************************************************************/
+/*************************** Data access functions ***************************/
+/*****************************************************************************/
+
+/* Decompresses a block into a buffer of its own, NULL if error */
+static uint8_t *decode_block(BlockCache *cache, uint64_t block, off_t start,
+        size_t size, int *data_fd) {
+
+    uint8_t *data = alloc_block_buffer(cache, size, data_fd);
+    if (data != NULL
+            && !cache->decode(cache->reader, block, start, data, size)) {
+        free_block_buffer(data, size, *data_fd);
+        data = NULL;
+        *data_fd = -1;
+    }
+    return data;
+}
+
+/* Decompresses the block of an entry claimed by add_new_block, and wakes
+ * up the threads waiting for it.  A failed entry is left empty, the threads
+ * holding it let go once they see that. */
+static void decode_entry(BlockCache *cache, BlockCacheEntry *entry) {
+    int data_fd;
+
+    /* The entry does not change while decoding is set */
+    uint8_t *data = decode_block(cache, entry->block, entry->offset,
+            entry->size, &data_fd);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->decoded_blocks++;
+    if (data != NULL) {
+        entry->data = data;
+        entry->fd = data_fd;
+    } else {
+        set_prefetched(cache, entry, FALSE);
+        entry->block = NO_BLOCK;
+        entry->size = 0;
+    }
+    entry->decoding = FALSE;
+    pthread_cond_broadcast(&cache->decoded);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Takes the next claimed entry off the decode queue, NULL if empty.  Must
+ * be called with lock held */
+static BlockCacheEntry *dequeue_entry(BlockCache *cache) {
+    if (cache->queue_length == 0) {
+        return NULL;
+    }
+
+    BlockCacheEntry *entry = cache->queue[cache->queue_head];
+    cache->queue_head = (cache->queue_head + 1) % BLOCK_CACHE_ENTRIES;
+    cache->queue_length--;
+    return entry;
+}
+
+/* Decompresses queued blocks until stopped */
+static void *decode_thread(void *arg) {
+    BlockCache *cache = (BlockCache *) arg;
+
+    pthread_mutex_lock(&cache->lock);
+    while (!cache->stopping) {
+        BlockCacheEntry *entry = dequeue_entry(cache);
+        if (entry == NULL) {
+            pthread_cond_wait(&cache->queued, &cache->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        decode_entry(cache, entry);
+
+        pthread_mutex_lock(&cache->lock);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
+
+/* Queues claimed entries for the decode threads.  Threads are only started
+ * here, so that a process forking after its first reads (such as a FUSE
+ * daemon going to the background) does not lose them.  Must be called with
+ * lock held */
+static void queue_entries(BlockCache *cache, BlockCacheEntry **entries,
+        uint32_t count) {
+    while (cache->num_threads < BLOCK_CACHE_DECODE_THREADS) {
+        if (pthread_create(&cache->threads[cache->num_threads], NULL,
+                    decode_thread, cache) != 0) {
+            break;
+        }
+        cache->num_threads++;
+    }
+
+    /* Every queued entry is being decoded, so the queue cannot overflow */
+    for (uint32_t i = 0; i < count; i++) {
+        assert(cache->queue_length < BLOCK_CACHE_ENTRIES);
+        uint32_t tail = (cache->queue_head + cache->queue_length)
+            % BLOCK_CACHE_ENTRIES;
+        cache->queue[tail] = entries[i];
+        cache->queue_length++;
+    }
+
+    pthread_cond_broadcast(&cache->queued);
+}
+
+/* Drops the hold get_blocks took on a cache entry */
+static void put_block(BlockCache *cache, BlockCacheEntry *entry) {
+    pthread_mutex_lock(&cache->lock);
+    assert(entry->refs > 0);
+    entry->refs--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Gets the blocks overlapping [offset, end), up to BLOCK_CACHE_PER_PASS of
+ * them, from cache or by decompressing them.  Cached blocks are held until
+ * put_block, blocks[], starts[] and sizes[] are set to where the blocks are
+ * and entries[] to the entries, NULL for a block that cannot be cached
+ * which the caller decompresses itself.  When prefetching, blocks stop at
+ * the first that cannot be cached instead.
+ *
+ * Blocks missing from the cache are decompressed at once, by the caller
+ * and the decode threads, without the cache lock held.  Their entries are
+ * added before though, so that threads wanting the same blocks wait for
+ * them rather than decompressing them again.
+ *
+ * Returns the number of blocks, 0 if offset is past the end of the data,
+ * or READER_ERROR if a block could not be decompressed. */
+static int32_t get_blocks(BlockCache *cache, off_t offset, off_t end,
+        uint64_t *blocks, off_t *starts, size_t *sizes,
+        BlockCacheEntry **entries, uint8_t prefetch) {
+
+    BlockCacheEntry *claimed[BLOCK_CACHE_PER_PASS];
+    uint32_t num_claimed = 0;
+    int32_t count = 0;
+    off_t position = offset;
+
+    pthread_mutex_lock(&cache->lock);
+    while (count < BLOCK_CACHE_PER_PASS && position < end
+            && cache->locate(cache->reader, position, &blocks[count],
+                &starts[count], &sizes[count])) {
+
+        BlockCacheEntry *entry = find_cache_entry(cache, blocks[count]);
+        if (entry) {
+            if (!prefetch) {
+                set_prefetched(cache, entry, FALSE);
+            }
+            if (entry->decoding) {
+                cache->coalesced_reads++;
+            }
+        } else {
+            entry = add_new_block(cache, blocks[count], starts[count],
+                    sizes[count], prefetch);
+            if (entry) {
+                claimed[num_claimed++] = entry;
+            } else if (prefetch) {
+                break;
+            }
+        }
+
+        if (entry) {
+            entry->refs++;
+        }
+        entries[count] = entry;
+
+        position = starts[count] + sizes[count];
+        count++;
+    }
+
+    /* The first block is decompressed by this thread, the rest alongside */
+    if (num_claimed > 1) {
+        queue_entries(cache, &claimed[1], num_claimed - 1);
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    if (num_claimed > 0) {
+        decode_entry(cache, claimed[0]);
+    }
+
+    pthread_mutex_lock(&cache->lock);
+
+    /* Rather than wait, help with whatever is queued */
+    BlockCacheEntry *queued;
+    while ((queued = dequeue_entry(cache)) != NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        decode_entry(cache, queued);
+        pthread_mutex_lock(&cache->lock);
+    }
+
+    uint8_t failed = FALSE;
+    for (int32_t i = 0; i < count; i++) {
+        if (entries[i] == NULL) {
+            continue;
+        }
+        while (entries[i]->decoding) {
+            pthread_cond_wait(&cache->decoded, &cache->lock);
+        }
+
+        /* The thread decompressing it failed */
+        if (entries[i]->data == NULL) {
+            failed = TRUE;
+        }
+    }
+
+    if (failed) {
+        for (int32_t i = 0; i < count; i++) {
+            if (entries[i]) {
+                assert(entries[i]->refs > 0);
+                entries[i]->refs--;
+            }
+        }
+        count = READER_ERROR;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return count;
+}
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/* Allocates an empty block cache */
+extern BlockCache *block_cache_alloc(void *reader, BlockLocate locate,
+        BlockDecode decode, const char *name) {
+    BlockCache *cache = (BlockCache *) malloc(sizeof(BlockCache));
+    assert(cache != NULL);
+
+    if (cache != NULL) {
+        cache->reader = reader;
+        cache->locate = locate;
+        cache->decode = decode;
+        cache->name = name;
+
+        cache->num_entries = 0;
+        cache->num_prefetched = 0;
+        cache->first = NULL;
+        cache->last = NULL;
+        pthread_mutex_init(&cache->lock, NULL);
+        pthread_cond_init(&cache->decoded, NULL);
+        pthread_cond_init(&cache->queued, NULL);
+        cache->queue_head = 0;
+        cache->queue_length = 0;
+        cache->num_threads = 0;
+        cache->stopping = FALSE;
+        cache->decoded_blocks = 0;
+        cache->coalesced_reads = 0;
+    }
+
+    return cache;
+}
+
+/* Reads decompressed data */
+extern int64_t block_cache_read(BlockCache *cache, uint8_t *buffer,
+        off_t offset, size_t length) {
+
+    uint64_t blocks[BLOCK_CACHE_PER_PASS];
+    off_t starts[BLOCK_CACHE_PER_PASS];
+    size_t sizes[BLOCK_CACHE_PER_PASS];
+    BlockCacheEntry *entries[BLOCK_CACHE_PER_PASS];
+    off_t position = offset;
+    off_t end = offset + length;
+
+    while (position < end) {
+        int32_t count = get_blocks(cache, position, end, blocks, starts,
+                sizes, entries, FALSE);
+        if (count <= 0) {
+            break;
+        }
+
+        uint8_t failed = FALSE;
+        for (int32_t i = 0; i < count; i++) {
+            uint8_t *block = NULL;
+            int block_fd = -1;
+
+            /* Blocks that cannot be cached are decompressed on their own */
+            if (entries[i]) {
+                block = entries[i]->data;
+            } else if (!failed) {
+                block = decode_block(cache, blocks[i], starts[i], sizes[i],
+                        &block_fd);
+            }
+
+            if (block && !failed) {
+                size_t n = MIN((size_t) (end - position),
+                        (size_t) (starts[i] + sizes[i] - position));
+                memcpy(&buffer[position - offset],
+                        &block[position - starts[i]], n);
+                position += n;
+            } else {
+                failed = TRUE;
+            }
+
+            if (entries[i]) {
+                put_block(cache, entries[i]);
+            } else if (block) {
+                free_block_buffer(block, sizes[i], block_fd);
+            }
+        }
+
+        if (failed) {
+            break;
+        }
+    }
+
+    if (position == offset && length > 0) {
+        return READER_ERROR;
+    }
+
+    return position - offset;
+}
+
+/* References a cached block */
+extern int64_t block_cache_read_ref(BlockCache *cache, off_t offset,
+        size_t length, struct CompressionRef *ref) {
+
+    uint64_t block;
+    off_t start;
+    size_t size;
+    BlockCacheEntry *entry;
+
+    if (get_blocks(cache, offset, offset + 1, &block, &start, &size, &entry,
+                FALSE) != 1) {
+        return READER_ERROR;
+    }
+
+    /* Only cached blocks stay around long enough to be referenced */
+    if (entry == NULL || entry->fd < 0) {
+        if (entry) {
+            put_block(cache, entry);
+        }
+        return READER_ERROR;
+    }
+
+    /* The hold from get_blocks is passed on to the reference */
+    ref->fd = entry->fd;
+    ref->fd_offset = offset - entry->offset;
+    ref->length = MIN(length, (size_t) (entry->offset + entry->size - offset));
+    ref->token = entry;
+
+    return ref->length;
+}
+
+/* Releases a reference from block_cache_read_ref */
+extern void block_cache_release_ref(BlockCache *cache,
+        struct CompressionRef *ref) {
+    put_block(cache, (BlockCacheEntry *) ref->token);
+}
+
+/* Decompresses the blocks overlapping a range into the cache */
+extern int64_t block_cache_prefetch(BlockCache *cache, off_t offset,
+        size_t length) {
+
+    uint64_t blocks[BLOCK_CACHE_PER_PASS];
+    off_t starts[BLOCK_CACHE_PER_PASS];
+    size_t sizes[BLOCK_CACHE_PER_PASS];
+    BlockCacheEntry *entries[BLOCK_CACHE_PER_PASS];
+    off_t position = offset;
+    off_t end = offset + length;
+
+    while (position < end) {
+        int32_t count = get_blocks(cache, position, end, blocks, starts,
+                sizes, entries, TRUE);
+        if (count < 0) {
+            return (position > offset) ? position - offset : READER_ERROR;
+        }
+
+        /* The cache is full of blocks in use or yet to be read */
+        if (count == 0) {
+            break;
+        }
+
+        for (int32_t i = 0; i < count; i++) {
+            put_block(cache, entries[i]);
+        }
+        position = starts[count - 1] + sizes[count - 1];
+    }
+
+    return MIN(position, end) - offset;
+}
+
+/* Reports block cache counters */
+extern void block_cache_stats(BlockCache *cache,
+        struct CompressionStats *stats) {
+    pthread_mutex_lock(&cache->lock);
+    stats->decoded = cache->decoded_blocks;
+    stats->coalesced = cache->coalesced_reads;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Frees a block cache */
+extern void block_cache_free(BlockCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    cache->stopping = TRUE;
+    pthread_cond_broadcast(&cache->queued);
+    pthread_mutex_unlock(&cache->lock);
+
+    for (uint32_t i = 0; i < cache->num_threads; i++) {
+        pthread_join(cache->threads[i], NULL);
+    }
+
+    free_cache_entries(cache);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->decoded);
+    pthread_cond_destroy(&cache->queued);
+    free(cache);
+}
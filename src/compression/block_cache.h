@@ -0,0 +1,209 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+#define BLOCK_CACHE_ENTRIES         32
+/* Most prefetched blocks waiting to be read, more would get them evicted
+ * before they are */
+#define BLOCK_CACHE_PREFETCH        (BLOCK_CACHE_ENTRIES / 4)
+/* Most blocks held by one read at a time, decoded in parallel */
+#define BLOCK_CACHE_PER_PASS        (BLOCK_CACHE_ENTRIES / 4)
+#define BLOCK_CACHE_DECODE_THREADS  4
+
+#define UNUSED(x) (void)(x)
+
+#define READER_ERROR   (-1)
+#define TRUE            1
+#define FALSE           0
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/* Finds the block holding a decompressed address, setting its index, its
+ * decompressed address and its size.  Returns FALSE past the end of the
+ * data. */
+typedef uint8_t (*BlockLocate)(void *reader, off_t offset, uint64_t *block,
+        off_t *start, size_t *size);
+
+/* Decompresses a whole block into data, which holds size bytes.  Called
+ * from several threads at once.  Returns FALSE if error. */
+typedef uint8_t (*BlockDecode)(void *reader, uint64_t block, off_t start,
+        uint8_t *data, size_t size);
+
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionStats;
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Decompressed block held by a BlockCache */
+typedef struct BlockCacheEntry {
+    /* Index of the block, as given by the reader */
+    uint64_t block;
+
+    /* Uncompressed address */
+    off_t offset;
+
+    /* Block size, 0 if the entry holds nothing */
+    size_t size;
+
+    /* Entire block */
+    uint8_t *data;
+
+    /* memfd backing data, or -1 if data is plain heap memory */
+    int fd;
+
+    /* Readers currently using the entry, including references handed out by
+     * block_cache_read_ref.  The entry is not evicted while set */
+    uint32_t refs;
+
+    /* Set while the block is being decompressed, data is NULL until then */
+    uint8_t decoding;
+
+    /* Set if decompressed by block_cache_prefetch and not read since */
+    uint8_t prefetched;
+
+    /* Next and previous pointers */
+    struct BlockCacheEntry *next;
+    struct BlockCacheEntry *prev;
+} BlockCacheEntry;
+
+/* Most recently used blocks of a reader whose data is split in blocks that
+ * decompress independently.  A block is only ever decompressed by one
+ * thread at a time, the others wanting it wait for that thread.  Reads
+ * spanning blocks decompress them in parallel with decode threads. */
+typedef struct BlockCache {
+
+    /* Reader the blocks belong to, and how to find and decompress them */
+    void *reader;
+    BlockLocate locate;
+    BlockDecode decode;
+
+    /* Name of the memfds holding the blocks */
+    const char *name;
+
+    /* Number cached */
+    uint64_t num_entries;
+
+    /* Number cached by block_cache_prefetch and not read since */
+    uint64_t num_prefetched;
+
+    /* Cache entry list */
+    BlockCacheEntry *first;
+    BlockCacheEntry *last;
+
+    /* Protects the entries and the decode queue, blocks are decompressed
+     * without it held */
+    pthread_mutex_t lock;
+
+    /* Signalled whenever a block finishes decompressing */
+    pthread_cond_t decoded;
+
+    /* Claimed entries waiting for a decode thread, and the signal that
+     * there are some */
+    BlockCacheEntry *queue[BLOCK_CACHE_ENTRIES];
+    uint32_t queue_head;
+    uint32_t queue_length;
+    pthread_cond_t queued;
+
+    /* Decode threads, started on the first read spanning blocks */
+    pthread_t threads[BLOCK_CACHE_DECODE_THREADS];
+    uint32_t num_threads;
+    uint8_t stopping;
+
+    /* Blocks decompressed, and reads that waited for another thread's
+     * decompression of their block */
+    uint64_t decoded_blocks;
+    uint64_t coalesced_reads;
+
+} BlockCache;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Allocates an empty block cache
+ *
+ *  @param reader Reader passed to locate and decode
+ *  @param locate Finds the block holding an address
+ *  @param decode Decompresses a block
+ *  @param name Name of the memfds holding the blocks, which must outlive
+ *              the cache
+ *
+ *  @returns BlockCache structure, or NULL if error
+ */
+extern BlockCache *block_cache_alloc(void *reader, BlockLocate locate,
+        BlockDecode decode, const char *name);
+
+/** Reads decompressed data, from cache or by decompressing the blocks the
+ *  read spans in parallel
+ *
+ *  @param cache BlockCache that has been allocated
+ *  @param buffer Buffer to read data into
+ *  @param offset Decompressed address to read from
+ *  @param length Number of bytes to read
+ *
+ *  @returns Number of bytes read, short at the end of the data, or
+ *           READER_ERROR if error
+ */
+extern int64_t block_cache_read(BlockCache *cache, uint8_t *buffer,
+        off_t offset, size_t length);
+
+/** References a cached block, so it can be spliced rather than copied
+ *
+ *  @param cache BlockCache that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the block, or
+ *           READER_ERROR if the block cannot be referenced
+ */
+extern int64_t block_cache_read_ref(BlockCache *cache, off_t offset,
+        size_t length, struct CompressionRef *ref);
+
+/** Releases a reference from block_cache_read_ref
+ *
+ *  @param cache BlockCache that has been allocated
+ *  @param ref Reference to release
+ */
+extern void block_cache_release_ref(BlockCache *cache,
+        struct CompressionRef *ref);
+
+/** Decompresses the blocks overlapping a range into the cache
+ *
+ *  @param cache BlockCache that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes now cached from offset on, which stops short
+ *           once BLOCK_CACHE_PREFETCH blocks are waiting to be read, or
+ *           READER_ERROR if error
+ */
+extern int64_t block_cache_prefetch(BlockCache *cache, off_t offset,
+        size_t length);
+
+/** Reports block cache counters
+ *
+ *  @param cache BlockCache that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void block_cache_stats(BlockCache *cache,
+        struct CompressionStats *stats);
+
+/** Frees a block cache, stopping its decode threads.  No references may be
+ *  out.
+ *
+ *  @param cache BlockCache structure
+ */
+extern void block_cache_free(BlockCache *cache);
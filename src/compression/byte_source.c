@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include "byte_source.h"
+#include "uring.h"
+
+/* Result of a read that has not completed */
+#define READ_PENDING    INT64_MIN
+
+/* Set to read files with io_uring instead of mapping them */
+static uint8_t prefer_ring = FALSE;
+
+/*****************************************************************************/
+/***************************** Private functions *****************************/
+/*****************************************************************************/
+
+/* Number of bytes of the file from offset, at most length */
+static size_t available_bytes(ByteSource *source, off_t offset,
+        size_t length) {
+    if (offset < 0 || (size_t) offset >= source->size) {
+        return 0;
+    }
+    if (length > source->size - offset) {
+        return source->size - offset;
+    }
+    return length;
+}
+
+/* Converts BYTE_SOURCE_ advice to madvise advice */
+static int map_advice(int advice) {
+    switch (advice) {
+        case BYTE_SOURCE_SEQUENTIAL:
+            return MADV_SEQUENTIAL;
+        case BYTE_SOURCE_RANDOM:
+            return MADV_RANDOM;
+        case BYTE_SOURCE_WILLNEED:
+            return MADV_WILLNEED;
+        default:
+            return MADV_NORMAL;
+    }
+}
+
+/* Converts BYTE_SOURCE_ advice to posix_fadvise advice */
+static int file_advice(int advice) {
+    switch (advice) {
+        case BYTE_SOURCE_SEQUENTIAL:
+            return POSIX_FADV_SEQUENTIAL;
+        case BYTE_SOURCE_RANDOM:
+            return POSIX_FADV_RANDOM;
+        case BYTE_SOURCE_WILLNEED:
+            return POSIX_FADV_WILLNEED;
+        default:
+            return POSIX_FADV_NORMAL;
+    }
+}
+
+/* Allocates a stream queue, with a ring if use_uring is set and one can be
+ * set up */
+static ByteStreamQueue *alloc_queue(uint8_t use_uring) {
+    ByteStreamQueue *queue = (ByteStreamQueue *) malloc(
+            sizeof(ByteStreamQueue));
+    assert(queue != NULL);
+    if (queue == NULL) {
+        return NULL;
+    }
+
+    /* Page aligned, as direct I/O wants */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    if (posix_memalign((void **) &queue->buffers, page_size,
+                BYTE_STREAM_WINDOW) != 0) {
+        free(queue);
+        return NULL;
+    }
+
+    queue->ring = use_uring ? uring_open(BYTE_STREAM_DEPTH) : NULL;
+
+    return queue;
+}
+
+/* Gets an idle stream queue, or allocates one */
+static ByteStreamQueue *get_queue(ByteSource *source) {
+    pthread_mutex_lock(&source->lock);
+    ByteStreamQueue *queue = source->queues;
+    if (queue != NULL) {
+        source->queues = queue->next;
+    }
+    uint8_t use_uring = source->use_uring;
+    pthread_mutex_unlock(&source->lock);
+
+    if (queue != NULL) {
+        return queue;
+    }
+
+    queue = alloc_queue(use_uring);
+    if (queue != NULL && use_uring && queue->ring == NULL) {
+        pthread_mutex_lock(&source->lock);
+        source->use_uring = FALSE;
+        pthread_mutex_unlock(&source->lock);
+    }
+
+    return queue;
+}
+
+/* Frees a stream queue, which must have no reads in flight */
+static void free_queue(ByteStreamQueue *queue) {
+    if (queue->ring != NULL) {
+        uring_close(queue->ring);
+    }
+    free(queue->buffers);
+    free(queue);
+}
+
+/* Asks for chunks of the range until the queue is full */
+static void request_chunks(ByteStream *stream) {
+    ByteStreamQueue *queue = stream->queue;
+
+    while (stream->count < BYTE_STREAM_DEPTH
+            && stream->requested < stream->end) {
+        uint32_t slot = (stream->head + stream->count) % BYTE_STREAM_DEPTH;
+
+        queue->offsets[slot] = stream->requested;
+        queue->lengths[slot] = MIN((off_t) BYTE_STREAM_CHUNK,
+                stream->end - stream->requested);
+        queue->results[slot] = READ_PENDING;
+
+        if (queue->ring != NULL) {
+            uring_read(queue->ring, stream->source->fd,
+                    queue->buffers + slot * BYTE_STREAM_CHUNK,
+                    queue->offsets[slot], queue->lengths[slot], slot);
+        }
+
+        stream->requested += queue->lengths[slot];
+        stream->count++;
+    }
+
+    if (queue->ring != NULL) {
+        uring_submit(queue->ring);
+    }
+}
+
+/* Moves a stream whose ring failed over to pread, so that the failure only
+ * costs speed.  The queue is leaked rather than reused, as the kernel may
+ * still write to its buffers, and what was in flight is read again.
+ * Returns FALSE if error */
+static uint8_t drop_ring(ByteStream *stream) {
+    ByteStreamQueue *queue = alloc_queue(FALSE);
+    if (queue == NULL) {
+        return FALSE;
+    }
+
+    stream->queue = queue;
+    stream->requested = stream->position;
+    stream->head = 0;
+    stream->count = 0;
+    request_chunks(stream);
+
+    return TRUE;
+}
+
+/* Waits for the read of the oldest chunk.  Without a ring, or if the read
+ * failed or came up short, the rest of the chunk is read with pread. */
+static int64_t complete_chunk(ByteStream *stream) {
+    ByteStreamQueue *queue = stream->queue;
+    uint32_t slot = stream->head;
+
+    while (queue->ring != NULL && queue->results[slot] == READ_PENDING) {
+        uint64_t tag;
+        int64_t result;
+
+        if (uring_wait(queue->ring, &tag, &result) < 0) {
+            if (!drop_ring(stream)) {
+                return -1;
+            }
+            queue = stream->queue;
+            slot = stream->head;
+            break;
+        }
+        queue->results[tag] = result;
+    }
+
+    size_t done = 0;
+    if (queue->ring != NULL && queue->results[slot] > 0) {
+        done = queue->results[slot];
+    }
+
+    if (done < queue->lengths[slot]) {
+        int64_t bytes_read = byte_source_read(stream->source,
+                queue->buffers + slot * BYTE_STREAM_CHUNK + done,
+                queue->offsets[slot] + done, queue->lengths[slot] - done);
+        if (bytes_read != (int64_t) (queue->lengths[slot] - done)) {
+            return -1;
+        }
+    }
+
+    queue->results[slot] = queue->lengths[slot];
+    return queue->lengths[slot];
+}
+
+/* Allocates a byte source, which is read with pread until mapped */
+static ByteSource *create_source(FILE *file) {
+    int fd = fileno(file);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    /* Unlike fstat, this also gives the size of block devices */
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < 0) {
+        return NULL;
+    }
+
+    ByteSource *source = (ByteSource *) malloc(sizeof(ByteSource));
+    assert(source != NULL);
+
+    if (source != NULL) {
+        source->fd = fd;
+        source->size = size;
+        source->map = NULL;
+        source->alignment = 1;
+        source->use_uring = TRUE;
+        source->queues = NULL;
+        pthread_mutex_init(&source->lock, NULL);
+    }
+
+    return source;
+}
+
+/* Reads with pread until length bytes are read or the file ends */
+static int64_t read_fully(ByteSource *source, uint8_t *buffer, off_t offset,
+        size_t length) {
+
+    size_t total = 0;
+    while (total < length) {
+        ssize_t bytes_read = pread(source->fd, buffer + total,
+                length - total, offset + total);
+        if (bytes_read < 0) {
+            return -1;
+        }
+        if (bytes_read == 0) {
+            break;
+        }
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+/* Reads a range that does not meet the alignment direct I/O wants, through
+ * an aligned bounce buffer */
+static int64_t read_unaligned(ByteSource *source, uint8_t *buffer,
+        off_t offset, size_t length) {
+
+    size_t alignment = source->alignment;
+    off_t start = offset - offset % alignment;
+    off_t end = offset + length;
+    end += (alignment - end % alignment) % alignment;
+
+    uint8_t *bounce;
+    size_t bounce_size = MIN((off_t) BYTE_SOURCE_BOUNCE, end - start);
+    if (posix_memalign((void **) &bounce, alignment, bounce_size) != 0) {
+        return -1;
+    }
+
+    size_t total = 0;
+    while (start < end && total < length) {
+        size_t chunk = MIN((off_t) bounce_size, end - start);
+        int64_t bytes_read = read_fully(source, bounce, start, chunk);
+        if (bytes_read < 0) {
+            free(bounce);
+            return -1;
+        }
+
+        /* Only the first chunk starts before offset */
+        size_t skip = offset + total - start;
+        if ((size_t) bytes_read <= skip) {
+            break;
+        }
+
+        size_t n = MIN(bytes_read - skip, length - total);
+        memcpy(buffer + total, bounce + skip, n);
+        total += n;
+
+        if ((size_t) bytes_read < chunk) {
+            break;
+        }
+        start += chunk;
+    }
+
+    free(bounce);
+    return total;
+}
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/* Opens a byte source over a file, mapping regular files if possible */
+extern ByteSource *byte_source_open(FILE *file) {
+    ByteSource *source = create_source(file);
+    if (source == NULL || prefer_ring) {
+        return source;
+    }
+
+    /* Faults on a mapping reach a device one readahead window at a time,
+     * streams keep several reads in flight instead */
+    struct stat st;
+    if (fstat(source->fd, &st) == 0 && S_ISBLK(st.st_mode)) {
+        return source;
+    }
+
+    /* Empty files and those larger than the address space are read */
+    if (source->size > 0 && (uint64_t) source->size <= SIZE_MAX) {
+        void *map = mmap(NULL, source->size, PROT_READ, MAP_SHARED,
+                source->fd, 0);
+        if (map != MAP_FAILED) {
+            source->map = (uint8_t *) map;
+        }
+    }
+
+    return source;
+}
+
+/* Reads files with io_uring instead of mapping them */
+extern void byte_source_set_ring(uint8_t enabled) {
+    prefer_ring = enabled;
+}
+
+/* Opens a byte source over a file read with direct I/O */
+extern ByteSource *byte_source_open_direct(FILE *file) {
+#ifdef O_DIRECT
+    ByteSource *source = create_source(file);
+    if (source == NULL) {
+        return NULL;
+    }
+
+    int flags = fcntl(source->fd, F_GETFL);
+    if (flags < 0 || fcntl(source->fd, F_SETFL, flags | O_DIRECT) < 0) {
+        byte_source_close(source);
+        return NULL;
+    }
+
+    /* A page is a multiple of the logical block size of any device */
+    source->alignment = sysconf(_SC_PAGESIZE);
+    return source;
+#else
+    UNUSED(file);
+    return NULL;
+#endif
+}
+
+/* Copies bytes out of the file */
+extern int64_t byte_source_read(ByteSource *source, uint8_t *buffer,
+        off_t offset, size_t length) {
+
+    if (source->map != NULL) {
+        length = available_bytes(source, offset, length);
+        memcpy(buffer, source->map + offset, length);
+        return length;
+    }
+
+    size_t alignment = source->alignment;
+    if (offset % alignment || length % alignment
+            || (uintptr_t) buffer % alignment) {
+        return read_unaligned(source, buffer, offset, length);
+    }
+
+    return read_fully(source, buffer, offset, length);
+}
+
+/* Gets bytes of the file for a decoder to consume */
+extern const uint8_t *byte_source_get(ByteSource *source, off_t offset,
+        size_t *length, uint8_t *scratch, size_t scratch_size) {
+
+    if (source->map != NULL) {
+        *length = available_bytes(source, offset, *length);
+        return (*length > 0) ? source->map + offset : NULL;
+    }
+
+    if (*length > scratch_size) {
+        *length = scratch_size;
+    }
+
+    int64_t bytes_read = byte_source_read(source, scratch, offset, *length);
+    if (bytes_read <= 0) {
+        *length = 0;
+        return NULL;
+    }
+
+    *length = bytes_read;
+    return scratch;
+}
+
+/* Tells the kernel how a range is about to be read */
+extern void byte_source_advise(ByteSource *source, off_t offset,
+        size_t length, int advice) {
+
+    if (length == 0) {
+        length = SIZE_MAX;
+    }
+    length = available_bytes(source, offset, length);
+    if (length == 0) {
+        return;
+    }
+
+    /* Direct I/O does not go through the page cache at all */
+    if (source->alignment > 1) {
+        return;
+    }
+
+    if (source->map == NULL) {
+        posix_fadvise(source->fd, offset, length, file_advice(advice));
+        return;
+    }
+
+    /* madvise wants a page aligned address */
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    size_t misalignment = offset % page_size;
+
+    madvise(source->map + offset - misalignment, length + misalignment,
+            map_advice(advice));
+}
+
+/* Starts reading a range of the file in order */
+extern void byte_stream_open(ByteStream *stream, ByteSource *source,
+        off_t offset, size_t length) {
+
+    if (length == 0) {
+        length = SIZE_MAX;
+    }
+
+    stream->source = source;
+    stream->position = offset;
+    stream->end = offset + available_bytes(source, offset, length);
+    stream->requested = offset;
+    stream->queue = NULL;
+    stream->head = 0;
+    stream->count = 0;
+    stream->held = FALSE;
+
+    if (source->map != NULL) {
+        byte_source_advise(source, offset,
+                MIN((off_t) BYTE_STREAM_WINDOW, stream->end - offset),
+                BYTE_SOURCE_WILLNEED);
+        return;
+    }
+
+    stream->queue = get_queue(source);
+    if (stream->queue != NULL) {
+        request_chunks(stream);
+    }
+}
+
+/* Gets the next bytes of a range */
+extern int64_t byte_stream_next(ByteStream *stream, const uint8_t **data) {
+    ByteSource *source = stream->source;
+
+    if (stream->position >= stream->end) {
+        return 0;
+    }
+
+    /* Mapped files need no reads, only the kernel told to read ahead */
+    if (source->map != NULL) {
+        size_t length = MIN((off_t) BYTE_STREAM_WINDOW,
+                stream->end - stream->position);
+
+        *data = source->map + stream->position;
+        stream->position += length;
+
+        byte_source_advise(source, stream->position,
+                MIN((off_t) BYTE_STREAM_WINDOW,
+                    stream->end - stream->position),
+                BYTE_SOURCE_WILLNEED);
+        return length;
+    }
+
+    if (stream->queue == NULL) {
+        return -1;
+    }
+
+    /* The chunk handed out last time is done with, read the next in it */
+    if (stream->held) {
+        stream->head = (stream->head + 1) % BYTE_STREAM_DEPTH;
+        stream->count--;
+        stream->held = FALSE;
+        request_chunks(stream);
+    }
+
+    int64_t length = complete_chunk(stream);
+    if (length < 0) {
+        return -1;
+    }
+
+    *data = stream->queue->buffers + stream->head * BYTE_STREAM_CHUNK;
+    stream->position += length;
+    stream->held = TRUE;
+
+    return length;
+}
+
+/* Stops reading a range */
+extern void byte_stream_close(ByteStream *stream) {
+    ByteSource *source = stream->source;
+    ByteStreamQueue *queue = stream->queue;
+
+    if (queue == NULL) {
+        return;
+    }
+
+    /* Buffers are only reused once the kernel is done writing to them */
+    for (uint32_t i = 0; i < stream->count; i++) {
+        uint32_t slot = (stream->head + i) % BYTE_STREAM_DEPTH;
+
+        while (queue->ring != NULL && queue->results[slot] == READ_PENDING) {
+            uint64_t tag;
+            int64_t result;
+
+            if (uring_wait(queue->ring, &tag, &result) < 0) {
+                /* Leaked rather than freed under the kernel */
+                stream->queue = NULL;
+                return;
+            }
+            queue->results[tag] = result;
+        }
+    }
+
+    pthread_mutex_lock(&source->lock);
+    queue->next = source->queues;
+    source->queues = queue;
+    pthread_mutex_unlock(&source->lock);
+
+    stream->queue = NULL;
+}
+
+/* Unmaps the file and frees the byte source */
+extern void byte_source_close(ByteSource *source) {
+    while (source->queues != NULL) {
+        ByteStreamQueue *queue = source->queues;
+        source->queues = queue->next;
+        free_queue(queue);
+    }
+    pthread_mutex_destroy(&source->lock);
+
+    if (source->map != NULL) {
+        munmap(source->map, source->size);
+    }
+    free(source);
+}
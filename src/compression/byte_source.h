@@ -0,0 +1,224 @@
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+/* Advice on how a range is about to be read */
+#define BYTE_SOURCE_NORMAL      0
+#define BYTE_SOURCE_SEQUENTIAL  1
+#define BYTE_SOURCE_RANDOM      2
+#define BYTE_SOURCE_WILLNEED    3
+
+#define UNUSED(x) (void)(x)
+
+#define TRUE            1
+#define FALSE           0
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#define BYTE_SOURCE_BOUNCE      1048576     /* Largest unaligned direct read */
+
+#define BYTE_STREAM_CHUNK       131072      /* Bytes asked for by each read */
+#define BYTE_STREAM_DEPTH       8           /* Reads a stream keeps in flight */
+
+/* Input a stream hands out at once, and reads ahead of the decoder */
+#define BYTE_STREAM_WINDOW      (BYTE_STREAM_CHUNK * BYTE_STREAM_DEPTH)
+
+/* Defined in uring.h */
+struct Uring;
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Reads of a stream, kept by the byte source for the next stream once the
+ * stream is closed */
+typedef struct ByteStreamQueue {
+
+    /* Ring the reads are submitted to, NULL if they are done with pread */
+    struct Uring *ring;
+
+    /* One chunk per read */
+    uint8_t *buffers;
+
+    /* Address, length and result of the read of each chunk */
+    off_t offsets[BYTE_STREAM_DEPTH];
+    size_t lengths[BYTE_STREAM_DEPTH];
+    int64_t results[BYTE_STREAM_DEPTH];
+
+    /* Idle queues of a byte source */
+    struct ByteStreamQueue *next;
+
+} ByteStreamQueue;
+
+/* Compressed input of a reader.  The file is mapped when possible so that
+ * decoders take their input straight from the page cache, without stdio
+ * buffering or a system call per chunk.  Block devices, files that cannot
+ * be mapped and all files once byte_source_set_ring is called are read
+ * with io_uring, or pread where it is not available. */
+typedef struct ByteSource {
+
+    /* File descriptor of the file, owned by the caller */
+    int fd;
+
+    /* Size of the file */
+    size_t size;
+
+    /* Mapping of the whole file, NULL if it is read with pread */
+    uint8_t *map;
+
+    /* Alignment of reads with direct I/O, 1 for reads through the page
+     * cache */
+    size_t alignment;
+
+    /* Cleared once setting up a ring fails, so that it is not tried again */
+    uint8_t use_uring;
+
+    /* Idle stream queues, and the lock protecting them */
+    ByteStreamQueue *queues;
+    pthread_mutex_t lock;
+
+} ByteSource;
+
+/* Range of the file a decoder consumes in order, such as a compressed block.
+ * Reads are started ahead of the decoder, so that the input of the next
+ * chunk arrives while the previous one is decoded. */
+typedef struct ByteStream {
+
+    /* Byte source read from */
+    ByteSource *source;
+
+    /* Address of the next byte handed out, and the end of the range */
+    off_t position;
+    off_t end;
+
+    /* End of the data asked for */
+    off_t requested;
+
+    /* Reads in flight, NULL if the file is mapped */
+    ByteStreamQueue *queue;
+
+    /* Oldest read of the queue, and number of reads in it */
+    uint32_t head;
+    uint32_t count;
+
+    /* Set while the oldest chunk is handed out to the decoder */
+    uint8_t held;
+
+} ByteStream;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Opens a byte source over a file, mapping it if possible.  Block devices
+ *  are never mapped, and neither is anything once byte_source_set_ring is
+ *  called.
+ *
+ *  @param file File to read from, which must stay open until the source is
+ *              closed
+ *
+ *  @returns ByteSource structure, or NULL if error
+ */
+extern ByteSource *byte_source_open(FILE *file);
+
+/** Reads files with io_uring instead of mapping them, so that streams keep
+ *  reads in flight rather than fault the file in.  Applies to sources
+ *  opened afterwards.
+ *
+ *  @param enabled TRUE to read with io_uring, FALSE to map files again
+ */
+extern void byte_source_set_ring(uint8_t enabled);
+
+/** Opens a byte source over a file read with direct I/O, bypassing the page
+ *  cache.  Unaligned reads go through a bounce buffer.
+ *
+ *  @param file File to read from, which must stay open until the source is
+ *              closed
+ *
+ *  @returns ByteSource structure, or NULL if direct I/O is not supported
+ */
+extern ByteSource *byte_source_open_direct(FILE *file);
+
+/** Copies bytes out of the file
+ *
+ *  @param source ByteSource that has been opened
+ *  @param buffer Buffer to read data into
+ *  @param offset Address in the file to read from
+ *  @param length Number of bytes to read
+ *
+ *  @returns Number of bytes read, fewer at the end of the file, or -1 if
+ *           error
+ */
+extern int64_t byte_source_read(ByteSource *source, uint8_t *buffer,
+        off_t offset, size_t length);
+
+/** Gets bytes of the file for a decoder to consume.  When the file is mapped
+ *  this points into the mapping and no copy is made, otherwise at most
+ *  scratch_size bytes are read into scratch.
+ *
+ *  @param source ByteSource that has been opened
+ *  @param offset Address in the file to read from
+ *  @param length Number of bytes wanted, set to the number available
+ *  @param scratch Buffer to read data into if the file is not mapped
+ *  @param scratch_size Size of scratch
+ *
+ *  @returns Pointer to the data, or NULL if error or at the end of the file
+ */
+extern const uint8_t *byte_source_get(ByteSource *source, off_t offset,
+        size_t *length, uint8_t *scratch, size_t scratch_size);
+
+/** Tells the kernel how a range is about to be read, which only matters
+ *  for readahead and page cache reclaim
+ *
+ *  @param source ByteSource that has been opened
+ *  @param offset Address in the file the advice starts at
+ *  @param length Number of bytes covered, 0 for up to the end of the file
+ *  @param advice One of the BYTE_SOURCE_ advice defines
+ */
+extern void byte_source_advise(ByteSource *source, off_t offset,
+        size_t length, int advice);
+
+/** Starts reading a range of the file in order
+ *
+ *  @param stream ByteStream to set up
+ *  @param source ByteSource that has been opened
+ *  @param offset Address in the file to start at
+ *  @param length Number of bytes in the range, 0 for up to the end of the
+ *                file
+ */
+extern void byte_stream_open(ByteStream *stream, ByteSource *source,
+        off_t offset, size_t length);
+
+/** Gets the next bytes of a range, which stay valid until the next call.
+ *  When the file is mapped this points into the mapping.
+ *
+ *  @param stream ByteStream that has been opened
+ *  @param data Set to the data
+ *
+ *  @returns Number of bytes, 0 at the end of the range, or -1 if error
+ */
+extern int64_t byte_stream_next(ByteStream *stream, const uint8_t **data);
+
+/** Stops reading a range, waiting for reads still in flight
+ *
+ *  @param stream ByteStream that has been opened
+ */
+extern void byte_stream_close(ByteStream *stream);
+
+/** Unmaps the file and frees the byte source, leaving the file open
+ *
+ *  @param source ByteSource that has been opened
+ */
+extern void byte_source_close(ByteSource *source);
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include "bzip2_reader.h"
+#include "../byte_source.h"
+#include "../block_cache.h"
+#include "../compression_reader.h"
+
+/*****************************************************************************/
+/*************************** Data access functions ***************************/
+/*****************************************************************************/
+
+/* Reads count bits, most significant first, from a bit address */
+static uint64_t get_bits(const uint8_t *data, uint64_t bit, uint32_t count) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < count; i++, bit++) {
+        value = (value << 1) | ((data[bit / 8] >> (7 - bit % 8)) & 1);
+    }
+    return value;
+}
+
+/* Writes count bits of value, most significant first, into zeroed data */
+static void put_bits(uint8_t *data, uint64_t *bit, uint64_t value,
+        uint32_t count) {
+    for (uint32_t i = count; i > 0; i--, (*bit)++) {
+        if ((value >> (i - 1)) & 1) {
+            data[*bit / 8] |= 0x80 >> (*bit % 8);
+        }
+    }
+}
+
+/* Wraps the bits of a block in a stream of its own, which bzlib can then
+ * decompress: a stream header, the block shifted to a byte boundary, and an
+ * end of stream marker.  The combined CRC of a stream of one block is the
+ * block CRC.  Level 9 is used whatever the level of the block, as it allows
+ * blocks of any size.  Returns the stream, to be freed, or NULL if error */
+static uint8_t *build_stream(Bzip2Reader *reader, uint64_t start_bit,
+        uint64_t end_bit, size_t *stream_size) {
+
+    uint64_t num_bits = end_bit - start_bit;
+    if (end_bit <= start_bit
+            || num_bits < BZIP2_MAGIC_BITS + BZIP2_CRC_BITS) {
+        return NULL;
+    }
+
+    off_t first_byte = start_bit / 8;
+    size_t input_size = (end_bit + 7) / 8 - first_byte;
+    uint8_t *scratch = NULL;
+    uint8_t *stream = NULL;
+
+    if (reader->source->map == NULL) {
+        scratch = (uint8_t *) malloc(input_size);
+        if (scratch == NULL) {
+            return NULL;
+        }
+    }
+
+    size_t length = input_size;
+    const uint8_t *input = byte_source_get(reader->source, first_byte,
+            &length, scratch, input_size);
+    if (input == NULL || length != input_size) {
+        goto exit;
+    }
+
+    *stream_size = BZIP2_MAGIC_HEADER_SIZE
+        + (num_bits + BZIP2_MAGIC_BITS + BZIP2_CRC_BITS + 7) / 8;
+    stream = (uint8_t *) calloc(*stream_size, 1);
+    if (stream == NULL) {
+        goto exit;
+    }
+
+    memcpy(stream, "BZh9", BZIP2_MAGIC_HEADER_SIZE);
+
+    uint32_t shift = start_bit % 8;
+    size_t num_bytes = (num_bits + 7) / 8;
+    uint8_t *block = stream + BZIP2_MAGIC_HEADER_SIZE;
+
+    for (size_t i = 0; i < num_bytes; i++) {
+        block[i] = input[i] << shift;
+        if (shift && i + 1 < input_size) {
+            block[i] |= input[i + 1] >> (8 - shift);
+        }
+    }
+    if (num_bits % 8) {
+        block[num_bytes - 1] &= (uint8_t) (0xFF << (8 - num_bits % 8));
+    }
+
+    uint64_t crc = get_bits(input, shift + BZIP2_MAGIC_BITS, BZIP2_CRC_BITS);
+    uint64_t bit = BZIP2_MAGIC_HEADER_SIZE * 8 + num_bits;
+    put_bits(stream, &bit, BZIP2_EOS_MAGIC, BZIP2_MAGIC_BITS);
+    put_bits(stream, &bit, crc, BZIP2_CRC_BITS);
+
+exit:
+    free(scratch);
+    return stream;
+}
+
+/* Decompresses a block between two bit addresses without keeping the data,
+ * which checks that it is a whole block.  Returns its uncompressed size, or
+ * READER_ERROR if it is not a valid block */
+static int64_t measure_block(Bzip2Reader *reader, uint64_t start_bit,
+        uint64_t end_bit) {
+
+    size_t stream_size;
+    uint8_t *stream = build_stream(reader, start_bit, end_bit, &stream_size);
+    if (stream == NULL) {
+        return READER_ERROR;
+    }
+
+    uint8_t *buffer = (uint8_t *) malloc(BZIP2_MEASURE_BUFFER_SIZE);
+    bz_stream bz;
+    memset(&bz, 0, sizeof(bz));
+
+    if (buffer == NULL || BZ2_bzDecompressInit(&bz, 0, 0) != BZ_OK) {
+        free(buffer);
+        free(stream);
+        return READER_ERROR;
+    }
+
+    bz.next_in = (char *) stream;
+    bz.avail_in = stream_size;
+
+    int64_t size = 0;
+    int ret;
+    do {
+        bz.next_out = (char *) buffer;
+        bz.avail_out = BZIP2_MEASURE_BUFFER_SIZE;
+
+        ret = BZ2_bzDecompress(&bz);
+        size += BZIP2_MEASURE_BUFFER_SIZE - bz.avail_out;
+
+        /* Out of input without reaching the end of the block */
+        if (ret == BZ_OK && bz.avail_in == 0 && bz.avail_out > 0) {
+            ret = BZ_UNEXPECTED_EOF;
+        }
+    } while (ret == BZ_OK);
+
+    BZ2_bzDecompressEnd(&bz);
+    free(buffer);
+    free(stream);
+
+    return (ret == BZ_STREAM_END) ? size : READER_ERROR;
+}
+
+/* Decompresses a whole block */
+static uint8_t decode_block(void *reader, uint64_t block, off_t start,
+        uint8_t *data, size_t size) {
+
+    Bzip2Reader *bzip2_reader = (Bzip2Reader *) reader;
+    size_t stream_size;
+    UNUSED(start);
+
+    uint8_t *stream = build_stream(bzip2_reader,
+            bzip2_reader->blocks[block].start_bit,
+            bzip2_reader->blocks[block].end_bit, &stream_size);
+    if (stream == NULL) {
+        return FALSE;
+    }
+
+    unsigned int length = size;
+    int ret = BZ2_bzBuffToBuffDecompress((char *) data, &length,
+            (char *) stream, stream_size, 0, 0);
+    free(stream);
+
+    return ret == BZ_OK && length == size;
+}
+
+/* Adds a marker to a growing list */
+static uint8_t add_marker(Bzip2Marker **markers, uint64_t *count,
+        uint64_t *capacity, uint64_t bit, uint8_t eos) {
+
+    if (*count == *capacity) {
+        uint64_t new_capacity = *capacity ? *capacity * 2 : 256;
+        Bzip2Marker *new_markers = (Bzip2Marker *) realloc(*markers,
+                sizeof(Bzip2Marker) * new_capacity);
+        if (new_markers == NULL) {
+            return FALSE;
+        }
+        *markers = new_markers;
+        *capacity = new_capacity;
+    }
+
+    (*markers)[*count].bit = bit;
+    (*markers)[*count].eos = eos;
+    (*count)++;
+    return TRUE;
+}
+
+/* Finds every block and end of stream magic in the file, at any bit
+ * address.  Only the shifts at which the last 16 bits read hold the low
+ * byte of a magic are compared in full. */
+static uint8_t scan_markers(Bzip2Reader *reader, Bzip2Marker **markers,
+        uint64_t *count) {
+
+    uint16_t *shifts = (uint16_t *) malloc(sizeof(uint16_t) * 65536);
+    uint64_t capacity = 0;
+    uint8_t ok = TRUE;
+
+    *markers = NULL;
+    *count = 0;
+
+    if (shifts == NULL) {
+        return FALSE;
+    }
+
+    /* Bits 0-7 for block magics at shift 0-7, bits 8-15 for end of stream */
+    for (uint32_t value = 0; value < 65536; value++) {
+        shifts[value] = 0;
+        for (uint32_t shift = 0; shift < 8; shift++) {
+            uint8_t low = value >> shift;
+            if (low == (uint8_t) BZIP2_BLOCK_MAGIC) {
+                shifts[value] |= 1 << shift;
+            }
+            if (low == (uint8_t) BZIP2_EOS_MAGIC) {
+                shifts[value] |= 1 << (8 + shift);
+            }
+        }
+    }
+
+    ByteStream stream;
+    const uint8_t *data;
+    int64_t length;
+    uint64_t window = 0;
+    uint64_t position = 0;
+    uint64_t mask = (1ULL << BZIP2_MAGIC_BITS) - 1;
+
+    byte_stream_open(&stream, reader->source, 0, 0);
+    while (ok && (length = byte_stream_next(&stream, &data)) > 0) {
+        for (int64_t i = 0; ok && i < length; i++) {
+            window = (window << 8) | data[i];
+            position += 8;
+
+            uint16_t candidates = shifts[window & 0xFFFF];
+            if (candidates == 0 || position < BZIP2_MAGIC_BITS + 8) {
+                continue;
+            }
+
+            /* Largest shift first, as it starts earliest in the file */
+            for (int32_t shift = 7; ok && shift >= 0; shift--) {
+                uint64_t bits = (window >> shift) & mask;
+                uint64_t bit = position - shift - BZIP2_MAGIC_BITS;
+
+                if ((candidates & (1 << shift))
+                        && bits == BZIP2_BLOCK_MAGIC) {
+                    ok = add_marker(markers, count, &capacity, bit, FALSE);
+                }
+                if ((candidates & (1 << (8 + shift)))
+                        && bits == BZIP2_EOS_MAGIC) {
+                    ok = add_marker(markers, count, &capacity, bit, TRUE);
+                }
+            }
+        }
+    }
+    byte_stream_close(&stream);
+    free(shifts);
+
+    if (length < 0) {
+        ok = FALSE;
+    }
+    if (!ok) {
+        free(*markers);
+        *markers = NULL;
+        *count = 0;
+    }
+    return ok;
+}
+
+/* Measures the blocks that start at the markers taken off a shared job */
+static void *measure_thread(void *arg) {
+    Bzip2IndexJob *job = (Bzip2IndexJob *) arg;
+    uint64_t i;
+
+    while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED))
+            < job->count) {
+        if (job->markers[i].eos || i + 1 == job->count) {
+            job->sizes[i] = READER_ERROR;
+        } else {
+            job->sizes[i] = measure_block(job->reader, job->markers[i].bit,
+                    job->markers[i + 1].bit);
+        }
+    }
+
+    return NULL;
+}
+
+/* Indexes the blocks of the file.  Each block magic is taken to start a
+ * block that ends at the next marker, and all are decompressed in parallel
+ * to check it and find their sizes.  Magics also occur by chance in the
+ * compressed data, which cuts a block short so that it fails to
+ * decompress.  Such a block is extended over the next markers until it
+ * decompresses, and a magic that only fails after an end of stream, in
+ * the stream trailer or header, is dropped. */
+static uint8_t build_index(Bzip2Reader *reader) {
+    Bzip2IndexJob job = {
+        .reader = reader,
+        .markers = NULL,
+        .sizes = NULL,
+        .count = 0,
+        .next = 0
+    };
+    pthread_t threads[BZIP2_INDEX_THREADS - 1];
+    uint32_t num_threads = 0;
+    uint8_t ok = FALSE;
+
+    if (!scan_markers(reader, &job.markers, &job.count) || job.count == 0) {
+        goto exit;
+    }
+
+    job.sizes = (int64_t *) malloc(sizeof(int64_t) * job.count);
+    reader->blocks = (Bzip2Block *) malloc(sizeof(Bzip2Block) * job.count);
+    reader->offsets = (uint64_t *) malloc(sizeof(uint64_t)
+            * (job.count + 1));
+    if (job.sizes == NULL || reader->blocks == NULL
+            || reader->offsets == NULL) {
+        goto exit;
+    }
+
+    while (num_threads < BZIP2_INDEX_THREADS - 1) {
+        if (pthread_create(&threads[num_threads], NULL, measure_thread,
+                    &job) != 0) {
+            break;
+        }
+        num_threads++;
+    }
+    measure_thread(&job);
+    for (uint32_t i = 0; i < num_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    reader->offsets[0] = 0;
+    uint64_t i = 0;
+    while (i < job.count) {
+        if (job.markers[i].eos) {
+            i++;
+            continue;
+        }
+
+        uint64_t j = i + 1;
+        int64_t size = job.sizes[i];
+        while (size < 0 && j + 1 < job.count
+                && j - i < BZIP2_MAX_FALSE_MARKERS) {
+            j++;
+            size = measure_block(reader, job.markers[i].bit,
+                    job.markers[j].bit);
+        }
+
+        if (size < 0) {
+            if (i > 0 && job.markers[i - 1].eos) {
+                i++;
+                continue;
+            }
+            goto exit;
+        }
+
+        Bzip2Block *block = &reader->blocks[reader->num_blocks];
+        block->start_bit = job.markers[i].bit;
+        block->end_bit = job.markers[j].bit;
+        reader->offsets[reader->num_blocks + 1]
+            = reader->offsets[reader->num_blocks] + size;
+        reader->num_blocks++;
+
+        i = j;
+    }
+
+    ok = reader->num_blocks > 0;
+
+exit:
+    free(job.markers);
+    free(job.sizes);
+    return ok;
+}
+
+/* Finds the block containing an uncompressed offset */
+static uint8_t locate_block(void *reader, off_t offset, uint64_t *block,
+        off_t *start, size_t *size) {
+
+    Bzip2Reader *bzip2_reader = (Bzip2Reader *) reader;
+    uint64_t *offsets = bzip2_reader->offsets;
+
+    if (offset < 0
+            || (uint64_t) offset >= offsets[bzip2_reader->num_blocks]) {
+        return FALSE;
+    }
+
+    /* Last block starting at or before offset */
+    uint64_t low = 0;
+    uint64_t high = bzip2_reader->num_blocks - 1;
+    while (low < high) {
+        uint64_t middle = low + (high - low + 1) / 2;
+        if (offsets[middle] <= (uint64_t) offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    *block = low;
+    *start = offsets[low];
+    *size = offsets[low + 1] - offsets[low];
+    return TRUE;
+}
+
+/*****************************************************************************/
+/************************** Public struct functions **************************/
+/*****************************************************************************/
+
+/* Checks if bzip2 file */
+extern uint8_t bzip2_is_supported(FILE *bzip2_file) {
+    uint8_t magic_header[] = BZIP2_MAGIC_HEADER;
+    uint8_t block_magic[] = {0x31, 0x41, 0x59, 0x26, 0x53, 0x59};
+    uint8_t file_header[BZIP2_MAGIC_HEADER_SIZE + sizeof(block_magic)];
+
+    size_t ret = fread(file_header, 1, sizeof(file_header), bzip2_file);
+
+    assert(ret == sizeof(file_header));
+    if (ret != sizeof(file_header)) {
+        return FALSE;
+    }
+
+    /* The level is the block size in 100k units */
+    if (memcmp(file_header, magic_header, sizeof(magic_header)) != 0
+            || file_header[3] < '1' || file_header[3] > '9') {
+        return FALSE;
+    }
+
+    /* Indexing decompresses the whole file, so it waits for alloc */
+    return memcmp(&file_header[BZIP2_MAGIC_HEADER_SIZE], block_magic,
+            sizeof(block_magic)) == 0;
+}
+
+/* Creates bzip2 reader struct */
+extern void *bzip2_reader_alloc(FILE *bzip2_file) {
+    Bzip2Reader *reader = (Bzip2Reader *) malloc(sizeof(Bzip2Reader));
+    assert(reader != NULL);
+
+    if (reader != NULL) {
+        reader->source = byte_source_open(bzip2_file);
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+
+        reader->blocks = NULL;
+        reader->num_blocks = 0;
+        reader->offsets = NULL;
+
+        reader->cache = block_cache_alloc(reader, locate_block, decode_block,
+                "spotlight-bzip2-block");
+        if (reader->cache == NULL) {
+            byte_source_close(reader->source);
+            free(reader);
+            return NULL;
+        }
+
+        /* The whole file is scanned for the index, then blocks are read in
+         * whatever order files need them */
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_SEQUENTIAL);
+        if (!build_index(reader)) {
+            bzip2_reader_free((void *) reader);
+            return NULL;
+        }
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
+    }
+
+    return (void *) reader;
+}
+
+/* Read bytes in bzip2 compressed file */
+extern int64_t bzip2_read(void *reader, uint8_t *buffer, off_t offset,
+        size_t length) {
+    return block_cache_read(((Bzip2Reader *) reader)->cache, buffer, offset,
+            length);
+}
+
+/* References a cached block */
+extern int64_t bzip2_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+    return block_cache_read_ref(((Bzip2Reader *) reader)->cache, offset,
+            length, ref);
+}
+
+/* Releases a reference from bzip2_read_ref */
+extern void bzip2_release_ref(void *reader, struct CompressionRef *ref) {
+    block_cache_release_ref(((Bzip2Reader *) reader)->cache, ref);
+}
+
+/* Decompresses the blocks overlapping a range into the cache */
+extern int64_t bzip2_prefetch(void *reader, off_t offset, size_t length) {
+    return block_cache_prefetch(((Bzip2Reader *) reader)->cache, offset,
+            length);
+}
+
+/* Reports bzip2 reader counters */
+extern void bzip2_stats(void *reader, struct CompressionStats *stats) {
+    block_cache_stats(((Bzip2Reader *) reader)->cache, stats);
+}
+
+/* Free bzip2 reader struct */
+extern void bzip2_reader_free(void *reader) {
+    Bzip2Reader *bzip2_reader = (Bzip2Reader *) reader;
+
+    block_cache_free(bzip2_reader->cache);
+    free(bzip2_reader->blocks);
+    free(bzip2_reader->offsets);
+    byte_source_close(bzip2_reader->source);
+    free(bzip2_reader);
+}
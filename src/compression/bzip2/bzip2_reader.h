@@ -0,0 +1,187 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <bzlib.h>
+#include <pthread.h>
+
+/* Threads measuring blocks while indexing */
+#define BZIP2_INDEX_THREADS             4
+/* Most block markers in a row taken to be false, before a block is given
+ * up on as corrupt */
+#define BZIP2_MAX_FALSE_MARKERS         8
+#define BZIP2_MEASURE_BUFFER_SIZE       1048576
+
+#define READER_ERROR   (-1)
+#define TRUE            1
+#define FALSE           0
+
+#define BZIP2_MAGIC_HEADER_SIZE     4
+#define BZIP2_MAGIC_HEADER          {'B', 'Z', 'h'}
+#define BZIP2_BLOCK_MAGIC           0x314159265359ULL
+#define BZIP2_EOS_MAGIC             0x177245385090ULL
+#define BZIP2_MAGIC_BITS            48
+#define BZIP2_CRC_BITS              32
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Block of a bzip2 stream, from its magic up to the next block or end of
+ * stream magic.  Blocks are not byte aligned */
+typedef struct Bzip2Block {
+
+    /* Bit address of the block magic in the file */
+    uint64_t start_bit;
+
+    /* Bit address just past the block */
+    uint64_t end_bit;
+
+} Bzip2Block;
+
+/* Block or end of stream magic found while indexing, which may also occur
+ * by chance inside a block */
+typedef struct Bzip2Marker {
+
+    /* Bit address of the magic in the file */
+    uint64_t bit;
+
+    /* Set for an end of stream magic */
+    uint8_t eos;
+
+} Bzip2Marker;
+
+/* Markers shared by the threads measuring blocks while indexing */
+typedef struct Bzip2IndexJob {
+
+    /* Reader being indexed */
+    struct Bzip2Reader *reader;
+
+    /* Markers, and the uncompressed size of the block from each up to the
+     * next, or READER_ERROR if that is not a whole block */
+    Bzip2Marker *markers;
+    int64_t *sizes;
+    uint64_t count;
+
+    /* Next marker to measure, taken atomically */
+    uint64_t next;
+
+} Bzip2IndexJob;
+
+/* Bzip2 compression reader */
+typedef struct Bzip2Reader {
+
+    /* Bzip2-compressed input */
+    struct ByteSource *source;
+
+    /* Blocks of every stream in the file, and the uncompressed address of
+     * each with the end of the last block after them */
+    Bzip2Block *blocks;
+    uint64_t num_blocks;
+    uint64_t *offsets;
+
+    /* Decompressed blocks, and the threads decompressing them */
+    struct BlockCache *cache;
+
+} Bzip2Reader;
+
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in block_cache.h */
+struct BlockCache;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Checks if bzip2 reader supports a particular file, from its stream
+ *  header and first block magic only
+ *
+ *  @param bzip2_file File pointer
+ *
+ *  @returns 1 for TRUE or 0 for FALSE
+ */
+extern uint8_t bzip2_is_supported(FILE *bzip2_file);
+
+/** Allocates memory for bzip2 reader, and indexes the blocks of the file.
+ *  Block sizes are not stored anywhere, so every block is decompressed once
+ *  for the index, in parallel.
+ *
+ *  @param bzip2_file bzip2-compressed file to read from
+ *
+ *  @returns Bzip2Reader structure, or NULL if error
+ */
+extern void *bzip2_reader_alloc(FILE *bzip2_file);
+
+/** Reads from bzip2-compressed file, decompressing the blocks a read spans
+ *  in parallel
+ *
+ *  @param reader Bzip2Reader that has been allocated
+ *  @param buffer Buffer to read data into
+ *  @param offset Decompressed address to read from
+ *  @param length Number of bytes to read, must be greater than size of buffer
+ *
+ *  @returns Number of bytes read, short at the end of the data, or
+ *           READER_ERROR if error
+ */
+extern int64_t bzip2_read(void *reader, uint8_t *buffer,
+        off_t offset, size_t length);
+
+/** References a cached block, so it can be spliced rather than copied
+ *
+ *  @param reader Bzip2Reader that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the block, or
+ *           READER_ERROR if the block cannot be referenced
+ */
+extern int64_t bzip2_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Releases a reference from bzip2_read_ref
+ *
+ *  @param reader Bzip2Reader that has been allocated
+ *  @param ref Reference to release
+ */
+extern void bzip2_release_ref(void *reader, struct CompressionRef *ref);
+
+/** Decompresses the blocks overlapping a range into the cache
+ *
+ *  @param reader Bzip2Reader that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes now cached from offset on, which stops short
+ *           once BLOCK_CACHE_PREFETCH blocks are waiting to be read, or
+ *           READER_ERROR if error
+ */
+extern int64_t bzip2_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports bzip2 reader counters
+ *
+ *  @param reader Bzip2Reader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void bzip2_stats(void *reader, struct CompressionStats *stats);
+
+/** Frees memory for bzip2 reader, stopping its decode threads
+ *
+ *  @param reader Bzip2Reader structure
+ */
+extern void bzip2_reader_free(void *reader);
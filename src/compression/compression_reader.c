@@ -1,3 +1,6 @@
+#include <stdlib.h>
+
+#include "byte_source.h"
 #include "constructors.h"
 
 /* Returns first supported single compression reader implementation */
@@ -41,6 +44,18 @@ extern CompressionReader *compression_reader_alloc(FILE *file) {
 }
 
 
+/* Reads uncompressed files with direct I/O */
+extern void compression_set_direct(size_t cache_size) {
+    raw_read_set_direct(cache_size);
+}
+
+
+/* Reads compressed files with io_uring instead of mapping them */
+extern void compression_set_ring(uint8_t enabled) {
+    byte_source_set_ring(enabled);
+}
+
+
 /* Reads from compressed file */
 extern int64_t compression_read(CompressionReader *reader, uint8_t *buf,
         off_t offset, size_t length) {
@@ -48,6 +63,115 @@ extern int64_t compression_read(CompressionReader *reader, uint8_t *buf,
 }
 
 
+/* Orders segments by decompressed address */
+static int compare_segments(const void *a, const void *b) {
+    const CompressionSegment *segment_a = (const CompressionSegment *) a;
+    const CompressionSegment *segment_b = (const CompressionSegment *) b;
+
+    if (segment_a->offset < segment_b->offset) {
+        return -1;
+    }
+    return segment_a->offset > segment_b->offset;
+}
+
+/* Merges segments that follow each other both in the file and in memory */
+static size_t coalesce_segments(CompressionSegment *segments, size_t count) {
+    size_t merged = 0;
+
+    for (size_t i = 1; i < count; i++) {
+        CompressionSegment *last = &segments[merged];
+
+        if (last->offset + (off_t) last->length == segments[i].offset
+                && last->buf + last->length == segments[i].buf) {
+            last->length += segments[i].length;
+        } else {
+            segments[++merged] = segments[i];
+        }
+    }
+
+    return merged + 1;
+}
+
+/* Reads many segments from compressed file */
+extern int64_t compression_readv(CompressionReader *reader,
+        CompressionSegment *segments, size_t count) {
+
+    if (count == 0) {
+        return 0;
+    }
+
+    qsort(segments, count, sizeof(CompressionSegment), compare_segments);
+    count = coalesce_segments(segments, count);
+
+    if (reader->reader_impl->readv) {
+        return reader->reader_impl->readv(reader->reader, segments, count);
+    }
+
+    int64_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        int64_t bytes_read = compression_read(reader, segments[i].buf,
+                segments[i].offset, segments[i].length);
+        if (bytes_read != (int64_t) segments[i].length) {
+            return -1;
+        }
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+
+/* References decompressed data without copying it */
+extern int64_t compression_read_ref(CompressionReader *reader, off_t offset,
+        size_t length, CompressionRef *ref) {
+
+    if (reader->reader_impl->read_ref == NULL) {
+        return -1;
+    }
+
+    return reader->reader_impl->read_ref(reader->reader, offset, length, ref);
+}
+
+/* Releases a reference from compression_read_ref */
+extern void compression_release_ref(CompressionReader *reader,
+        CompressionRef *ref) {
+
+    if (ref->token != NULL && reader->reader_impl->release_ref != NULL) {
+        reader->reader_impl->release_ref(reader->reader, ref);
+    }
+    ref->token = NULL;
+}
+
+
+/* Checks if a reader gains anything from prefetching */
+extern uint8_t compression_can_prefetch(CompressionReader *reader) {
+    return reader->reader_impl->prefetch != NULL;
+}
+
+/* Gets a range ready for reading */
+extern int64_t compression_prefetch(CompressionReader *reader, off_t offset,
+        size_t length) {
+
+    if (reader->reader_impl->prefetch == NULL) {
+        return -1;
+    }
+
+    return reader->reader_impl->prefetch(reader->reader, offset, length);
+}
+
+/* Reports the reader counters */
+extern void compression_get_stats(CompressionReader *reader,
+        CompressionStats *stats) {
+
+    stats->decoded = 0;
+    stats->coalesced = 0;
+
+    if (reader->reader_impl->stats != NULL) {
+        reader->reader_impl->stats(reader->reader, stats);
+    }
+}
+
+
 /* Frees memory for compression reader */
 extern void compression_reader_free(CompressionReader *reader) {
     reader->reader_impl->free(reader->reader);
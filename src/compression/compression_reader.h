@@ -7,6 +7,50 @@
 /********************************** Structs **********************************/
 /*****************************************************************************/
 
+/* One piece of a vectored read */
+typedef struct CompressionSegment {
+
+    /* Decompressed address to read from */
+    off_t offset;
+
+    /* Number of bytes to read */
+    size_t length;
+
+    /* Buffer to read data into */
+    uint8_t *buf;
+
+} CompressionSegment;
+
+/* Reference to decompressed data held by a reader, readable through a file
+ * descriptor so that it can be spliced instead of copied */
+typedef struct CompressionRef {
+
+    /* File descriptor holding the data */
+    int fd;
+
+    /* Position of the data in fd */
+    off_t fd_offset;
+
+    /* Number of bytes referenced */
+    size_t length;
+
+    /* Reader private, NULL if the reference needs no release */
+    void *token;
+
+} CompressionRef;
+
+/* Counters kept by a reader */
+typedef struct CompressionStats {
+
+    /* Blocks, or stretches of the stream, decompressed */
+    uint64_t decoded;
+
+    /* Requests that waited for another thread to decompress what they
+     * needed instead of doing it themselves */
+    uint64_t coalesced;
+
+} CompressionStats;
+
 /* Structure for compression reader implementation */
 typedef struct CompressionReaderImpl {
 
@@ -19,6 +63,24 @@ typedef struct CompressionReaderImpl {
     /* Function that reads data from file */
     int64_t (*read)(void *reader, uint8_t *buf, off_t offset, size_t length);
 
+    /* Function that reads many segments at once, sorted by offset (optional) */
+    int64_t (*readv)(void *reader, CompressionSegment *segments,
+            size_t count);
+
+    /* Function that references data instead of copying it (optional) */
+    int64_t (*read_ref)(void *reader, off_t offset, size_t length,
+            CompressionRef *ref);
+
+    /* Function that drops a reference from read_ref (optional) */
+    void (*release_ref)(void *reader, CompressionRef *ref);
+
+    /* Function that gets a range ready for reading ahead of time, for
+     * instance by decompressing it into a cache (optional) */
+    int64_t (*prefetch)(void *reader, off_t offset, size_t length);
+
+    /* Function that reports the reader counters (optional) */
+    void (*stats)(void *reader, CompressionStats *stats);
+
     /* Function that frees compression reader */
     void (*free)(void *reader);
 
@@ -47,6 +109,23 @@ typedef struct CompressionReader {
  */
 extern CompressionReader *compression_reader_alloc(FILE *file);
 
+/** Reads uncompressed files with direct I/O, so that they are not cached by
+ *  the kernel on top of what is read from them.  Small reads are cached by
+ *  the reader instead.  Applies to readers allocated afterwards.
+ *
+ *  @param cache_size Bytes of the reader's block cache, 0 to read through
+ *                    the page cache
+ */
+extern void compression_set_direct(size_t cache_size);
+
+/** Reads images with io_uring instead of mapping them, so that blocks are
+ *  read at queue depth rather than faulted in.  Block devices are always
+ *  read this way.  Applies to readers allocated afterwards.
+ *
+ *  @param enabled TRUE to read with io_uring, FALSE to map images
+ */
+extern void compression_set_ring(uint8_t enabled);
+
 /** Reads from compressed file
  *
  *  @param reader CompressionReader that has been allocated
@@ -59,6 +138,73 @@ extern CompressionReader *compression_reader_alloc(FILE *file);
 extern int64_t compression_read(CompressionReader *reader, uint8_t *buf,
         off_t offset, size_t length);
 
+/** Reads many segments from compressed file in one pass
+ *
+ *  Segments are sorted and those contiguous both in the file and in memory
+ *  are merged, so that each stretch of the file is decompressed once.
+ *
+ *  @param reader CompressionReader that has been allocated
+ *  @param segments Segments to read, may be reordered
+ *  @param count Number of segments
+ *
+ *  @returns Total number of bytes read or -1 if error
+ */
+extern int64_t compression_readv(CompressionReader *reader,
+        CompressionSegment *segments, size_t count);
+
+/** References decompressed data without copying it
+ *
+ *  The reference may cover less than length bytes, for instance when the
+ *  range spans several decompressed blocks.
+ *
+ *  @param reader CompressionReader that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in, released with compression_release_ref
+ *
+ *  @returns Number of bytes referenced or -1 if not possible
+ */
+extern int64_t compression_read_ref(CompressionReader *reader, off_t offset,
+        size_t length, CompressionRef *ref);
+
+/** Releases a reference from compression_read_ref
+ *
+ *  @param reader CompressionReader that has been allocated
+ *  @param ref Reference to release
+ */
+extern void compression_release_ref(CompressionReader *reader,
+        CompressionRef *ref);
+
+/** Checks if a reader gains anything from prefetching
+ *
+ *  @param reader CompressionReader that has been allocated
+ *
+ *  @returns 1 for TRUE or 0 for FALSE
+ */
+extern uint8_t compression_can_prefetch(CompressionReader *reader);
+
+/** Gets a range ready for reading, so that a later read of it is quick
+ *
+ *  The reader may stop short, for instance when prefetching more would
+ *  evict data that is yet to be read.
+ *
+ *  @param reader CompressionReader that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes prefetched or -1 if error
+ */
+extern int64_t compression_prefetch(CompressionReader *reader, off_t offset,
+        size_t length);
+
+/** Reports the reader counters, all zero if the reader keeps none
+ *
+ *  @param reader CompressionReader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void compression_get_stats(CompressionReader *reader,
+        CompressionStats *stats);
+
 /** Frees memory for compression reader
  *
  *  @param reader CompressionReader structure
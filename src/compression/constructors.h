@@ -3,13 +3,17 @@
 /*****************************************************************************/
 /**************************** Constructor defines ****************************/
 /*****************************************************************************/
-#define NUMBER_AVAILABLE 3
+#define NUMBER_AVAILABLE 7
 
 /*****************************************************************************/
 /*************** Imports of compression reader implementations ***************/
 /*****************************************************************************/
 #include "gzip/gzip_reader.h"
 #include "xz/xz_reader.h"
+#include "zstd/zstd_reader.h"
+#include "lz4/lz4_reader.h"
+#include "bzip2/bzip2_reader.h"
+#include "qcow2/qcow2_reader.h"
 #include "raw_read/reader.h"
 
 
@@ -24,6 +28,10 @@ static CompressionReaderImpl available_readers[NUMBER_AVAILABLE] = {
         .is_supported = gzip_is_supported,
         .alloc = gzip_reader_alloc,
         .read = gzip_read,
+        .readv = gzip_readv,
+        .read_ref = gzip_read_ref,
+        .prefetch = gzip_prefetch,
+        .stats = gzip_stats,
         .free = gzip_reader_free
     },
 
@@ -32,15 +40,71 @@ static CompressionReaderImpl available_readers[NUMBER_AVAILABLE] = {
         .is_supported = xz_is_supported,
         .alloc = xz_reader_alloc,
         .read = xz_read,
+        .read_ref = xz_read_ref,
+        .release_ref = xz_release_ref,
+        .prefetch = xz_prefetch,
+        .stats = xz_stats,
         .free = xz_reader_free
     },
 
+    /* Seekable zstd compression */
+    {
+        .is_supported = zstd_is_supported,
+        .alloc = zstd_reader_alloc,
+        .read = zstd_read,
+        .read_ref = zstd_read_ref,
+        .release_ref = zstd_release_ref,
+        .prefetch = zstd_prefetch,
+        .stats = zstd_stats,
+        .free = zstd_reader_free
+    },
+
+    /* Lz4 frames of independent blocks */
+    {
+        .is_supported = lz4_is_supported,
+        .alloc = lz4_reader_alloc,
+        .read = lz4_read,
+        .read_ref = lz4_read_ref,
+        .release_ref = lz4_release_ref,
+        .prefetch = lz4_prefetch,
+        .stats = lz4_stats,
+        .free = lz4_reader_free
+    },
+
+    /* Bzip2 streams, indexed by block */
+    {
+        .is_supported = bzip2_is_supported,
+        .alloc = bzip2_reader_alloc,
+        .read = bzip2_read,
+        .read_ref = bzip2_read_ref,
+        .release_ref = bzip2_release_ref,
+        .prefetch = bzip2_prefetch,
+        .stats = bzip2_stats,
+        .free = bzip2_reader_free
+    },
+
+    /* qcow2 images, with or without compressed clusters */
+    {
+        .is_supported = qcow2_is_supported,
+        .alloc = qcow2_reader_alloc,
+        .read = qcow2_read,
+        .read_ref = qcow2_read_ref,
+        .release_ref = qcow2_release_ref,
+        .prefetch = qcow2_prefetch,
+        .stats = qcow2_stats,
+        .free = qcow2_reader_free
+    },
+
 
     /* Raw read (no compression) */
     {
         .is_supported = raw_read_is_supported,
         .alloc = raw_read_reader_alloc,
         .read = raw_read_read,
+        .readv = raw_read_readv,
+        .read_ref = raw_read_read_ref,
+        .prefetch = raw_read_prefetch,
+        .stats = raw_read_stats,
         .free = raw_read_reader_free
     }
 };
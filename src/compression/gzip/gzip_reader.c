@@ -1,4 +1,7 @@
 #include "gzip_reader.h"
+#include "../byte_source.h"
+#include "../compression_reader.h"
+#include "../zero_runs.h"
 
 /*****************************************************************************/
 /************************* Private struct functions **************************/
@@ -101,25 +104,47 @@ static void free_access_point_list(GzipAccessPointList *list) {
     free(list);
 }
 
+/*****************************************************************************/
+/****************************** Input functions ******************************/
+/*****************************************************************************/
+
+/* Hands inflate the next input of the compressed stream.  When the file is
+ * mapped the input comes straight from the mapping, otherwise from reads
+ * started ahead of inflate */
+static int8_t next_input(z_stream *stream, ByteStream *input) {
+    const uint8_t *data;
+
+    int64_t length = byte_stream_next(input, &data);
+    if (length < 0) {
+        return Z_ERRNO;
+    }
+    if (length == 0) {
+        return Z_DATA_ERROR;
+    }
+
+    stream->avail_in = length;
+    stream->next_in = (uint8_t *) data;
+
+    return Z_OK;
+}
+
 /*****************************************************************************/
 /**************************** Indexing functions *****************************/
 /*****************************************************************************/
 
-/* Processes the next chunk */
+/* Processes the next chunk, scanning what it inflates to for runs of
+ * zeros */
 static int8_t index_next_chunk(GzipReader *reader, off_t max_byte_address,
-        z_stream *stream, uint8_t *input_buf, uint8_t *context,
-        off_t *raw_byte_counter, off_t *compressed_byte_counter) {
+        z_stream *stream, ByteStream *input, uint8_t *context,
+        ZeroScan *scan, off_t *raw_byte_counter,
+        off_t *compressed_byte_counter) {
 
     int8_t return_value;
 
-    stream->avail_in = fread(input_buf, 1, CHUNK, reader->gzip_file);
-    if (ferror(reader->gzip_file)) {
-        return Z_ERRNO;
-    }
-    if (stream->avail_in == 0) {
-        return Z_DATA_ERROR;
+    return_value = next_input(stream, input);
+    if (return_value != Z_OK) {
+        return return_value;
     }
-    stream->next_in = input_buf;
     stream->avail_out = 0;
 
     /* Process chunk, or until end of stream */
@@ -131,6 +156,8 @@ static int8_t index_next_chunk(GzipReader *reader, off_t max_byte_address,
         }
 
         /* Inflate until out of input, output, or at end of block */
+        off_t output_address = *raw_byte_counter;
+        uint8_t *output = stream->next_out;
         *compressed_byte_counter += stream->avail_in;
         *raw_byte_counter += stream->avail_out;
 
@@ -140,6 +167,9 @@ static int8_t index_next_chunk(GzipReader *reader, off_t max_byte_address,
         *compressed_byte_counter -= stream->avail_in;
         *raw_byte_counter -= stream->avail_out;
 
+        zero_scan_feed(scan, reader->zeros, output_address, output,
+                stream->next_out - output);
+
         if (return_value == Z_MEM_ERROR
                 || return_value == Z_DATA_ERROR
                 || return_value == Z_NEED_DICT) {
@@ -155,7 +185,9 @@ static int8_t index_next_chunk(GzipReader *reader, off_t max_byte_address,
             new_entry = create_access_point_entry(*raw_byte_counter,
                     *compressed_byte_counter, stream->data_type & 7,
                     stream->avail_out, context);
+            pthread_mutex_lock(&reader->lock);
             append_access_point_list(reader->list, new_entry);
+            pthread_mutex_unlock(&reader->lock);
 
             if (max_byte_address <
                     reader->list->last->raw_byte_address + SPAN) {
@@ -172,7 +204,8 @@ static int8_t build_index(GzipReader *reader, off_t max_byte_address) {
 
     int8_t return_value;
     uint8_t context[WINDOW_SIZE];
-    uint8_t input_buffer[CHUNK];
+    ByteStream input;
+    ZeroScan scan;
     off_t raw_byte_counter;
     off_t compressed_byte_counter;
 
@@ -198,165 +231,256 @@ static int8_t build_index(GzipReader *reader, off_t max_byte_address) {
         raw_byte_counter = entry->raw_byte_address;
         compressed_byte_counter = entry->compressed_byte_address;
         if (entry->bits) {
-            compressed_byte_counter--;
-        }
-        if (fseeko(reader->gzip_file, compressed_byte_counter, SEEK_SET) == -1) {
-            inflateEnd(&stream);
-            return ferror(reader->gzip_file) ? Z_ERRNO : Z_DATA_ERROR;
-        }
-
-        if (entry->bits) {
-            compressed_byte_counter++;
-            int next_char = getc(reader->gzip_file);
-            if (next_char == -1) {
+            uint8_t next_char;
+            int64_t bytes_read = byte_source_read(reader->source, &next_char,
+                    compressed_byte_counter - 1, 1);
+            if (bytes_read != 1) {
                 inflateEnd(&stream);
-                if (ferror(reader->gzip_file)) {
-                    return Z_ERRNO;
-                }
-                return Z_DATA_ERROR;
+                return (bytes_read < 0) ? Z_ERRNO : Z_DATA_ERROR;
             }
             inflatePrime(&stream, entry->bits, next_char >> (8 - entry->bits));
         }
         inflateSetDictionary(&stream, entry->context, WINDOW_SIZE);
     }
 
+    /* The rest of the stream is read in order until the index is built */
+    byte_source_advise(reader->source, compressed_byte_counter, 0,
+            BYTE_SOURCE_SEQUENTIAL);
+    byte_stream_open(&input, reader->source, compressed_byte_counter, 0);
+    zero_scan_start(&scan, raw_byte_counter);
+
     while (return_value == Z_OK) {
         return_value = index_next_chunk(reader, max_byte_address,
-                &stream, input_buffer, context, &raw_byte_counter,
+                &stream, &input, context, &scan, &raw_byte_counter,
                 &compressed_byte_counter);
         if (max_byte_address < raw_byte_counter + SPAN) {
             break;
         }
     }
 
+    /* Only what was inflated is known to be zeros */
+    if (return_value == Z_OK || return_value == Z_STREAM_END) {
+        zero_scan_finish(&scan, reader->zeros);
+    }
+
+    byte_stream_close(&input);
+    byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
+
     inflateEnd(&stream);
     return return_value;
 }
 
-/* Checks if index needs to be built, and builds if required */
+/* Checks if index reaches max_byte_address, must be called with lock held */
+static uint8_t index_covers(GzipReader *reader, off_t max_byte_address) {
+    if (reader->list->length == 0) {
+        return FALSE;
+    }
+    assert(reader->list->last != NULL);
+
+    off_t last_index = reader->list->last->raw_byte_address + SPAN;
+    return last_index > max_byte_address;
+}
+
+/* Checks if index needs to be built, and builds if required.  Only one
+ * thread builds at a time, without the lock held so that reads of the
+ * indexed part go on meanwhile */
 static int8_t check_and_build_index(GzipReader *reader,
         off_t max_byte_address) {
-    if (reader->list->length) {
-        assert(reader->list->last != NULL);
+    int8_t return_value = Z_OK;
+    uint8_t waited = FALSE;
+
+    pthread_mutex_lock(&reader->lock);
+    while (!index_covers(reader, max_byte_address)) {
+        if (!reader->building) {
+            reader->building = TRUE;
+            reader->index_builds++;
+            pthread_mutex_unlock(&reader->lock);
+
+            return_value = build_index(reader, max_byte_address);
+
+            pthread_mutex_lock(&reader->lock);
+            reader->building = FALSE;
+            pthread_cond_broadcast(&reader->built);
+            break;
+        }
 
-        off_t last_index = reader->list->last->raw_byte_address + SPAN;
-        if (last_index > max_byte_address) {
-            return 0;
+        if (!waited) {
+            reader->coalesced_builds++;
+            waited = TRUE;
         }
+        pthread_cond_wait(&reader->built, &reader->lock);
     }
-    return build_index(reader, max_byte_address);
+    pthread_mutex_unlock(&reader->lock);
+
+    return return_value;
 }
 
 /*****************************************************************************/
 /*************************** Data access functions ***************************/
 /*****************************************************************************/
 
-static int8_t read_next_chunk(GzipReader *reader,
-        z_stream *stream, uint8_t *input_buffer) {
+/* Inflates from the next chunk.  Each read has its own input stream, so
+ * that several threads can inflate at once */
+static int8_t read_next_chunk(z_stream *stream, ByteStream *input) {
 
     if (stream->avail_in == 0) {
-        stream->avail_in = fread(input_buffer, 1, CHUNK, reader->gzip_file);
-        if (ferror(reader->gzip_file)) {
-            return Z_ERRNO;
-        }
-        if (stream->avail_in == 0) {
-            return Z_DATA_ERROR;
+        int8_t return_value = next_input(stream, input);
+        if (return_value != Z_OK) {
+            return return_value;
         }
-        stream->next_in = input_buffer;
     }
 
     /* Normal inflate */
     return inflate(stream, Z_NO_FLUSH);
 }
 
-static int8_t _gzip_read(GzipReader *reader, uint8_t *buffer,
-        off_t offset, uint64_t length) {
-
-    if (length == 0) {
-        return 0;
-    }
-
-    uint8_t skip;
-    uint8_t input_buffer[CHUNK];
-    uint8_t discard_window[WINDOW_SIZE];
-
-    /* Find where in stream to start */
+/* Finds last access point at or before offset */
+static GzipAccessPointEntry *find_access_point(GzipReader *reader,
+        off_t offset) {
     // TODO: Improve searching because this is currently linear
+    pthread_mutex_lock(&reader->lock);
     GzipAccessPointEntry *current = reader->list->first;
     assert(current != NULL);
-    while (current->next && current->next->raw_byte_address < offset) {
+    while (current->next && current->next->raw_byte_address <= offset) {
         current = current->next;
     }
+    pthread_mutex_unlock(&reader->lock);
+    return current;
+}
+
+/* Initialises inflate state to start at access point */
+static int8_t start_at_access_point(GzipReader *reader, z_stream *stream,
+        GzipAccessPointEntry *entry, ByteStream *input) {
 
     int8_t return_value;
 
-    /* Initialize file and inflate state to start there */
-    /* Initialise inflate */
-    z_stream stream = {
-        .zalloc = Z_NULL,
-        .zfree = Z_NULL,
-        .opaque = Z_NULL,
-        .avail_in = 0,
-        .next_in = Z_NULL,
-    };
-    return_value = inflateInit2(&stream, RAW_INFLATE_BITS);
+    stream->zalloc = Z_NULL;
+    stream->zfree = Z_NULL;
+    stream->opaque = Z_NULL;
+    stream->avail_in = 0;
+    stream->next_in = Z_NULL;
+
+    return_value = inflateInit2(stream, RAW_INFLATE_BITS);
     if (return_value != Z_OK) {
-        inflateEnd(&stream);
         return return_value;
     }
 
-    off_t comp_offset;
-    comp_offset = current->compressed_byte_address - ((current->bits) ? 1 : 0);
-    return_value = fseeko(reader->gzip_file, comp_offset, SEEK_SET);
-    if (return_value == -1) {
-        inflateEnd(&stream);
-        return ferror(reader->gzip_file) ? Z_ERRNO : Z_DATA_ERROR;
+    if (entry->bits) {
+        uint8_t next_char;
+        int64_t bytes_read = byte_source_read(reader->source, &next_char,
+                entry->compressed_byte_address - 1, 1);
+        if (bytes_read != 1) {
+            inflateEnd(stream);
+            return (bytes_read < 0) ? Z_ERRNO : Z_DATA_ERROR;
+        }
+        inflatePrime(stream, entry->bits, next_char >> (8 - entry->bits));
     }
+    inflateSetDictionary(stream, entry->context, WINDOW_SIZE);
 
-    if (current->bits) {
-        int next_char = getc(reader->gzip_file);
-        if (next_char == -1) {
-            inflateEnd(&stream);
-            return ferror(reader->gzip_file) ? Z_ERRNO : Z_DATA_ERROR;
-        }
-        inflatePrime(&stream, current->bits, next_char >> (8 - current->bits));
+    byte_stream_open(input, reader->source, entry->compressed_byte_address,
+            0);
+
+    return Z_OK;
+}
+
+/* Drops the inflate state and input of a read */
+static void stop_reading(z_stream *stream, ByteStream *input) {
+    inflateEnd(stream);
+    byte_stream_close(input);
+}
+
+/* Uncompresses length bytes into buffer, or until end of stream */
+static int8_t inflate_into(z_stream *stream, ByteStream *input,
+        uint8_t *buffer, uint64_t length) {
+
+    int8_t return_value = Z_OK;
+
+    stream->avail_out = length;
+    stream->next_out = buffer;
+    while (stream->avail_out != 0 && return_value == Z_OK) {
+        return_value = read_next_chunk(stream, input);
     }
-    inflateSetDictionary(&stream, current->context, WINDOW_SIZE);
 
-    /* Skip uncompressed bytes until offset reached, then satisfy request */
-    offset -= current->raw_byte_address;
-    stream.avail_in = 0;
-    skip = 1;                               /* While skipping to offset */
-    do {
-        /* Define where to put uncompressed data, and how much */
-        if (offset == 0 && skip) {
-            /* At offset */
-            stream.avail_out = length;
-            stream.next_out = buffer;
-            skip = 0;
-        } else if (offset > WINDOW_SIZE) {
-            /* Skip WINDOW_SIZE bytes */
-            stream.avail_out = WINDOW_SIZE;
-            stream.next_out = discard_window;
-            offset -= WINDOW_SIZE;
-        } else if (offset != 0) {
-            /* Last skip */
-            stream.avail_out = (unsigned) offset;
-            stream.next_out = discard_window;
-            offset = 0;
-        }
+    return return_value;
+}
 
-        /* Uncompress until avail_out filled, or end of stream */
-        do {
-            return_value = read_next_chunk(reader, &stream,
-                    input_buffer);
-        } while (stream.avail_out != 0 && return_value == Z_OK);
+/* Reads sorted segments with as few inflate passes as possible.  The stream
+ * is only restarted when an access point lies between the current position
+ * and the next part to inflate, otherwise the gap is skipped by inflating
+ * it.  Parts in known runs of zeros are filled in without inflating. */
+static int8_t _gzip_readv(GzipReader *reader, CompressionSegment *segments,
+        size_t count) {
 
-        /* Do until offset reached and requested data read, or stream ends */
-    } while (skip && return_value == Z_OK);
+    int8_t return_value = Z_OK;
+    uint8_t discard_window[WINDOW_SIZE];
+    uint8_t started = FALSE;
+    off_t position = 0;
+    ByteStream input;
+    z_stream stream;
+
+    for (size_t i = 0; i < count && return_value == Z_OK; i++) {
+        off_t offset = segments[i].offset;
+        size_t length = segments[i].length;
+        uint8_t *buf = segments[i].buf;
+
+        while (length != 0 && return_value == Z_OK) {
+            int64_t zeros = zero_runs_lookup(reader->zeros, offset, length);
+            if (zeros > 0) {
+                memset(buf, 0, zeros);
+                offset += zeros;
+                length -= zeros;
+                buf += zeros;
+                continue;
+            }
+            size_t part = -zeros;
+
+            GzipAccessPointEntry *entry;
+            entry = find_access_point(reader, offset);
+            if (!started || entry->raw_byte_address > position
+                    || offset < position) {
+                if (started) {
+                    stop_reading(&stream, &input);
+                }
+                return_value = start_at_access_point(reader, &stream, entry,
+                        &input);
+                if (return_value != Z_OK) {
+                    return return_value;
+                }
+                started = TRUE;
+                position = entry->raw_byte_address;
+            }
 
-    /* Compute number of uncompressed bytes read after offset */
-    inflateEnd(&stream);
+            /* Skip uncompressed bytes until offset reached */
+            while (position < offset && return_value == Z_OK) {
+                uint64_t skip = MIN(offset - position, (off_t) WINDOW_SIZE);
+                return_value = inflate_into(&stream, &input, discard_window,
+                        skip);
+                position += skip - stream.avail_out;
+            }
+
+            /* Then satisfy request */
+            if (return_value == Z_OK) {
+                return_value = inflate_into(&stream, &input, buf, part);
+                position += part - stream.avail_out;
+
+                /* The end of the stream is only fine if the part is full */
+                if (return_value == Z_STREAM_END
+                        && (part < length || i + 1 < count)) {
+                    return_value = stream.avail_out ? Z_DATA_ERROR : Z_OK;
+                    stop_reading(&stream, &input);
+                    started = FALSE;
+                }
+            }
+
+            offset += part;
+            length -= part;
+            buf += part;
+        }
+    }
+
+    if (started) {
+        stop_reading(&stream, &input);
+    }
 
     return return_value;
 }
@@ -393,8 +517,21 @@ extern void *gzip_reader_alloc(FILE *gzip_file) {
     assert(reader != NULL);
 
     if (reader != NULL) {
-        reader->gzip_file = gzip_file;
+        reader->source = byte_source_open(gzip_file);
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
+
         reader->list = create_access_point_list();
+        reader->zeros = zero_runs_alloc();
+        assert(reader->zeros != NULL);
+        pthread_mutex_init(&reader->lock, NULL);
+        pthread_cond_init(&reader->built, NULL);
+        reader->building = FALSE;
+        reader->index_builds = 0;
+        reader->coalesced_builds = 0;
     }
 
     return (void *) reader;
@@ -404,23 +541,98 @@ extern void *gzip_reader_alloc(FILE *gzip_file) {
 extern int64_t gzip_read(void *reader, uint8_t *buffer, off_t offset,
         size_t length) {
 
+    CompressionSegment segment = {
+        .offset = offset,
+        .length = length,
+        .buf = buffer,
+    };
+
+    return gzip_readv(reader, &segment, 1);
+}
+
+/* Read many segments in gzip compressed file */
+extern int64_t gzip_readv(void *reader, struct CompressionSegment *segments,
+        size_t count) {
+
     GzipReader *gzip_reader = (GzipReader *) reader;
     int8_t return_value;
+    int64_t total = 0;
 
-    return_value = check_and_build_index(gzip_reader, offset + length);
+    if (count == 0) {
+        return 0;
+    }
+
+    CompressionSegment *last = &segments[count - 1];
+    return_value = check_and_build_index(gzip_reader,
+            last->offset + last->length);
     return_value = (return_value == Z_STREAM_END) ? Z_OK : return_value;
     assert(return_value == Z_OK);
 
-    return_value = _gzip_read(gzip_reader, buffer, offset, length);
+    return_value = _gzip_readv(gzip_reader, segments, count);
     return_value = (return_value == Z_STREAM_END) ? Z_OK : return_value;
     assert(return_value == Z_OK);
 
-    return (return_value == Z_OK) ? (signed) length : INDEXER_ERROR;
+    for (size_t i = 0; i < count; i++) {
+        total += segments[i].length;
+    }
+
+    return (return_value == Z_OK) ? total : INDEXER_ERROR;
+}
+
+/* References a known run of zeros */
+extern int64_t gzip_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+
+    GzipReader *gzip_reader = (GzipReader *) reader;
+    int fd = zero_runs_fd();
+    if (fd < 0) {
+        return INDEXER_ERROR;
+    }
+
+    int64_t zeros = zero_runs_lookup(gzip_reader->zeros, offset,
+            MIN(length, (size_t) ZERO_RUNS_FD_SIZE));
+    if (zeros <= 0) {
+        return INDEXER_ERROR;
+    }
+
+    ref->fd = fd;
+    ref->fd_offset = 0;
+    ref->length = zeros;
+    ref->token = NULL;
+
+    return zeros;
+}
+
+/* Extends the index past a range */
+extern int64_t gzip_prefetch(void *reader, off_t offset, size_t length) {
+    int8_t return_value;
+
+    return_value = check_and_build_index((GzipReader *) reader,
+            offset + length);
+
+    if (return_value == Z_OK || return_value == Z_STREAM_END) {
+        return length;
+    }
+    return INDEXER_ERROR;
+}
+
+/* Reports gzip reader counters */
+extern void gzip_stats(void *reader, struct CompressionStats *stats) {
+    GzipReader *gzip_reader = (GzipReader *) reader;
+
+    pthread_mutex_lock(&gzip_reader->lock);
+    stats->decoded = gzip_reader->index_builds;
+    stats->coalesced = gzip_reader->coalesced_builds;
+    pthread_mutex_unlock(&gzip_reader->lock);
 }
 
 /* Free gzip reader struct */
 extern void gzip_reader_free(void *reader) {
     GzipReader *gzip_reader = (GzipReader *) reader;
     free_access_point_list(gzip_reader->list);
+    zero_runs_free(gzip_reader->zeros);
+    byte_source_close(gzip_reader->source);
+    pthread_mutex_destroy(&gzip_reader->lock);
+    pthread_cond_destroy(&gzip_reader->built);
     free(gzip_reader);
 }
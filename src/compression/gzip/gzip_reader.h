@@ -1,14 +1,15 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "../../libs/zlib-ng/zlib.h"
 
 #define SPAN        1048576L    /* Desired distance between access points */
 #define WINDOW_SIZE 32768U      /* Sliding window size */
-#define CHUNK       16384       /* File input buffer size */
 
 #define GZIP_WINDOW_BITS 47
 #define RAW_INFLATE_BITS (-15)
@@ -20,6 +21,11 @@
 #define GZIP_MAGIC_HEADER_SIZE  2
 #define GZIP_MAGIC_HEADER       {0x1F, 0x8B}
 
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
 /*****************************************************************************/
 /********************************** Structs **********************************/
 /*****************************************************************************/
@@ -58,13 +64,41 @@ typedef struct GzipAccessPointList {
 /* Indexer access fields, used for calling indexer functions */
 typedef struct GzipReader {
 
-    /* File pointer to gzip-compressed file */
-    FILE *gzip_file;
+    /* Gzip-compressed input, read without moving the file position so
+     * that threads do not get in each other's way */
+    struct ByteSource *source;
 
     /* Pointer to access point list */
     struct GzipAccessPointList *list;
+
+    /* Protects the access point list while it grows.  Entries never change
+     * once appended, so they are used without the lock held */
+    pthread_mutex_t lock;
+
+    /* Set while a thread extends the index, others wait on built for it
+     * instead of inflating the same stretch of the stream again */
+    uint8_t building;
+    pthread_cond_t built;
+
+    /* Runs of zeros met while indexing, read without inflating */
+    struct ZeroRunList *zeros;
+
+    /* Index extensions, and requests that waited for another thread's */
+    uint64_t index_builds;
+    uint64_t coalesced_builds;
 } GzipReader;
 
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionSegment;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in zero_runs.h */
+struct ZeroRunList;
+
 /*****************************************************************************/
 /***************************** Public functions ******************************/
 /*****************************************************************************/
@@ -97,6 +131,52 @@ extern void *gzip_reader_alloc(FILE *gzip_file);
 extern int64_t gzip_read(void *reader, uint8_t *buffer,
         off_t offset, size_t length);
 
+/** Reads many segments from gzip-compressed file in a single inflate pass
+ *  where possible.  Parts in runs of zeros met while indexing are filled in
+ *  without inflating.
+ *
+ *  @param reader GzipReader that has been allocated
+ *  @param segments Segments to read, sorted by offset
+ *  @param count Number of segments
+ *
+ *  @returns Total number of bytes read or INDEXER_ERROR if error
+ */
+extern int64_t gzip_readv(void *reader, struct CompressionSegment *segments,
+        size_t count);
+
+/** References a run of zeros met while indexing, so it can be spliced from
+ *  the shared file of zeros rather than copied.  Anything else cannot be
+ *  referenced.
+ *
+ *  @param reader GzipReader that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the run, or
+ *           INDEXER_ERROR if offset is not in a known run of zeros
+ */
+extern int64_t gzip_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Extends the index past a range, so that reading it does not wait for
+ *  the stream to be indexed up to there
+ *
+ *  @param reader GzipReader that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns length, or INDEXER_ERROR if error
+ */
+extern int64_t gzip_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports gzip reader counters
+ *
+ *  @param reader GzipReader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void gzip_stats(void *reader, struct CompressionStats *stats);
+
 /** Frees memory for gzip reader
  *
  *  @param reader GzipReader structure
@@ -0,0 +1,505 @@
+#define _GNU_SOURCE
+#include "lz4_reader.h"
+#include "../byte_source.h"
+#include "../compression_reader.h"
+#include "../slot_cache.h"
+
+/*****************************************************************************/
+/*************************** Data access functions ***************************/
+/*****************************************************************************/
+
+/* Reads a little-endian value of size bytes */
+static uint64_t read_le(const uint8_t *bytes, uint32_t size) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        value |= (uint64_t) bytes[i] << (8 * i);
+    }
+    return value;
+}
+
+/* Decompresses a block into buffer, which is read straight from the mapping
+ * of the file if there is one.  Returns the size of the block, or
+ * READER_ERROR if it does not fit in capacity or is corrupt. */
+static int64_t decode_block(Lz4Reader *reader, uint64_t index,
+        uint8_t *buffer, size_t capacity) {
+
+    Lz4Block *block = &reader->blocks[index];
+    uint8_t *scratch = NULL;
+    int64_t size = READER_ERROR;
+
+    if (reader->source->map == NULL) {
+        scratch = (uint8_t *) malloc(block->compressed_size);
+        if (scratch == NULL) {
+            return READER_ERROR;
+        }
+    }
+
+    size_t length = block->compressed_size;
+    const uint8_t *input = byte_source_get(reader->source,
+            block->compressed_offset, &length, scratch,
+            block->compressed_size);
+    if (input == NULL || length != block->compressed_size) {
+        goto exit;
+    }
+
+    if (block->stored) {
+        if (length <= capacity) {
+            memcpy(buffer, input, length);
+            size = length;
+        }
+    } else {
+        int ret = LZ4_decompress_safe((const char *) input, (char *) buffer,
+                length, capacity);
+        if (ret >= 0) {
+            size = ret;
+        }
+    }
+
+exit:
+    free(scratch);
+    return size;
+}
+
+/* Adds a block to the index, growing it as needed */
+static uint8_t add_block(Lz4Reader *reader, uint64_t *capacity,
+        uint64_t compressed_offset, uint32_t size_field) {
+
+    if (reader->num_blocks == *capacity) {
+        uint64_t new_capacity = *capacity ? *capacity * 2 : 64;
+
+        Lz4Block *blocks = (Lz4Block *) realloc(reader->blocks,
+                sizeof(Lz4Block) * new_capacity);
+        if (blocks == NULL) {
+            return FALSE;
+        }
+        reader->blocks = blocks;
+
+        uint64_t *offsets = (uint64_t *) realloc(reader->offsets,
+                sizeof(uint64_t) * (new_capacity + 1));
+        if (offsets == NULL) {
+            return FALSE;
+        }
+        reader->offsets = offsets;
+
+        *capacity = new_capacity;
+    }
+
+    Lz4Block *block = &reader->blocks[reader->num_blocks++];
+    block->compressed_offset = compressed_offset;
+    block->compressed_size = size_field & LZ4_BLOCK_SIZE_MASK;
+    block->stored = (size_field & LZ4_BLOCK_STORED) != 0;
+    return TRUE;
+}
+
+/* Works out the uncompressed sizes of the blocks of a frame.  Blocks are
+ * full but for the last, whose size comes from the content size if the
+ * frame has one and from decompressing it otherwise.  Blocks found not to
+ * be full when read are reported as corrupt then. */
+static uint8_t size_frame_blocks(Lz4Reader *reader, uint64_t first,
+        size_t block_size, uint8_t has_content_size, uint64_t content_size) {
+
+    uint64_t last = reader->num_blocks - 1;
+
+    for (uint64_t i = first; i < reader->num_blocks; i++) {
+        Lz4Block *block = &reader->blocks[i];
+        uint64_t size = block_size;
+
+        if (block->stored) {
+            size = block->compressed_size;
+        } else if (i == last && has_content_size) {
+            uint64_t frame_size = reader->offsets[i] - reader->offsets[first];
+            if (content_size <= frame_size
+                    || content_size - frame_size > block_size) {
+                return FALSE;
+            }
+            size = content_size - frame_size;
+        } else if (i == last) {
+            uint8_t *buffer = (uint8_t *) malloc(block_size);
+            if (buffer == NULL) {
+                return FALSE;
+            }
+            int64_t decoded = decode_block(reader, i, buffer, block_size);
+            free(buffer);
+            if (decoded < 0) {
+                return FALSE;
+            }
+            size = decoded;
+        }
+
+        reader->offsets[i + 1] = reader->offsets[i] + size;
+    }
+
+    return TRUE;
+}
+
+/* Indexes the blocks of every frame from their size fields, which are all
+ * that is read of the file.  See:
+ * https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md */
+static uint8_t parse_frames(Lz4Reader *reader) {
+    uint64_t size = reader->source->size;
+    uint64_t position = 0;
+    uint64_t capacity = 0;
+    uint8_t header[8];
+
+    assert(reader->blocks == NULL);
+
+    reader->offsets = (uint64_t *) malloc(sizeof(uint64_t));
+    if (reader->offsets == NULL) {
+        return FALSE;
+    }
+    reader->offsets[0] = 0;
+    reader->max_block_size = 0;
+
+    while (position < size) {
+        if (size - position < 8 || byte_source_read(reader->source, header,
+                    position, 8) != 8) {
+            return FALSE;
+        }
+
+        uint32_t magic = read_le(&header[0], 4);
+
+        /* Skippable frames hold no data */
+        if ((magic & LZ4_SKIPPABLE_MASK) == LZ4_SKIPPABLE_MAGIC) {
+            position += 8 + read_le(&header[4], 4);
+            continue;
+        }
+
+        if (magic != LZ4_FRAME_MAGIC) {
+            return FALSE;
+        }
+
+        /* Blocks that depend on earlier ones or on a dictionary cannot be
+         * decompressed on their own */
+        uint8_t flags = header[4];
+        uint8_t block_size_id = (header[5] >> LZ4_BD_BLOCK_SIZE_SHIFT)
+            & LZ4_BD_BLOCK_SIZE_MASK;
+        if ((flags & LZ4_FLG_VERSION_MASK) != LZ4_FLG_VERSION
+                || !(flags & LZ4_FLG_BLOCK_INDEPENDENT)
+                || (flags & LZ4_FLG_DICT_ID)
+                || block_size_id < 4) {
+            return FALSE;
+        }
+
+        /* 64 KiB, 256 KiB, 1 MiB or 4 MiB */
+        size_t block_size = (size_t) 1 << (8 + 2 * block_size_id);
+        if (block_size > reader->max_block_size) {
+            reader->max_block_size = block_size;
+        }
+
+        /* Header checksums are skipped, the blocks are checked as they are
+         * decompressed */
+        uint64_t content_size = 0;
+        uint8_t has_content_size = (flags & LZ4_FLG_CONTENT_SIZE) != 0;
+        position += 6;
+        if (has_content_size) {
+            if (byte_source_read(reader->source, header, position, 8) != 8) {
+                return FALSE;
+            }
+            content_size = read_le(header, 8);
+            position += 8;
+        }
+        position += 1;
+
+        uint32_t trailer = (flags & LZ4_FLG_BLOCK_CHECKSUM)
+            ? LZ4_CHECKSUM_SIZE : 0;
+        uint64_t first = reader->num_blocks;
+
+        while (TRUE) {
+            if (size - MIN(position, size) < 4
+                    || byte_source_read(reader->source, header, position, 4)
+                        != 4) {
+                return FALSE;
+            }
+            position += 4;
+
+            uint32_t size_field = read_le(header, 4);
+            if (size_field == 0) {
+                break;
+            }
+
+            if ((size_field & LZ4_BLOCK_SIZE_MASK) > block_size
+                    || !add_block(reader, &capacity, position, size_field)) {
+                return FALSE;
+            }
+            position += (size_field & LZ4_BLOCK_SIZE_MASK) + trailer;
+        }
+
+        if (flags & LZ4_FLG_CONTENT_CHECKSUM) {
+            position += LZ4_CHECKSUM_SIZE;
+        }
+        if (position > size) {
+            return FALSE;
+        }
+
+        if (!size_frame_blocks(reader, first, block_size, has_content_size,
+                    content_size)) {
+            return FALSE;
+        }
+    }
+
+    return position == size;
+}
+
+/* Finds the block containing an uncompressed offset, skipping empty ones */
+static uint8_t locate_block(Lz4Reader *reader, off_t offset,
+        uint64_t *block) {
+    if (offset < 0 || (uint64_t) offset >= reader->offsets[reader->num_blocks]) {
+        return FALSE;
+    }
+
+    /* Last block starting at or before offset */
+    uint64_t low = 0;
+    uint64_t high = reader->num_blocks - 1;
+    while (low < high) {
+        uint64_t middle = low + (high - low + 1) / 2;
+        if (reader->offsets[middle] <= (uint64_t) offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    *block = low;
+    return TRUE;
+}
+
+/* Decompresses a block into a cache slot, checking it has the size its
+ * frame gives it */
+static int64_t load_block(void *reader, uint64_t block, void *arg,
+        uint8_t *data, size_t size) {
+    Lz4Reader *lz4_reader = (Lz4Reader *) reader;
+
+    UNUSED(arg);
+    int64_t decoded = decode_block(lz4_reader, block, data, size);
+    if (decoded != (int64_t) (lz4_reader->offsets[block + 1]
+                - lz4_reader->offsets[block])) {
+        return READER_ERROR;
+    }
+    return decoded;
+}
+
+/*****************************************************************************/
+/************************** Public struct functions **************************/
+/*****************************************************************************/
+
+/* Checks if lz4 file */
+extern uint8_t lz4_is_supported(FILE *lz4_file) {
+    uint8_t file_header[4];
+
+    size_t ret = fread(file_header, 1, sizeof(file_header), lz4_file);
+
+    assert(ret == sizeof(file_header));
+    if (ret != sizeof(file_header)) {
+        return FALSE;
+    }
+
+    if (read_le(file_header, 4) != LZ4_FRAME_MAGIC) {
+        return FALSE;
+    }
+
+    Lz4Reader reader = {
+        .source = byte_source_open(lz4_file),
+        .blocks = NULL,
+        .num_blocks = 0,
+        .offsets = NULL
+    };
+    if (reader.source == NULL) {
+        return FALSE;
+    }
+
+    uint8_t supported = parse_frames(&reader);
+    byte_source_close(reader.source);
+    free(reader.blocks);
+    free(reader.offsets);
+
+    return supported;
+}
+
+/* Creates lz4 reader struct */
+extern void *lz4_reader_alloc(FILE *lz4_file) {
+    Lz4Reader *reader = (Lz4Reader *) malloc(sizeof(Lz4Reader));
+    assert(reader != NULL);
+
+    if (reader != NULL) {
+        reader->source = byte_source_open(lz4_file);
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+
+        /* Blocks are read in whatever order files need them */
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
+
+        reader->blocks = NULL;
+        reader->num_blocks = 0;
+        reader->offsets = NULL;
+        reader->cache = NULL;
+
+        if (!parse_frames(reader) || reader->num_blocks == 0) {
+            lz4_reader_free((void *) reader);
+            return NULL;
+        }
+
+        reader->cache = slot_cache_alloc(reader, load_block,
+                reader->max_block_size, LZ4_CACHE_SIZE_MB * 1024 * 1024,
+                LZ4_CACHE_MIN_BLOCKS, 0, "spotlight-lz4-cache");
+        if (reader->cache == NULL) {
+            lz4_reader_free((void *) reader);
+            return NULL;
+        }
+    }
+
+    return (void *) reader;
+}
+
+/* Read bytes in lz4 compressed file */
+extern int64_t lz4_read(void *reader, uint8_t *buffer, off_t offset,
+        size_t length) {
+
+    Lz4Reader *lz4_reader = (Lz4Reader *) reader;
+
+    off_t position = offset;
+    off_t end = offset + length;
+    uint64_t block;
+
+    if (!locate_block(lz4_reader, offset, &block)) {
+        return length ? READER_ERROR : 0;
+    }
+
+    while (position < end && block < lz4_reader->num_blocks) {
+        off_t start = lz4_reader->offsets[block];
+        size_t size = lz4_reader->offsets[block + 1] - start;
+        size_t n = MIN((size_t) (end - position),
+                (size_t) (start + size - position));
+        uint8_t *out = &buffer[position - offset];
+
+        /* Whole blocks are decompressed straight into the buffer unless
+         * cached already, rather than evict blocks for data read once */
+        uint8_t whole = (position == start && n == size);
+
+        SlotCacheEntry *entry = NULL;
+        if (size > 0 && !slot_cache_get(lz4_reader->cache, block, NULL,
+                    !whole, FALSE, &entry)) {
+            break;
+        }
+
+        if (size == 0) {
+            /* Nothing to read */
+        } else if (entry) {
+            memcpy(out, &entry->data[position - start], n);
+            slot_cache_put(lz4_reader->cache, entry);
+        } else if (whole) {
+            int64_t decoded = decode_block(lz4_reader, block, out, size);
+            slot_cache_count_load(lz4_reader->cache);
+            if (decoded != (int64_t) size) {
+                break;
+            }
+        } else {
+            /* Every cache entry is held */
+            uint8_t *data = (uint8_t *) malloc(lz4_reader->max_block_size);
+            int64_t decoded = data ? decode_block(lz4_reader, block, data,
+                    lz4_reader->max_block_size) : READER_ERROR;
+            slot_cache_count_load(lz4_reader->cache);
+            if (decoded == (int64_t) size) {
+                memcpy(out, &data[position - start], n);
+            }
+            free(data);
+            if (decoded != (int64_t) size) {
+                break;
+            }
+        }
+
+        position += n;
+        block++;
+    }
+
+    if (position == offset && length > 0) {
+        return READER_ERROR;
+    }
+
+    return position - offset;
+}
+
+/* References a cached block */
+extern int64_t lz4_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+
+    Lz4Reader *lz4_reader = (Lz4Reader *) reader;
+
+    uint64_t block;
+    SlotCacheEntry *entry;
+
+    /* Only blocks in the memfd can be referenced */
+    if (lz4_reader->cache->fd < 0
+            || !locate_block(lz4_reader, offset, &block)
+            || !slot_cache_get(lz4_reader->cache, block, NULL, TRUE, FALSE,
+                &entry)
+            || entry == NULL) {
+        return READER_ERROR;
+    }
+
+    /* The hold from slot_cache_get is passed on to the reference */
+    off_t start = lz4_reader->offsets[block];
+    size_t size = lz4_reader->offsets[block + 1] - start;
+
+    ref->fd = lz4_reader->cache->fd;
+    ref->fd_offset = entry->fd_offset + (offset - start);
+    ref->length = MIN(length, (size_t) (start + size - offset));
+    ref->token = entry;
+
+    return ref->length;
+}
+
+/* Releases a reference from lz4_read_ref */
+extern void lz4_release_ref(void *reader, struct CompressionRef *ref) {
+    slot_cache_put(((Lz4Reader *) reader)->cache,
+            (SlotCacheEntry *) ref->token);
+}
+
+/* Decompresses the blocks overlapping a range into the cache */
+extern int64_t lz4_prefetch(void *reader, off_t offset, size_t length) {
+    Lz4Reader *lz4_reader = (Lz4Reader *) reader;
+
+    off_t position = offset;
+    off_t end = offset + length;
+    uint64_t block;
+
+    while (position < end && locate_block(lz4_reader, position, &block)) {
+        SlotCacheEntry *entry;
+
+        if (!slot_cache_get(lz4_reader->cache, block, NULL, TRUE, TRUE,
+                    &entry)) {
+            return (position > offset) ? position - offset : READER_ERROR;
+        }
+
+        /* The cache is full of blocks in use or yet to be read */
+        if (entry == NULL) {
+            break;
+        }
+        slot_cache_put(lz4_reader->cache, entry);
+
+        position = lz4_reader->offsets[block + 1];
+    }
+
+    return MIN(position, end) - offset;
+}
+
+/* Reports lz4 reader counters */
+extern void lz4_stats(void *reader, struct CompressionStats *stats) {
+    Lz4Reader *lz4_reader = (Lz4Reader *) reader;
+
+    slot_cache_stats(lz4_reader->cache, stats);
+}
+
+/* Free lz4 reader struct */
+extern void lz4_reader_free(void *reader) {
+    Lz4Reader *lz4_reader = (Lz4Reader *) reader;
+
+    if (lz4_reader->cache != NULL) {
+        slot_cache_free(lz4_reader->cache);
+    }
+    free(lz4_reader->blocks);
+    free(lz4_reader->offsets);
+    byte_source_close(lz4_reader->source);
+    free(lz4_reader);
+}
@@ -0,0 +1,170 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <lz4.h>
+#include <pthread.h>
+
+#define LZ4_CACHE_SIZE_MB           16
+#define LZ4_CACHE_MIN_BLOCKS        8
+
+#define READER_ERROR   (-1)
+#define TRUE            1
+#define FALSE           0
+
+#define LZ4_FRAME_MAGIC             0x184D2204
+#define LZ4_SKIPPABLE_MAGIC         0x184D2A50
+#define LZ4_SKIPPABLE_MASK          0xFFFFFFF0
+
+/* Frame descriptor bits */
+#define LZ4_FLG_VERSION_MASK        0xC0
+#define LZ4_FLG_VERSION             0x40
+#define LZ4_FLG_BLOCK_INDEPENDENT   0x20
+#define LZ4_FLG_BLOCK_CHECKSUM      0x10
+#define LZ4_FLG_CONTENT_SIZE        0x08
+#define LZ4_FLG_CONTENT_CHECKSUM    0x04
+#define LZ4_FLG_DICT_ID             0x01
+#define LZ4_BD_BLOCK_SIZE_SHIFT     4
+#define LZ4_BD_BLOCK_SIZE_MASK      0x07
+
+/* Block size field bits */
+#define LZ4_BLOCK_STORED            0x80000000
+#define LZ4_BLOCK_SIZE_MASK         0x7FFFFFFF
+
+#define LZ4_CHECKSUM_SIZE           4
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Block of an lz4 frame */
+typedef struct Lz4Block {
+
+    /* Address of the block data in the file, past its size field */
+    uint64_t compressed_offset;
+
+    /* Bytes of block data */
+    uint32_t compressed_size;
+
+    /* Set if the block data is stored uncompressed */
+    uint8_t stored;
+
+} Lz4Block;
+
+/* lz4 frame compression reader */
+typedef struct Lz4Reader {
+
+    /* lz4-compressed input */
+    struct ByteSource *source;
+
+    /* Blocks of every frame in the file, and the uncompressed address of
+     * each with the end of the last block after them */
+    Lz4Block *blocks;
+    uint64_t num_blocks;
+    uint64_t *offsets;
+
+    /* Largest block size of any frame */
+    size_t max_block_size;
+
+    /* Decompressed blocks, in fixed slots of the largest block size */
+    struct SlotCache *cache;
+
+} Lz4Reader;
+
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in slot_cache.h */
+struct SlotCache;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Checks if lz4 reader supports a particular file, which must hold lz4
+ *  frames of independent blocks, all but the last of each frame full
+ *
+ *  @param lz4_file File pointer
+ *
+ *  @returns 1 for TRUE or 0 for FALSE
+ */
+extern uint8_t lz4_is_supported(FILE *lz4_file);
+
+/** Allocates memory for lz4 reader, indexing the blocks of the file
+ *
+ *  @param lz4_file lz4-compressed file to read from
+ *
+ *  @returns Lz4Reader structure, or NULL if error
+ */
+extern void *lz4_reader_alloc(FILE *lz4_file);
+
+/** Reads from lz4-compressed file
+ *
+ *  @param reader Lz4Reader that has been allocated
+ *  @param buffer Buffer to read data into
+ *  @param offset Decompressed address to read from
+ *  @param length Number of bytes to read, must be greater than size of buffer
+ *
+ *  @returns Number of bytes read, short at the end of the data, or
+ *           READER_ERROR if error
+ */
+extern int64_t lz4_read(void *reader, uint8_t *buffer,
+        off_t offset, size_t length);
+
+/** References a cached block, so it can be spliced rather than copied
+ *
+ *  @param reader Lz4Reader that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the block, or
+ *           READER_ERROR if the block cannot be referenced
+ */
+extern int64_t lz4_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Releases a reference from lz4_read_ref
+ *
+ *  @param reader Lz4Reader that has been allocated
+ *  @param ref Reference to release
+ */
+extern void lz4_release_ref(void *reader, struct CompressionRef *ref);
+
+/** Decompresses the blocks overlapping a range into the cache
+ *
+ *  @param reader Lz4Reader that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes now cached from offset on, which stops short
+ *           once a quarter of the cache is waiting to be read, or
+ *           READER_ERROR if error
+ */
+extern int64_t lz4_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports lz4 reader counters
+ *
+ *  @param reader Lz4Reader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void lz4_stats(void *reader, struct CompressionStats *stats);
+
+/** Frees memory for lz4 reader
+ *
+ *  @param reader Lz4Reader structure
+ */
+extern void lz4_reader_free(void *reader);
@@ -0,0 +1,566 @@
+#define _GNU_SOURCE
+#include "qcow2_reader.h"
+#include "../byte_source.h"
+#include "../compression_reader.h"
+#include "../slot_cache.h"
+
+/*****************************************************************************/
+/*************************** Data access functions ***************************/
+/*****************************************************************************/
+
+/* Reads a big-endian value of size bytes */
+static uint64_t read_be(const uint8_t *bytes, uint32_t size) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < size; i++) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+/* Reads the header and the active L1 table, checking that the image has
+ * nothing this reader cannot follow.  Snapshots are ignored.  See:
+ * https://gitlab.com/qemu-project/qemu/-/blob/master/docs/interop/qcow2.txt */
+static uint8_t parse_header(Qcow2Reader *reader) {
+    uint8_t header[QCOW2_HEADER_V3_SIZE + 1];
+
+    assert(reader->l1_table == NULL);
+
+    int64_t length = byte_source_read(reader->source, header, 0,
+            sizeof(header));
+    if (length < QCOW2_HEADER_V2_SIZE
+            || read_be(&header[0], 4) != QCOW2_MAGIC) {
+        return FALSE;
+    }
+
+    uint32_t version = read_be(&header[4], 4);
+    uint64_t backing_file_offset = read_be(&header[8], 8);
+    uint32_t cluster_bits = read_be(&header[20], 4);
+    uint64_t size = read_be(&header[24], 8);
+    uint32_t crypt_method = read_be(&header[32], 4);
+    uint32_t l1_size = read_be(&header[36], 4);
+    uint64_t l1_table_offset = read_be(&header[40], 8);
+
+    /* Unallocated clusters would have to be read from the backing file */
+    if ((version != 2 && version != 3) || backing_file_offset != 0
+            || crypt_method != 0
+            || cluster_bits < QCOW2_MIN_CLUSTER_BITS
+            || cluster_bits > QCOW2_MAX_CLUSTER_BITS) {
+        return FALSE;
+    }
+
+    if (version == 3) {
+        if (length < QCOW2_HEADER_V3_SIZE) {
+            return FALSE;
+        }
+
+        uint64_t incompatible = read_be(&header[72], 8);
+        uint32_t header_length = read_be(&header[100], 4);
+
+        /* Clusters are only read, so a dirty image is still consistent */
+        uint64_t supported = QCOW2_INCOMPAT_DIRTY;
+        if (header_length > QCOW2_HEADER_V3_SIZE
+                && length > QCOW2_HEADER_V3_SIZE
+                && header[QCOW2_HEADER_V3_SIZE] == QCOW2_COMPRESSION_ZLIB) {
+            supported |= QCOW2_INCOMPAT_COMPRESSION;
+        }
+        if (incompatible & ~supported) {
+            return FALSE;
+        }
+    }
+
+    /* Each L2 table maps a cluster of 8 byte entries */
+    uint32_t l2_bits = cluster_bits - 3;
+    uint64_t l1_needed = ((size >> cluster_bits)
+            + ((size & ((1ULL << cluster_bits) - 1)) ? 1 : 0)
+            + (1ULL << l2_bits) - 1) >> l2_bits;
+    if (l1_size < l1_needed
+            || (uint64_t) l1_size * sizeof(uint64_t) > QCOW2_MAX_L1_SIZE) {
+        return FALSE;
+    }
+
+    reader->cluster_bits = cluster_bits;
+    reader->cluster_size = (size_t) 1 << cluster_bits;
+    reader->size = size;
+    reader->l1_size = l1_size;
+
+    reader->l1_table = (uint64_t *) malloc(sizeof(uint64_t)
+            * (l1_size ? l1_size : 1));
+    if (reader->l1_table == NULL) {
+        return FALSE;
+    }
+
+    size_t l1_length = (size_t) l1_size * sizeof(uint64_t);
+    if (l1_length > 0 && byte_source_read(reader->source,
+                (uint8_t *) reader->l1_table, l1_table_offset, l1_length)
+            != (int64_t) l1_length) {
+        return FALSE;
+    }
+
+    for (uint64_t i = 0; i < reader->l1_size; i++) {
+        reader->l1_table[i] = read_be((uint8_t *) &reader->l1_table[i], 8);
+    }
+
+    return TRUE;
+}
+
+/* Finds a cached L2 table, and marks it most recently used.  Must be called
+ * with lock held */
+static Qcow2L2Table *find_l2_table(Qcow2Reader *reader, uint64_t l1_index) {
+    for (uint32_t i = 0; i < QCOW2_L2_CACHE_TABLES; i++) {
+        Qcow2L2Table *table = &reader->l2_tables[i];
+        if (table->entries && table->l1_index == l1_index) {
+            table->last_used = ++reader->l2_clock;
+            return table;
+        }
+    }
+
+    return NULL;
+}
+
+/* Looks up the L2 entry of a guest cluster, reading its L2 table into the
+ * L2 cache if needed.  Entries are copied out, so tables can be replaced
+ * while others use them.  Clusters with no L2 table get an entry of 0. */
+static uint8_t get_l2_entry(Qcow2Reader *reader, uint64_t cluster,
+        uint64_t *l2_entry) {
+
+    uint32_t l2_bits = reader->cluster_bits - 3;
+    uint64_t l1_index = cluster >> l2_bits;
+    uint64_t l2_index = cluster & ((1ULL << l2_bits) - 1);
+
+    if (l1_index >= reader->l1_size) {
+        return FALSE;
+    }
+
+    uint64_t l2_offset = reader->l1_table[l1_index] & QCOW2_OFFSET_MASK;
+    if (l2_offset == 0) {
+        *l2_entry = 0;
+        return TRUE;
+    }
+
+    pthread_mutex_lock(&reader->lock);
+    Qcow2L2Table *table = find_l2_table(reader, l1_index);
+    if (table) {
+        *l2_entry = read_be(&table->entries[l2_index * 8], 8);
+        pthread_mutex_unlock(&reader->lock);
+        return TRUE;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    uint8_t *entries = (uint8_t *) malloc(reader->cluster_size);
+    if (entries == NULL) {
+        return FALSE;
+    }
+    if (byte_source_read(reader->source, entries, l2_offset,
+                reader->cluster_size) != (int64_t) reader->cluster_size) {
+        free(entries);
+        return FALSE;
+    }
+    *l2_entry = read_be(&entries[l2_index * 8], 8);
+
+    /* Another thread may have read the same table meanwhile */
+    pthread_mutex_lock(&reader->lock);
+    if (find_l2_table(reader, l1_index)) {
+        free(entries);
+    } else {
+        table = &reader->l2_tables[0];
+        for (uint32_t i = 1; i < QCOW2_L2_CACHE_TABLES; i++) {
+            if (reader->l2_tables[i].last_used < table->last_used) {
+                table = &reader->l2_tables[i];
+            }
+        }
+        free(table->entries);
+        table->l1_index = l1_index;
+        table->entries = entries;
+        table->last_used = ++reader->l2_clock;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    return TRUE;
+}
+
+/* Classifies an L2 entry, and gives the host address of the cluster data */
+static uint8_t cluster_type(Qcow2Reader *reader, uint64_t l2_entry,
+        uint64_t *host_offset) {
+
+    if (l2_entry & QCOW2_COMPRESSED) {
+        uint32_t offset_bits = 62 - (reader->cluster_bits - 8);
+        *host_offset = l2_entry & ((1ULL << offset_bits) - 1);
+        return QCOW2_CLUSTER_COMPRESSED;
+    }
+
+    *host_offset = l2_entry & QCOW2_OFFSET_MASK;
+    if (*host_offset == 0 || (l2_entry & QCOW2_ZERO)) {
+        return QCOW2_CLUSTER_ZERO;
+    }
+    return QCOW2_CLUSTER_NORMAL;
+}
+
+/* Inflates a compressed cluster into buffer, which is read straight from
+ * the mapping of the image if there is one.  The compressed size is only
+ * known to the sector, so inflating stops at the end of the deflate stream
+ * or of the cluster, whichever is first. */
+static uint8_t decode_cluster(Qcow2Reader *reader, uint64_t l2_entry,
+        uint8_t *buffer) {
+
+    uint32_t offset_bits = 62 - (reader->cluster_bits - 8);
+    uint64_t host_offset = l2_entry & ((1ULL << offset_bits) - 1);
+    uint64_t num_sectors = ((l2_entry >> offset_bits)
+            & ((1ULL << (reader->cluster_bits - 8)) - 1)) + 1;
+    uint64_t compressed_size = num_sectors * QCOW2_SECTOR_SIZE
+        - (host_offset & (QCOW2_SECTOR_SIZE - 1));
+
+    /* The last sector of the image may be cut short */
+    if (host_offset >= reader->source->size) {
+        return FALSE;
+    }
+    compressed_size = MIN(compressed_size,
+            reader->source->size - host_offset);
+
+    uint8_t *scratch = NULL;
+    uint8_t ok = FALSE;
+
+    if (reader->source->map == NULL) {
+        scratch = (uint8_t *) malloc(compressed_size);
+        if (scratch == NULL) {
+            return FALSE;
+        }
+    }
+
+    size_t length = compressed_size;
+    const uint8_t *input = byte_source_get(reader->source, host_offset,
+            &length, scratch, compressed_size);
+    if (input == NULL || length != compressed_size) {
+        goto exit;
+    }
+
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, QCOW2_INFLATE_BITS) != Z_OK) {
+        goto exit;
+    }
+
+    stream.next_in = (uint8_t *) input;
+    stream.avail_in = length;
+    stream.next_out = buffer;
+    stream.avail_out = reader->cluster_size;
+
+    int ret = inflate(&stream, Z_FINISH);
+    if (ret == Z_STREAM_END) {
+        /* A short last cluster, the rest of it reads as zeros */
+        memset(stream.next_out, 0, stream.avail_out);
+        ok = TRUE;
+    } else if ((ret == Z_OK || ret == Z_BUF_ERROR) && stream.avail_out == 0) {
+        ok = TRUE;
+    }
+    inflateEnd(&stream);
+
+exit:
+    free(scratch);
+    return ok;
+}
+
+/* Inflates a compressed cluster into a cache slot, arg being its L2 entry */
+static int64_t load_cluster(void *reader, uint64_t cluster, void *arg,
+        uint8_t *data, size_t size) {
+    Qcow2Reader *qcow2_reader = (Qcow2Reader *) reader;
+
+    UNUSED(cluster);
+    assert(size == qcow2_reader->cluster_size);
+    if (!decode_cluster(qcow2_reader, *(uint64_t *) arg, data)) {
+        return READER_ERROR;
+    }
+    return size;
+}
+
+/*****************************************************************************/
+/************************** Public struct functions **************************/
+/*****************************************************************************/
+
+/* Checks if qcow2 image */
+extern uint8_t qcow2_is_supported(FILE *qcow2_file) {
+    uint8_t file_header[4];
+
+    size_t ret = fread(file_header, 1, sizeof(file_header), qcow2_file);
+
+    assert(ret == sizeof(file_header));
+    if (ret != sizeof(file_header)) {
+        return FALSE;
+    }
+
+    if (read_be(file_header, 4) != QCOW2_MAGIC) {
+        return FALSE;
+    }
+
+    Qcow2Reader reader = {
+        .source = byte_source_open(qcow2_file),
+        .l1_table = NULL,
+        .l1_size = 0
+    };
+    if (reader.source == NULL) {
+        return FALSE;
+    }
+
+    uint8_t supported = parse_header(&reader);
+    byte_source_close(reader.source);
+    free(reader.l1_table);
+
+    return supported;
+}
+
+/* Creates qcow2 reader struct */
+extern void *qcow2_reader_alloc(FILE *qcow2_file) {
+    Qcow2Reader *reader = (Qcow2Reader *) malloc(sizeof(Qcow2Reader));
+    assert(reader != NULL);
+
+    if (reader != NULL) {
+        reader->source = byte_source_open(qcow2_file);
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+
+        /* Clusters are read in whatever order files need them */
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
+
+        reader->l1_table = NULL;
+        reader->l1_size = 0;
+        for (uint32_t i = 0; i < QCOW2_L2_CACHE_TABLES; i++) {
+            reader->l2_tables[i].l1_index = 0;
+            reader->l2_tables[i].entries = NULL;
+            reader->l2_tables[i].last_used = 0;
+        }
+        reader->l2_clock = 0;
+        reader->cache = NULL;
+        pthread_mutex_init(&reader->lock, NULL);
+
+        if (!parse_header(reader)) {
+            qcow2_reader_free((void *) reader);
+            return NULL;
+        }
+
+        reader->cache = slot_cache_alloc(reader, load_cluster,
+                reader->cluster_size, QCOW2_CACHE_SIZE_MB * 1024 * 1024,
+                QCOW2_CACHE_MIN_CLUSTERS, 0, "spotlight-qcow2-cache");
+        if (reader->cache == NULL) {
+            qcow2_reader_free((void *) reader);
+            return NULL;
+        }
+    }
+
+    return (void *) reader;
+}
+
+/* Read bytes in qcow2 image */
+extern int64_t qcow2_read(void *reader, uint8_t *buffer, off_t offset,
+        size_t length) {
+
+    Qcow2Reader *qcow2_reader = (Qcow2Reader *) reader;
+
+    if (offset < 0 || (uint64_t) offset >= qcow2_reader->size) {
+        return length ? READER_ERROR : 0;
+    }
+
+    off_t position = offset;
+    off_t end = MIN((uint64_t) offset + length, qcow2_reader->size);
+
+    while (position < end) {
+        uint64_t cluster = position >> qcow2_reader->cluster_bits;
+        off_t start = cluster << qcow2_reader->cluster_bits;
+        size_t size = qcow2_reader->cluster_size;
+        size_t n = MIN((size_t) (end - position),
+                (size_t) (start + size - position));
+        uint8_t *out = &buffer[position - offset];
+        uint64_t l2_entry;
+        uint64_t host_offset;
+
+        if (!get_l2_entry(qcow2_reader, cluster, &l2_entry)) {
+            break;
+        }
+
+        uint8_t type = cluster_type(qcow2_reader, l2_entry, &host_offset);
+        if (type == QCOW2_CLUSTER_ZERO) {
+            memset(out, 0, n);
+
+        } else if (type == QCOW2_CLUSTER_NORMAL) {
+            if (byte_source_read(qcow2_reader->source, out,
+                        host_offset + (position - start), n) != (int64_t) n) {
+                break;
+            }
+
+        } else {
+            /* Whole clusters are inflated straight into the buffer unless
+             * cached already, rather than evict clusters for data read
+             * once */
+            uint8_t whole = (position == start && n == size);
+
+            SlotCacheEntry *entry = NULL;
+            if (!slot_cache_get(qcow2_reader->cache, cluster, &l2_entry,
+                        !whole, FALSE, &entry)) {
+                break;
+            }
+
+            if (entry) {
+                memcpy(out, &entry->data[position - start], n);
+                slot_cache_put(qcow2_reader->cache, entry);
+            } else if (whole) {
+                uint8_t ok = decode_cluster(qcow2_reader, l2_entry, out);
+                slot_cache_count_load(qcow2_reader->cache);
+                if (!ok) {
+                    break;
+                }
+            } else {
+                /* Every cache entry is held */
+                uint8_t *data = (uint8_t *) malloc(size);
+                uint8_t ok = data && decode_cluster(qcow2_reader, l2_entry,
+                        data);
+                slot_cache_count_load(qcow2_reader->cache);
+                if (ok) {
+                    memcpy(out, &data[position - start], n);
+                }
+                free(data);
+                if (!ok) {
+                    break;
+                }
+            }
+        }
+
+        position += n;
+    }
+
+    if (position == offset && length > 0) {
+        return READER_ERROR;
+    }
+
+    return position - offset;
+}
+
+/* References a cluster in the image or in the cache */
+extern int64_t qcow2_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+
+    Qcow2Reader *qcow2_reader = (Qcow2Reader *) reader;
+
+    if (offset < 0 || (uint64_t) offset >= qcow2_reader->size) {
+        return READER_ERROR;
+    }
+
+    uint64_t cluster = offset >> qcow2_reader->cluster_bits;
+    off_t start = cluster << qcow2_reader->cluster_bits;
+    size_t n = MIN(length, (size_t) MIN(start + qcow2_reader->cluster_size,
+                qcow2_reader->size) - offset);
+    uint64_t l2_entry;
+    uint64_t host_offset;
+
+    if (!get_l2_entry(qcow2_reader, cluster, &l2_entry)) {
+        return READER_ERROR;
+    }
+
+    /* Zeros have nothing to reference, they are read instead */
+    uint8_t type = cluster_type(qcow2_reader, l2_entry, &host_offset);
+    if (type == QCOW2_CLUSTER_ZERO) {
+        return READER_ERROR;
+    }
+
+    if (type == QCOW2_CLUSTER_NORMAL) {
+        ref->fd = qcow2_reader->source->fd;
+        ref->fd_offset = host_offset + (offset - start);
+        ref->length = n;
+        ref->token = NULL;
+        return ref->length;
+    }
+
+    /* Only clusters in the memfd can be referenced */
+    SlotCacheEntry *entry;
+    if (qcow2_reader->cache->fd < 0
+            || !slot_cache_get(qcow2_reader->cache, cluster, &l2_entry,
+                TRUE, FALSE, &entry)
+            || entry == NULL) {
+        return READER_ERROR;
+    }
+
+    /* The hold from slot_cache_get is passed on to the reference */
+    ref->fd = qcow2_reader->cache->fd;
+    ref->fd_offset = entry->fd_offset + (offset - start);
+    ref->length = n;
+    ref->token = entry;
+
+    return ref->length;
+}
+
+/* Releases a reference from qcow2_read_ref */
+extern void qcow2_release_ref(void *reader, struct CompressionRef *ref) {
+    if (ref->token) {
+        slot_cache_put(((Qcow2Reader *) reader)->cache,
+                (SlotCacheEntry *) ref->token);
+    }
+}
+
+/* Gets the clusters overlapping a range ready for reading */
+extern int64_t qcow2_prefetch(void *reader, off_t offset, size_t length) {
+    Qcow2Reader *qcow2_reader = (Qcow2Reader *) reader;
+
+    if (offset < 0 || (uint64_t) offset >= qcow2_reader->size) {
+        return length ? READER_ERROR : 0;
+    }
+
+    off_t position = offset;
+    off_t end = MIN((uint64_t) offset + length, qcow2_reader->size);
+
+    while (position < end) {
+        uint64_t cluster = position >> qcow2_reader->cluster_bits;
+        off_t next = (cluster + 1) << qcow2_reader->cluster_bits;
+        uint64_t l2_entry;
+        uint64_t host_offset;
+
+        if (!get_l2_entry(qcow2_reader, cluster, &l2_entry)) {
+            return (position > offset) ? position - offset : READER_ERROR;
+        }
+
+        uint8_t type = cluster_type(qcow2_reader, l2_entry, &host_offset);
+        if (type == QCOW2_CLUSTER_NORMAL) {
+            byte_source_advise(qcow2_reader->source, host_offset,
+                    qcow2_reader->cluster_size, BYTE_SOURCE_WILLNEED);
+
+        } else if (type == QCOW2_CLUSTER_COMPRESSED) {
+            SlotCacheEntry *entry;
+
+            if (!slot_cache_get(qcow2_reader->cache, cluster, &l2_entry,
+                        TRUE, TRUE, &entry)) {
+                return (position > offset) ? position - offset : READER_ERROR;
+            }
+
+            /* The cache is full of clusters in use or yet to be read */
+            if (entry == NULL) {
+                break;
+            }
+            slot_cache_put(qcow2_reader->cache, entry);
+        }
+
+        position = next;
+    }
+
+    return MIN(position, end) - offset;
+}
+
+/* Reports qcow2 reader counters */
+extern void qcow2_stats(void *reader, struct CompressionStats *stats) {
+    Qcow2Reader *qcow2_reader = (Qcow2Reader *) reader;
+
+    slot_cache_stats(qcow2_reader->cache, stats);
+}
+
+/* Free qcow2 reader struct */
+extern void qcow2_reader_free(void *reader) {
+    Qcow2Reader *qcow2_reader = (Qcow2Reader *) reader;
+
+    if (qcow2_reader->cache != NULL) {
+        slot_cache_free(qcow2_reader->cache);
+    }
+    for (uint32_t i = 0; i < QCOW2_L2_CACHE_TABLES; i++) {
+        free(qcow2_reader->l2_tables[i].entries);
+    }
+    free(qcow2_reader->l1_table);
+    byte_source_close(qcow2_reader->source);
+    pthread_mutex_destroy(&qcow2_reader->lock);
+    free(qcow2_reader);
+}
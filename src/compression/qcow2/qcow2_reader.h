@@ -0,0 +1,196 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "../../libs/zlib-ng/zlib.h"
+
+#define QCOW2_CACHE_SIZE_MB         16
+#define QCOW2_CACHE_MIN_CLUSTERS    8
+/* L2 tables kept, each maps cluster_size / 8 clusters */
+#define QCOW2_L2_CACHE_TABLES       16
+
+#define READER_ERROR   (-1)
+#define TRUE            1
+#define FALSE           0
+
+#define QCOW2_MAGIC                 0x514649FB
+#define QCOW2_HEADER_V2_SIZE        72
+#define QCOW2_HEADER_V3_SIZE        104
+#define QCOW2_MIN_CLUSTER_BITS      9
+#define QCOW2_MAX_CLUSTER_BITS      21
+/* Largest L1 table accepted, as for qemu */
+#define QCOW2_MAX_L1_SIZE           (32 * 1024 * 1024)
+
+/* Incompatible feature bits */
+#define QCOW2_INCOMPAT_DIRTY        (1ULL << 0)
+#define QCOW2_INCOMPAT_CORRUPT      (1ULL << 1)
+#define QCOW2_INCOMPAT_DATA_FILE    (1ULL << 2)
+#define QCOW2_INCOMPAT_COMPRESSION  (1ULL << 3)
+#define QCOW2_INCOMPAT_EXTL2        (1ULL << 4)
+
+#define QCOW2_COMPRESSION_ZLIB      0
+
+/* L1 and L2 table entry bits */
+#define QCOW2_OFFSET_MASK           0x00FFFFFFFFFFFE00ULL
+#define QCOW2_COMPRESSED            (1ULL << 62)
+#define QCOW2_ZERO                  (1ULL << 0)
+
+#define QCOW2_SECTOR_SIZE           512
+#define QCOW2_INFLATE_BITS          (-15)
+
+/* How a guest cluster is stored: unallocated or zero-flagged and read as
+ * zeros, as is in a host cluster, or deflated into a run of host sectors */
+#define QCOW2_CLUSTER_ZERO          0
+#define QCOW2_CLUSTER_NORMAL        1
+#define QCOW2_CLUSTER_COMPRESSED    2
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* L2 table held in the L2 cache */
+typedef struct Qcow2L2Table {
+
+    /* Index of the L1 entry pointing at the table */
+    uint64_t l1_index;
+
+    /* Entries as stored, big-endian, NULL if the slot is unused */
+    uint8_t *entries;
+
+    /* Value of the use clock when the table was last looked at */
+    uint64_t last_used;
+
+} Qcow2L2Table;
+
+/* qcow2 image reader */
+typedef struct Qcow2Reader {
+
+    /* qcow2 image */
+    struct ByteSource *source;
+
+    /* Cluster size, as a power of two */
+    uint32_t cluster_bits;
+    size_t cluster_size;
+
+    /* Size of the guest disk */
+    uint64_t size;
+
+    /* Active L1 table, in host byte order */
+    uint64_t *l1_table;
+    uint64_t l1_size;
+
+    /* L2 tables read so far, least recently used replaced first */
+    Qcow2L2Table l2_tables[QCOW2_L2_CACHE_TABLES];
+    uint64_t l2_clock;
+
+    /* Decompressed clusters, keyed by guest cluster index */
+    struct SlotCache *cache;
+
+    /* Protects the L2 cache, tables are read without it held */
+    pthread_mutex_t lock;
+
+} Qcow2Reader;
+
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in slot_cache.h */
+struct SlotCache;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Checks if qcow2 reader supports a particular file, which must be a
+ *  version 2 or 3 image with no backing file, encryption, external data
+ *  file or subclusters, compressed with deflate if at all
+ *
+ *  @param qcow2_file File pointer
+ *
+ *  @returns 1 for TRUE or 0 for FALSE
+ */
+extern uint8_t qcow2_is_supported(FILE *qcow2_file);
+
+/** Allocates memory for qcow2 reader, reading the header and L1 table
+ *
+ *  @param qcow2_file qcow2 image to read from
+ *
+ *  @returns Qcow2Reader structure, or NULL if error
+ */
+extern void *qcow2_reader_alloc(FILE *qcow2_file);
+
+/** Reads from the guest disk of a qcow2 image.  Compressed clusters are
+ *  inflated, unallocated and zero clusters read as zeros.
+ *
+ *  @param reader Qcow2Reader that has been allocated
+ *  @param buffer Buffer to read data into
+ *  @param offset Guest disk address to read from
+ *  @param length Number of bytes to read, must be greater than size of buffer
+ *
+ *  @returns Number of bytes read, short at the end of the disk, or
+ *           READER_ERROR if error
+ */
+extern int64_t qcow2_read(void *reader, uint8_t *buffer,
+        off_t offset, size_t length);
+
+/** References a cluster, in the image for an uncompressed one or in the
+ *  cache for a compressed one, so it can be spliced rather than copied
+ *
+ *  @param reader Qcow2Reader that has been allocated
+ *  @param offset Guest disk address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the cluster, or
+ *           READER_ERROR if the cluster cannot be referenced
+ */
+extern int64_t qcow2_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Releases a reference from qcow2_read_ref
+ *
+ *  @param reader Qcow2Reader that has been allocated
+ *  @param ref Reference to release
+ */
+extern void qcow2_release_ref(void *reader, struct CompressionRef *ref);
+
+/** Decompresses the compressed clusters overlapping a range into the cache,
+ *  and asks the kernel to read the uncompressed ones
+ *
+ *  @param reader Qcow2Reader that has been allocated
+ *  @param offset Guest disk address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes now ready from offset on, which stops short
+ *           once a quarter of the cache is waiting to be read, or
+ *           READER_ERROR if error
+ */
+extern int64_t qcow2_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports qcow2 reader counters
+ *
+ *  @param reader Qcow2Reader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void qcow2_stats(void *reader, struct CompressionStats *stats);
+
+/** Frees memory for qcow2 reader
+ *
+ *  @param reader Qcow2Reader structure
+ */
+extern void qcow2_reader_free(void *reader);
@@ -1,28 +1,191 @@
 #include "reader.h"
+#include "../byte_source.h"
+#include "../compression_reader.h"
+#include "../slot_cache.h"
+
+/* Bytes of the block cache, 0 if images are read through the page cache */
+static size_t direct_cache_size = 0;
+
+/*****************************************************************************/
+/*************************** Data access functions ***************************/
+/*****************************************************************************/
+
+/* Reads a block of the image into a cache slot */
+static int64_t load_block(void *reader, uint64_t block, void *arg,
+        uint8_t *data, size_t size) {
+    UNUSED(arg);
+    return byte_source_read(((RawReader *) reader)->source, data,
+            (off_t) block * RAW_CACHE_BLOCK, size);
+}
+
+/* Reads through the block cache */
+static int64_t read_cached(RawReader *reader, uint8_t *buffer, off_t offset,
+        size_t length) {
+
+    size_t total = 0;
+
+    while (total < length) {
+        off_t position = offset + total;
+        uint64_t block = position / RAW_CACHE_BLOCK;
+        size_t block_offset = position % RAW_CACHE_BLOCK;
+        size_t n = MIN(length - total, RAW_CACHE_BLOCK - block_offset);
+
+        /* Every entry is held, or the block could not be read */
+        SlotCacheEntry *entry;
+        if (!slot_cache_get(reader->cache, block, NULL, TRUE, FALSE, &entry)
+                || entry == NULL) {
+            int64_t bytes_read = byte_source_read(reader->source,
+                    buffer + total, position, n);
+            if (bytes_read < 0) {
+                return total ? (int64_t) total : READER_ERROR;
+            }
+            total += bytes_read;
+            if ((size_t) bytes_read < n) {
+                break;
+            }
+            continue;
+        }
+
+        size_t available = (entry->length > block_offset)
+            ? entry->length - block_offset : 0;
+        uint8_t image_ends = available < n;
+
+        n = MIN(n, available);
+        memcpy(buffer + total, entry->data + block_offset, n);
+        slot_cache_put(reader->cache, entry);
+
+        total += n;
+        if (image_ends) {
+            break;
+        }
+    }
+
+    return total;
+}
 
 /*****************************************************************************/
 /***************************** Public functions ******************************/
 /*****************************************************************************/
 
+/* Reads uncompressed images with direct I/O */
+extern void raw_read_set_direct(size_t cache_size) {
+    direct_cache_size = cache_size;
+}
+
 /* Returns true because no compression supports all files */
 extern uint8_t raw_read_is_supported(FILE *file) {
     UNUSED(file);
     return TRUE;
 }
 
-/* Returns FILE pointer, no need to allocate any memory */
+/* Creates raw reader struct */
 extern void *raw_read_reader_alloc(FILE *file) {
-    return file;
+    RawReader *reader = (RawReader *) malloc(sizeof(RawReader));
+    assert(reader != NULL);
+
+    if (reader != NULL) {
+        reader->source = NULL;
+        reader->cache = NULL;
+
+        /* Falls back to the page cache if the file cannot do direct I/O */
+        if (direct_cache_size > 0) {
+            reader->source = byte_source_open_direct(file);
+            if (reader->source != NULL) {
+                reader->cache = slot_cache_alloc(reader, load_block,
+                        RAW_CACHE_BLOCK, direct_cache_size,
+                        RAW_CACHE_MIN_BLOCKS, reader->source->alignment,
+                        NULL);
+                if (reader->cache == NULL) {
+                    byte_source_close(reader->source);
+                    reader->source = NULL;
+                }
+            }
+        }
+
+        if (reader->source == NULL) {
+            reader->source = byte_source_open(file);
+        }
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+    }
+
+    return (void *) reader;
 }
 
 /* Reads directly from file */
-extern int64_t raw_read_read(void *file, uint8_t *buffer, off_t offset,
+extern int64_t raw_read_read(void *reader, uint8_t *buffer, off_t offset,
         size_t length) {
-    int fd = fileno((FILE *) file);
-    return pread(fd, buffer, length, offset);
+
+    RawReader *raw_reader = (RawReader *) reader;
+
+    if (raw_reader->cache != NULL && length <= RAW_MAX_CACHED_READ) {
+        return read_cached(raw_reader, buffer, offset, length);
+    }
+
+    return byte_source_read(raw_reader->source, buffer, offset, length);
 }
 
-/* Does nothing, nothing to free */
-extern void raw_read_reader_free(void *file) {
-    UNUSED(file);
+/* Reads many segments of file data */
+extern int64_t raw_read_readv(void *reader,
+        struct CompressionSegment *segments, size_t count) {
+
+    RawReader *raw_reader = (RawReader *) reader;
+    int64_t total = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int64_t bytes_read = byte_source_read(raw_reader->source,
+                segments[i].buf, segments[i].offset, segments[i].length);
+        if (bytes_read != (int64_t) segments[i].length) {
+            return READER_ERROR;
+        }
+        total += bytes_read;
+    }
+
+    return total;
+}
+
+/* References data in the file itself */
+extern int64_t raw_read_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+
+    RawReader *raw_reader = (RawReader *) reader;
+
+    if (raw_reader->cache != NULL) {
+        return READER_ERROR;
+    }
+
+    ref->fd = raw_reader->source->fd;
+    ref->fd_offset = offset;
+    ref->length = length;
+    ref->token = NULL;
+    return length;
+}
+
+/* Asks the kernel to read a range into the page cache */
+extern int64_t raw_read_prefetch(void *reader, off_t offset, size_t length) {
+    byte_source_advise(((RawReader *) reader)->source, offset, length,
+            BYTE_SOURCE_WILLNEED);
+    return length;
+}
+
+/* Reports raw reader counters */
+extern void raw_read_stats(void *reader, struct CompressionStats *stats) {
+    RawReader *raw_reader = (RawReader *) reader;
+
+    if (raw_reader->cache != NULL) {
+        slot_cache_stats(raw_reader->cache, stats);
+    }
+}
+
+/* Free raw reader struct */
+extern void raw_read_reader_free(void *reader) {
+    RawReader *raw_reader = (RawReader *) reader;
+
+    if (raw_reader->cache != NULL) {
+        slot_cache_free(raw_reader->cache);
+    }
+    byte_source_close(raw_reader->source);
+    free(raw_reader);
 }
@@ -1,16 +1,67 @@
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
 #define UNUSED(x) (void)(x)
 
+#define RAW_CACHE_BLOCK         65536       /* Bytes per cached block */
+#define RAW_CACHE_MIN_BLOCKS    16          /* Smallest direct I/O cache */
+
+/* Larger reads are file data, left for the kernel to cache as FUSE pages */
+#define RAW_MAX_CACHED_READ     (4 * RAW_CACHE_BLOCK)
+
+#define READER_ERROR   (-1)
 #define TRUE            1
+#define FALSE           0
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Uncompressed image reader */
+typedef struct RawReader {
+
+    /* Image, read through the page cache or with direct I/O */
+    struct ByteSource *source;
+
+    /* Block cache keyed by block index, NULL unless the image is read with
+     * direct I/O */
+    struct SlotCache *cache;
+
+} RawReader;
+
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionSegment;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in slot_cache.h */
+struct SlotCache;
 
 /*****************************************************************************/
 /***************************** Public functions ******************************/
 /*****************************************************************************/
 
+/** Reads uncompressed images with direct I/O, so that the image is not
+ *  cached by the kernel on top of the file pages of the mount.  Metadata
+ *  is cached by the reader instead.
+ *
+ *  @param cache_size Bytes of the block cache, 0 reads images through the
+ *                    page cache
+ */
+extern void raw_read_set_direct(size_t cache_size);
+
 /** Returns true because no compression supports all files
  *
  *  @param file File pointer
@@ -19,28 +70,70 @@
  */
 extern uint8_t raw_read_is_supported(FILE *file);
 
-/** Returns FILE pointer
+/** Allocates memory for raw reader
  *
  *  @param file File to read from
  *
- *  @returns file pointer
+ *  @returns RawReader structure, or NULL if error
  */
 extern void *raw_read_reader_alloc(FILE *file);
 
-/** Reads directly from file
+/** Reads directly from file, through the block cache with direct I/O
  *
- *  @param file File to read from
+ *  @param reader RawReader that has been allocated
  *  @param buffer Buffer to read data into
  *  @param offset Address to read from
  *  @param length Number of bytes to read, must be greater than size of buffer
  *
  *  @returns Number of bytes read or -1 is returned
  */
-extern int64_t raw_read_read(void *file, uint8_t *buffer, off_t offset,
+extern int64_t raw_read_read(void *reader, uint8_t *buffer, off_t offset,
         size_t length);
 
-/** Does nothing
+/** Reads many segments of file data, around the block cache
+ *
+ *  @param reader RawReader that has been allocated
+ *  @param segments Segments to read, sorted by offset
+ *  @param count Number of segments
+ *
+ *  @returns Total number of bytes read or READER_ERROR if error
+ */
+extern int64_t raw_read_readv(void *reader,
+        struct CompressionSegment *segments, size_t count);
+
+/** References data in the file itself, which needs no release.  Not
+ *  possible with direct I/O, as the file pages are not in the page cache.
+ *
+ *  @param reader RawReader that has been allocated
+ *  @param offset Address to reference
+ *  @param length Number of bytes to reference
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, or READER_ERROR with direct I/O
+ */
+extern int64_t raw_read_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Asks the kernel to read a range into the page cache, so that the reads
+ *  that follow do not wait for the disk.  Does nothing with direct I/O.
+ *
+ *  @param reader RawReader that has been allocated
+ *  @param offset Address to prefetch from
+ *  @param length Number of bytes to prefetch
+ *
+ *  @returns length
+ */
+extern int64_t raw_read_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports raw reader counters
+ *
+ *  @param reader RawReader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void raw_read_stats(void *reader, struct CompressionStats *stats);
+
+/** Frees memory for raw reader, leaving the file open
  *
- *  @param file File that was read
+ *  @param reader RawReader that has been allocated
  */
-extern void raw_read_reader_free(void *file);
+extern void raw_read_reader_free(void *reader);
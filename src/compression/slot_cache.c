@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include "slot_cache.h"
+#include "compression_reader.h"
+
+/*****************************************************************************/
+/************************* Private struct functions **************************/
+/*****************************************************************************/
+
+/* Moves a cache entry to start of linked list */
+static void move_to_cache_head(SlotCache *cache, SlotCacheEntry *entry) {
+    if (cache->first != entry) {
+        if (entry->next) {
+            entry->next->prev = entry->prev;
+        } else {
+            assert(entry == cache->last);
+            cache->last = entry->prev;
+        }
+        entry->prev->next = entry->next;
+
+        entry->prev = NULL;
+        entry->next = cache->first;
+        entry->next->prev = entry;
+        cache->first = entry;
+    }
+}
+
+/* Hash bucket of a key */
+static SlotCacheEntry **cache_bucket(SlotCache *cache, uint64_t key) {
+    return &cache->buckets[(key * 0x9E3779B97F4A7C15ULL >> 32)
+        & (cache->num_buckets - 1)];
+}
+
+/* Marks an entry as read, or not, since it was prefetched */
+static void set_prefetched(SlotCache *cache, SlotCacheEntry *entry,
+        uint8_t prefetched) {
+    if (entry->prefetched != prefetched) {
+        cache->num_prefetched += prefetched ? 1 : -1;
+        entry->prefetched = prefetched;
+    }
+}
+
+/* Removes an entry from its hash bucket, leaving it empty */
+static void remove_cache_entry(SlotCache *cache, SlotCacheEntry *entry) {
+    if (entry->key == SLOT_CACHE_NO_KEY) {
+        return;
+    }
+
+    SlotCacheEntry **link = cache_bucket(cache, entry->key);
+    while (*link != entry) {
+        link = &(*link)->hash_next;
+    }
+    *link = entry->hash_next;
+
+    entry->hash_next = NULL;
+    entry->key = SLOT_CACHE_NO_KEY;
+    entry->length = 0;
+    set_prefetched(cache, entry, FALSE);
+}
+
+/* Finds the cache entry holding a key */
+static SlotCacheEntry *find_cache_entry(SlotCache *cache, uint64_t key) {
+    SlotCacheEntry *entry = *cache_bucket(cache, key);
+    while (entry && entry->key != key) {
+        entry = entry->hash_next;
+    }
+    return entry;
+}
+
+/* Allocates the memory of the slots, in one memfd if named and where
+ * available, so that data can be handed out by file descriptor and spliced
+ * by the kernel */
+static uint8_t alloc_slots(SlotCache *cache, size_t size, size_t alignment,
+        const char *name) {
+    cache->fd = -1;
+
+#ifdef MFD_CLOEXEC
+    if (name != NULL) {
+        int memfd = memfd_create(name, MFD_CLOEXEC);
+        if (memfd >= 0) {
+            if (ftruncate(memfd, size) == 0) {
+                void *slots = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED, memfd, 0);
+                if (slots != MAP_FAILED) {
+                    cache->slots = (uint8_t *) slots;
+                    cache->fd = memfd;
+                    return TRUE;
+                }
+            }
+            close(memfd);
+        }
+    }
+#else
+    UNUSED(name);
+#endif
+
+    if (alignment > 0) {
+        void *slots;
+        if (posix_memalign(&slots, alignment, size) != 0) {
+            return FALSE;
+        }
+        cache->slots = (uint8_t *) slots;
+    } else {
+        cache->slots = (uint8_t *) malloc(size);
+    }
+
+    return cache->slots != NULL;
+}
+
+/* Frees memory from alloc_slots */
+static void free_slots(SlotCache *cache) {
+    if (cache->fd >= 0) {
+        munmap(cache->slots, (size_t) cache->num_entries * cache->slot_size);
+        close(cache->fd);
+    } else {
+        free(cache->slots);
+    }
+}
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/* Allocates an empty slot cache */
+extern SlotCache *slot_cache_alloc(void *reader, SlotLoad load,
+        size_t slot_size, size_t cache_size, uint32_t min_slots,
+        size_t alignment, const char *name) {
+
+    SlotCache *cache = (SlotCache *) calloc(1, sizeof(SlotCache));
+    assert(cache != NULL);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache->reader = reader;
+    cache->load = load;
+    cache->slot_size = slot_size;
+    cache->num_entries = cache_size / slot_size;
+    if (cache->num_entries < min_slots) {
+        cache->num_entries = min_slots;
+    }
+
+    cache->num_buckets = 1;
+    while (cache->num_buckets < cache->num_entries) {
+        cache->num_buckets <<= 1;
+    }
+
+    cache->entries = (SlotCacheEntry *) calloc(cache->num_entries,
+            sizeof(SlotCacheEntry));
+    cache->buckets = (SlotCacheEntry **) calloc(cache->num_buckets,
+            sizeof(SlotCacheEntry *));
+    if (cache->entries == NULL || cache->buckets == NULL
+            || !alloc_slots(cache, (size_t) cache->num_entries * slot_size,
+                alignment, name)) {
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+
+    for (uint32_t i = 0; i < cache->num_entries; i++) {
+        SlotCacheEntry *entry = &cache->entries[i];
+        entry->key = SLOT_CACHE_NO_KEY;
+        entry->fd_offset = (off_t) i * slot_size;
+        entry->data = cache->slots + entry->fd_offset;
+        entry->prev = (i > 0) ? &cache->entries[i - 1] : NULL;
+        entry->next = (i + 1 < cache->num_entries)
+            ? &cache->entries[i + 1] : NULL;
+    }
+    cache->first = &cache->entries[0];
+    cache->last = &cache->entries[cache->num_entries - 1];
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->loaded, NULL);
+
+    return cache;
+}
+
+/* Gets the entry holding a key, loading it if needed.  Loading happens
+ * without the cache lock, the entry is added before though so that threads
+ * wanting the same key wait for it rather than loading it again. */
+extern uint8_t slot_cache_get(SlotCache *cache, uint64_t key, void *arg,
+        uint8_t load, uint8_t prefetch, SlotCacheEntry **entry) {
+
+    uint8_t waited = FALSE;
+
+    *entry = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    while (TRUE) {
+        SlotCacheEntry *found = find_cache_entry(cache, key);
+        if (found == NULL) {
+            break;
+        }
+
+        found->refs++;
+        move_to_cache_head(cache, found);
+        if (!prefetch) {
+            set_prefetched(cache, found, FALSE);
+        }
+
+        if (found->loading && !waited) {
+            cache->coalesced_reads++;
+            waited = TRUE;
+        }
+        while (found->loading) {
+            pthread_cond_wait(&cache->loaded, &cache->lock);
+        }
+
+        /* The thread loading it failed, and the entry was emptied */
+        if (found->key != key) {
+            found->refs--;
+            continue;
+        }
+
+        pthread_mutex_unlock(&cache->lock);
+        *entry = found;
+        return TRUE;
+    }
+
+    if (!load || (prefetch && cache->num_prefetched
+                >= cache->num_entries / SLOT_CACHE_PREFETCH_SHARE)) {
+        pthread_mutex_unlock(&cache->lock);
+        return TRUE;
+    }
+
+    /* Replace the least recently used entry that nobody holds */
+    SlotCacheEntry *victim = cache->last;
+    while (victim && victim->refs > 0) {
+        victim = victim->prev;
+    }
+    if (victim == NULL) {
+        pthread_mutex_unlock(&cache->lock);
+        return TRUE;
+    }
+
+    remove_cache_entry(cache, victim);
+    victim->key = key;
+    victim->refs = 1;
+    victim->loading = TRUE;
+    set_prefetched(cache, victim, prefetch);
+    SlotCacheEntry **bucket = cache_bucket(cache, key);
+    victim->hash_next = *bucket;
+    *bucket = victim;
+    move_to_cache_head(cache, victim);
+    pthread_mutex_unlock(&cache->lock);
+
+    int64_t length = cache->load(cache->reader, key, arg, victim->data,
+            cache->slot_size);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->loads++;
+    victim->loading = FALSE;
+    if (length < 0) {
+        remove_cache_entry(cache, victim);
+        victim->refs--;
+        victim = NULL;
+    } else {
+        victim->length = length;
+    }
+    pthread_cond_broadcast(&cache->loaded);
+    pthread_mutex_unlock(&cache->lock);
+
+    *entry = victim;
+    return victim != NULL;
+}
+
+/* Drops the hold slot_cache_get took on an entry */
+extern void slot_cache_put(SlotCache *cache, SlotCacheEntry *entry) {
+    pthread_mutex_lock(&cache->lock);
+    assert(entry->refs > 0);
+    entry->refs--;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Counts a load made around the cache */
+extern void slot_cache_count_load(SlotCache *cache) {
+    pthread_mutex_lock(&cache->lock);
+    cache->loads++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Reports slot cache counters */
+extern void slot_cache_stats(SlotCache *cache,
+        struct CompressionStats *stats) {
+    pthread_mutex_lock(&cache->lock);
+    stats->decoded = cache->loads;
+    stats->coalesced = cache->coalesced_reads;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/* Frees a slot cache */
+extern void slot_cache_free(SlotCache *cache) {
+    free_slots(cache);
+    free(cache->buckets);
+    free(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->loaded);
+    free(cache);
+}
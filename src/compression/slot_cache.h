@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+/* Most loads from slot_cache_get with prefetch set waiting to be read, as a
+ * share of the cache, more would get them evicted before they are */
+#define SLOT_CACHE_PREFETCH_SHARE   4
+
+/* Key of a cache entry holding nothing */
+#define SLOT_CACHE_NO_KEY           UINT64_MAX
+
+#define UNUSED(x) (void)(x)
+
+#define READER_ERROR   (-1)
+#define TRUE            1
+#define FALSE           0
+
+/* Loads the data of a key into a slot of size bytes, arg being what was
+ * given to slot_cache_get.  Called without the cache lock, from several
+ * threads at once.  Returns the number of bytes loaded, or READER_ERROR if
+ * error. */
+typedef int64_t (*SlotLoad)(void *reader, uint64_t key, void *arg,
+        uint8_t *data, size_t size);
+
+/* Defined in compression_reader.h */
+struct CompressionStats;
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Slot of a SlotCache */
+typedef struct SlotCacheEntry {
+
+    /* Key of the data, as given by the reader, or SLOT_CACHE_NO_KEY if the
+     * entry holds nothing */
+    uint64_t key;
+
+    /* Memory of the slot, and its address in the memfd */
+    uint8_t *data;
+    off_t fd_offset;
+
+    /* Bytes loaded into the slot */
+    size_t length;
+
+    /* Readers using the entry, including references handed out from it.
+     * The entry is not replaced while set */
+    uint32_t refs;
+
+    /* Set while the data is loaded, others wait on loaded for it */
+    uint8_t loading;
+
+    /* Set if loaded for a prefetch and not read since */
+    uint8_t prefetched;
+
+    /* Next entry in the same hash bucket */
+    struct SlotCacheEntry *hash_next;
+
+    /* List fields, most recently used first */
+    struct SlotCacheEntry *next;
+    struct SlotCacheEntry *prev;
+
+} SlotCacheEntry;
+
+/* Fixed number of equally sized slots, found by key through a hash table
+ * and replaced least recently used first.  Data is only ever loaded into
+ * the cache by one thread at a time, the others wanting it wait for that
+ * thread. */
+typedef struct SlotCache {
+
+    /* Reader the data belongs to, and how to load it */
+    void *reader;
+    SlotLoad load;
+
+    /* Entries, and the memory of their slots */
+    SlotCacheEntry *entries;
+    uint32_t num_entries;
+    uint8_t *slots;
+    size_t slot_size;
+
+    /* memfd backing the slots, or -1 if they are plain heap memory */
+    int fd;
+
+    /* Hash table of the entries holding data */
+    SlotCacheEntry **buckets;
+    uint32_t num_buckets;
+
+    /* Number of entries loaded for a prefetch and not read since */
+    uint32_t num_prefetched;
+
+    /* First and last entries in list */
+    SlotCacheEntry *first;
+    SlotCacheEntry *last;
+
+    /* Protects the entries, data is loaded without it held */
+    pthread_mutex_t lock;
+
+    /* Signalled whenever an entry finishes loading */
+    pthread_cond_t loaded;
+
+    /* Loads, including those counted by slot_cache_count_load, and reads
+     * that waited for another thread's load of their data */
+    uint64_t loads;
+    uint64_t coalesced_reads;
+
+} SlotCache;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Allocates an empty slot cache
+ *
+ *  @param reader Reader passed to load
+ *  @param load Loads the data of a key
+ *  @param slot_size Bytes per slot
+ *  @param cache_size Bytes of all the slots, rounded down to whole slots
+ *  @param min_slots Fewest slots, whatever cache_size is
+ *  @param alignment Alignment of the slots, 0 for none in particular
+ *  @param name Name of the memfd holding the slots, so that they can be
+ *              spliced, or NULL to keep them in plain heap memory
+ *
+ *  @returns SlotCache structure, or NULL if error
+ */
+extern SlotCache *slot_cache_alloc(void *reader, SlotLoad load,
+        size_t slot_size, size_t cache_size, uint32_t min_slots,
+        size_t alignment, const char *name);
+
+/** Gets the entry holding a key, from cache or by loading it into the cache
+ *  if load is set, and holds it until slot_cache_put
+ *
+ *  @param cache SlotCache that has been allocated
+ *  @param key Key of the data
+ *  @param arg Passed on to the load function
+ *  @param load Loads the data if not cached
+ *  @param prefetch Set for data not needed yet, which is not loaded once a
+ *                  share of SLOT_CACHE_PREFETCH_SHARE of the cache is yet
+ *                  to be read
+ *  @param entry Set to the entry, or to NULL if the data is not cached and
+ *               was not loaded, because load is not set, every entry is
+ *               held, or too much of the cache is yet to be read
+ *
+ *  @returns 0 for FALSE if the data could not be loaded, 1 for TRUE
+ *           otherwise
+ */
+extern uint8_t slot_cache_get(SlotCache *cache, uint64_t key, void *arg,
+        uint8_t load, uint8_t prefetch, SlotCacheEntry **entry);
+
+/** Drops the hold slot_cache_get took on an entry
+ *
+ *  @param cache SlotCache that has been allocated
+ *  @param entry Entry from slot_cache_get
+ */
+extern void slot_cache_put(SlotCache *cache, SlotCacheEntry *entry);
+
+/** Counts a load made around the cache, into memory of the reader's own
+ *
+ *  @param cache SlotCache that has been allocated
+ */
+extern void slot_cache_count_load(SlotCache *cache);
+
+/** Reports slot cache counters
+ *
+ *  @param cache SlotCache that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void slot_cache_stats(SlotCache *cache,
+        struct CompressionStats *stats);
+
+/** Frees a slot cache.  No entries may be held.
+ *
+ *  @param cache SlotCache structure
+ */
+extern void slot_cache_free(SlotCache *cache);
@@ -0,0 +1,206 @@
+#include "uring.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*****************************************************************************/
+/***************************** Private functions *****************************/
+/*****************************************************************************/
+
+static int io_uring_setup(uint32_t entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, uint32_t to_submit, uint32_t min_complete,
+        uint32_t flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            NULL, 0);
+}
+
+/* Maps one of the queues of a ring */
+static void *map_queue(int fd, size_t size, off_t queue) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, fd, queue);
+    return (map == MAP_FAILED) ? NULL : map;
+}
+
+/* Hands the queued requests to the kernel, waiting for min_complete of them
+ * to complete */
+static int enter(Uring *ring, uint32_t min_complete) {
+    uint32_t flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+
+    while (TRUE) {
+        int submitted = io_uring_enter(ring->fd, ring->unsubmitted,
+                min_complete, flags);
+        if (submitted >= 0) {
+            ring->unsubmitted -= submitted;
+            return 0;
+        }
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/* Sets up a ring */
+extern Uring *uring_open(uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = io_uring_setup(entries, &params);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    Uring *ring = (Uring *) calloc(1, sizeof(Uring));
+    if (ring == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    ring->fd = fd;
+    ring->sq_ring_size = params.sq_off.array
+        + params.sq_entries * sizeof(uint32_t);
+    ring->cq_ring_size = params.cq_off.cqes
+        + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->sq_ring = map_queue(fd, ring->sq_ring_size, IORING_OFF_SQ_RING);
+    ring->cq_ring = map_queue(fd, ring->cq_ring_size, IORING_OFF_CQ_RING);
+    ring->sqes = map_queue(fd, ring->sqes_size, IORING_OFF_SQES);
+    if (ring->sq_ring == NULL || ring->cq_ring == NULL
+            || ring->sqes == NULL) {
+        uring_close(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = (uint8_t *) ring->sq_ring;
+    ring->sq_head = (uint32_t *) (sq + params.sq_off.head);
+    ring->sq_tail = (uint32_t *) (sq + params.sq_off.tail);
+    ring->sq_mask = (uint32_t *) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (uint32_t *) (sq + params.sq_off.array);
+
+    uint8_t *cq = (uint8_t *) ring->cq_ring;
+    ring->cq_head = (uint32_t *) (cq + params.cq_off.head);
+    ring->cq_tail = (uint32_t *) (cq + params.cq_off.tail);
+    ring->cq_mask = (uint32_t *) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+
+    return ring;
+}
+
+/* Queues a read */
+extern void uring_read(Uring *ring, int fd, uint8_t *buffer, off_t offset,
+        size_t length, uint64_t tag) {
+
+    /* Only this thread adds to the queue, the kernel moves the head */
+    uint32_t tail = *ring->sq_tail;
+    uint32_t index = tail & *ring->sq_mask;
+
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t) buffer;
+    sqe->len = length;
+    sqe->user_data = tag;
+
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->unsubmitted++;
+}
+
+/* Starts the queued reads */
+extern int uring_submit(Uring *ring) {
+    if (ring->unsubmitted == 0) {
+        return 0;
+    }
+    return enter(ring, 0);
+}
+
+/* Waits for a read to complete */
+extern int uring_wait(Uring *ring, uint64_t *tag, int64_t *result) {
+    while (TRUE) {
+        uint32_t head = *ring->cq_head;
+        uint32_t tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head != tail) {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            *tag = cqe->user_data;
+            *result = cqe->res;
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+
+        if (enter(ring, 1) < 0) {
+            return -1;
+        }
+    }
+}
+
+/* Tears down a ring */
+extern void uring_close(Uring *ring) {
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring != NULL) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring != NULL) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    close(ring->fd);
+    free(ring);
+}
+
+#else
+
+/* Without io_uring, reads fall back to pread */
+extern Uring *uring_open(uint32_t entries) {
+    UNUSED(entries);
+    return NULL;
+}
+
+extern void uring_read(Uring *ring, int fd, uint8_t *buffer, off_t offset,
+        size_t length, uint64_t tag) {
+    UNUSED(ring);
+    UNUSED(fd);
+    UNUSED(buffer);
+    UNUSED(offset);
+    UNUSED(length);
+    UNUSED(tag);
+}
+
+extern int uring_submit(Uring *ring) {
+    UNUSED(ring);
+    return -1;
+}
+
+extern int uring_wait(Uring *ring, uint64_t *tag, int64_t *result) {
+    UNUSED(ring);
+    UNUSED(tag);
+    UNUSED(result);
+    return -1;
+}
+
+extern void uring_close(Uring *ring) {
+    UNUSED(ring);
+}
+
+#endif
@@ -0,0 +1,97 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define UNUSED(x) (void)(x)
+
+#define TRUE            1
+#define FALSE           0
+
+/* Defined in linux/io_uring.h */
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* io_uring instance, driven through the system calls directly so that no
+ * library is needed.  A ring is only used by one thread at a time. */
+typedef struct Uring {
+
+    /* File descriptor of the ring */
+    int fd;
+
+    /* Submission queue, shared with the kernel */
+    uint32_t *sq_head;
+    uint32_t *sq_tail;
+    uint32_t *sq_mask;
+    uint32_t *sq_array;
+    struct io_uring_sqe *sqes;
+
+    /* Completion queue, shared with the kernel */
+    uint32_t *cq_head;
+    uint32_t *cq_tail;
+    uint32_t *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    /* Mappings of the queues */
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    /* Requests queued but not yet handed to the kernel */
+    uint32_t unsubmitted;
+
+} Uring;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Sets up a ring
+ *
+ *  @param entries Most requests in flight at once
+ *
+ *  @returns Uring structure, or NULL if io_uring is not available
+ */
+extern Uring *uring_open(uint32_t entries);
+
+/** Queues a read, which is only started by uring_submit or uring_wait
+ *
+ *  @param ring Uring that has been set up
+ *  @param fd File descriptor to read from
+ *  @param buffer Buffer to read data into
+ *  @param offset Address in the file to read from
+ *  @param length Number of bytes to read
+ *  @param tag Value given back with the completion
+ */
+extern void uring_read(Uring *ring, int fd, uint8_t *buffer, off_t offset,
+        size_t length, uint64_t tag);
+
+/** Starts the queued reads without waiting for them
+ *
+ *  @param ring Uring that has been set up
+ *
+ *  @returns 0, or -1 if error
+ */
+extern int uring_submit(Uring *ring);
+
+/** Waits for a read to complete, starting the queued reads first
+ *
+ *  @param ring Uring that has been set up
+ *  @param tag Set to the tag of the read
+ *  @param result Set to the number of bytes read, or to -errno
+ *
+ *  @returns 0, or -1 if error
+ */
+extern int uring_wait(Uring *ring, uint64_t *tag, int64_t *result);
+
+/** Tears down a ring, which must have no reads in flight
+ *
+ *  @param ring Uring that has been set up
+ */
+extern void uring_close(Uring *ring);
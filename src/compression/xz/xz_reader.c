@@ -1,118 +1,9 @@
+#define _GNU_SOURCE
 #include "xz_reader.h"
-
-/*****************************************************************************/
-/************************* Private struct functions **************************/
-/*****************************************************************************/
-
-/* Moves a cache entry to start of linked list */
-static void move_to_cache_head(XzBlockCache *cache, XzBlockCacheEntry *entry) {
-    if (cache->first != entry) {
-        if (entry->next) {
-            entry->next->prev = entry->prev;
-        } else {
-            assert(entry == cache->last);
-            cache->last = entry->prev;
-        }
-        entry->prev->next = entry->next;
-
-        entry->prev = NULL;
-        entry->next = cache->first;
-        entry->next->prev = entry;
-        cache->first = entry;
-    }
-}
-
-/* Get block from cache, or do not get block */
-static uint8_t get_cache_block(XzBlockCache *cache, uint8_t **buffer,
-        off_t *start, size_t *size, off_t offset) {
-
-    for (XzBlockCacheEntry *entry = cache->first; entry; entry = entry->next) {
-        off_t entry_end = entry->offset + (long) entry->size;
-        if (entry->offset <= offset && offset < entry_end) {
-            buffer[0] = entry->data;
-            start[0] = entry->offset;
-            size[0] = entry->size;
-            move_to_cache_head(cache, entry);
-            return TRUE;
-        }
-    }
-
-    return FALSE;
-}
-
-/* Add new cache block entry, using LRU cache replacement policy */
-static uint8_t add_new_block(XzBlockCache *cache, uint8_t *block, off_t offset,
-        size_t size) {
-
-    if (MAX_NUM_BLOCKS_CACHE == 0) {
-        return FALSE;
-    }
-
-    if (cache->num_blocks < MAX_NUM_BLOCKS_CACHE) {
-        XzBlockCacheEntry *new_entry;
-        new_entry = (XzBlockCacheEntry *) malloc(sizeof(XzBlockCacheEntry));
-        assert(new_entry != NULL);
-
-        if (new_entry == NULL) {
-            return FALSE;
-        }
-
-        new_entry->data = block;
-        new_entry->offset = offset;
-        new_entry->size = size;
-
-        new_entry->prev = NULL;
-        new_entry->next = cache->first;
-        if (cache->first) {
-            cache->first->prev = new_entry;
-        }
-        cache->first = new_entry;
-        if (cache->last == NULL) {
-            assert(cache->num_blocks == 0);
-            cache->last = new_entry;
-        }
-        cache->num_blocks++;
-
-    } else {
-        move_to_cache_head(cache, cache->last);
-        free(cache->first->data);
-        cache->first->data = block;
-        cache->first->offset = offset;
-        cache->first->size = size;
-    }
-    return TRUE;
-}
-
-/* Free cache entries */
-static void free_cache_entries(XzBlockCache *cache) {
-    uint64_t count = 0;
-    XzBlockCacheEntry *current = cache->first;
-    XzBlockCacheEntry *temp_prev;
-
-    if (current) {
-        assert(current->prev == NULL);
-        assert(cache->last->next == NULL);
-    }
-
-    while (current) {
-        temp_prev = current;
-        current = current->next;
-
-        if (current) {
-            assert(temp_prev == current->prev);
-        }
-
-        free(temp_prev->data);
-        free(temp_prev);
-
-        count++;
-    }
-
-    assert(count == cache->num_blocks);
-    cache->num_blocks = 0;
-    cache->first = NULL;
-    cache->last = NULL;
-}
+#include "../byte_source.h"
+#include "../block_cache.h"
+#include "../zero_runs.h"
+#include "../compression_reader.h"
 
 /*****************************************************************************/
 /*************************** Data access functions ***************************/
@@ -124,7 +15,6 @@ static lzma_ret parse_block_indexes(XzReader *reader) {
     assert(reader->index == NULL);
 
     lzma_ret return_value = LZMA_OK;
-    int32_t file_fd = fileno(reader->xz_file);
 
     uint8_t buffer[IO_BUFFER_SIZE];
     lzma_stream stream = LZMA_STREAM_INIT;
@@ -132,11 +22,8 @@ static lzma_ret parse_block_indexes(XzReader *reader) {
     lzma_stream_flags header_flags;
     lzma_stream_flags footer_flags;
 
-    /* Seek to end of file */
-    fseek(reader->xz_file, 0, SEEK_END);
-
-    /* Current position in file */
-    off_t position = ftell(reader->xz_file);
+    /* Current position in file, starting from its end */
+    off_t position = reader->source->size;
 
     /* Each loop iteration decodes one index */
     do {
@@ -156,8 +43,8 @@ static lzma_ret parse_block_indexes(XzReader *reader) {
                 goto error;
             }
 
-            if (pread(file_fd, &buffer, LZMA_STREAM_HEADER_SIZE, position)
-                    != LZMA_STREAM_HEADER_SIZE) {
+            if (byte_source_read(reader->source, buffer, position,
+                        LZMA_STREAM_HEADER_SIZE) != LZMA_STREAM_HEADER_SIZE) {
                 return_value = LZMA_PROG_ERROR;
                 goto error;
             }
@@ -168,7 +55,7 @@ static lzma_ret parse_block_indexes(XzReader *reader) {
                 break;
             }
 
-            /* To avoid calling pread for every 4 bytes of stream padding */
+            /* To avoid reading again for every 4 bytes of stream padding */
             do {
                 stream_padding += 4;
                 position -= 4;
@@ -205,18 +92,18 @@ static lzma_ret parse_block_indexes(XzReader *reader) {
         }
 
         do {
-            long pread_size = MIN(IO_BUFFER_SIZE, (long) index_size);
-            stream.avail_in = pread_size;
-            if (pread(file_fd, &buffer, stream.avail_in, position)
-                    != pread_size) {
+            size_t length = index_size;
+            stream.next_in = byte_source_get(reader->source, position,
+                    &length, buffer, IO_BUFFER_SIZE);
+            if (stream.next_in == NULL) {
                 return_value = LZMA_PROG_ERROR;
                 goto error;
             }
+            stream.avail_in = length;
 
             position += stream.avail_in;
             index_size -= stream.avail_in;
 
-            stream.next_in = buffer;
             return_value = lzma_code(&stream, LZMA_RUN);
         } while (return_value == LZMA_OK);
 
@@ -239,8 +126,8 @@ static lzma_ret parse_block_indexes(XzReader *reader) {
         }
 
         position -= lzma_index_total_size(current_index);
-        if (pread(file_fd, &buffer, LZMA_STREAM_HEADER_SIZE, position)
-                != LZMA_STREAM_HEADER_SIZE) {
+        if (byte_source_read(reader->source, buffer, position,
+                    LZMA_STREAM_HEADER_SIZE) != LZMA_STREAM_HEADER_SIZE) {
             return_value = LZMA_PROG_ERROR;
             goto error;
         }
@@ -288,35 +175,31 @@ error:
 }
 
 /* Base on code from: https://github.com/libguestfs/nbdkit */
-static lzma_ret read_block(XzReader *reader, uint8_t **data, off_t offset,
-        off_t *block_start, size_t *block_size) {
+static lzma_ret read_block(XzReader *reader, off_t block_start,
+        uint8_t *data, size_t block_size) {
 
     off_t compressed_offset;
-    size_t size;
+    off_t compressed_end;
     lzma_index_iter iter;
     uint8_t header[LZMA_BLOCK_HEADER_SIZE_MAX];
     lzma_block block;
     lzma_filter filters[LZMA_FILTERS_MAX + 1];
     lzma_ret return_value;
     lzma_stream stream = LZMA_STREAM_INIT;
-    uint8_t buffer[IO_BUFFER_SIZE];
-    int32_t file_fd = fileno(reader->xz_file);
+    ByteStream input;
 
-    /* Locate block containing uncompressed offset */
+    /* Locate block starting at the uncompressed address */
     lzma_index_iter_init(&iter, reader->index);
-    if (lzma_index_iter_locate(&iter, offset)) {
+    if (lzma_index_iter_locate(&iter, block_start)
+            || iter.block.uncompressed_size != block_size) {
         return LZMA_PROG_ERROR;
     }
 
-    fseek(reader->xz_file, 0, SEEK_END);
-    size = ftell(reader->xz_file);
-
-    *block_start = iter.block.uncompressed_file_offset;
-    *block_size = iter.block.uncompressed_size;
+    compressed_offset = iter.block.compressed_file_offset;
+    compressed_end = compressed_offset + iter.block.total_size;
 
     /* Find size of block header by reading single byte */
-    compressed_offset = iter.block.compressed_file_offset;
-    if (pread(file_fd, header, 1, compressed_offset) != 1) {
+    if (byte_source_read(reader->source, header, compressed_offset, 1) != 1) {
         return LZMA_PROG_ERROR;
     }
     compressed_offset++;
@@ -331,8 +214,8 @@ static lzma_ret read_block(XzReader *reader, uint8_t **data, off_t offset,
     block.uncompressed_size = iter.block.uncompressed_size;
 
     /* Read and decode block header */
-    if (pread(file_fd, &header[1], block.header_size - 1, compressed_offset)
-            != block.header_size - 1) {
+    if (byte_source_read(reader->source, &header[1], compressed_offset,
+                block.header_size - 1) != block.header_size - 1) {
         return LZMA_DATA_ERROR;
     }
     compressed_offset += block.header_size - 1;
@@ -355,29 +238,22 @@ static lzma_ret read_block(XzReader *reader, uint8_t **data, off_t offset,
         goto error1;
     }
 
-    *data = (uint8_t *) malloc(sizeof(uint8_t) * block_size[0]);
-    if (data[0] == NULL) {
-        goto error2;
-    }
+    /* The rest of the block is read ahead while the start is decoded */
+    byte_stream_open(&input, reader->source, compressed_offset,
+            compressed_end - compressed_offset);
 
     stream.next_in = NULL;
     stream.avail_in = 0;
-    stream.next_out = (uint8_t *) data[0];
+    stream.next_out = data;
     stream.avail_out = block.uncompressed_size;
     do {
         if (stream.avail_in == 0) {
-            stream.avail_in = IO_BUFFER_SIZE;
-            if (compressed_offset + stream.avail_in > size) {
-                stream.avail_in = size - compressed_offset;
-            }
-            if (stream.avail_in > 0) {
-                stream.next_in = buffer;
-                if (pread(file_fd, buffer, stream.avail_in, compressed_offset)
-                        != (unsigned) stream.avail_in) {
-                    goto error2;
-                }
-                compressed_offset += stream.avail_in;
+            int64_t length = byte_stream_next(&input, &stream.next_in);
+            if (length < 0) {
+                return_value = LZMA_DATA_ERROR;
+                goto error2;
             }
+            stream.avail_in = length;
         }
 
         return_value = lzma_code(&stream, LZMA_RUN);
@@ -387,8 +263,15 @@ static lzma_ret read_block(XzReader *reader, uint8_t **data, off_t offset,
         goto error2;
     }
 
+    byte_stream_close(&input);
     lzma_end(&stream);
 
+    /* Record the runs of zeros, so they need not be decompressed again */
+    ZeroScan scan;
+    zero_scan_start(&scan, block_start);
+    zero_scan_feed(&scan, reader->zeros, block_start, data, block_size);
+    zero_scan_finish(&scan, reader->zeros);
+
     for (size_t i = 0; filters[i].id != LZMA_VLI_UNKNOWN; i++) {
         free(filters[i].options);
     }
@@ -396,6 +279,7 @@ static lzma_ret read_block(XzReader *reader, uint8_t **data, off_t offset,
     return LZMA_OK;
 
 error2:
+    byte_stream_close(&input);
     lzma_end(&stream);
 
 error1:
@@ -403,11 +287,32 @@ error1:
         free(filters[i].options);
     }
 
-    free(*data);
-
     return return_value;
 }
 
+/* Finds the block containing an uncompressed offset */
+static uint8_t locate_block(void *reader, off_t offset, uint64_t *block,
+        off_t *start, size_t *size) {
+    lzma_index_iter iter;
+
+    lzma_index_iter_init(&iter, ((XzReader *) reader)->index);
+    if (lzma_index_iter_locate(&iter, offset)) {
+        return FALSE;
+    }
+
+    *block = iter.block.number_in_file;
+    *start = iter.block.uncompressed_file_offset;
+    *size = iter.block.uncompressed_size;
+    return TRUE;
+}
+
+/* Decompresses a whole block */
+static uint8_t decode_block(void *reader, uint64_t block, off_t start,
+        uint8_t *data, size_t size) {
+    UNUSED(block);
+    return read_block((XzReader *) reader, start, data, size) == LZMA_OK;
+}
+
 /*****************************************************************************/
 /************************** Public struct functions **************************/
 /*****************************************************************************/
@@ -431,11 +336,18 @@ extern uint8_t xz_is_supported(FILE *xz_file) {
     }
 
     XzReader reader = {
-        .xz_file = xz_file,
+        .source = byte_source_open(xz_file),
         .index = NULL,
         .stream_padding = 0
     };
-    if (parse_block_indexes(&reader) != LZMA_OK) {
+    if (reader.source == NULL) {
+        return FALSE;
+    }
+
+    lzma_ret return_value = parse_block_indexes(&reader);
+    byte_source_close(reader.source);
+
+    if (return_value != LZMA_OK) {
         return FALSE;
     } else {
         lzma_index_iter iter;
@@ -465,12 +377,30 @@ extern void *xz_reader_alloc(FILE *xz_file) {
     assert(reader != NULL);
 
     if (reader != NULL) {
-        reader->xz_file = xz_file;
-        reader->index = NULL;
+        reader->source = byte_source_open(xz_file);
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+
+        /* Blocks are read in whatever order files need them */
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
 
-        reader->cache.num_blocks = 0;
-        reader->cache.first = NULL;
-        reader->cache.last = NULL;
+        reader->index = NULL;
+        reader->zeros = zero_runs_alloc();
+        reader->cache = block_cache_alloc(reader, locate_block, decode_block,
+                "spotlight-xz-block");
+        if (reader->zeros == NULL || reader->cache == NULL) {
+            if (reader->zeros) {
+                zero_runs_free(reader->zeros);
+            }
+            if (reader->cache) {
+                block_cache_free(reader->cache);
+            }
+            byte_source_close(reader->source);
+            free(reader);
+            return NULL;
+        }
 
         if (parse_block_indexes(reader) != LZMA_OK) {
             xz_reader_free((void *) reader);
@@ -486,46 +416,81 @@ extern int64_t xz_read(void *reader, uint8_t *buffer, off_t offset,
         size_t length) {
 
     XzReader *xz_reader = (XzReader *) reader;
-    XzBlockCache *cache = &xz_reader->cache;
-
-    uint8_t *block;
-    uint8_t cache_hit;
-    off_t start;
-    size_t size;
-
-    cache_hit = get_cache_block(cache, &block, &start, &size, offset);
-
-    if (!cache_hit) {
-        lzma_ret ret = read_block(xz_reader, &block, offset, &start, &size);
-        if (ret != LZMA_OK) {
-            return READER_ERROR;
+    size_t done = 0;
+
+    while (done < length) {
+        int64_t zeros = zero_runs_lookup(xz_reader->zeros, offset + done,
+                length - done);
+        if (zeros > 0) {
+            memset(buffer + done, 0, zeros);
+            done += zeros;
+            continue;
         }
 
-        cache_hit = add_new_block(cache, block, start, size);
+        /* Up to the next run of zeros, or the end of the read */
+        int64_t n = block_cache_read(xz_reader->cache, buffer + done,
+                offset + done, -zeros);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+        if (n < -zeros) {
+            break;
+        }
     }
 
-    off_t n = length;
-    if (start + size - offset < (unsigned long) n) {
-        n = start + size - offset;
+    if (done == 0 && length > 0) {
+        return READER_ERROR;
     }
 
-    memcpy(buffer, &block[offset - start], n);
+    return done;
+}
 
-    if (!cache_hit) {
-        free(block);
-    }
+/* References a cached block */
+extern int64_t xz_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+
+    XzReader *xz_reader = (XzReader *) reader;
 
-    if (length - n > 0) {
-        return n + xz_read(reader, buffer + n, offset + n, length - n);
+    /* Runs of zeros are all referenced from the same file */
+    int zeros_fd = zero_runs_fd();
+    if (zeros_fd >= 0) {
+        int64_t zeros = zero_runs_lookup(xz_reader->zeros, offset,
+                MIN(length, (size_t) ZERO_RUNS_FD_SIZE));
+        if (zeros > 0) {
+            ref->fd = zeros_fd;
+            ref->fd_offset = 0;
+            ref->length = zeros;
+            ref->token = NULL;
+            return zeros;
+        }
     }
 
-    return n;
+    return block_cache_read_ref(xz_reader->cache, offset, length, ref);
+}
+
+/* Releases a reference from xz_read_ref */
+extern void xz_release_ref(void *reader, struct CompressionRef *ref) {
+    block_cache_release_ref(((XzReader *) reader)->cache, ref);
+}
+
+/* Decompresses the blocks overlapping a range into the cache */
+extern int64_t xz_prefetch(void *reader, off_t offset, size_t length) {
+    return block_cache_prefetch(((XzReader *) reader)->cache, offset,
+            length);
+}
+
+/* Reports xz reader counters */
+extern void xz_stats(void *reader, struct CompressionStats *stats) {
+    block_cache_stats(((XzReader *) reader)->cache, stats);
 }
 
 /* Free xz reader struct */
 extern void xz_reader_free(void *reader) {
     XzReader *xz_reader = (XzReader *) reader;
+    block_cache_free(xz_reader->cache);
     lzma_index_end(xz_reader->index, NULL);
-    free_cache_entries(&xz_reader->cache);
+    zero_runs_free(xz_reader->zeros);
+    byte_source_close(xz_reader->source);
     free(xz_reader);
 }
@@ -3,12 +3,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include <lzma.h>
+#include <pthread.h>
 
 #define MAX_SUPPORTED_BLOCK_SIZE_MB     64
-#define MAX_NUM_BLOCKS_CACHE            32
 #define IO_BUFFER_SIZE                  16384
 
 #define READER_ERROR   (-1)
@@ -27,39 +28,11 @@
 /********************************** Structs **********************************/
 /*****************************************************************************/
 
-/* XzBlockCacheEntry */
-typedef struct XzBlockCacheEntry {
-    /* Uncompressed address */
-    off_t offset;
-
-    /* Block size */
-    size_t size;
-
-    /* Entire block */
-    uint8_t *data;
-
-    /* Next and previous pointers */
-    struct XzBlockCacheEntry *next;
-    struct XzBlockCacheEntry *prev;
-} XzBlockCacheEntry;
-
-/* XZ block cache */
-typedef struct XzBlockCache {
-
-    /* Number cached */
-    uint64_t num_blocks;
-
-    /* Cache entry list */
-    XzBlockCacheEntry *first;
-    XzBlockCacheEntry *last;
-
-} XzBlockCache;
-
 /* XZ compression reader */
 typedef struct XzReader {
 
-    /* File pointer to xz-compressed file */
-    FILE *xz_file;
+    /* Xz-compressed input */
+    struct ByteSource *source;
 
     /* Contains index to blocks in xz file */
     lzma_index *index;
@@ -67,11 +40,28 @@ typedef struct XzReader {
     /* Total amount of stream padding */
     uint64_t stream_padding;
 
-    /* Block cache */
-    XzBlockCache cache;
+    /* Decompressed blocks, and the threads decompressing them */
+    struct BlockCache *cache;
+
+    /* Runs of zeros in the blocks decompressed so far, read without
+     * decompressing their blocks again */
+    struct ZeroRunList *zeros;
 
 } XzReader;
 
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in zero_runs.h */
+struct ZeroRunList;
+
+/* Defined in block_cache.h */
+struct BlockCache;
+
 /*****************************************************************************/
 /***************************** Public functions ******************************/
 /*****************************************************************************/
@@ -92,19 +82,62 @@ extern uint8_t xz_is_supported(FILE *xz_file);
  */
 extern void *xz_reader_alloc(FILE *xz_file);
 
-/** Reads from xz-compresssed file
+/** Reads from xz-compresssed file, decompressing the blocks a read spans
+ *  in parallel.  Parts in runs of zeros of blocks decompressed before are
+ *  filled in without decompressing again.
  *
  *  @param reader XzReader that has been allocated
  *  @param buffer Buffer to read data into
  *  @param offset Decompressed address to read from
  *  @param length Number of bytes to read, must be greater than size of buffer
  *
- *  @returns Number of bytes read or READER_ERROR if error
+ *  @returns Number of bytes read, short at the end of the data, or
+ *           READER_ERROR if error
  */
 extern int64_t xz_read(void *reader, uint8_t *buffer,
         off_t offset, size_t length);
 
-/** Frees memory for xz reader
+/** References a cached block, or the shared file of zeros for a run of
+ *  zeros, so it can be spliced rather than copied
+ *
+ *  @param reader XzReader that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the block or run,
+ *           or READER_ERROR if the block cannot be referenced
+ */
+extern int64_t xz_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Releases a reference from xz_read_ref
+ *
+ *  @param reader XzReader that has been allocated
+ *  @param ref Reference to release
+ */
+extern void xz_release_ref(void *reader, struct CompressionRef *ref);
+
+/** Decompresses the blocks overlapping a range into the cache
+ *
+ *  @param reader XzReader that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes now cached from offset on, which stops short
+ *           once BLOCK_CACHE_PREFETCH blocks are waiting to be read, or
+ *           READER_ERROR if error
+ */
+extern int64_t xz_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports xz reader counters
+ *
+ *  @param reader XzReader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void xz_stats(void *reader, struct CompressionStats *stats);
+
+/** Frees memory for xz reader, stopping its decode threads
  *
  *  @param reader XzReader structure
  */
@@ -0,0 +1,239 @@
+#define _GNU_SOURCE
+#include "zero_runs.h"
+
+/* Bytes checked at once when looking for the end of a run */
+#define ZERO_SCAN_STRIDE    64
+
+/* Shared file of zeros, made on first use */
+static pthread_once_t zeros_once = PTHREAD_ONCE_INIT;
+static int zeros_fd = -1;
+
+/*****************************************************************************/
+/***************************** Private functions *****************************/
+/*****************************************************************************/
+
+/* Loads 8 bytes from anywhere */
+static uint64_t load_word(const uint8_t *data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+/* Number of zero bytes at the start of data, at most length */
+static size_t count_zeros(const uint8_t *data, size_t length) {
+    size_t i = 0;
+
+    while (i + ZERO_SCAN_STRIDE <= length) {
+        uint64_t bits = 0;
+        for (size_t j = 0; j < ZERO_SCAN_STRIDE; j += sizeof(uint64_t)) {
+            bits |= load_word(data + i + j);
+        }
+        if (bits) {
+            break;
+        }
+        i += ZERO_SCAN_STRIDE;
+    }
+
+    while (i < length && data[i] == 0) {
+        i++;
+    }
+
+    return i;
+}
+
+/* Number of bytes at the start of data before a zero word at an address
+ * that is a multiple of 8, or length if there is none.  Runs are only
+ * started on such words, which costs at most 7 bytes of each run and keeps
+ * the scan of data with no runs to one test per word. */
+static size_t find_zero_word(const uint8_t *data, size_t length,
+        off_t position) {
+    size_t i = (sizeof(uint64_t) - (position & (sizeof(uint64_t) - 1)))
+        & (sizeof(uint64_t) - 1);
+
+    for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+        if (load_word(data + i) == 0) {
+            return i;
+        }
+    }
+
+    return length;
+}
+
+/* Index of the first run ending at or after offset, count if none does.
+ * Must be called with the lock held */
+static size_t find_run(ZeroRunList *list, off_t offset) {
+    size_t low = 0;
+    size_t high = list->count;
+
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (list->runs[middle].end < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+
+    return low;
+}
+
+/* Makes the shared file of zeros */
+static void create_zeros_fd(void) {
+#ifdef MFD_CLOEXEC
+    int fd = memfd_create("spotlight-zeros", MFD_CLOEXEC);
+    if (fd >= 0) {
+        if (ftruncate(fd, ZERO_RUNS_FD_SIZE) == 0) {
+            zeros_fd = fd;
+        } else {
+            close(fd);
+        }
+    }
+#endif
+}
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/* Allocates an empty zero run list */
+extern ZeroRunList *zero_runs_alloc(void) {
+    ZeroRunList *list = (ZeroRunList *) malloc(sizeof(ZeroRunList));
+    if (list == NULL) {
+        return NULL;
+    }
+
+    list->runs = NULL;
+    list->count = 0;
+    list->capacity = 0;
+    pthread_mutex_init(&list->lock, NULL);
+
+    return list;
+}
+
+/* Records a run of zeros */
+extern void zero_runs_add(ZeroRunList *list, off_t start, off_t end) {
+    if (end - start < ZERO_RUN_MIN) {
+        return;
+    }
+
+    pthread_mutex_lock(&list->lock);
+
+    /* Runs first to last - 1 touch the new one, and are merged into it */
+    size_t first = find_run(list, start);
+    size_t last = first;
+    while (last < list->count && list->runs[last].start <= end) {
+        last++;
+    }
+
+    if (first == last) {
+        if (list->count == list->capacity) {
+            size_t capacity = list->capacity ? list->capacity * 2 : 64;
+            ZeroRun *runs = NULL;
+            if (list->count < ZERO_RUNS_MAX) {
+                runs = (ZeroRun *) realloc(list->runs,
+                        MIN(capacity, (size_t) ZERO_RUNS_MAX)
+                        * sizeof(ZeroRun));
+            }
+            if (runs == NULL) {
+                pthread_mutex_unlock(&list->lock);
+                return;
+            }
+            list->runs = runs;
+            list->capacity = MIN(capacity, (size_t) ZERO_RUNS_MAX);
+        }
+
+        memmove(&list->runs[first + 1], &list->runs[first],
+                (list->count - first) * sizeof(ZeroRun));
+        list->runs[first].start = start;
+        list->runs[first].end = end;
+        list->count++;
+    } else {
+        ZeroRun *run = &list->runs[first];
+        run->start = MIN(run->start, start);
+        run->end = (list->runs[last - 1].end > end)
+            ? list->runs[last - 1].end : end;
+
+        memmove(&list->runs[first + 1], &list->runs[last],
+                (list->count - last) * sizeof(ZeroRun));
+        list->count -= last - first - 1;
+    }
+
+    pthread_mutex_unlock(&list->lock);
+}
+
+/* Finds out whether a range starts in a run of zeros */
+extern int64_t zero_runs_lookup(ZeroRunList *list, off_t offset,
+        size_t length) {
+    int64_t result = -(int64_t) length;
+
+    pthread_mutex_lock(&list->lock);
+    size_t i = find_run(list, offset + 1);
+    if (i < list->count) {
+        ZeroRun *run = &list->runs[i];
+        if (run->start <= offset) {
+            result = MIN((uint64_t) (run->end - offset), (uint64_t) length);
+        } else {
+            result = -(int64_t) MIN((uint64_t) (run->start - offset),
+                    (uint64_t) length);
+        }
+    }
+    pthread_mutex_unlock(&list->lock);
+
+    return result;
+}
+
+/* Frees a zero run list */
+extern void zero_runs_free(ZeroRunList *list) {
+    pthread_mutex_destroy(&list->lock);
+    free(list->runs);
+    free(list);
+}
+
+/* Starts a scan of decompressed data */
+extern void zero_scan_start(ZeroScan *scan, off_t position) {
+    scan->position = position;
+    scan->run_start = -1;
+}
+
+/* Scans the next decompressed data */
+extern void zero_scan_feed(ZeroScan *scan, ZeroRunList *list,
+        off_t position, const uint8_t *data, size_t length) {
+
+    if (position != scan->position) {
+        zero_scan_finish(scan, list);
+    }
+
+    size_t i = 0;
+    while (i < length) {
+        if (scan->run_start >= 0) {
+            size_t zeros = count_zeros(data + i, length - i);
+            if (zeros == length - i) {
+                break;
+            }
+            zero_runs_add(list, scan->run_start, position + i + zeros);
+            scan->run_start = -1;
+            i += zeros + 1;
+        } else {
+            i += find_zero_word(data + i, length - i, position + i);
+            if (i < length) {
+                scan->run_start = position + i;
+            }
+        }
+    }
+
+    scan->position = position + length;
+}
+
+/* Ends a scan */
+extern void zero_scan_finish(ZeroScan *scan, ZeroRunList *list) {
+    if (scan->run_start >= 0) {
+        zero_runs_add(list, scan->run_start, scan->position);
+    }
+    scan->run_start = -1;
+}
+
+/* Gets a file descriptor reading as zeros */
+extern int zero_runs_fd(void) {
+    pthread_once(&zeros_once, create_zeros_fd);
+    return zeros_fd;
+}
@@ -0,0 +1,140 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <assert.h>
+#include <pthread.h>
+
+#define TRUE            1
+#define FALSE           0
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/* Shortest run of zeros recorded, shorter ones are cheaper to decompress
+ * than to keep track of */
+#define ZERO_RUN_MIN            65536
+
+/* Most runs kept by a list, 16 bytes each */
+#define ZERO_RUNS_MAX           (1024 * 1024)
+
+/* Size of the shared file of zeros references are handed out from.  It is
+ * sparse, so it takes no memory however large */
+#define ZERO_RUNS_FD_SIZE       (64 * 1024 * 1024)
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Stretch of decompressed data known to be all zeros */
+typedef struct ZeroRun {
+
+    /* Decompressed addresses of the first byte and of the byte after */
+    off_t start;
+    off_t end;
+
+} ZeroRun;
+
+/* Zero runs found in the decompressed data of a reader, sorted by address
+ * and merged where they touch.  Runs are added as data is decompressed, so
+ * a list only ever knows about what has been decompressed at least once. */
+typedef struct ZeroRunList {
+
+    /* Runs, in order */
+    ZeroRun *runs;
+    size_t count;
+    size_t capacity;
+
+    /* Protects the runs, readers look them up while decoders add to them */
+    pthread_mutex_t lock;
+
+} ZeroRunList;
+
+/* State of a scan of data decompressed in order, possibly over many calls */
+typedef struct ZeroScan {
+
+    /* Decompressed address the next data is expected at */
+    off_t position;
+
+    /* Start of the run of zeros the data ends in, or -1 if it does not */
+    off_t run_start;
+
+} ZeroScan;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Allocates an empty zero run list
+ *
+ *  @returns ZeroRunList structure, or NULL if error
+ */
+extern ZeroRunList *zero_runs_alloc(void);
+
+/** Records a run of zeros, merging it with the runs it touches.  Runs
+ *  shorter than ZERO_RUN_MIN are ignored, as are new runs once the list
+ *  holds ZERO_RUNS_MAX.
+ *
+ *  @param list ZeroRunList that has been allocated
+ *  @param start Decompressed address of the first zero
+ *  @param end Decompressed address after the last zero
+ */
+extern void zero_runs_add(ZeroRunList *list, off_t start, off_t end);
+
+/** Finds out whether a range starts in a run of zeros
+ *
+ *  @param list ZeroRunList that has been allocated
+ *  @param offset Decompressed address the range starts at
+ *  @param length Number of bytes in the range
+ *
+ *  @returns Number of bytes from offset on that are zeros, or the negated
+ *           number of bytes before the next run if offset is not in one.
+ *           Either is at most length.
+ */
+extern int64_t zero_runs_lookup(ZeroRunList *list, off_t offset,
+        size_t length);
+
+/** Frees a zero run list
+ *
+ *  @param list ZeroRunList structure
+ */
+extern void zero_runs_free(ZeroRunList *list);
+
+/** Starts a scan of decompressed data for runs of zeros
+ *
+ *  @param scan Scan to start
+ *  @param position Decompressed address of the first data to scan
+ */
+extern void zero_scan_start(ZeroScan *scan, off_t position);
+
+/** Scans the next decompressed data, recording the runs of zeros that end
+ *  in it.  Data that does not follow on from the last is scanned as if the
+ *  scan was restarted at position.
+ *
+ *  @param scan Scan that has been started
+ *  @param list ZeroRunList to record runs in
+ *  @param position Decompressed address of data
+ *  @param data Decompressed data
+ *  @param length Number of bytes of data
+ */
+extern void zero_scan_feed(ZeroScan *scan, ZeroRunList *list,
+        off_t position, const uint8_t *data, size_t length);
+
+/** Ends a scan, recording the run of zeros the data ended in
+ *
+ *  @param scan Scan that has been started
+ *  @param list ZeroRunList to record runs in
+ */
+extern void zero_scan_finish(ZeroScan *scan, ZeroRunList *list);
+
+/** Gets a file descriptor reading as ZERO_RUNS_FD_SIZE zeros, shared by all
+ *  readers so that runs of zeros can be referenced instead of copied
+ *
+ *  @returns File descriptor, or -1 if there is none
+ */
+extern int zero_runs_fd(void);
@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include "zstd_reader.h"
+#include "../byte_source.h"
+#include "../block_cache.h"
+#include "../compression_reader.h"
+
+/*****************************************************************************/
+/************************* Private struct functions **************************/
+/*****************************************************************************/
+
+/* Takes an idle decompression context, or creates one */
+static ZSTD_DCtx *get_context(ZstdReader *reader) {
+    ZSTD_DCtx *context = NULL;
+
+    pthread_mutex_lock(&reader->lock);
+    if (reader->num_contexts > 0) {
+        context = reader->contexts[--reader->num_contexts];
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    return context ? context : ZSTD_createDCtx();
+}
+
+/* Gives back a context from get_context */
+static void put_context(ZstdReader *reader, ZSTD_DCtx *context) {
+    pthread_mutex_lock(&reader->lock);
+    if (reader->num_contexts < ZSTD_MAX_IDLE_CONTEXTS) {
+        reader->contexts[reader->num_contexts++] = context;
+        context = NULL;
+    }
+    pthread_mutex_unlock(&reader->lock);
+
+    ZSTD_freeDCtx(context);
+}
+
+/*****************************************************************************/
+/*************************** Data access functions ***************************/
+/*****************************************************************************/
+
+/* Reads a little-endian 32-bit value */
+static uint32_t read_le32(const uint8_t *bytes) {
+    return (uint32_t) bytes[0] | (uint32_t) bytes[1] << 8
+        | (uint32_t) bytes[2] << 16 | (uint32_t) bytes[3] << 24;
+}
+
+/* Reads the seek table at the end of the file into the frame offsets.  See:
+ * https://github.com/facebook/zstd/blob/dev/contrib/seekable_format */
+static uint8_t parse_seek_table(ZstdReader *reader) {
+    uint8_t footer[ZSTD_SEEK_TABLE_FOOTER_SIZE];
+    uint8_t header[ZSTD_SKIPPABLE_HEADER_SIZE];
+    off_t size = reader->source->size;
+
+    assert(reader->offsets == NULL);
+
+    if (size < ZSTD_SKIPPABLE_HEADER_SIZE + ZSTD_SEEK_TABLE_FOOTER_SIZE) {
+        return FALSE;
+    }
+
+    /* Decode seek table footer */
+    if (byte_source_read(reader->source, footer,
+                size - ZSTD_SEEK_TABLE_FOOTER_SIZE,
+                ZSTD_SEEK_TABLE_FOOTER_SIZE) != ZSTD_SEEK_TABLE_FOOTER_SIZE) {
+        return FALSE;
+    }
+
+    uint64_t num_frames = read_le32(&footer[0]);
+    uint8_t descriptor = footer[4];
+
+    if (read_le32(&footer[5]) != ZSTD_SEEKABLE_MAGIC
+            || (descriptor & ZSTD_SEEK_RESERVED_BITS) != 0
+            || num_frames > ZSTD_MAX_FRAMES) {
+        return FALSE;
+    }
+
+    /* Frame checksums are skipped, frames carry their own if they want
+     * them checked */
+    size_t entry_size = ZSTD_SEEK_ENTRY_SIZE;
+    if (descriptor & ZSTD_SEEK_CHECKSUM_FLAG) {
+        entry_size += ZSTD_SEEK_CHECKSUM_SIZE;
+    }
+
+    size_t entries_size = num_frames * entry_size;
+    off_t table_size = ZSTD_SKIPPABLE_HEADER_SIZE + entries_size
+        + ZSTD_SEEK_TABLE_FOOTER_SIZE;
+    if (table_size > size) {
+        return FALSE;
+    }
+
+    /* Check the skippable frame holding the seek table */
+    off_t table_start = size - table_size;
+    if (byte_source_read(reader->source, header, table_start,
+                ZSTD_SKIPPABLE_HEADER_SIZE) != ZSTD_SKIPPABLE_HEADER_SIZE) {
+        return FALSE;
+    }
+
+    if (read_le32(&header[0]) != ZSTD_SEEK_TABLE_MAGIC
+            || read_le32(&header[4])
+                != table_size - ZSTD_SKIPPABLE_HEADER_SIZE) {
+        return FALSE;
+    }
+
+    uint8_t *entries = (uint8_t *) malloc(entries_size + 1);
+    reader->compressed_offsets = (uint64_t *) malloc(sizeof(uint64_t)
+            * (num_frames + 1));
+    reader->offsets = (uint64_t *) malloc(sizeof(uint64_t)
+            * (num_frames + 1));
+    if (entries == NULL || reader->compressed_offsets == NULL
+            || reader->offsets == NULL) {
+        goto error;
+    }
+
+    if (byte_source_read(reader->source, entries,
+                table_start + ZSTD_SKIPPABLE_HEADER_SIZE, entries_size)
+            != (int64_t) entries_size) {
+        goto error;
+    }
+
+    /* Frames follow each other from the start of the file */
+    uint64_t max_supported = MAX_SUPPORTED_FRAME_SIZE_MB * 1024 * 1024;
+    reader->compressed_offsets[0] = 0;
+    reader->offsets[0] = 0;
+
+    for (uint64_t i = 0; i < num_frames; i++) {
+        uint32_t compressed_size = read_le32(&entries[i * entry_size]);
+        uint32_t decompressed_size = read_le32(&entries[i * entry_size + 4]);
+
+        if (decompressed_size > max_supported) {
+            goto error;
+        }
+
+        reader->compressed_offsets[i + 1] = reader->compressed_offsets[i]
+            + compressed_size;
+        reader->offsets[i + 1] = reader->offsets[i] + decompressed_size;
+    }
+
+    if (reader->compressed_offsets[num_frames] != (uint64_t) table_start) {
+        goto error;
+    }
+
+    reader->num_frames = num_frames;
+    free(entries);
+    return TRUE;
+
+error:
+    free(entries);
+    free(reader->compressed_offsets);
+    free(reader->offsets);
+    reader->compressed_offsets = NULL;
+    reader->offsets = NULL;
+    return FALSE;
+}
+
+/* Finds the frame containing an uncompressed offset */
+static uint8_t locate_frame(void *reader, off_t offset, uint64_t *frame,
+        off_t *start, size_t *size) {
+
+    ZstdReader *zstd_reader = (ZstdReader *) reader;
+    uint64_t *offsets = zstd_reader->offsets;
+
+    if (offset < 0 || (uint64_t) offset >= offsets[zstd_reader->num_frames]) {
+        return FALSE;
+    }
+
+    /* Last frame starting at or before offset */
+    uint64_t low = 0;
+    uint64_t high = zstd_reader->num_frames - 1;
+    while (low < high) {
+        uint64_t middle = low + (high - low + 1) / 2;
+        if (offsets[middle] <= (uint64_t) offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+
+    *frame = low;
+    *start = offsets[low];
+    *size = offsets[low + 1] - offsets[low];
+    return TRUE;
+}
+
+/* Decompresses a whole frame, which is read straight from the mapping of
+ * the file if there is one */
+static uint8_t decode_frame(void *reader, uint64_t frame, off_t start,
+        uint8_t *data, size_t size) {
+
+    ZstdReader *zstd_reader = (ZstdReader *) reader;
+    off_t compressed_offset = zstd_reader->compressed_offsets[frame];
+    size_t compressed_size = zstd_reader->compressed_offsets[frame + 1]
+        - compressed_offset;
+
+    uint8_t *scratch = NULL;
+    uint8_t ok = FALSE;
+    UNUSED(start);
+
+    if (zstd_reader->source->map == NULL) {
+        scratch = (uint8_t *) malloc(compressed_size);
+        if (scratch == NULL) {
+            return FALSE;
+        }
+    }
+
+    size_t length = compressed_size;
+    const uint8_t *input = byte_source_get(zstd_reader->source,
+            compressed_offset, &length, scratch, compressed_size);
+    if (input == NULL || length != compressed_size) {
+        goto exit;
+    }
+
+    ZSTD_DCtx *context = get_context(zstd_reader);
+    if (context == NULL) {
+        goto exit;
+    }
+
+    size_t ret = ZSTD_decompressDCtx(context, data, size, input,
+            compressed_size);
+    put_context(zstd_reader, context);
+
+    ok = !ZSTD_isError(ret) && ret == size;
+
+exit:
+    free(scratch);
+    return ok;
+}
+
+/*****************************************************************************/
+/************************** Public struct functions **************************/
+/*****************************************************************************/
+
+/* Checks if zstd seekable file */
+extern uint8_t zstd_is_supported(FILE *zstd_file) {
+    uint8_t file_header[4];
+
+    size_t ret = fread(file_header, 1, sizeof(file_header), zstd_file);
+
+    assert(ret == sizeof(file_header));
+    if (ret != sizeof(file_header)) {
+        return FALSE;
+    }
+
+    if (read_le32(file_header) != ZSTD_FRAME_MAGIC) {
+        return FALSE;
+    }
+
+    ZstdReader reader = {
+        .source = byte_source_open(zstd_file),
+        .num_frames = 0,
+        .compressed_offsets = NULL,
+        .offsets = NULL
+    };
+    if (reader.source == NULL) {
+        return FALSE;
+    }
+
+    uint8_t supported = parse_seek_table(&reader);
+    byte_source_close(reader.source);
+    free(reader.compressed_offsets);
+    free(reader.offsets);
+
+    return supported;
+}
+
+/* Creates zstd reader struct */
+extern void *zstd_reader_alloc(FILE *zstd_file) {
+    ZstdReader *reader = (ZstdReader *) malloc(sizeof(ZstdReader));
+    assert(reader != NULL);
+
+    if (reader != NULL) {
+        reader->source = byte_source_open(zstd_file);
+        if (reader->source == NULL) {
+            free(reader);
+            return NULL;
+        }
+
+        /* Frames are read in whatever order files need them */
+        byte_source_advise(reader->source, 0, 0, BYTE_SOURCE_RANDOM);
+
+        reader->num_frames = 0;
+        reader->compressed_offsets = NULL;
+        reader->offsets = NULL;
+
+        reader->cache = block_cache_alloc(reader, locate_frame, decode_frame,
+                "spotlight-zstd-frame");
+        if (reader->cache == NULL) {
+            byte_source_close(reader->source);
+            free(reader);
+            return NULL;
+        }
+
+        pthread_mutex_init(&reader->lock, NULL);
+        reader->num_contexts = 0;
+
+        if (!parse_seek_table(reader)) {
+            zstd_reader_free((void *) reader);
+            return NULL;
+        }
+    }
+
+    return (void *) reader;
+}
+
+/* Read bytes in zstd compressed file */
+extern int64_t zstd_read(void *reader, uint8_t *buffer, off_t offset,
+        size_t length) {
+    return block_cache_read(((ZstdReader *) reader)->cache, buffer, offset,
+            length);
+}
+
+/* References a cached frame */
+extern int64_t zstd_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref) {
+    return block_cache_read_ref(((ZstdReader *) reader)->cache, offset,
+            length, ref);
+}
+
+/* Releases a reference from zstd_read_ref */
+extern void zstd_release_ref(void *reader, struct CompressionRef *ref) {
+    block_cache_release_ref(((ZstdReader *) reader)->cache, ref);
+}
+
+/* Decompresses the frames overlapping a range into the cache */
+extern int64_t zstd_prefetch(void *reader, off_t offset, size_t length) {
+    return block_cache_prefetch(((ZstdReader *) reader)->cache, offset,
+            length);
+}
+
+/* Reports zstd reader counters */
+extern void zstd_stats(void *reader, struct CompressionStats *stats) {
+    block_cache_stats(((ZstdReader *) reader)->cache, stats);
+}
+
+/* Free zstd reader struct */
+extern void zstd_reader_free(void *reader) {
+    ZstdReader *zstd_reader = (ZstdReader *) reader;
+
+    /* Stops the decode threads, which use the contexts */
+    block_cache_free(zstd_reader->cache);
+
+    for (uint32_t i = 0; i < zstd_reader->num_contexts; i++) {
+        ZSTD_freeDCtx(zstd_reader->contexts[i]);
+    }
+
+    free(zstd_reader->compressed_offsets);
+    free(zstd_reader->offsets);
+    byte_source_close(zstd_reader->source);
+    pthread_mutex_destroy(&zstd_reader->lock);
+    free(zstd_reader);
+}
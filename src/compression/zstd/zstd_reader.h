@@ -0,0 +1,154 @@
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <pthread.h>
+#include <zstd.h>
+
+#define MAX_SUPPORTED_FRAME_SIZE_MB     64
+/* Idle contexts kept, enough for the decode threads and as many readers */
+#define ZSTD_MAX_IDLE_CONTEXTS          8
+
+#define READER_ERROR   (-1)
+#define TRUE            1
+#define FALSE           0
+
+#define ZSTD_FRAME_MAGIC            0xFD2FB528
+#define ZSTD_SEEKABLE_MAGIC         0x8F92EAB1
+#define ZSTD_SEEK_TABLE_MAGIC       0x184D2A5E
+#define ZSTD_SKIPPABLE_HEADER_SIZE  8
+#define ZSTD_SEEK_TABLE_FOOTER_SIZE 9
+#define ZSTD_SEEK_ENTRY_SIZE        8
+#define ZSTD_SEEK_CHECKSUM_SIZE     4
+#define ZSTD_MAX_FRAMES             0x8000000
+
+/* Seek table descriptor bits */
+#define ZSTD_SEEK_CHECKSUM_FLAG     0x80
+#define ZSTD_SEEK_RESERVED_BITS     0x7C
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Zstd seekable compression reader */
+typedef struct ZstdReader {
+
+    /* Zstd-compressed input */
+    struct ByteSource *source;
+
+    /* Compressed and uncompressed address of each frame, from the seek
+     * table, with the end of the last frame after it */
+    uint64_t num_frames;
+    uint64_t *compressed_offsets;
+    uint64_t *offsets;
+
+    /* Decompressed frames, and the threads decompressing them */
+    struct BlockCache *cache;
+
+    /* Protects the idle contexts */
+    pthread_mutex_t lock;
+
+    /* Decompression contexts not in use */
+    ZSTD_DCtx *contexts[ZSTD_MAX_IDLE_CONTEXTS];
+    uint32_t num_contexts;
+
+} ZstdReader;
+
+/* Defined in compression_reader.h */
+struct CompressionRef;
+struct CompressionStats;
+
+/* Defined in byte_source.h */
+struct ByteSource;
+
+/* Defined in block_cache.h */
+struct BlockCache;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Checks if zstd reader supports a particular file, which must be in the
+ *  seekable format: independent frames followed by a seek table
+ *
+ *  @param zstd_file File pointer
+ *
+ *  @returns 1 for TRUE or 0 for FALSE
+ */
+extern uint8_t zstd_is_supported(FILE *zstd_file);
+
+/** Allocates memory for zstd reader
+ *
+ *  @param zstd_file zstd-compressed file to read from
+ *
+ *  @returns ZstdReader structure, or NULL if error
+ */
+extern void *zstd_reader_alloc(FILE *zstd_file);
+
+/** Reads from zstd-compressed file, decompressing the frames a read spans
+ *  in parallel
+ *
+ *  @param reader ZstdReader that has been allocated
+ *  @param buffer Buffer to read data into
+ *  @param offset Decompressed address to read from
+ *  @param length Number of bytes to read, must be greater than size of buffer
+ *
+ *  @returns Number of bytes read, short at the end of the data, or
+ *           READER_ERROR if error
+ */
+extern int64_t zstd_read(void *reader, uint8_t *buffer,
+        off_t offset, size_t length);
+
+/** References a cached frame, so it can be spliced rather than copied
+ *
+ *  @param reader ZstdReader that has been allocated
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in
+ *
+ *  @returns Number of bytes referenced, up to the end of the frame, or
+ *           READER_ERROR if the frame cannot be referenced
+ */
+extern int64_t zstd_read_ref(void *reader, off_t offset, size_t length,
+        struct CompressionRef *ref);
+
+/** Releases a reference from zstd_read_ref
+ *
+ *  @param reader ZstdReader that has been allocated
+ *  @param ref Reference to release
+ */
+extern void zstd_release_ref(void *reader, struct CompressionRef *ref);
+
+/** Decompresses the frames overlapping a range into the cache
+ *
+ *  @param reader ZstdReader that has been allocated
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes wanted
+ *
+ *  @returns Number of bytes now cached from offset on, which stops short
+ *           once BLOCK_CACHE_PREFETCH frames are waiting to be read, or
+ *           READER_ERROR if error
+ */
+extern int64_t zstd_prefetch(void *reader, off_t offset, size_t length);
+
+/** Reports zstd reader counters
+ *
+ *  @param reader ZstdReader that has been allocated
+ *  @param stats Counters to fill in
+ */
+extern void zstd_stats(void *reader, struct CompressionStats *stats);
+
+/** Frees memory for zstd reader, stopping its decode threads
+ *
+ *  @param reader ZstdReader structure
+ */
+extern void zstd_reader_free(void *reader);
@@ -1,12 +1,23 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "../read_layer.h"
 
 int main(int argc, char *argv[]) {
+    const char *program = argv[0];
 
-    if (argc != 4) {
-        fprintf(stderr, "Usage: %s File Offset Length\n", argv[0]);
+    /* -u reads the file with io_uring instead of mapping it */
+    if (argc > 1 && strcmp(argv[1], "-u") == 0) {
+        compression_set_ring(1);
+        argv++;
+        argc--;
+    }
+
+    if (argc < 4 || argc % 2 != 0) {
+        fprintf(stderr,
+                "Usage: %s [-u] File Offset Length [Offset Length]...\n",
+                program);
         return 1;
     }
 
@@ -16,31 +27,60 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
-    off_t offset = atol(argv[2]);
-    size_t length = atol(argv[3]);
+    /* More than one range is read as a single vectored read */
+    size_t count = (argc - 2) / 2;
+    CompressionSegment *segments;
+    segments = (CompressionSegment *) malloc(count * sizeof(CompressionSegment));
+    uint8_t **buffers = (uint8_t **) malloc(count * sizeof(uint8_t *));
+    size_t *lengths = (size_t *) malloc(count * sizeof(size_t));
+    size_t total = 0;
 
-    if (offset < 0 || length <= 0) {
-        fprintf(stderr, "Error: Offset must be >= 0 and length must be > 0\n");
-        fclose(file);
-        return 1;
-    }
+    for (size_t i = 0; i < count; i++) {
+        off_t offset = atol(argv[2 + 2 * i]);
+        size_t length = atol(argv[3 + 2 * i]);
 
-    uint8_t *buffer = (uint8_t *) malloc(length);
+        if (offset < 0 || length <= 0) {
+            fprintf(stderr,
+                    "Error: Offset must be >= 0 and length must be > 0\n");
+            fclose(file);
+            return 1;
+        }
 
-    int64_t bytes_read = read_wrapper(file, buffer, offset, length);
+        buffers[i] = (uint8_t *) malloc(length);
+        lengths[i] = length;
+        total += length;
 
-    if (bytes_read != (int64_t) length) {
+        segments[i].offset = offset;
+        segments[i].length = length;
+        segments[i].buf = buffers[i];
+    }
+
+    int64_t bytes_read;
+    if (count == 1) {
+        bytes_read = read_wrapper(file, buffers[0], segments[0].offset,
+                lengths[0]);
+    } else {
+        bytes_read = read_wrapper_v(file, segments, count);
+    }
+
+    if (bytes_read != (int64_t) total) {
         fprintf(stderr,
                 "Error: Number of bytes read does not match, %li != %li\n",
-                bytes_read, length);
+                bytes_read, total);
         free_read_wrapper();
         fclose(file);
         return 1;
     }
 
-    fwrite(buffer, 1, length, stdout);
+    /* Segments may have been reordered, buffers keep argument order */
+    for (size_t i = 0; i < count; i++) {
+        fwrite(buffers[i], 1, lengths[i], stdout);
+        free(buffers[i]);
+    }
 
-    free(buffer);
+    free(lengths);
+    free(buffers);
+    free(segments);
     free_read_wrapper();
     fclose(file);
 
@@ -3,7 +3,7 @@
 /*****************************************************************************/
 /**************************** Constructor defines ****************************/
 /*****************************************************************************/
-#define NUMBER_AVAILABLE 1
+#define NUMBER_AVAILABLE 2
 
 /*****************************************************************************/
 /********************** Imports of fuse implementations **********************/
@@ -15,6 +15,13 @@
 /**************** Initialise available fuse implementations ******************/
 /*****************************************************************************/
 static FuseImplementation available_fuse_implementations[NUMBER_AVAILABLE] = {
+    /* Highest precedence at the top */
+
+    /* ext4 implementation on the low-level API, with -o lowlevel */
+    {
+        .is_supported = ext4fuse_ll_is_supported,
+        .start = ext4fuse_ll_main
+    },
 
     /* ext4 implementation */
     {
@@ -0,0 +1,359 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dirlist.h"
+#include "disk.h"
+#include "inode.h"
+#include "logging.h"
+#include "snapshot.h"
+#include "super.h"
+
+/* Upper bound on the number of directory blocks fetched by a single read */
+#define DIRLIST_READ_BLOCKS         32
+#define DIRLIST_INITIAL_ENTRIES     64
+#define DIRLIST_INITIAL_NAMES       1024
+/* Number of decoded directories kept around after their last user is gone */
+#define DIRLIST_CACHE_SIZE          64
+
+
+static struct dirlist_cache_slot {
+    struct dirlist *dl;
+    uint64_t last_used;
+} dirlist_cache[DIRLIST_CACHE_SIZE];
+static uint64_t dirlist_cache_clock;
+static pthread_mutex_t dirlist_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+
+static int dirlist_append(struct dirlist *dl, uint32_t *max_entries,
+                          uint32_t *names_len, uint32_t *max_names,
+                          struct ext4_dir_entry_2 *dentry)
+{
+    if (dl->n_entries == *max_entries) {
+        struct dirlist_entry *entries;
+
+        entries = realloc(dl->entries, 2 * *max_entries * sizeof(*entries));
+        if (entries == NULL) return -1;
+        dl->entries = entries;
+        *max_entries *= 2;
+    }
+
+    while (*names_len + dentry->name_len + 1 > *max_names) {
+        char *names = realloc(dl->names, 2 * *max_names);
+        if (names == NULL) return -1;
+        dl->names = names;
+        *max_names *= 2;
+    }
+
+    struct dirlist_entry *entry = &dl->entries[dl->n_entries++];
+    entry->inode = dentry->inode;
+    entry->name_off = *names_len;
+    entry->name_len = dentry->name_len;
+    entry->file_type = dentry->file_type;
+
+    memcpy(&dl->names[*names_len], dentry->name, dentry->name_len);
+    dl->names[*names_len + dentry->name_len] = 0;
+    *names_len += dentry->name_len + 1;
+
+    return 0;
+}
+
+/* Walks every dentry in a single directory block */
+static int dirlist_parse_block(struct dirlist *dl, uint8_t *block,
+                               uint32_t *max_entries, uint32_t *names_len,
+                               uint32_t *max_names)
+{
+    uint32_t offset = 0;
+
+    while (offset + offsetof(struct ext4_dir_entry_2, name) <= BLOCK_SIZE) {
+        struct ext4_dir_entry_2 *dentry = (struct ext4_dir_entry_2 *)&block[offset];
+
+        /* A rec_len shorter than the dentry header (zero would loop forever)
+         * or past the block means the block is corrupted */
+        if (dentry->rec_len < offsetof(struct ext4_dir_entry_2, name) ||
+            offset + dentry->rec_len > BLOCK_SIZE) {
+            WARNING("Bad rec_len %d at offset %d", dentry->rec_len, offset);
+            break;
+        }
+
+        /* The name must fit in the entry, or it would be read past it */
+        if (dentry->name_len > dentry->rec_len - offsetof(struct ext4_dir_entry_2, name)) {
+            WARNING("Bad name_len %d at offset %d", dentry->name_len, offset);
+            break;
+        }
+        offset += dentry->rec_len;
+
+        /* Unused slots and htree nodes show up as entries with no inode */
+        if (!dentry->inode || !dentry->name_len) continue;
+
+        if (dirlist_append(dl, max_entries, names_len, max_names, dentry) < 0) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* File type bits of st_mode for an entry, from the type its dentry records
+ * rather than its inode, 0 if unknown */
+mode_t dirlist_mode(struct dirlist *dl, uint32_t i)
+{
+    switch (dl->entries[i].file_type) {
+    case EXT4_FT_REG_FILE:  return S_IFREG;
+    case EXT4_FT_DIR:       return S_IFDIR;
+    case EXT4_FT_CHRDEV:    return S_IFCHR;
+    case EXT4_FT_BLKDEV:    return S_IFBLK;
+    case EXT4_FT_FIFO:      return S_IFIFO;
+    case EXT4_FT_SOCK:      return S_IFSOCK;
+    case EXT4_FT_SYMLINK:   return S_IFLNK;
+    default:                return 0;
+    }
+}
+
+static uint32_t dirlist_hash_name(const char *name, uint8_t name_len)
+{
+    uint32_t hash = 2166136261U;
+
+    for (uint8_t i = 0; i < name_len; i++) {
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
+static int dirlist_build_hash(struct dirlist *dl)
+{
+    uint32_t size = 1;
+
+    while (size < 2 * dl->n_entries) size <<= 1;
+
+    dl->hash = calloc(size, sizeof(uint32_t));
+    if (dl->hash == NULL) return -1;
+    dl->hash_mask = size - 1;
+
+    for (uint32_t i = 0; i < dl->n_entries; i++) {
+        uint32_t slot = dirlist_hash_name(dirlist_name(dl, i), dl->entries[i].name_len);
+        slot &= dl->hash_mask;
+        while (dl->hash[slot]) slot = (slot + 1) & dl->hash_mask;
+        dl->hash[slot] = i + 1;
+    }
+
+    return 0;
+}
+
+static void dirlist_free(struct dirlist *dl)
+{
+    if (dl == NULL) return;
+
+    free(dl->entries);
+    free(dl->names);
+    free(dl->hash);
+    free(dl);
+}
+
+/* Copies a directory listed by the snapshot, without reading the image */
+static struct dirlist *dirlist_decode_snapshot(uint32_t inode_idx)
+{
+    const struct dirlist_entry *entries;
+    const char *names;
+    uint32_t n_entries, names_len;
+
+    if (!snapshot_get_dir(inode_idx, &entries, &n_entries, &names, &names_len)) return NULL;
+
+    struct dirlist *dl = calloc(1, sizeof(struct dirlist));
+    if (dl == NULL) return NULL;
+
+    dl->inode_idx = inode_idx;
+    dl->n_entries = n_entries;
+    dl->entries = malloc(n_entries * sizeof(struct dirlist_entry) + 1);
+    dl->names = malloc(names_len + 1);
+    if (dl->entries == NULL || dl->names == NULL) goto fail;
+
+    memcpy(dl->entries, entries, n_entries * sizeof(struct dirlist_entry));
+    memcpy(dl->names, names, names_len);
+
+    if (dirlist_build_hash(dl) < 0) goto fail;
+
+    DEBUG("Directory %d copied from the snapshot, %d entries", inode_idx, n_entries);
+    return dl;
+
+fail:
+    dirlist_free(dl);
+    return NULL;
+}
+
+/* Decodes the whole directory up front.  Contiguous directory blocks are
+ * fetched with one read, instead of one read per block as inode_dentry_get
+ * does. */
+static struct dirlist *dirlist_decode(uint32_t inode_idx)
+{
+    struct ext4_inode inode;
+    uint32_t max_entries = DIRLIST_INITIAL_ENTRIES;
+    uint32_t max_names = DIRLIST_INITIAL_NAMES;
+    uint32_t names_len = 0;
+
+    struct dirlist *snap = dirlist_decode_snapshot(inode_idx);
+    if (snap) return snap;
+
+    if (inode_get_by_number(inode_idx, &inode) < 0) return NULL;
+    if (!S_ISDIR(inode.i_mode)) return NULL;
+
+    struct dirlist *dl = calloc(1, sizeof(struct dirlist));
+    uint8_t *blocks = MALLOC_BLOCKS(DIRLIST_READ_BLOCKS);
+    if (dl == NULL || blocks == NULL) goto fail;
+
+    dl->inode_idx = inode_idx;
+    dl->entries = malloc(max_entries * sizeof(struct dirlist_entry));
+    dl->names = malloc(max_names);
+    if (dl->entries == NULL || dl->names == NULL) goto fail;
+
+    uint32_t n_blocks = BYTES2BLOCKS(inode_get_size(&inode));
+    uint32_t extent_len;
+
+    for (uint32_t lblock = 0; lblock < n_blocks; lblock += extent_len) {
+        uint64_t pblock = inode_get_data_pblock(&inode, lblock, &extent_len);
+
+        extent_len = MIN(extent_len, n_blocks - lblock);
+        extent_len = MIN(extent_len, (uint32_t)DIRLIST_READ_BLOCKS);
+        if (extent_len == 0) extent_len = 1;
+
+        /* Directories should not be sparse, but do not choke if they are */
+        if (pblock == 0) continue;
+
+        disk_read(BLOCKS2BYTES(pblock), BLOCKS2BYTES(extent_len), blocks);
+
+        for (uint32_t i = 0; i < extent_len; i++) {
+            if (dirlist_parse_block(dl, blocks + BLOCKS2BYTES(i), &max_entries,
+                                    &names_len, &max_names) < 0) {
+                goto fail;
+            }
+        }
+    }
+
+    if (dirlist_build_hash(dl) < 0) goto fail;
+
+    DEBUG("Directory %d decoded into %d entries", inode_idx, dl->n_entries);
+
+    free(blocks);
+    return dl;
+
+fail:
+    free(blocks);
+    dirlist_free(dl);
+    return NULL;
+}
+
+/* Must be called with dirlist_cache_lock held */
+static struct dirlist *dirlist_cache_find(uint32_t inode_idx)
+{
+    for (uint32_t i = 0; i < DIRLIST_CACHE_SIZE; i++) {
+        struct dirlist *dl = dirlist_cache[i].dl;
+
+        if (dl && dl->inode_idx == inode_idx) {
+            dirlist_cache[i].last_used = ++dirlist_cache_clock;
+            dl->refcount++;
+            return dl;
+        }
+    }
+    return NULL;
+}
+
+/* Must be called with dirlist_cache_lock held.  The cache keeps its own
+ * reference, dropped when the slot is reused. */
+static void dirlist_cache_insert(struct dirlist *dl)
+{
+    uint32_t victim = 0;
+
+    for (uint32_t i = 0; i < DIRLIST_CACHE_SIZE; i++) {
+        if (dirlist_cache[i].dl == NULL) {
+            victim = i;
+            break;
+        }
+        if (dirlist_cache[i].last_used < dirlist_cache[victim].last_used) {
+            victim = i;
+        }
+    }
+
+    struct dirlist *old = dirlist_cache[victim].dl;
+    if (old && --old->refcount == 0) {
+        dirlist_free(old);
+    }
+
+    dl->refcount++;
+    dirlist_cache[victim].dl = dl;
+    dirlist_cache[victim].last_used = ++dirlist_cache_clock;
+}
+
+/* Returns a referenced, decoded directory.  Every call must be paired with a
+ * dirlist_put. */
+struct dirlist *dirlist_get(uint32_t inode_idx)
+{
+    struct dirlist *dl;
+
+    pthread_mutex_lock(&dirlist_cache_lock);
+    dl = dirlist_cache_find(inode_idx);
+    pthread_mutex_unlock(&dirlist_cache_lock);
+    if (dl) return dl;
+
+    /* Decode without the lock held, so other directories stay available */
+    struct dirlist *decoded = dirlist_decode(inode_idx);
+    if (decoded == NULL) return NULL;
+
+    pthread_mutex_lock(&dirlist_cache_lock);
+    dl = dirlist_cache_find(inode_idx);
+    if (dl == NULL) {
+        dl = decoded;
+        dl->refcount = 1;
+        dirlist_cache_insert(dl);
+        decoded = NULL;
+    }
+    pthread_mutex_unlock(&dirlist_cache_lock);
+
+    /* Somebody else decoded the same directory meanwhile */
+    dirlist_free(decoded);
+
+    return dl;
+}
+
+void dirlist_put(struct dirlist *dl)
+{
+    if (dl == NULL) return;
+
+    pthread_mutex_lock(&dirlist_cache_lock);
+    ASSERT(dl->refcount > 0);
+    if (--dl->refcount == 0) {
+        dirlist_free(dl);
+    }
+    pthread_mutex_unlock(&dirlist_cache_lock);
+}
+
+/* Returns the index of the named entry, or -1 if there is no such entry */
+int32_t dirlist_lookup(struct dirlist *dl, const char *name, uint8_t name_len)
+{
+    uint32_t slot = dirlist_hash_name(name, name_len) & dl->hash_mask;
+
+    while (dl->hash[slot]) {
+        uint32_t i = dl->hash[slot] - 1;
+
+        if (dl->entries[i].name_len == name_len &&
+            memcmp(dirlist_name(dl, i), name, name_len) == 0) {
+            return i;
+        }
+        slot = (slot + 1) & dl->hash_mask;
+    }
+
+    return -1;
+}
@@ -0,0 +1,38 @@
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A directory decoded once into a compact array.  The entry index doubles as
+ * the readdir cookie, so offsets handed to the kernel stay stable for as long
+ * as the handle is open.  Decoded directories are shared through a small
+ * cache and indexed by name, so lookups do not rescan directory blocks. */
+struct dirlist_entry {
+    uint32_t inode;
+    uint32_t name_off;      /* Offset of the NUL-terminated name in names */
+    uint8_t name_len;
+    uint8_t file_type;
+};
+
+struct dirlist {
+    uint32_t inode_idx;     /* Inode of the directory itself */
+    uint32_t n_entries;
+    struct dirlist_entry *entries;
+    char *names;
+    uint32_t hash_mask;     /* Open addressing table of entry index + 1 */
+    uint32_t *hash;
+    uint32_t refcount;
+};
+
+static inline const char *dirlist_name(struct dirlist *dl, uint32_t i)
+{
+    return &dl->names[dl->entries[i].name_off];
+}
+
+mode_t dirlist_mode(struct dirlist *dl, uint32_t i);
+struct dirlist *dirlist_get(uint32_t inode_idx);
+void dirlist_put(struct dirlist *dl);
+int32_t dirlist_lookup(struct dirlist *dl, const char *name, uint8_t name_len);
+
+#endif
@@ -14,9 +14,11 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <pthread.h>
+#include <stdlib.h>
 #include <errno.h>
 
 #include "disk.h"
+#include "hydrate.h"
 #include "logging.h"
 
 #ifdef __FreeBSD__
@@ -24,6 +26,7 @@
 #endif
 
 #include "../../read_layer.h"
+#include "../../readahead.h"
 #define pread _pread
 
 static int disk_fd = -1;
@@ -109,6 +112,14 @@ int disk_open(const char *path)
 
 int disk_close()
 {
+    CompressionStats stats;
+
+    hydrate_stop();
+
+    read_stats_wrapper(&stats);
+    INFO("Decompressed %ju blocks, %ju requests waited for another thread's",
+         (uintmax_t)stats.decoded, (uintmax_t)stats.coalesced);
+
     free_read_wrapper();
     if (disk_file != NULL) {
         fclose(disk_file);
@@ -119,17 +130,77 @@ int disk_close()
     return 0;
 }
 
+/* File data reads may decompress whole blocks of the image, which takes a
+ * long time.  Only a few of them run at once, and one CPU is left to the
+ * metadata reads (superblock, inode tables, directories, extent blocks),
+ * which never wait here.  The readers are thread safe, so a stat does not
+ * queue behind a bulk copy. */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t running;
+    uint32_t limit;         /* 0 until first use or disk_set_data_readers */
+} data_gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+
+void disk_set_data_readers(uint32_t n)
+{
+    pthread_mutex_lock(&data_gate.lock);
+    data_gate.limit = n ? n : 1;
+    pthread_cond_broadcast(&data_gate.cond);
+    pthread_mutex_unlock(&data_gate.lock);
+}
+
+void disk_set_readahead(size_t max_window)
+{
+    readahead_set_window(max_window);
+}
+
+void disk_set_direct(size_t cache_size)
+{
+    compression_set_direct(cache_size);
+}
+
+void disk_set_ring(int enabled)
+{
+    compression_set_ring(enabled ? 1 : 0);
+}
+
+static void data_gate_enter(void)
+{
+    pthread_mutex_lock(&data_gate.lock);
+    if (data_gate.limit == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        data_gate.limit = cpus > 2 ? cpus - 1 : 1;
+    }
+    while (data_gate.running >= data_gate.limit) {
+        pthread_cond_wait(&data_gate.cond, &data_gate.lock);
+    }
+    data_gate.running++;
+    pthread_mutex_unlock(&data_gate.lock);
+}
+
+static void data_gate_leave(void)
+{
+    pthread_mutex_lock(&data_gate.lock);
+    ASSERT(data_gate.running > 0);
+    data_gate.running--;
+    pthread_cond_signal(&data_gate.cond);
+    pthread_mutex_unlock(&data_gate.lock);
+}
+
 int __disk_read(off_t where, size_t size, void *p, const char *func, int line)
 {
-    static pthread_mutex_t read_lock = PTHREAD_MUTEX_INITIALIZER;
     ssize_t pread_ret;
 
     ASSERT(disk_fd >= 0);
 
-    pthread_mutex_lock(&read_lock);
+    if (hydrate_read(where, size, p)) {
+        DEBUG("Hydrated Read: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
+        return size;
+    }
+
     DEBUG("Disk Read: 0x%jx +0x%zx [%s:%d]", where, size, func, line);
     pread_ret = pread_wrapper(disk_fd, p, size, where);
-    pthread_mutex_unlock(&read_lock);
     if (size == 0) WARNING("Read operation with 0 size");
 
     ASSERT((size_t)pread_ret == size);
@@ -137,6 +208,106 @@ int __disk_read(off_t where, size_t size, void *p, const char *func, int line)
     return pread_ret;
 }
 
+/* Reads file data segments in one go.  The decompressor sorts and merges
+ * them, so physically adjacent pieces are decoded once. */
+int __disk_readv(struct disk_segment *segs, size_t count, const char *func, int line)
+{
+    size_t size = 0;
+    int64_t ret = 0;
+
+    ASSERT(disk_fd >= 0);
+
+    for (size_t i = 0; i < count; i++) {
+        size += segs[i].size;
+    }
+
+    data_gate_enter();
+
+#if defined(__FreeBSD__) && !defined(__APPLE__)
+    for (size_t i = 0; i < count; i++) {
+        DEBUG("Disk Read: 0x%jx +0x%zx [%s:%d]", segs[i].where, segs[i].size, func, line);
+        ret += pread_wrapper(disk_fd, segs[i].p, segs[i].size, segs[i].where);
+    }
+#else
+    CompressionSegment *segments = malloc(count * sizeof(CompressionSegment));
+    ASSERT(segments != NULL);
+
+    for (size_t i = 0; i < count; i++) {
+        segments[i].offset = segs[i].where;
+        segments[i].length = segs[i].size;
+        segments[i].buf = segs[i].p;
+    }
+
+    DEBUG("Disk Readv: %zu segments, 0x%zx bytes [%s:%d]", count, size, func, line);
+    ret = read_wrapper_v(disk_file, segments, count);
+
+    free(segments);
+#endif
+
+    data_gate_leave();
+
+    ASSERT((size_t)ret == size);
+
+    return ret;
+}
+
+/* References up to size bytes at where.  Returns the number of bytes
+ * referenced, or a negative value if the reader cannot hand out references
+ * for this range. */
+int disk_read_ref(off_t where, size_t size, struct disk_ref *ref)
+{
+#if defined(__FreeBSD__) && !defined(__APPLE__)
+    UNUSED(where);
+    UNUSED(size);
+    UNUSED(ref);
+    return -1;
+#else
+    CompressionRef cref;
+    int64_t ret;
+
+    ASSERT(disk_fd >= 0);
+
+    data_gate_enter();
+    DEBUG("Disk Ref: 0x%jx +0x%zx", where, size);
+    ret = read_ref_wrapper(disk_file, where, size, &cref);
+    data_gate_leave();
+
+    if (ret <= 0) return -1;
+
+    ref->fd = cref.fd;
+    ref->pos = cref.fd_offset;
+    ref->size = cref.length;
+    ref->token = cref.token;
+
+    return ret;
+#endif
+}
+
+/* Lets the reader start decompressing a range that is about to be read */
+void disk_prefetch(off_t where, size_t size)
+{
+    ASSERT(disk_fd >= 0);
+
+    DEBUG("Disk Prefetch: 0x%jx +0x%zx", where, size);
+    prefetch_wrapper(disk_file, where, size);
+}
+
+void disk_release_ref(struct disk_ref *ref)
+{
+    CompressionRef cref = {
+        .fd = ref->fd,
+        .fd_offset = ref->pos,
+        .length = ref->size,
+        .token = ref->token,
+    };
+
+    if (ref->token == NULL) return;
+
+    release_ref_wrapper(&cref);
+
+    ref->token = NULL;
+}
+
 int disk_ctx_create(struct disk_ctx *ctx, off_t where, size_t size, uint32_t len)
 {
     ASSERT(ctx);        /* Should be user allocated */
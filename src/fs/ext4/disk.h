@@ -7,6 +7,7 @@
 
 #define disk_read(__where, __s, __p)        __disk_read(__where, __s, __p, __func__, __LINE__)
 #define disk_read_block(__blocks, __p)      __disk_read(BLOCKS2BYTES(__blocks), BLOCK_SIZE, __p, __func__, __LINE__)
+#define disk_readv(__segs, __n)             __disk_readv(__segs, __n, __func__, __LINE__)
 #define disk_ctx_read(__ctx, __s, __p)      __disk_ctx_read(__ctx, __s, __p, __func__, __LINE__)
 #define disk_read_type(__where, __t)        ({                                          \
     __t ret;                                                                            \
@@ -21,9 +22,36 @@ struct disk_ctx {
     size_t size;            /* How much to read */
 };
 
+/* One piece of a vectored read */
+struct disk_segment {
+    off_t where;
+    size_t size;
+    void *p;
+};
+
+/* Image data referenced through a file descriptor instead of copied */
+struct disk_ref {
+    int fd;
+    off_t pos;
+    size_t size;
+    void *token;            /* Owned by the reader, NULL if nothing to release */
+};
+
 int disk_open(const char *path);
 int disk_close();
 int __disk_read(off_t where, size_t size, void *p, const char *func, int line);
+int __disk_readv(struct disk_segment *segs, size_t count, const char *func, int line);
+int disk_read_ref(off_t where, size_t size, struct disk_ref *ref);
+void disk_release_ref(struct disk_ref *ref);
+void disk_prefetch(off_t where, size_t size);
+/* Bounds how many file data reads (disk_readv, disk_read_ref) run at once */
+void disk_set_data_readers(uint32_t n);
+/* Largest window decompressed ahead of sequential readers, 0 disables it */
+void disk_set_readahead(size_t max_window);
+/* Reads raw images with O_DIRECT, caching metadata in cache_size bytes */
+void disk_set_direct(size_t cache_size);
+/* Reads images with io_uring instead of mapping them */
+void disk_set_ring(int enabled);
 
 int disk_ctx_create(struct disk_ctx *ctx, off_t where, size_t size, uint32_t len);
 int __disk_ctx_read(struct disk_ctx *ctx, size_t size, void *p, const char *func, int line);
@@ -13,11 +13,18 @@
 #include "logging.h"
 #include "super.h"
 
-/* Calculates the physical block from a given logical block and extent */
+/* Number of blocks covered by an extent, written or not */
+static uint32_t extent_n_blocks(struct ext4_extent *ee)
+{
+    if (ee->ee_len > EXT_INIT_MAX_LEN) return ee->ee_len - EXT_INIT_MAX_LEN;
+    return ee->ee_len;
+}
+
+/* Calculates the physical block from a given logical block and extent.
+ * Holes and unwritten extents read as zeros, so they map to block 0, with
+ * len set to the blocks left before the next extent or written data. */
 static uint64_t extent_get_block_from_ees(struct ext4_extent *ee, uint32_t n_ee, uint32_t lblock, uint32_t *len)
 {
-    uint32_t block_ext_index = 0;
-    uint32_t block_ext_offset = 0;
     uint32_t i;
 
     DEBUG("Extent contains %d entries", n_ee);
@@ -27,21 +34,31 @@ static uint64_t extent_get_block_from_ees(struct ext4_extent *ee, uint32_t n_ee,
     for (i = 0; i < n_ee; i++) {
         ASSERT(ee[i].ee_start_hi == 0);
 
-        if (ee[i].ee_block + ee[i].ee_len > lblock) {
-            block_ext_index = i;
-            block_ext_offset = lblock - ee[i].ee_block;
-            if (len) *len = ee[i].ee_block + ee[i].ee_len - lblock;
-            break;
+        if (lblock < ee[i].ee_block) {
+            DEBUG("Hole of %d blocks before extent [%d]", ee[i].ee_block - lblock, i);
+            if (len) *len = ee[i].ee_block - lblock;
+            return 0;
         }
+
+        if (lblock - ee[i].ee_block < extent_n_blocks(&ee[i])) break;
     }
 
     if (n_ee == i) {
-        DEBUG("Extent [%d] doesn't contain block", block_ext_index);
+        DEBUG("Extents end before block");
+        if (len) *len = lblock < UINT32_MAX ? UINT32_MAX - lblock : 1;
         return 0;
-    } else {
-        DEBUG("Block located [%d:%d]", block_ext_index, block_ext_offset);
-        return ee[block_ext_index].ee_start_lo + block_ext_offset;
     }
+
+    uint32_t block_ext_offset = lblock - ee[i].ee_block;
+    if (len) *len = extent_n_blocks(&ee[i]) - block_ext_offset;
+
+    if (ee[i].ee_len > EXT_INIT_MAX_LEN) {
+        DEBUG("Block in unwritten extent [%d:%d]", i, block_ext_offset);
+        return 0;
+    }
+
+    DEBUG("Block located [%d:%d]", i, block_ext_offset);
+    return ee[i].ee_start_lo + block_ext_offset;
 }
 
 /* Fetches a block that stores extent info and returns an array of extents
@@ -78,9 +95,9 @@ uint64_t extent_get_pblock(void *extents, uint32_t lblock, uint32_t *len)
     } else {
         struct ext4_extent_idx *ei_array = extents + sizeof(struct ext4_extent_header);
         struct ext4_extent_idx *recurse_ei = NULL;
+        int i;
 
-        for (int i = 0; i < eh->eh_entries; i++) {
-            ei_array = extents + sizeof(struct ext4_extent_header);
+        for (i = 0; i < eh->eh_entries; i++) {
             ASSERT(ei_array[i].ei_leaf_hi == 0);
 
             if (ei_array[i].ei_block > lblock) {
@@ -90,11 +107,20 @@ uint64_t extent_get_pblock(void *extents, uint32_t lblock, uint32_t *len)
             recurse_ei = &ei_array[i];
         }
 
-        ASSERT(recurse_ei);
+        if (recurse_ei == NULL) {
+            /* Hole before the first subtree */
+            if (len) *len = eh->eh_entries ? ei_array[0].ei_block - lblock : UINT32_MAX - lblock;
+            return 0;
+        }
 
         void *leaf_extents = extent_get_extents_in_block(recurse_ei->ei_leaf_lo);
         ret = extent_get_pblock(leaf_extents, lblock, len);
         free(leaf_extents);
+
+        /* A hole at the end of a subtree stops where the next one starts */
+        if (ret == 0 && len && i < eh->eh_entries && *len > ei_array[i].ei_block - lblock) {
+            *len = ei_array[i].ei_block - lblock;
+        }
     }
 
     return ret;
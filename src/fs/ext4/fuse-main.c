@@ -23,11 +23,16 @@
 
 #include "fuse-main.h"
 
+#include <fuse_lowlevel.h>
+
 #include "common.h"
 #include "disk.h"
+#include "hydrate.h"
 #include "inode.h"
+#include "ll-ops.h"
 #include "logging.h"
 #include "ops.h"
+#include "snapshot.h"
 #include "super.h"
 
 #include "types/ext4_super.h"
@@ -36,12 +41,38 @@
 #define EXT4FUSE_VERSION    ext4fuse_unknown_version
 #endif
 
+/* The image never changes under us, so the kernel can hold on to names and
+ * attributes for as long as it wants.  Given before the user's arguments, so
+ * any of these can still be overridden from the command line. */
+#define E4F_DEFAULT_OPTS    "-ouse_ino,readdir_ino,"                        \
+                            "entry_timeout=86400,negative_timeout=86400,"   \
+                            "attr_timeout=86400"
+
+#if FUSE_USE_VERSION >= 30
+/* Each worker thread reads requests from its own /dev/fuse fd */
+#define E4F_LOOP_OPTS       "-oclone_fd"
+#endif
+
+/* libfuse 3.18 and later can take requests from per-core io_uring queues
+ * instead of read(2) and write(2) on /dev/fuse.  It keeps using the device
+ * when the kernel does not offer FUSE over io_uring. */
+#ifdef FUSE_CAP_OVER_IO_URING
+#define E4F_URING_OPTS      "-oio_uring"
+#endif
+
+/* Metadata cache of raw images read with -o odirect */
+#define E4F_ODIRECT_CACHE_MB    64
+
 
 static struct fuse_operations e4f_ops = {
     .getattr    = op_getattr,
+    .opendir    = op_opendir,
     .readdir    = op_readdir,
+    .releasedir = op_releasedir,
     .open       = op_open,
+    .release    = op_release,
     .read       = op_read,
+    .read_buf   = op_read_buf,
     .readlink   = op_readlink,
     .init       = op_init,
 };
@@ -49,10 +80,30 @@ static struct fuse_operations e4f_ops = {
 static struct e4f {
     char *disk;
     char *logfile;
+    int lowlevel;
+    int uring;
+    int notify_store;
+    unsigned int data_readers;
+    int readahead_kb;
+    int hydrate;
+    char *snapshot;
+    int odirect;
+    unsigned int odirect_cache_mb;
+    int uring_reads;
 } e4f;
 
 static struct fuse_opt e4f_opts[] = {
     { "logfile=%s", offsetof(struct e4f, logfile), 0 },
+    { "lowlevel", offsetof(struct e4f, lowlevel), 1 },
+    { "uring", offsetof(struct e4f, uring), 1 },
+    { "notify_store", offsetof(struct e4f, notify_store), 1 },
+    { "data_readers=%u", offsetof(struct e4f, data_readers), 0 },
+    { "readahead_kb=%d", offsetof(struct e4f, readahead_kb), 0 },
+    { "hydrate", offsetof(struct e4f, hydrate), 1 },
+    { "snapshot=%s", offsetof(struct e4f, snapshot), 0 },
+    { "odirect", offsetof(struct e4f, odirect), 1 },
+    { "odirect_cache_mb=%u", offsetof(struct e4f, odirect_cache_mb), 0 },
+    { "uring_reads", offsetof(struct e4f, uring_reads), 1 },
     FUSE_OPT_END
 };
 
@@ -85,7 +136,9 @@ void signal_handle_sigsegv(int signal)
     char **strings;
     size_t i;
 
-    disk_close();
+    /* Not disk_close(): it joins the hydrate and prefetch threads and takes
+     * reader locks the faulting thread may hold.  The image is only read,
+     * so abort() leaves nothing behind that needs closing. */
 
     DEBUG("========================================");
     DEBUG("Segmentation Fault.  Starting backtrace:");
@@ -99,27 +152,51 @@ void signal_handle_sigsegv(int signal)
     abort();
 }
 
-int ext4fuse_main(int argc, char *argv[])
+static int e4f_parse_opts(struct fuse_args *args)
 {
-    int res;
-    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    // Default options
+    e4f.disk = NULL;
+    e4f.logfile = DEFAULT_LOG_FILE;
+    e4f.lowlevel = 0;
+    e4f.uring = 0;
+    e4f.notify_store = 0;
+    e4f.data_readers = 0;
+    e4f.readahead_kb = -1;
+    e4f.hydrate = 0;
+    e4f.snapshot = NULL;
+    e4f.odirect = 0;
+    e4f.odirect_cache_mb = E4F_ODIRECT_CACHE_MB;
+    e4f.uring_reads = 0;
+
+    return fuse_opt_parse(args, &e4f, e4f_opts, e4f_opt_proc);
+}
+
+static uint8_t e4f_disk_is_ext4(void)
+{
+    off_t disk_magic_offset = BOOT_SECTOR_SIZE + offsetof(struct ext4_super_block, s_magic);
+    uint16_t disk_magic;
+    if (disk_read(disk_magic_offset, sizeof(disk_magic), &disk_magic) < 0) {
+        return FALSE;
+    }
 
+    return disk_magic == 0xEF53;
+}
+
+/* Everything both implementations need before handing over to FUSE */
+static int e4f_setup(struct fuse_args *args, const char *progname)
+{
     if (signal(SIGSEGV, signal_handle_sigsegv) == SIG_ERR) {
         fprintf(stderr, "Failed to initialize signals\n");
         return EXIT_FAILURE;
     }
 
-    // Default options
-    e4f.disk = NULL;
-    e4f.logfile = DEFAULT_LOG_FILE;
-
-    if (fuse_opt_parse(&args, &e4f, e4f_opts, e4f_opt_proc) == -1) {
+    if (e4f_parse_opts(args) == -1) {
         return EXIT_FAILURE;
     }
 
     if (!e4f.disk) {
         fprintf(stderr, "Version: %s\n", EXT4FUSE_VERSION);
-        fprintf(stderr, "Usage: %s <disk> <mountpoint>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <disk> <mountpoint>\n", progname);
         exit(1);
     }
 
@@ -134,35 +211,219 @@ int ext4fuse_main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
-    off_t disk_magic_offset = BOOT_SECTOR_SIZE + offsetof(struct ext4_super_block, s_magic);
-    uint16_t disk_magic;
-    if (disk_read(disk_magic_offset, sizeof(disk_magic), &disk_magic) < 0) {
-        fprintf(stderr, "Failed to read disk: %s\n",  e4f.disk);
-        return EXIT_FAILURE;
+    if (e4f.data_readers) {
+        disk_set_data_readers(e4f.data_readers);
+    }
+
+    /* Before the first read, which sets up the reader */
+    if (e4f.odirect) {
+        disk_set_direct((size_t)e4f.odirect_cache_mb * 1024 * 1024);
+    }
+    if (e4f.uring_reads) {
+        disk_set_ring(1);
     }
 
-    if (disk_magic != 0xEF53) {
+    if (e4f.readahead_kb >= 0) {
+        disk_set_readahead((size_t)e4f.readahead_kb * 1024);
+    }
+
+    if (!e4f_disk_is_ext4()) {
         fprintf(stderr, "Partition doesn't contain EXT4 filesystem\n");
         return EXIT_FAILURE;
     }
 
+    if (e4f.hydrate) {
+        hydrate_enable();
+    }
+
+    if (e4f.snapshot) {
+        snapshot_enable(e4f.snapshot);
+    }
+
+#if FUSE_USE_VERSION >= 30
+    if (fuse_opt_insert_arg(args, 1, E4F_LOOP_OPTS) == -1) {
+        return EXIT_FAILURE;
+    }
+#endif
+
+    if (e4f.uring) {
+#ifdef E4F_URING_OPTS
+        if (fuse_opt_insert_arg(args, 1, E4F_URING_OPTS) == -1) {
+            return EXIT_FAILURE;
+        }
+        INFO("Requesting FUSE over io_uring");
+#else
+        WARNING("libfuse lacks io_uring support, using /dev/fuse");
+#endif
+    }
+
+    if (e4f.notify_store && !e4f.lowlevel) {
+        WARNING("notify_store needs -o lowlevel, ignoring it");
+    }
+
+    return EXIT_SUCCESS;
+}
+
+int ext4fuse_main(int argc, char *argv[])
+{
+    int res;
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    res = e4f_setup(&args, argv[0]);
+    if (res != EXIT_SUCCESS) {
+        return res;
+    }
+
+    /* These are high-level options, the low-level session rejects them */
+    if (fuse_opt_insert_arg(&args, 1, E4F_DEFAULT_OPTS) == -1) {
+        return EXIT_FAILURE;
+    }
+
     res = fuse_main(args.argc, args.argv, &e4f_ops, NULL);
 
     fuse_opt_free_args(&args);
     free(e4f.disk);
+    free(e4f.snapshot);
+    snapshot_unload();
+    disk_close();
 
     return res;
-}   
+}
 
-uint8_t ext4fuse_is_supported(int argc, char *argv[])
+#if FUSE_USE_VERSION >= 30
+static int e4f_ll_run(struct fuse_args *args)
+{
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int res = EXIT_FAILURE;
+
+    if (fuse_parse_cmdline(args, &opts) != 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (opts.mountpoint == NULL) {
+        fprintf(stderr, "Usage: %s <disk> <mountpoint>\n", args->argv[0]);
+        goto out;
+    }
+
+    se = fuse_session_new(args, &e4f_ll_ops, sizeof(e4f_ll_ops), NULL);
+    if (se == NULL) {
+        goto out;
+    }
+
+    if (fuse_set_signal_handlers(se) == -1) {
+        goto out_destroy;
+    }
+
+    if (fuse_session_mount(se, opts.mountpoint) != 0) {
+        goto out_signals;
+    }
+
+    if (e4f.notify_store) {
+        ll_enable_notify_store(se);
+    }
+
+    fuse_daemonize(opts.foreground);
+
+    if (opts.singlethread) {
+        res = fuse_session_loop(se) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else {
+        res = fuse_session_loop_mt(se, opts.clone_fd) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    fuse_session_unmount(se);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_destroy:
+    fuse_session_destroy(se);
+out:
+    free(opts.mountpoint);
+
+    return res;
+}
+#else
+static int e4f_ll_run(struct fuse_args *args)
+{
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mountpoint;
+    int multithreaded;
+    int foreground;
+    int res = EXIT_FAILURE;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    ch = fuse_mount(mountpoint, args);
+    if (ch == NULL) {
+        goto out;
+    }
+
+    se = fuse_lowlevel_new(args, &e4f_ll_ops, sizeof(e4f_ll_ops), NULL);
+    if (se == NULL) {
+        goto out_unmount;
+    }
+
+    if (fuse_set_signal_handlers(se) == -1) {
+        goto out_destroy;
+    }
+
+    fuse_session_add_chan(se, ch);
+
+    if (e4f.notify_store) {
+        ll_enable_notify_store(ch);
+    }
+    fuse_daemonize(foreground);
+
+    if (multithreaded) {
+        res = fuse_session_loop_mt(se) ? EXIT_FAILURE : EXIT_SUCCESS;
+    } else {
+        res = fuse_session_loop(se) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    fuse_remove_signal_handlers(se);
+    fuse_session_remove_chan(ch);
+
+out_destroy:
+    fuse_session_destroy(se);
+out_unmount:
+    fuse_unmount(mountpoint, ch);
+out:
+    free(mountpoint);
+
+    return res;
+}
+#endif
+
+/* Same as ext4fuse_main, but requests are keyed by inode number, so no path
+ * is ever resolved while serving them */
+int ext4fuse_ll_main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    int res;
 
-    // Default options
-    e4f.disk = NULL;
-    e4f.logfile = DEFAULT_LOG_FILE;
+    res = e4f_setup(&args, argv[0]);
+    if (res != EXIT_SUCCESS) {
+        return res;
+    }
+
+    res = e4f_ll_run(&args);
+
+    fuse_opt_free_args(&args);
+    free(e4f.disk);
+    free(e4f.snapshot);
+    snapshot_unload();
+    disk_close();
+
+    return res;
+}
+
+uint8_t ext4fuse_is_supported(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
 
-    if (fuse_opt_parse(&args, &e4f, e4f_opts, e4f_opt_proc) == -1) {
+    if (e4f_parse_opts(&args) == -1) {
         return FALSE;
     }
 
@@ -174,19 +435,38 @@ uint8_t ext4fuse_is_supported(int argc, char *argv[])
         return FALSE;
     }
 
-    off_t disk_magic_offset = BOOT_SECTOR_SIZE + offsetof(struct ext4_super_block, s_magic);
-    uint16_t disk_magic;
-    if (disk_read(disk_magic_offset, sizeof(disk_magic), &disk_magic) < 0) {
+    if (!e4f_disk_is_ext4()) {
         return FALSE;
     }
 
-    if (disk_magic != 0xEF53) {
+    fuse_opt_free_args(&args);
+    free(e4f.disk);
+    disk_close();
+
+    return TRUE;
+}
+
+/* The low-level implementation is only picked when asked for with -o lowlevel.
+ * The options are checked before the disk is probed, as opening the disk
+ * can mean indexing or decompressing the whole image. */
+uint8_t ext4fuse_ll_is_supported(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    uint8_t lowlevel;
+
+    if (e4f_parse_opts(&args) == -1) {
         return FALSE;
     }
 
+    lowlevel = e4f.lowlevel;
     fuse_opt_free_args(&args);
     free(e4f.disk);
-    disk_close();
+    free(e4f.logfile);
+    free(e4f.snapshot);
 
-    return TRUE;
+    if (!lowlevel) {
+        return FALSE;
+    }
+
+    return ext4fuse_is_supported(argc, argv);
 }
@@ -8,3 +8,10 @@ int ext4fuse_main(int argc, char *argv[]);
 
 /* Checks if ext4fuse implementation supports file */
 uint8_t ext4fuse_is_supported(int argc, char *argv[]);
+
+/* Starts ext4fuse implementation on the FUSE low-level API */
+int ext4fuse_ll_main(int argc, char *argv[]);
+
+/* Checks if the low-level ext4fuse implementation was requested and supports
+ * file */
+uint8_t ext4fuse_ll_is_supported(int argc, char *argv[]);
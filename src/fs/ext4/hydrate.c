@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "disk.h"
+#include "extents.h"
+#include "hydrate.h"
+#include "inode.h"
+#include "logging.h"
+#include "super.h"
+
+#define HYDRATE_INITIAL_RANGES      256
+/* Deepest extent tree walked, deeper ones are taken for corruption */
+#define HYDRATE_MAX_EXTENT_DEPTH    5
+/* Symlinks up to this size keep their target in i_block */
+#define HYDRATE_FAST_SYMLINK_SIZE   60
+
+
+/* Run of blocks holding metadata, found while walking the groups */
+struct hydrate_range {
+    uint64_t pblock;
+    uint64_t n_blocks;
+};
+
+struct hydrate_list {
+    struct hydrate_range *ranges;
+    uint32_t n_ranges;
+    uint32_t max_ranges;
+};
+
+/* Decoded copy of one run of metadata blocks */
+struct hydrate_region {
+    off_t where;
+    size_t size;
+    uint8_t *data;
+};
+
+/* Regions sorted by address, never modified once published */
+struct hydrate_map {
+    uint32_t n_regions;
+    struct hydrate_region *regions;
+    uint8_t *data;
+};
+
+static struct {
+    int enabled;
+    int started;
+    int stop;
+    pthread_t thread;
+    struct hydrate_map *map;    /* NULL until the pass is done */
+} hydrate;
+
+
+
+static int hydrate_add(struct hydrate_list *list, uint64_t pblock, uint64_t n_blocks)
+{
+    if (pblock == 0 || n_blocks == 0) return 0;
+
+    if (list->n_ranges) {
+        struct hydrate_range *last = &list->ranges[list->n_ranges - 1];
+
+        if (last->pblock + last->n_blocks == pblock) {
+            last->n_blocks += n_blocks;
+            return 0;
+        }
+    }
+
+    if (list->n_ranges == list->max_ranges) {
+        uint32_t max_ranges = list->max_ranges ? 2 * list->max_ranges : HYDRATE_INITIAL_RANGES;
+        struct hydrate_range *ranges;
+
+        ranges = realloc(list->ranges, max_ranges * sizeof(struct hydrate_range));
+        if (ranges == NULL) return -1;
+        list->ranges = ranges;
+        list->max_ranges = max_ranges;
+    }
+
+    list->ranges[list->n_ranges].pblock = pblock;
+    list->ranges[list->n_ranges].n_blocks = n_blocks;
+    list->n_ranges++;
+
+    return 0;
+}
+
+/* Adds the index and leaf blocks below an extent tree node.  The leaves point
+ * at file data, which is left alone. */
+static int hydrate_add_extent_tree(struct hydrate_list *list, struct ext4_extent_header *eh,
+                                   uint32_t max_entries)
+{
+    struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+    uint32_t n_entries = MIN((uint32_t)eh->eh_entries, max_entries);
+    int ret = 0;
+
+    if (eh->eh_magic != EXT4_EXT_MAGIC) return 0;
+    if (eh->eh_depth == 0 || eh->eh_depth > HYDRATE_MAX_EXTENT_DEPTH) return 0;
+
+    uint8_t *block = MALLOC_BLOCKS(1);
+    if (block == NULL) return -1;
+
+    for (uint32_t i = 0; i < n_entries && ret == 0; i++) {
+        struct ext4_extent_header *child = (struct ext4_extent_header *)block;
+
+        if (hydrate_add(list, ei[i].ei_leaf_lo, 1) < 0) {
+            ret = -1;
+            break;
+        }
+
+        disk_read_block(ei[i].ei_leaf_lo, block);
+        if (child->eh_depth + 1 != eh->eh_depth) {
+            WARNING("Extent block %d has depth %d", ei[i].ei_leaf_lo, child->eh_depth);
+            continue;
+        }
+        ret = hydrate_add_extent_tree(list, child,
+                                      (BLOCK_SIZE - sizeof(*child)) / sizeof(*ei));
+    }
+
+    free(block);
+    return ret;
+}
+
+/* Adds an ext2/3 mapping block and, for double and triple indirect ones, the
+ * mapping blocks below it */
+static int hydrate_add_ind_tree(struct hydrate_list *list, uint32_t pblock, int level)
+{
+    int ret = 0;
+
+    if (pblock == 0) return 0;
+    if (hydrate_add(list, pblock, 1) < 0) return -1;
+    if (level == 1) return 0;
+
+    uint32_t *addrs = MALLOC_BLOCKS(1);
+    if (addrs == NULL) return -1;
+
+    disk_read_block(pblock, (uint8_t *)addrs);
+    for (uint32_t i = 0; i < BLOCK_SIZE / sizeof(uint32_t) && ret == 0; i++) {
+        ret = hydrate_add_ind_tree(list, addrs[i], level - 1);
+    }
+
+    free(addrs);
+    return ret;
+}
+
+static int hydrate_add_data(struct hydrate_list *list, struct ext4_inode *inode)
+{
+    uint32_t n_blocks = BYTES2BLOCKS(inode_get_size(inode));
+    uint32_t extent_len;
+
+    for (uint32_t lblock = 0; lblock < n_blocks; lblock += extent_len) {
+        uint64_t pblock = inode_get_data_pblock(inode, lblock, &extent_len);
+
+        extent_len = MIN(extent_len, n_blocks - lblock);
+        if (extent_len == 0) extent_len = 1;
+
+        if (hydrate_add(list, pblock, extent_len) < 0) return -1;
+    }
+
+    return 0;
+}
+
+/* Adds whatever a lookup, readdir or read of this inode has to go through:
+ * the mapping blocks of files, and the contents of directories and of
+ * symlinks that do not fit in the inode */
+static int hydrate_add_inode(struct hydrate_list *list, struct ext4_inode *inode)
+{
+    int is_data_meta = S_ISDIR(inode->i_mode) ||
+                       (S_ISLNK(inode->i_mode) &&
+                        inode_get_size(inode) > HYDRATE_FAST_SYMLINK_SIZE);
+
+    /* i_block of anything else holds no block numbers */
+    if (!is_data_meta && !S_ISREG(inode->i_mode)) return 0;
+
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        uint32_t max_entries = (sizeof(inode->i_block) - sizeof(struct ext4_extent_header)) /
+                               sizeof(struct ext4_extent_idx);
+
+        if (hydrate_add_extent_tree(list, (struct ext4_extent_header *)inode->i_block,
+                                    max_entries) < 0) {
+            return -1;
+        }
+    } else {
+        if (hydrate_add_ind_tree(list, inode->i_block[EXT4_IND_BLOCK], 1) < 0) return -1;
+        if (hydrate_add_ind_tree(list, inode->i_block[EXT4_DIND_BLOCK], 2) < 0) return -1;
+        if (hydrate_add_ind_tree(list, inode->i_block[EXT4_TIND_BLOCK], 3) < 0) return -1;
+    }
+
+    if (is_data_meta) {
+        return hydrate_add_data(list, inode);
+    }
+    return 0;
+}
+
+/* Adds the inode table blocks that hold inodes in use, going by the inode
+ * bitmap, and the metadata those inodes point at */
+static int hydrate_add_group(struct hydrate_list *list, uint32_t group,
+                             uint8_t *bitmap, uint8_t *table)
+{
+    uint64_t bitmap_pblock = super_group_inode_bitmap(group);
+    uint64_t table_pblock = super_group_inode_table(group);
+    uint32_t inodes_per_block = BLOCK_SIZE / super_inode_size();
+    uint32_t inodes_per_group = super_inodes_per_group();
+
+    if (bitmap_pblock == 0) return 0;
+    disk_read_block(bitmap_pblock, bitmap);
+
+    for (uint32_t first = 0; first < inodes_per_group; first += inodes_per_block) {
+        uint32_t last = MIN(first + inodes_per_block, inodes_per_group);
+        uint32_t used = 0;
+
+        for (uint32_t i = first; i < last; i++) {
+            used |= bitmap[i / 8] & (1 << (i % 8));
+        }
+        if (!used) continue;
+
+        uint64_t pblock = table_pblock + first / inodes_per_block;
+        if (hydrate_add(list, pblock, 1) < 0) return -1;
+        disk_read_block(pblock, table);
+
+        for (uint32_t i = first; i < last; i++) {
+            uint32_t n = group * inodes_per_group + i + 1;
+            struct ext4_inode inode;
+
+            if (!(bitmap[i / 8] & (1 << (i % 8)))) continue;
+            /* The journal and resize inodes are never looked at */
+            if (n < super_first_inode() && n != ROOT_INODE_N) continue;
+
+            memset(&inode, 0, sizeof(struct ext4_inode));
+            memcpy(&inode, table + (i - first) * super_inode_size(),
+                   MIN(super_inode_size(), sizeof(struct ext4_inode)));
+            if (inode.i_mode == 0) continue;
+
+            if (hydrate_add_inode(list, &inode) < 0) return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int hydrate_range_cmp(const void *a, const void *b)
+{
+    const struct hydrate_range *x = a;
+    const struct hydrate_range *y = b;
+    return (x->pblock > y->pblock) - (x->pblock < y->pblock);
+}
+
+/* Sorts and merges the ranges, then decodes each of them with one read */
+static struct hydrate_map *hydrate_decode(struct hydrate_list *list)
+{
+    uint32_t n_regions = 0;
+    uint64_t total = 0;
+
+    qsort(list->ranges, list->n_ranges, sizeof(struct hydrate_range), hydrate_range_cmp);
+
+    for (uint32_t i = 0; i < list->n_ranges; i++) {
+        struct hydrate_range *range = &list->ranges[i];
+        struct hydrate_range *last = n_regions ? &list->ranges[n_regions - 1] : NULL;
+
+        if (last && last->pblock + last->n_blocks >= range->pblock) {
+            uint64_t end = range->pblock + range->n_blocks;
+            if (end > last->pblock + last->n_blocks) {
+                last->n_blocks = end - last->pblock;
+            }
+        } else {
+            list->ranges[n_regions++] = *range;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_regions; i++) {
+        total += BLOCKS2BYTES(list->ranges[i].n_blocks);
+    }
+
+    struct hydrate_map *map = calloc(1, sizeof(struct hydrate_map));
+    if (map == NULL) return NULL;
+
+    map->regions = malloc(n_regions * sizeof(struct hydrate_region) + 1);
+    map->data = malloc(total + 1);
+    if (map->regions == NULL || map->data == NULL) goto fail;
+
+    uint8_t *p = map->data;
+    for (uint32_t i = 0; i < n_regions; i++) {
+        struct hydrate_region *region = &map->regions[i];
+
+        if (__atomic_load_n(&hydrate.stop, __ATOMIC_RELAXED)) goto fail;
+
+        region->where = BLOCKS2BYTES(list->ranges[i].pblock);
+        region->size = BLOCKS2BYTES(list->ranges[i].n_blocks);
+        region->data = p;
+        disk_read(region->where, region->size, region->data);
+        p += region->size;
+    }
+    map->n_regions = n_regions;
+
+    INFO("Hydrated %d metadata regions, %ju bytes", n_regions, (uintmax_t)total);
+    return map;
+
+fail:
+    free(map->regions);
+    free(map->data);
+    free(map);
+    return NULL;
+}
+
+static void *hydrate_run(void *arg)
+{
+    struct hydrate_list list = { NULL, 0, 0 };
+    struct hydrate_map *map = NULL;
+    UNUSED(arg);
+
+    uint8_t *bitmap = MALLOC_BLOCKS(1);
+    uint8_t *table = MALLOC_BLOCKS(1);
+    if (bitmap == NULL || table == NULL) goto out;
+
+    for (uint32_t group = 0; group < super_n_block_groups(); group++) {
+        if (__atomic_load_n(&hydrate.stop, __ATOMIC_RELAXED)) goto out;
+
+        if (hydrate_add_group(&list, group, bitmap, table) < 0) {
+            WARNING("Out of memory, metadata is not hydrated");
+            goto out;
+        }
+    }
+
+    map = hydrate_decode(&list);
+    if (map) {
+        __atomic_store_n(&hydrate.map, map, __ATOMIC_RELEASE);
+    }
+
+out:
+    free(list.ranges);
+    free(bitmap);
+    free(table);
+    return NULL;
+}
+
+void hydrate_enable(void)
+{
+    hydrate.enabled = 1;
+}
+
+/* Must be called once the superblock and group descriptors are loaded, from
+ * the process that serves requests */
+void hydrate_start(void)
+{
+    if (!hydrate.enabled || hydrate.started) return;
+
+    if (pthread_create(&hydrate.thread, NULL, hydrate_run, NULL) != 0) {
+        WARNING("Cannot start the hydration thread");
+        return;
+    }
+    hydrate.started = 1;
+}
+
+void hydrate_stop(void)
+{
+    if (hydrate.started) {
+        __atomic_store_n(&hydrate.stop, 1, __ATOMIC_RELAXED);
+        pthread_join(hydrate.thread, NULL);
+        hydrate.started = 0;
+    }
+
+    struct hydrate_map *map = __atomic_exchange_n(&hydrate.map, NULL, __ATOMIC_ACQUIRE);
+    if (map) {
+        free(map->regions);
+        free(map->data);
+        free(map);
+    }
+}
+
+/* Copies [where, where + size) from the hydrated metadata.  Returns 0 if the
+ * pass is not done yet or the range was not hydrated. */
+int hydrate_read(off_t where, size_t size, void *p)
+{
+    struct hydrate_map *map = __atomic_load_n(&hydrate.map, __ATOMIC_ACQUIRE);
+    uint32_t lo = 0, hi;
+
+    if (map == NULL) return 0;
+
+    /* Find the last region starting at or before where */
+    hi = map->n_regions;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (map->regions[mid].where <= where) lo = mid + 1;
+        else hi = mid;
+    }
+    if (lo == 0) return 0;
+
+    struct hydrate_region *region = &map->regions[lo - 1];
+    if ((uint64_t)(where - region->where) + size > region->size) return 0;
+
+    memcpy(p, region->data + (where - region->where), size);
+    return 1;
+}
@@ -0,0 +1,15 @@
+#ifndef HYDRATE_H
+#define HYDRATE_H
+
+#include <sys/types.h>
+
+/* With -o hydrate, the metadata of the image (inode tables, directory blocks,
+ * extent tree and indirect mapping blocks) is decoded into memory by a
+ * background pass started at mount.  Once it is done, metadata reads are
+ * served from memory instead of the decompressor. */
+void hydrate_enable(void);
+void hydrate_start(void);
+void hydrate_stop(void);
+int hydrate_read(off_t where, size_t size, void *p);
+
+#endif
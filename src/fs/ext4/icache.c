@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <pthread.h>
+#include <string.h>
+
+#include "icache.h"
+#include "logging.h"
+
+/* Direct mapped on the inode number.  Inodes listed together usually have
+ * neighbouring numbers, so they land on distinct slots.  32768 slots keep
+ * around 5 MiB of inodes, enough to stat a large directory after listing it
+ * without going back to the inode tables. */
+#define ICACHE_ENTRIES          32768
+#define ICACHE_LOCKS            64
+#define ICACHE_SLOT(__n)        ((__n) % ICACHE_ENTRIES)
+#define ICACHE_LOCK(__n)        (&icache_locks[ICACHE_SLOT(__n) % ICACHE_LOCKS])
+
+
+struct icache_entry {
+    uint32_t inode_idx;     /* 0 means the slot is empty */
+    struct ext4_inode inode;
+};
+
+static struct icache_entry icache[ICACHE_ENTRIES];
+static pthread_mutex_t icache_locks[ICACHE_LOCKS] = {
+    [0 ... ICACHE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER
+};
+
+
+int icache_lookup(uint32_t n, struct ext4_inode *inode)
+{
+    struct icache_entry *entry = &icache[ICACHE_SLOT(n)];
+    int found = 0;
+
+    pthread_mutex_lock(ICACHE_LOCK(n));
+    if (entry->inode_idx == n) {
+        memcpy(inode, &entry->inode, sizeof(struct ext4_inode));
+        found = 1;
+    }
+    pthread_mutex_unlock(ICACHE_LOCK(n));
+
+    return found;
+}
+
+void icache_insert(uint32_t n, struct ext4_inode *inode)
+{
+    struct icache_entry *entry = &icache[ICACHE_SLOT(n)];
+
+    ASSERT(n != 0);
+
+    pthread_mutex_lock(ICACHE_LOCK(n));
+    entry->inode_idx = n;
+    memcpy(&entry->inode, inode, sizeof(struct ext4_inode));
+    pthread_mutex_unlock(ICACHE_LOCK(n));
+}
@@ -0,0 +1,11 @@
+#ifndef ICACHE_H
+#define ICACHE_H
+
+#include <stdint.h>
+
+#include "types/ext4_inode.h"
+
+int icache_lookup(uint32_t n, struct ext4_inode *inode);
+void icache_insert(uint32_t n, struct ext4_inode *inode);
+
+#endif
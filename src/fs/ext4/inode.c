@@ -17,8 +17,10 @@
 #include "dcache.h"
 #include "disk.h"
 #include "extents.h"
+#include "icache.h"
 #include "inode.h"
 #include "logging.h"
+#include "snapshot.h"
 #include "super.h"
 
 
@@ -30,43 +32,177 @@
 #define MAX_DIND_BLOCK              (MAX_IND_BLOCK + ADDRESSES_IN_DIND_BLOCK)
 #define MAX_TIND_BLOCK              (MAX_DIND_BLOCK + ADDRESSES_IN_TIND_BLOCK)
 
-#define ROOT_INODE_N                2
+#define INODE_PREFETCH_BYTES        (64 * 1024)
 #define IS_PATH_SEPARATOR(__c)      ((__c) == '/')
 
 
-static uint32_t __inode_get_data_pblock_ind(uint32_t lblock, uint32_t index_block)
+/* Returns the pblock stored at addrs[idx] and counts how many of the
+ * following entries continue the run: consecutive pblocks, or consecutive
+ * holes when the first entry is a hole. */
+static uint32_t __inode_get_run(uint32_t *addrs, uint32_t n_addrs, uint32_t idx, uint32_t *run_len)
 {
-    ASSERT(lblock < ADDRESSES_IN_IND_BLOCK);
-    return disk_read_u32(BLOCKS2BYTES(index_block) + lblock * sizeof(uint32_t));
+    uint32_t pblock = addrs[idx];
+    uint32_t len = 1;
+
+    ASSERT(idx < n_addrs);
+
+    if (pblock) {
+        while (idx + len < n_addrs && addrs[idx + len] == pblock + len) len++;
+    } else {
+        while (idx + len < n_addrs && addrs[idx + len] == 0) len++;
+    }
+
+    *run_len = len;
+    return pblock;
 }
 
-static uint32_t __inode_get_data_pblock_dind(uint32_t lblock, uint32_t dindex_block)
+/* Finds a mapping block among those kept by an open file.  Open files keep
+ * the most recently used mapping blocks, so sequential reads fetch each of
+ * them once instead of once per data block.  Must be called with file->lock
+ * held, and the result is only valid while it is. */
+static uint32_t *__inode_find_ind_block(struct inode_file *file, uint32_t pblock)
 {
-    ASSERT(lblock < ADDRESSES_IN_DIND_BLOCK);
+    for (uint32_t i = 0; i < INODE_BLKMAP_SLOTS; i++) {
+        struct inode_blkmap *map = &file->blkmap[i];
 
-    uint32_t index_block_offset_in_dindex = (lblock / ADDRESSES_IN_IND_BLOCK) * sizeof(uint32_t);
-    lblock %= ADDRESSES_IN_IND_BLOCK;
+        if (map->addrs && map->pblock == pblock) {
+            map->last_used = ++file->clock;
+            return map->addrs;
+        }
+    }
 
-    uint32_t index_block = disk_read_u32(BLOCKS2BYTES(dindex_block) + index_block_offset_in_dindex);
+    return NULL;
+}
+
+/* Keeps a mapping block read without file->lock in place of the least
+ * recently used one.  Another thread may have read the same block meanwhile,
+ * in which case addrs is freed.  Must be called with file->lock held. */
+static void __inode_keep_ind_block(struct inode_file *file, uint32_t pblock, uint32_t *addrs)
+{
+    struct inode_blkmap *victim = &file->blkmap[0];
 
-    return __inode_get_data_pblock_ind(lblock, index_block);
+    for (uint32_t i = 0; i < INODE_BLKMAP_SLOTS; i++) {
+        struct inode_blkmap *map = &file->blkmap[i];
+
+        if (map->addrs && map->pblock == pblock) {
+            free(addrs);
+            return;
+        }
+        if (map->last_used < victim->last_used) {
+            victim = map;
+        }
+    }
+
+    DEBUG("Caching mapping block %d", pblock);
+    free(victim->addrs);
+    victim->addrs = addrs;
+    victim->pblock = pblock;
+    victim->last_used = ++file->clock;
 }
 
-static uint32_t __inode_get_data_pblock_tind(uint32_t lblock, uint32_t tindex_block)
+/* Walks the ext2/3 block map.  Runs of consecutive pblocks are reported
+ * through extent_len, so callers can read them with a single request.  A
+ * missing mapping block is a hole covering everything it would map. */
+static uint64_t __inode_get_data_pblock_ind(struct inode_file *file, struct ext4_inode *inode,
+                                            uint32_t lblock, uint32_t *extent_len)
 {
-    ASSERT(lblock < ADDRESSES_IN_TIND_BLOCK);
+    uint32_t run_len;
+    uint32_t level;
+    uint32_t block;
+    uint64_t span;          /* Blocks mapped by each entry of the current level */
+    uint64_t ret = 0;
+
+    ASSERT(lblock <= BYTES2BLOCKS(inode_get_size(inode)));
+
+    if (lblock < EXT4_NDIR_BLOCKS) {
+        ret = __inode_get_run(inode->i_block, EXT4_NDIR_BLOCKS, lblock, &run_len);
+        if (extent_len) *extent_len = run_len;
+        return ret;
+    }
+
+    if (lblock < MAX_IND_BLOCK) {
+        lblock -= EXT4_NDIR_BLOCKS;
+        block = inode->i_block[EXT4_IND_BLOCK];
+        level = 1;
+    } else if (lblock < MAX_DIND_BLOCK) {
+        lblock -= MAX_IND_BLOCK;
+        block = inode->i_block[EXT4_DIND_BLOCK];
+        level = 2;
+    } else if (lblock < MAX_TIND_BLOCK) {
+        lblock -= MAX_DIND_BLOCK;
+        block = inode->i_block[EXT4_TIND_BLOCK];
+        level = 3;
+    } else {
+        /* File-system corruption? */
+        ASSERT(0);
+        return 0;
+    }
 
-    uint32_t dindex_block_offset_in_tindex = (lblock / ADDRESSES_IN_DIND_BLOCK) * sizeof(uint32_t);
-    lblock %= ADDRESSES_IN_DIND_BLOCK;
+    span = 1;
+    for (uint32_t i = 1; i < level; i++) span *= ADDRESSES_IN_IND_BLOCK;
 
-    uint32_t dindex_block = disk_read_u32(BLOCKS2BYTES(tindex_block) + dindex_block_offset_in_tindex);
+    for (;;) {
+        uint32_t *addrs = NULL;
+        uint32_t *buf = NULL;
 
-    return __inode_get_data_pblock_dind(lblock, dindex_block);
+        if (block == 0) {
+            /* Hole up to the end of what this mapping block would cover */
+            uint64_t hole = span * ADDRESSES_IN_IND_BLOCK - lblock;
+            run_len = hole > UINT32_MAX ? UINT32_MAX : hole;
+            ret = 0;
+            break;
+        }
+
+        if (file) {
+            pthread_mutex_lock(&file->lock);
+            addrs = __inode_find_ind_block(file, block);
+        }
+
+        /* The block is read without the lock, so that other reads of the
+         * file do not wait for it */
+        if (addrs == NULL) {
+            if (file) pthread_mutex_unlock(&file->lock);
+
+            buf = MALLOC_BLOCKS(1);
+            if (buf == NULL) {
+                ERR("Unable to allocate mapping block %d", block);
+                run_len = 1;
+                ret = 0;
+                break;
+            }
+            disk_read_block(block, (uint8_t *)buf);
+            addrs = buf;
+
+            if (file) pthread_mutex_lock(&file->lock);
+        }
+
+        uint32_t pblock = block;
+        uint8_t found = span == 1;
+        if (found) {
+            ret = __inode_get_run(addrs, ADDRESSES_IN_IND_BLOCK, lblock, &run_len);
+        } else {
+            block = addrs[lblock / span];
+            lblock %= span;
+            span /= ADDRESSES_IN_IND_BLOCK;
+        }
+
+        if (file) {
+            if (buf) __inode_keep_ind_block(file, pblock, buf);
+            pthread_mutex_unlock(&file->lock);
+        } else {
+            free(buf);
+        }
+
+        if (found) break;
+    }
+
+    if (extent_len) *extent_len = run_len;
+    return ret;
 }
 
 /* Get pblock for a given inode and lblock.  If extent is not NULL, it will
  * store the length of extent, that is, the number of consecutive pblocks
- * that are also consecutive lblocks (not counting the requested one). */
+ * that are also consecutive lblocks (counting the requested one). */
 uint64_t inode_get_data_pblock(struct ext4_inode *inode, uint32_t lblock, uint32_t *extent_len)
 {
     if (extent_len) *extent_len = 1;
@@ -74,28 +210,55 @@ uint64_t inode_get_data_pblock(struct ext4_inode *inode, uint32_t lblock, uint32
     if (inode->i_flags & EXT4_EXTENTS_FL) {
         return extent_get_pblock(&inode->i_block, lblock, extent_len);
     } else {
-        ASSERT(lblock <= BYTES2BLOCKS(inode_get_size(inode)));
-
-        if (lblock < EXT4_NDIR_BLOCKS) {
-            return inode->i_block[lblock];
-        } else if (lblock < MAX_IND_BLOCK) {
-            uint32_t index_block = inode->i_block[EXT4_IND_BLOCK];
-            return __inode_get_data_pblock_ind(lblock - EXT4_NDIR_BLOCKS, index_block);
-        } else if (lblock < MAX_DIND_BLOCK) {
-            uint32_t dindex_block = inode->i_block[EXT4_DIND_BLOCK];
-            return __inode_get_data_pblock_dind(lblock - MAX_IND_BLOCK, dindex_block);
-        } else if (lblock < MAX_TIND_BLOCK) {
-            uint32_t tindex_block = inode->i_block[EXT4_TIND_BLOCK];
-            return __inode_get_data_pblock_tind(lblock - MAX_DIND_BLOCK, tindex_block);
-        } else {
-            /* File-system corruption? */
-            ASSERT(0);
-        }
+        return __inode_get_data_pblock_ind(NULL, inode, lblock, extent_len);
     }
+}
 
-    /* Should never reach here */
-    ASSERT(0);
-    return 0;
+struct inode_file *inode_file_open(uint32_t n)
+{
+    struct inode_file *file = calloc(1, sizeof(struct inode_file));
+    if (file == NULL) return NULL;
+
+    if (inode_get_by_number(n, &file->inode) < 0) {
+        free(file);
+        return NULL;
+    }
+
+    file->inode_idx = n;
+    pthread_mutex_init(&file->lock, NULL);
+
+    return file;
+}
+
+void inode_file_close(struct inode_file *file)
+{
+    if (file == NULL) return;
+
+    for (uint32_t i = 0; i < INODE_BLKMAP_SLOTS; i++) {
+        free(file->blkmap[i].addrs);
+    }
+    pthread_mutex_destroy(&file->lock);
+    free(file);
+}
+
+/* Same as inode_get_data_pblock, using the mapping blocks cached by the open
+ * file */
+uint64_t inode_file_get_data_pblock(struct inode_file *file, uint32_t lblock, uint32_t *extent_len)
+{
+    struct ext4_inode *inode = &file->inode;
+    uint64_t pblock;
+
+    if (snapshot_get_data_pblock(file->inode_idx, lblock, extent_len, &pblock)) {
+        return pblock;
+    }
+
+    if (extent_len) *extent_len = 1;
+
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        return extent_get_pblock(&inode->i_block, lblock, extent_len);
+    } else {
+        return __inode_get_data_pblock_ind(file, inode, lblock, extent_len);
+    }
 }
 
 static void dir_ctx_update(struct ext4_inode *inode, uint32_t lblock, struct inode_dir_ctx *ctx)
@@ -141,21 +304,111 @@ struct ext4_dir_entry_2 *inode_dentry_get(struct ext4_inode *inode, off_t offset
     }
 }
 
-int inode_get_by_number(uint32_t n, struct ext4_inode *inode)
+/* Byte offset of an on-disk inode.  n is 1-based, like in dentries */
+static off_t inode_disk_offset(uint32_t n)
 {
-    if (n == 0) return -ENOENT;
     n--;    /* Inode 0 doesn't exist on disk */
 
     off_t off = super_group_inode_table_offset(n);
     off += (n % super_inodes_per_group()) * super_inode_size();
+    return off;
+}
+
+int inode_get_by_number(uint32_t n, struct ext4_inode *inode)
+{
+    if (n == 0) return -ENOENT;
+    if (snapshot_get_inode(n, inode)) return 0;
+    if (icache_lookup(n, inode)) return 0;
 
     /* If on-disk inode is ext3 type, it will be smaller than the struct.  EXT4
      * inodes, on the other hand, are double size, but the struct still doesn't
      * have fields for all of them. */
-    disk_read(off, MIN(super_inode_size(), sizeof(struct ext4_inode)), inode);
+    memset(inode, 0, sizeof(struct ext4_inode));
+    disk_read(inode_disk_offset(n), MIN(super_inode_size(), sizeof(struct ext4_inode)), inode);
+    icache_insert(n, inode);
     return 0;
 }
 
+static int inode_number_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Loads a batch of inodes into the inode cache.  Inodes are sorted and those
+ * sitting close together in the same group's inode table are fetched with a
+ * single read, so listing a directory costs a handful of inode table reads
+ * rather than one read per entry. */
+void inode_prefetch(const uint32_t *numbers, uint32_t count)
+{
+    struct ext4_inode inode;
+    uint32_t *sorted;
+    uint8_t *buf;
+
+    /* The snapshot has every inode a directory lists */
+    if (count == 0 || snapshot_loaded()) return;
+
+    sorted = malloc(count * sizeof(uint32_t));
+    buf = malloc(INODE_PREFETCH_BYTES);
+    if (sorted == NULL || buf == NULL) goto out;
+
+    memcpy(sorted, numbers, count * sizeof(uint32_t));
+    qsort(sorted, count, sizeof(uint32_t), inode_number_cmp);
+
+    for (uint32_t i = 0; i < count; ) {
+        uint32_t first = i;
+
+        if (sorted[i] == 0 || icache_lookup(sorted[i], &inode)) {
+            i++;
+            continue;
+        }
+
+        /* Grow the run while it stays inside one group and one read */
+        off_t start = inode_disk_offset(sorted[first]);
+        uint32_t group = (sorted[first] - 1) / super_inodes_per_group();
+        uint32_t last = first;
+        for (i = first + 1; i < count; i++) {
+            if ((sorted[i] - 1) / super_inodes_per_group() != group) break;
+            if (inode_disk_offset(sorted[i]) + super_inode_size() - start > INODE_PREFETCH_BYTES) break;
+            last = i;
+        }
+
+        size_t len = inode_disk_offset(sorted[last]) + super_inode_size() - start;
+        DEBUG("Prefetching inodes %d-%d with one read", sorted[first], sorted[last]);
+        disk_read(start, len, buf);
+
+        for (uint32_t j = first; j <= last; j++) {
+            if (j > first && sorted[j] == sorted[j - 1]) continue;
+
+            memset(&inode, 0, sizeof(struct ext4_inode));
+            memcpy(&inode, buf + (inode_disk_offset(sorted[j]) - start),
+                   MIN(super_inode_size(), sizeof(struct ext4_inode)));
+            icache_insert(sorted[j], &inode);
+        }
+    }
+
+out:
+    free(sorted);
+    free(buf);
+}
+
+void inode_fill_stat(uint32_t n, struct ext4_inode *inode, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+
+    st->st_ino = n;
+    st->st_mode = inode->i_mode & ~0222;
+    st->st_nlink = inode->i_links_count;
+    st->st_size = inode_get_size(inode);
+    st->st_blocks = inode->i_blocks_lo;
+    st->st_uid = inode->i_uid;
+    st->st_gid = inode->i_gid;
+    st->st_atime = inode->i_atime;
+    st->st_mtime = inode->i_mtime;
+    st->st_ctime = inode->i_ctime;
+}
+
 static uint8_t get_path_token_len(const char *path)
 {
     uint8_t len = 0;
@@ -199,6 +452,12 @@ uint32_t inode_get_idx_by_path(const char *path)
     /* Paths from fuse are always absolute */
     assert(IS_PATH_SEPARATOR(path[0]));
 
+    if (snapshot_lookup_path(path, &inode_idx)) {
+        DEBUG("Looked up %s in the snapshot: %d", path, inode_idx);
+        inode_dir_ctx_put(dctx);
+        return inode_idx;
+    }
+
     DEBUG("Looking up: %s", path);
 
     struct dcache_entry *dc_entry = get_cached_inode_num(&path);
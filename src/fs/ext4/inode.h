@@ -1,16 +1,42 @@
 #ifndef INODE_H
 #define INODE_H
 
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include "types/ext4_inode.h"
 #include "types/ext4_dentry.h"
 
+#define ROOT_INODE_N                2
+#define INODE_BLKMAP_SLOTS          4
+
 struct inode_dir_ctx {
     uint32_t lblock;        /* Currently buffered lblock */
     uint8_t buf[];
 };
 
+/* An ext2/3 indirect mapping block kept by an open file */
+struct inode_blkmap {
+    uint64_t pblock;
+    uint64_t last_used;
+    uint32_t *addrs;
+};
+
+/* State of an open file.  Enough slots are kept for the ind, dind and tind
+ * blocks on the path to the data being read. */
+struct inode_file {
+    uint32_t inode_idx;
+    struct ext4_inode inode;
+    pthread_mutex_t lock;   /* Protects blkmap and the hint fields */
+    uint64_t clock;
+    struct inode_blkmap blkmap[INODE_BLKMAP_SLOTS];
+    uint64_t stored_end;    /* End of the data pushed to the page cache */
+    uint64_t next_offset;   /* Where the next sequential read starts */
+    uint64_t hinted_end;    /* End of the data hinted for prefetch */
+    uint32_t hint_window;   /* Data kept hinted ahead of sequential reads */
+};
+
 static inline uint64_t inode_get_size(struct ext4_inode *inode)
 {
     return ((uint64_t)inode->i_size_high << 32) | inode->i_size_lo;
@@ -18,12 +44,18 @@ static inline uint64_t inode_get_size(struct ext4_inode *inode)
 
 uint64_t inode_get_data_pblock(struct ext4_inode *inode, uint32_t lblock, uint32_t *extent_len);
 
+struct inode_file *inode_file_open(uint32_t n);
+void inode_file_close(struct inode_file *file);
+uint64_t inode_file_get_data_pblock(struct inode_file *file, uint32_t lblock, uint32_t *extent_len);
+
 struct inode_dir_ctx *inode_dir_ctx_get(void);
 void inode_dir_ctx_put(struct inode_dir_ctx *);
 void inode_dir_ctx_reset(struct inode_dir_ctx *ctx, struct ext4_inode *inode);
 struct ext4_dir_entry_2 *inode_dentry_get(struct ext4_inode *inode, off_t offset, struct inode_dir_ctx *ctx);
 
 int inode_get_by_number(uint32_t n, struct ext4_inode *inode);
+void inode_prefetch(const uint32_t *numbers, uint32_t count);
+void inode_fill_stat(uint32_t n, struct ext4_inode *inode, struct stat *st);
 int inode_get_by_path(const char *path, struct ext4_inode *inode);
 uint32_t inode_get_idx_by_path(const char *path);
 
@@ -0,0 +1,376 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "dirlist.h"
+#include "disk.h"
+#include "inode.h"
+#include "ll-ops.h"
+#include "logging.h"
+#include "ops.h"
+
+/* The image is read-only, so everything the kernel learns stays valid */
+#define LL_TIMEOUT                  86400.0
+#define LL_PREFETCH_ENTRIES         256
+/* Upper bound on the references a spliced read reply is made of */
+#define LL_READ_REFS                64
+/* Most file data pushed into the page cache after a single read */
+#define LL_STORE_WINDOW             (1024 * 1024)
+
+/* FUSE reserves 1 for the root, ext4 uses 2.  Inode 1 of ext4 holds bad
+ * blocks and never shows up in a directory, so the swap is unambiguous. */
+#define LL_TO_EXT4(__ino)           ((__ino) == FUSE_ROOT_ID ? ROOT_INODE_N : (uint32_t)(__ino))
+#define EXT4_TO_LL(__n)             ((__n) == ROOT_INODE_N ? FUSE_ROOT_ID : (fuse_ino_t)(__n))
+
+
+/* Where -o notify_store pushes data, NULL when disabled */
+#if FUSE_USE_VERSION >= 30
+static struct fuse_session *ll_notify;
+
+void ll_enable_notify_store(struct fuse_session *se)
+{
+    ll_notify = se;
+}
+#else
+static struct fuse_chan *ll_notify;
+
+void ll_enable_notify_store(struct fuse_chan *ch)
+{
+    ll_notify = ch;
+}
+#endif
+
+
+static int ll_fill_entry(uint32_t inode_idx, struct fuse_entry_param *e)
+{
+    struct ext4_inode inode;
+
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    if (inode_get_by_number(inode_idx, &inode) < 0) {
+        return -ENOENT;
+    }
+
+    inode_fill_stat(inode_idx, &inode, &e->attr);
+    e->attr.st_ino = EXT4_TO_LL(inode_idx);
+    e->ino = EXT4_TO_LL(inode_idx);
+    e->generation = inode.i_generation;
+    e->attr_timeout = LL_TIMEOUT;
+    e->entry_timeout = LL_TIMEOUT;
+
+    return 0;
+}
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    UNUSED(userdata);
+#if FUSE_USE_VERSION >= 30
+    op_init(conn, NULL);
+#else
+    op_init(conn);
+#endif
+}
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fuse_entry_param e;
+    size_t name_len = strlen(name);
+
+    DEBUG("lookup(%lu, %s)", parent, name);
+
+    if (name_len > EXT4_NAME_LEN) {
+        fuse_reply_err(req, ENAMETOOLONG);
+        return;
+    }
+
+    struct dirlist *dl = dirlist_get(LL_TO_EXT4(parent));
+    if (dl == NULL) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    int32_t i = dirlist_lookup(dl, name, name_len);
+    if (i < 0) {
+        /* A zero inode makes the kernel cache the miss for entry_timeout */
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.entry_timeout = LL_TIMEOUT;
+        fuse_reply_entry(req, &e);
+    } else if (ll_fill_entry(dl->entries[i].inode, &e) < 0) {
+        fuse_reply_err(req, ENOENT);
+    } else {
+        fuse_reply_entry(req, &e);
+    }
+
+    dirlist_put(dl);
+}
+
+/* Nothing is kept per looked up inode, so there is nothing to forget */
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    UNUSED(ino);
+    UNUSED(nlookup);
+    fuse_reply_none(req);
+}
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct fuse_entry_param e;
+
+    UNUSED(fi);
+    DEBUG("getattr(%lu)", ino);
+
+    if (ll_fill_entry(LL_TO_EXT4(ino), &e) < 0) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    fuse_reply_attr(req, &e.attr, LL_TIMEOUT);
+}
+
+static void ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+    char buf[PATH_MAX + 1];
+
+    DEBUG("readlink(%lu)", ino);
+
+    int ret = op_readlink_inode(LL_TO_EXT4(ino), buf, sizeof(buf));
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    fuse_reply_readlink(req, buf);
+}
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("open(%lu)", ino);
+
+    if ((fi->flags & 3) != O_RDONLY) {
+        fuse_reply_err(req, EACCES);
+        return;
+    }
+
+    struct inode_file *file = inode_file_open(LL_TO_EXT4(ino));
+    if (file == NULL) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    /* File data cannot change either, keep it across opens */
+    fi->keep_cache = 1;
+    fi->fh = (uintptr_t)file;
+    fuse_reply_open(req, fi);
+}
+
+/* Stores the file data following a read into the kernel page cache, as long
+ * as it sits in the reader block that was just decoded for the read.  Later
+ * reads of it are then served by the kernel without a round-trip.  The lock
+ * is not held across the walk or the store, which take it or may block. */
+static void ll_store_ahead(fuse_ino_t ino, struct inode_file *file, off_t off,
+                           const void *token)
+{
+    struct disk_ref refs[LL_READ_REFS];
+
+    pthread_mutex_lock(&file->lock);
+    if ((uint64_t)off < file->stored_end) {
+        off = file->stored_end;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    int n_refs = op_read_file_refs_block(file, LL_STORE_WINDOW, off, refs, LL_READ_REFS, token);
+    if (n_refs <= 0) return;
+
+    struct fuse_bufvec *bufv = op_refs_to_bufvec(refs, n_refs);
+    if (bufv) {
+        size_t size = fuse_buf_size(bufv);
+        int ret = fuse_lowlevel_notify_store(ll_notify, ino, off, bufv, 0);
+
+        DEBUG("notify_store(%lu, %zd, %zu) = %d", ino, off, size, ret);
+        if (ret == 0) {
+            pthread_mutex_lock(&file->lock);
+            if (file->stored_end < off + size) {
+                file->stored_end = off + size;
+            }
+            pthread_mutex_unlock(&file->lock);
+        }
+        free(bufv);
+    }
+
+    while (n_refs) {
+        disk_release_ref(&refs[--n_refs]);
+    }
+}
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info *fi)
+{
+    DEBUG("read(%lu, %zd, %zd)", ino, size, off);
+
+    struct inode_file *file = (struct inode_file *)(uintptr_t)fi->fh;
+    struct disk_ref refs[LL_READ_REFS];
+
+    op_read_hint(file, size, off);
+
+    /* Hand the kernel file descriptors to splice from.  References are held
+     * until the reply has gone out. */
+    int n_refs = op_read_file_refs(file, size, off, refs, LL_READ_REFS);
+    if (n_refs >= 0) {
+        struct fuse_bufvec *bufv = op_refs_to_bufvec(refs, n_refs);
+
+        if (bufv) {
+            off_t end = off + fuse_buf_size(bufv);
+
+            fuse_reply_data(req, bufv, 0);
+            free(bufv);
+
+            if (ll_notify && n_refs && refs[n_refs - 1].token) {
+                ll_store_ahead(ino, file, end, refs[n_refs - 1].token);
+            }
+        }
+        while (n_refs) {
+            disk_release_ref(&refs[--n_refs]);
+        }
+        if (bufv) return;
+    }
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int ret = op_read_file(file, buf, size, off);
+    if (ret < 0) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_buf(req, buf, ret);
+    }
+
+    free(buf);
+}
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("release(%lu)", ino);
+
+    inode_file_close((struct inode_file *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("opendir(%lu)", ino);
+
+    struct dirlist *dl = dirlist_get(LL_TO_EXT4(ino));
+    if (dl == NULL) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    fi->fh = (uintptr_t)dl;
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+/* Shared by readdir and readdirplus; the cookie is the entry index plus one.
+ * Plain readdir only needs the inode number and type, which the directory
+ * entry has, so inodes are only loaded for readdirplus.  An entry whose
+ * inode fails to load is still listed, with the type from the entry. */
+static void ll_readdir_common(fuse_req_t req, size_t size, off_t off,
+                              struct fuse_file_info *fi, int plus)
+{
+    struct dirlist *dl = (struct dirlist *)(uintptr_t)fi->fh;
+    size_t used = 0;
+
+    char *buf = malloc(size);
+    if (buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    for (uint32_t i = off; i < dl->n_entries; i++) {
+        struct fuse_entry_param e;
+        const char *name = dirlist_name(dl, i);
+        size_t entry_size;
+
+        if (plus && (i - off) % LL_PREFETCH_ENTRIES == 0) {
+            uint32_t numbers[LL_PREFETCH_ENTRIES];
+            uint32_t count = 0;
+
+            for (uint32_t j = i; j < dl->n_entries && count < LL_PREFETCH_ENTRIES; j++) {
+                numbers[count++] = dl->entries[j].inode;
+            }
+            inode_prefetch(numbers, count);
+        }
+
+        if (!plus || ll_fill_entry(dl->entries[i].inode, &e) < 0) {
+            memset(&e, 0, sizeof(e));
+            e.attr.st_ino = EXT4_TO_LL(dl->entries[i].inode);
+            e.attr.st_mode = dirlist_mode(dl, i);
+        }
+
+        if (plus) {
+            entry_size = fuse_add_direntry_plus(req, buf + used, size - used, name, &e, i + 1);
+        } else {
+            entry_size = fuse_add_direntry(req, buf + used, size - used, name, &e.attr, i + 1);
+        }
+
+        /* Entry did not fit, the kernel will come back for it */
+        if (entry_size > size - used) break;
+        used += entry_size;
+    }
+
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info *fi)
+{
+    DEBUG("readdir(%lu, %zd)", ino, off);
+    ll_readdir_common(req, size, off, fi, 0);
+}
+
+static void ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                           struct fuse_file_info *fi)
+{
+    DEBUG("readdirplus(%lu, %zd)", ino, off);
+    ll_readdir_common(req, size, off, fi, 1);
+}
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    DEBUG("releasedir(%lu)", ino);
+
+    dirlist_put((struct dirlist *)(uintptr_t)fi->fh);
+    fuse_reply_err(req, 0);
+}
+
+struct fuse_lowlevel_ops e4f_ll_ops = {
+    .init           = ll_init,
+    .lookup         = ll_lookup,
+    .forget         = ll_forget,
+    .getattr        = ll_getattr,
+    .readlink       = ll_readlink,
+    .open           = ll_open,
+    .read           = ll_read,
+    .release        = ll_release,
+    .opendir        = ll_opendir,
+    .readdir        = ll_readdir,
+    .readdirplus    = ll_readdirplus,
+    .releasedir     = ll_releasedir,
+};
@@ -0,0 +1,15 @@
+#ifndef LL_OPS_H
+#define LL_OPS_H
+
+#include <fuse_lowlevel.h>
+
+extern struct fuse_lowlevel_ops e4f_ll_ops;
+
+/* Makes reads push the rest of each decoded block into the kernel page cache */
+#if FUSE_USE_VERSION >= 30
+void ll_enable_notify_store(struct fuse_session *se);
+#else
+void ll_enable_notify_store(struct fuse_chan *ch);
+#endif
+
+#endif
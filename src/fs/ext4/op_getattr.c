@@ -12,18 +12,29 @@
 #include <sys/stat.h>
 #include <string.h>
 
+#include "common.h"
 #include "inode.h"
 #include "logging.h"
+#include "ops.h"
 
+#if FUSE_USE_VERSION >= 30
+int op_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+#else
 int op_getattr(const char *path, struct stat *stbuf)
+#endif
 {
     struct ext4_inode inode;
+    uint32_t inode_idx;
     int ret = 0;
 
     DEBUG("getattr(%s)", path);
+#if FUSE_USE_VERSION >= 30
+    UNUSED(fi);
+#endif
 
     memset(stbuf, 0, sizeof(struct stat));
-    ret = inode_get_by_path(path, &inode);
+    inode_idx = inode_get_idx_by_path(path);
+    ret = inode_get_by_number(inode_idx, &inode);
 
     if (ret < 0) {
         return ret;
@@ -31,15 +42,7 @@ int op_getattr(const char *path, struct stat *stbuf)
 
     DEBUG("getattr done");
 
-    stbuf->st_mode = inode.i_mode & ~0222;
-    stbuf->st_nlink = inode.i_links_count;
-    stbuf->st_size = inode_get_size(&inode);
-    stbuf->st_blocks = inode.i_blocks_lo;
-    stbuf->st_uid = inode.i_uid;
-    stbuf->st_gid = inode.i_gid;
-    stbuf->st_atime = inode.i_atime;
-    stbuf->st_mtime = inode.i_mtime;
-    stbuf->st_ctime = inode.i_ctime;
+    inode_fill_stat(inode_idx, &inode, stbuf);
 
     return 0;
 }
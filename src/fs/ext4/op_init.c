@@ -10,15 +10,44 @@
 
 #include <stdlib.h>
 
+#include "hydrate.h"
 #include "inode.h"
 #include "logging.h"
 #include "ops.h"
+#include "snapshot.h"
 #include "super.h"
 
+/* Largest request asked for.  libfuse clamps it to its buffer size and,
+ * with FUSE 3, turns it into the max_pages the kernel may send at once. */
+#define E4F_MAX_REQUEST_SIZE        (8 * 1024 * 1024)
+
+
+#if FUSE_USE_VERSION >= 30
+void *op_init(struct fuse_conn_info *info, struct fuse_config *cfg)
+#else
 void *op_init(struct fuse_conn_info *info)
+#endif
 {
     INFO("Using FUSE protocol %d.%d", info->proto_major, info->proto_minor);
 
+    /* Nothing is ever written, the write size only sets the request size */
+    info->max_write = E4F_MAX_REQUEST_SIZE;
+    info->want |= info->capable & (FUSE_CAP_SPLICE_READ |
+                                   FUSE_CAP_SPLICE_WRITE |
+                                   FUSE_CAP_SPLICE_MOVE);
+
+#ifdef FUSE_CAP_OVER_IO_URING
+    INFO("FUSE over io_uring %s", fuse_get_feature_flag(info, FUSE_CAP_OVER_IO_URING) ?
+                                  "in use" : "not in use");
+#endif
+
+#if FUSE_USE_VERSION >= 30
+    /* Cached data and attributes stay valid: the image never changes */
+    if (cfg) {
+        cfg->kernel_cache = 1;
+    }
+#endif
+
     if (super_fill() != 0) {
         ERR("ext4fuse cannot continue");
         abort();
@@ -34,5 +63,11 @@ void *op_init(struct fuse_conn_info *info)
         abort();
     }
 
+    if (snapshot_load() != 0) {
+        WARNING("Not using the snapshot");
+    }
+
+    hydrate_start();
+
     return NULL;
 }
@@ -9,6 +9,7 @@
 
 
 #include <errno.h>
+#include <stdint.h>
 
 #include "common.h"
 #include "inode.h"
@@ -21,8 +22,14 @@ int op_open(const char *path, struct fuse_file_info *fi)
     if((fi->flags & 3) != O_RDONLY)
         return -EACCES;
 
-    fi->fh = inode_get_idx_by_path(path);
-    DEBUG("%s is inode %d", path, fi->fh);
+    uint32_t inode_idx = inode_get_idx_by_path(path);
+    DEBUG("%s is inode %d", path, inode_idx);
+
+    struct inode_file *file = inode_file_open(inode_idx);
+    if (file == NULL) {
+        return -ENOENT;
+    }
+    fi->fh = (uintptr_t)file;
 
     return 0;
 }
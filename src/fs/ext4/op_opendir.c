@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <errno.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "dirlist.h"
+#include "inode.h"
+#include "logging.h"
+#include "ops.h"
+
+int op_opendir(const char *path, struct fuse_file_info *fi)
+{
+    DEBUG("opendir(%s)", path);
+
+    uint32_t inode_idx = inode_get_idx_by_path(path);
+    if (inode_idx == 0) {
+        return -ENOENT;
+    }
+
+    struct dirlist *dl = dirlist_get(inode_idx);
+    if (dl == NULL) {
+        return -ENOTDIR;
+    }
+
+    fi->fh = (uintptr_t)dl;
+    return 0;
+}
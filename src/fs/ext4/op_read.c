@@ -8,6 +8,8 @@
  */
 
 
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <errno.h>
@@ -20,6 +22,20 @@
 #include "ops.h"
 
 
+/* Upper bound on the pieces handed to a single vectored disk read */
+#define READ_SEGMENTS       64
+/* Upper bound on the references a read_buf reply is made of */
+#define READ_BUF_REFS       64
+/* Data hinted ahead of a sequential reader, doubled up to the largest window
+ * as long as the reader keeps going */
+#define HINT_MIN_WINDOW     131072
+#define HINT_MAX_WINDOW     4194304
+/* Extents closer than this on disk are hinted as one range */
+#define HINT_MERGE_GAP      262144
+/* Upper bound on the ranges hinted by a single read */
+#define HINT_RANGES         8
+
+
 /* We truncate the read size if it exceeds the limits of the file. */
 static size_t truncate_size(struct ext4_inode *inode, size_t size, size_t offset)
 {
@@ -39,8 +55,10 @@ static size_t truncate_size(struct ext4_inode *inode, size_t size, size_t offset
     return size;
 }
 
-/* This function reads all necessary data until the offset is aligned */
-static size_t first_read(struct ext4_inode *inode, char *buf, size_t size, off_t offset)
+/* This function reads all necessary data until the offset is aligned.  The
+ * read itself is queued on segs, to be issued along with the rest. */
+static size_t first_read(struct inode_file *file, char *buf, size_t size, off_t offset,
+                         struct disk_segment *segs, size_t *n_segs)
 {
     /* Reason for the -1 is that offset = 0 and size = BLOCK_SIZE is all on the
      * same block.  Meaning that byte at offset + size is not actually read. */
@@ -52,68 +70,342 @@ static size_t first_read(struct ext4_inode *inode, char *buf, size_t size, off_t
     if (size == 0) return 0;
     if (start_block_off == 0) return 0;
 
-    uint64_t start_pblock = inode_get_data_pblock(inode, start_lblock, NULL);
+    uint64_t start_pblock = inode_file_get_data_pblock(file, start_lblock, NULL);
+    size_t bytes = size;
 
     /* Check if all the read request lays on the same block */
-    if (start_lblock == end_lblock) {
-        disk_read(BLOCKS2BYTES(start_pblock) + start_block_off, size, buf);
-        return size;
+    if (start_lblock != end_lblock) {
+        bytes = ALIGN_TO_BLOCKSIZE(offset) - offset;
+        ASSERT((offset + bytes) % BLOCK_SIZE == 0);
+    }
+
+    if (start_pblock) {
+        segs[*n_segs].where = BLOCKS2BYTES(start_pblock) + start_block_off;
+        segs[*n_segs].size = bytes;
+        segs[*n_segs].p = buf;
+        (*n_segs)++;
     } else {
-        size_t size_to_block_end = ALIGN_TO_BLOCKSIZE(offset) - offset;
-        ASSERT((offset + size_to_block_end) % BLOCK_SIZE == 0);
+        memset(buf, 0, bytes);
+    }
+    return bytes;
+}
+
+/* Hints the disk ranges behind [start, end) of the file, so the reader can
+ * start on them before they are asked for.  Holes are skipped, and extents
+ * that sit close together on disk are hinted as one range. */
+static void hint_extents(struct inode_file *file, uint64_t start, uint64_t end)
+{
+    uint64_t lblock = start / BLOCK_SIZE;
+    uint64_t end_lblock = (end + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint64_t range_start = 0, range_end = 0;
+    int n_ranges = 0;
+    uint32_t extent_len;
+
+    for (; lblock < end_lblock; lblock += extent_len) {
+        uint64_t pblock = inode_file_get_data_pblock(file, lblock, &extent_len);
+
+        if (extent_len == 0) extent_len = 1;
+        if (extent_len > end_lblock - lblock) extent_len = end_lblock - lblock;
+        if (pblock == 0) continue;
+
+        uint64_t where = BLOCKS2BYTES(pblock);
+        uint64_t size = BLOCKS2BYTES((uint64_t)extent_len);
+
+        if (range_end && where >= range_end && where - range_end <= HINT_MERGE_GAP) {
+            range_end = where + size;
+            continue;
+        }
+        if (range_end) {
+            disk_prefetch(range_start, range_end - range_start);
+            if (++n_ranges == HINT_RANGES) return;
+        }
+        range_start = where;
+        range_end = where + size;
+    }
 
-        disk_read(BLOCKS2BYTES(start_pblock) + start_block_off, size_to_block_end, buf);
-        return size_to_block_end;
+    if (range_end) {
+        disk_prefetch(range_start, range_end - range_start);
     }
 }
 
-int op_read(const char *path, char *buf, size_t size, off_t offset,
-            struct fuse_file_info *fi)
+/* Follows the read pattern of an open file.  While the file is read
+ * sequentially, the extents coming up next are hinted to the reader, with a
+ * window that grows as the reader keeps going.  Unlike readahead on the image
+ * as a whole, this follows the file across fragmented extents. */
+void op_read_hint(struct inode_file *file, size_t size, off_t offset)
+{
+    uint64_t inode_size = inode_get_size(&file->inode);
+    uint64_t end = (uint64_t)offset + size;
+    uint64_t hint_start, hint_end;
+
+    if (size == 0 || (uint64_t)offset >= inode_size) return;
+    if (end > inode_size) end = inode_size;
+
+    pthread_mutex_lock(&file->lock);
+    if ((uint64_t)offset != file->next_offset) {
+        /* Random access: start over once the reader settles again */
+        file->next_offset = end;
+        file->hinted_end = end;
+        file->hint_window = 0;
+        pthread_mutex_unlock(&file->lock);
+        return;
+    }
+
+    file->next_offset = end;
+    if (file->hint_window == 0) {
+        file->hint_window = HINT_MIN_WINDOW;
+    }
+    if (file->hinted_end < end) {
+        file->hinted_end = end;
+    }
+
+    /* Only hint again once the reader has eaten into the window */
+    if (file->hinted_end - end >= file->hint_window / 2 ||
+        file->hinted_end >= inode_size) {
+        pthread_mutex_unlock(&file->lock);
+        return;
+    }
+
+    hint_start = file->hinted_end;
+    hint_end = end + file->hint_window;
+    if (hint_end > inode_size) hint_end = inode_size;
+    file->hinted_end = hint_end;
+    if (file->hint_window < HINT_MAX_WINDOW) {
+        file->hint_window *= 2;
+    }
+    pthread_mutex_unlock(&file->lock);
+
+    DEBUG("Hinting 0x%"PRIx64"-0x%"PRIx64" of inode %d", hint_start, hint_end, file->inode_idx);
+    hint_extents(file, hint_start, hint_end);
+}
+
+int op_read_file(struct inode_file *file, char *buf, size_t size, off_t offset)
 {
     size_t un_offset = (size_t)offset;
-    struct ext4_inode inode;
     size_t ret = 0;
     uint32_t extent_len;
+    struct disk_segment segs[READ_SEGMENTS];
+    size_t n_segs = 0;
 
     /* Not sure if this is possible at all... */
     ASSERT(offset >= 0);
 
-    DEBUG("read(%s, buf, %zd, %zd, fi->fh=%d)", path, size, un_offset, fi->fh);
-    int inode_get_ret = inode_get_by_number(fi->fh, &inode);
-
-    if (inode_get_ret < 0) {
-        return inode_get_ret;
-    }
-
-    size = truncate_size(&inode, size, un_offset);
-    ret = first_read(&inode, buf, size, un_offset);
+    size = truncate_size(&file->inode, size, un_offset);
+    ret = first_read(file, buf, size, un_offset, segs, &n_segs);
 
     buf += ret;
     un_offset += ret;
 
     for (unsigned int lblock = un_offset / BLOCK_SIZE; size > ret; lblock += extent_len) {
-        uint64_t pblock = inode_get_data_pblock(&inode, lblock, &extent_len);
-        size_t bytes;
+        uint64_t pblock = inode_file_get_data_pblock(file, lblock, &extent_len);
+        size_t bytes = size - ret;
 
-        if (pblock) {
-            struct disk_ctx read_ctx;
+        /* The whole run is consumed at once, as lblock moves past it */
+        if (bytes > BLOCKS2BYTES((uint64_t)extent_len)) {
+            bytes = BLOCKS2BYTES((uint64_t)extent_len);
+        }
 
-            disk_ctx_create(&read_ctx, BLOCKS2BYTES(pblock), BLOCK_SIZE, extent_len);
-            bytes = disk_ctx_read(&read_ctx, size - ret, buf);
-        } else {
-            bytes = size - ret;
-            if (bytes > BLOCK_SIZE) {
-                bytes = BLOCK_SIZE;
+        if (pblock) {
+            segs[n_segs].where = BLOCKS2BYTES(pblock);
+            segs[n_segs].size = bytes;
+            segs[n_segs].p = buf;
+            if (++n_segs == READ_SEGMENTS) {
+                disk_readv(segs, n_segs);
+                n_segs = 0;
             }
+        } else {
+            /* Holes and unwritten extents come whole, and read as zeros */
             memset(buf,0,bytes);
             DEBUG("sparse file, skipping %d bytes",bytes);
         }
         ret += bytes;
         buf += bytes;
-        DEBUG("Read %zd/%zd bytes from %d consecutive blocks", ret, size, extent_len);
+        DEBUG("Queued %zd/%zd bytes from %d consecutive blocks", ret, size, extent_len);
+    }
+
+    if (n_segs) {
+        disk_readv(segs, n_segs);
     }
 
     /* We always read as many bytes as requested (after initial truncation) */
     ASSERT(size == ret);
     return ret;
 }
+
+/* Collects references for up to size bytes at offset.  With a token, only
+ * data held by that same reader block is wanted, and the walk stops early,
+ * without failing, at the first hole or data held elsewhere. */
+static int __op_read_file_refs(struct inode_file *file, size_t size, off_t offset,
+                               struct disk_ref *refs, size_t max_refs, const void *token)
+{
+    size_t un_offset = (size_t)offset;
+    size_t n_refs = 0;
+    size_t done = 0;
+
+    ASSERT(offset >= 0);
+
+    size = truncate_size(&file->inode, size, un_offset);
+
+    while (done < size) {
+        uint64_t pos = un_offset + done;
+        uint32_t extent_len;
+        uint64_t pblock = inode_file_get_data_pblock(file, pos / BLOCK_SIZE, &extent_len);
+        size_t block_off = pos % BLOCK_SIZE;
+        size_t bytes = size - done;
+
+        if (bytes > BLOCKS2BYTES((uint64_t)extent_len) - block_off) {
+            bytes = BLOCKS2BYTES((uint64_t)extent_len) - block_off;
+        }
+
+        /* Holes and unwritten extents have nothing to reference */
+        if (pblock == 0) goto stop;
+
+        off_t where = BLOCKS2BYTES(pblock) + block_off;
+        while (bytes) {
+            struct disk_ref ref;
+            int ret = disk_read_ref(where, bytes, &ref);
+
+            if (ret <= 0) goto stop;
+            if (token && ref.token != token) {
+                disk_release_ref(&ref);
+                goto stop;
+            }
+
+            struct disk_ref *last = n_refs ? &refs[n_refs - 1] : NULL;
+            if (last && !last->token && !ref.token && last->fd == ref.fd &&
+                last->pos + (off_t)last->size == ref.pos) {
+                last->size += ref.size;
+            } else if (n_refs < max_refs) {
+                refs[n_refs++] = ref;
+            } else {
+                disk_release_ref(&ref);
+                goto stop;
+            }
+
+            where += ret;
+            bytes -= ret;
+            done += ret;
+        }
+    }
+
+    return n_refs;
+
+stop:
+    if (token) return n_refs;
+
+    while (n_refs) {
+        disk_release_ref(&refs[--n_refs]);
+    }
+    return -1;
+}
+
+/* References the data of a read instead of copying it, so that it can be
+ * spliced straight from the reader's buffers or the image.  Returns the
+ * number of references, or -1 if the range has holes or the reader cannot
+ * hand out references.  Every reference must go to disk_release_ref. */
+int op_read_file_refs(struct inode_file *file, size_t size, off_t offset,
+                      struct disk_ref *refs, size_t max_refs)
+{
+    return __op_read_file_refs(file, size, offset, refs, max_refs, NULL);
+}
+
+/* Same as op_read_file_refs, but only for the file data that follows in the
+ * reader block behind token.  That data is already decoded, so handing it
+ * out costs no decompression.  Returns the number of references, possibly 0,
+ * covering a prefix of the range. */
+int op_read_file_refs_block(struct inode_file *file, size_t size, off_t offset,
+                            struct disk_ref *refs, size_t max_refs, const void *token)
+{
+    ASSERT(token != NULL);
+    return __op_read_file_refs(file, size, offset, refs, max_refs, token);
+}
+
+/* Wraps references from op_read_file_refs into a buffer vector, to be freed
+ * with free() */
+struct fuse_bufvec *op_refs_to_bufvec(struct disk_ref *refs, size_t n_refs)
+{
+    size_t count = n_refs ? n_refs : 1;
+    struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec) +
+                                      (count - 1) * sizeof(struct fuse_buf));
+    if (bufv == NULL) return NULL;
+
+    *bufv = FUSE_BUFVEC_INIT(0);
+    bufv->count = count;
+
+    for (size_t i = 0; i < n_refs; i++) {
+        bufv->buf[i].size = refs[i].size;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].mem = NULL;
+        bufv->buf[i].fd = refs[i].fd;
+        bufv->buf[i].pos = refs[i].pos;
+    }
+
+    return bufv;
+}
+
+int op_read(const char *path, char *buf, size_t size, off_t offset,
+            struct fuse_file_info *fi)
+{
+    struct inode_file *file = (struct inode_file *)(uintptr_t)fi->fh;
+
+    DEBUG("read(%s, buf, %zd, %zd, fi->fh=%d)", path, size, offset, fi->fh);
+    op_read_hint(file, size, offset);
+    return op_read_file(file, buf, size, offset);
+}
+
+/* Replies with file descriptors where possible, so that libfuse can splice
+ * the data instead of copying it twice.  The high-level API does not say when
+ * the reply has been sent, so references that must be released are given
+ * back right away and the data copied instead. */
+int op_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                struct fuse_file_info *fi)
+{
+    struct inode_file *file = (struct inode_file *)(uintptr_t)fi->fh;
+    struct disk_ref refs[READ_BUF_REFS];
+    struct fuse_bufvec *bufv;
+
+    DEBUG("read_buf(%s, %zd, %zd)", path, size, offset);
+    op_read_hint(file, size, offset);
+
+    int n_refs = op_read_file_refs(file, size, offset, refs, READ_BUF_REFS);
+    int must_release = 0;
+
+    for (int i = 0; i < n_refs; i++) {
+        must_release |= refs[i].token != NULL;
+    }
+    if (must_release) {
+        while (n_refs) {
+            disk_release_ref(&refs[--n_refs]);
+        }
+        n_refs = -1;
+    }
+
+    if (n_refs >= 0) {
+        bufv = op_refs_to_bufvec(refs, n_refs);
+        if (bufv == NULL) return -ENOMEM;
+
+        *bufp = bufv;
+        return 0;
+    }
+
+    bufv = malloc(sizeof(struct fuse_bufvec));
+    char *buf = malloc(size);
+    if (bufv == NULL || buf == NULL) {
+        free(bufv);
+        free(buf);
+        return -ENOMEM;
+    }
+
+    int ret = op_read_file(file, buf, size, offset);
+    if (ret < 0) {
+        free(bufv);
+        free(buf);
+        return ret;
+    }
+
+    *bufv = FUSE_BUFVEC_INIT(ret);
+    bufv->buf[0].mem = buf;
+    *bufp = bufv;
+
+    return 0;
+}
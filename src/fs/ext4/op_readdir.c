@@ -8,57 +8,91 @@
  */
 
 
+#include <stdint.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <fuse.h>
 
 #include "common.h"
+#include "dirlist.h"
 #include "inode.h"
 #include "logging.h"
+#include "ops.h"
 
+/* Entries whose inodes are batch loaded ahead of the filler */
+#define READDIR_PREFETCH_ENTRIES    256
 
-static char *get_printable_name(char *s, struct ext4_dir_entry_2 *entry)
+
+#if FUSE_USE_VERSION >= 30
+/* Batch loads the inodes of the next entries, grouped by inode table block,
+ * so that filling in their attributes does not read one inode at a time */
+static void readdir_prefetch(struct dirlist *dl, uint32_t first)
 {
-    memcpy(s, entry->name, entry->name_len);
-    s[entry->name_len] = 0;
-    return s;
+    uint32_t numbers[READDIR_PREFETCH_ENTRIES];
+    uint32_t count = 0;
+
+    for (uint32_t i = first; i < dl->n_entries && count < READDIR_PREFETCH_ENTRIES; i++) {
+        numbers[count++] = dl->entries[i].inode;
+    }
+
+    inode_prefetch(numbers, count);
 }
+#endif
 
+/* The directory was decoded by opendir, so readdir only walks the entry
+ * array.  Cookies are entry indexes plus one, which keeps them stable across
+ * calls no matter how the kernel splits the listing.  Plain readdir only
+ * needs the inode number and type, which the entry has, so inodes are only
+ * loaded when FUSE 3 asks for readdirplus.  FUSE 2 keeps nothing else from
+ * the filler.  An entry whose inode fails to load is still listed. */
+#if FUSE_USE_VERSION >= 30
+int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                       off_t offset, struct fuse_file_info *fi,
+                       enum fuse_readdir_flags flags)
+#else
 int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                        off_t offset, struct fuse_file_info *fi)
+#endif
 {
-    DEBUG("readdir");
+    DEBUG("readdir(%s, %jd)", path, offset);
 
-    UNUSED(fi);
-    char name_buf[EXT4_NAME_LEN];
-    struct ext4_dir_entry_2 *dentry = NULL;
-    struct ext4_inode inode;
+    struct dirlist *dl = (struct dirlist *)(uintptr_t)fi->fh;
+    ASSERT(dl != NULL);
 
-    /* We can use inode_get_by_number, but first we need to implement opendir */
-    int ret = inode_get_by_path(path, &inode);
+    for (uint32_t i = offset; i < dl->n_entries; i++) {
+        struct stat st;
 
-    if (ret < 0) {
-        return ret;
-    }
+#if FUSE_USE_VERSION >= 30
+        enum fuse_fill_dir_flags fill = 0;
+
+        if (flags & FUSE_READDIR_PLUS) {
+            struct ext4_inode inode;
 
-    struct inode_dir_ctx *dctx = inode_dir_ctx_get();
-    inode_dir_ctx_reset(dctx, &inode);
-    while ((dentry = inode_dentry_get(&inode, offset, dctx))) {
-        offset += dentry->rec_len;
+            if ((i - offset) % READDIR_PREFETCH_ENTRIES == 0) {
+                readdir_prefetch(dl, i);
+            }
 
-        if (!dentry->inode) {
-            /* It seems that is possible to have a dummy entry like this at the
-             * begining of a block of dentries.  Looks like skipping is the
-             * reasonable thing to do. */
-            continue;
+            if (inode_get_by_number(dl->entries[i].inode, &inode) == 0) {
+                inode_fill_stat(dl->entries[i].inode, &inode, &st);
+                fill = FUSE_FILL_DIR_PLUS;
+            }
         }
 
-        /* Providing offset to the filler function seems slower... */
-        get_printable_name(name_buf, dentry);
-        if (name_buf[0]) {
-            if (filler(buf, name_buf, NULL, offset) != 0) break;
+        if (!(fill & FUSE_FILL_DIR_PLUS)) {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = dl->entries[i].inode;
+            st.st_mode = dirlist_mode(dl, i);
         }
+
+        if (filler(buf, dirlist_name(dl, i), &st, i + 1, fill) != 0) break;
+#else
+        memset(&st, 0, sizeof(st));
+        st.st_ino = dl->entries[i].inode;
+        st.st_mode = dirlist_mode(dl, i);
+
+        if (filler(buf, dirlist_name(dl, i), &st, i + 1) != 0) break;
+#endif
     }
-    inode_dir_ctx_put(dctx);
 
     return 0;
 }
@@ -18,6 +18,7 @@
 #include "inode.h"
 #include "logging.h"
 #include "ops.h"
+#include "snapshot.h"
 #include "super.h"
 
 
@@ -41,17 +42,34 @@ static int get_link_dest(struct ext4_inode *inode, char *buf, size_t bufsize)
 }
 
 /* Check return values, bufer sizes and so on; strings are nasty... */
-int op_readlink(const char *path, char *buf, size_t bufsize)
+int op_readlink_inode(uint32_t inode_idx, char *buf, size_t bufsize)
 {
     struct ext4_inode inode;
-    DEBUG("readlink");
 
-    inode_get_by_path(path, &inode);
+    int ret = inode_get_by_number(inode_idx, &inode);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (!S_ISLNK(inode.i_mode)) {
         return -EINVAL;
     }
 
+    if (snapshot_get_link(inode_idx, buf, bufsize)) {
+        return 0;
+    }
+
     get_link_dest(&inode, buf, bufsize);
-    DEBUG("Link resolved: %s => %s", path, buf);
     return 0;
 }
+
+int op_readlink(const char *path, char *buf, size_t bufsize)
+{
+    DEBUG("readlink");
+
+    int ret = op_readlink_inode(inode_get_idx_by_path(path), buf, bufsize);
+    if (ret == 0) {
+        DEBUG("Link resolved: %s => %s", path, buf);
+    }
+    return ret;
+}
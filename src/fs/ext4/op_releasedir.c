@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <stdint.h>
+
+#include "common.h"
+#include "dirlist.h"
+#include "logging.h"
+#include "ops.h"
+
+int op_releasedir(const char *path, struct fuse_file_info *fi)
+{
+    DEBUG("releasedir(%s)", path);
+
+    dirlist_put((struct dirlist *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+
+    return 0;
+}
@@ -1,15 +1,48 @@
 #ifndef OPS_H
 #define OPS_H
 
+#include <stdint.h>
 #include <fuse.h>
 
+#if FUSE_USE_VERSION >= 30
+void *op_init(struct fuse_conn_info *info, struct fuse_config *cfg);
+#else
 void *op_init(struct fuse_conn_info *info);
+#endif
 int op_readlink(const char *path, char *buf, size_t bufsize);
 int op_read(const char *path, char *buf, size_t size, off_t offset
                              , struct fuse_file_info *fi);
+int op_opendir(const char *path, struct fuse_file_info *fi);
+#if FUSE_USE_VERSION >= 30
+int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler
+                               , off_t offset, struct fuse_file_info *fi
+                               , enum fuse_readdir_flags flags);
+#else
 int op_readdir(const char *path, void *buf, fuse_fill_dir_t filler
                                , off_t offset, struct fuse_file_info *fi);
+#endif
+int op_releasedir(const char *path, struct fuse_file_info *fi);
+#if FUSE_USE_VERSION >= 30
+int op_getattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi);
+#else
 int op_getattr(const char *path, struct stat *stbuf);
+#endif
 int op_open(const char *path, struct fuse_file_info *fi);
+int op_release(const char *path, struct fuse_file_info *fi);
+int op_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                struct fuse_file_info *fi);
+
+struct inode_file;
+struct disk_ref;
+
+/* Inode based cores of the path based operations above */
+int op_read_file(struct inode_file *file, char *buf, size_t size, off_t offset);
+int op_read_file_refs(struct inode_file *file, size_t size, off_t offset,
+                      struct disk_ref *refs, size_t max_refs);
+int op_read_file_refs_block(struct inode_file *file, size_t size, off_t offset,
+                            struct disk_ref *refs, size_t max_refs, const void *token);
+void op_read_hint(struct inode_file *file, size_t size, off_t offset);
+struct fuse_bufvec *op_refs_to_bufvec(struct disk_ref *refs, size_t n_refs);
+int op_readlink_inode(uint32_t inode_idx, char *buf, size_t bufsize);
 
 #endif
@@ -0,0 +1,442 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <zstd.h>
+
+#include "../../compression/compression_reader.h"
+
+#include "disk.h"
+#include "logging.h"
+#include "pack.h"
+#include "super.h"
+
+#include "types/ext4_super.h"
+
+#define PACK_INITIAL_FRAMES         1024
+#define PACK_LATENCY_SEED           0x5EED
+
+/* How a block is packed */
+#define PACK_BLOCK_UNUSED           0
+#define PACK_BLOCK_METADATA         1
+#define PACK_BLOCK_DATA             2
+
+/* Seekable zstd format, see zstd's contrib/seekable_format */
+#define PACK_SKIPPABLE_MAGIC        0x184D2A5E
+#define PACK_SEEKABLE_MAGIC         0x8F92EAB1
+#define PACK_SEEK_ENTRY_SIZE        8
+#define PACK_SEEK_FOOTER_SIZE       9
+#define PACK_MAX_FRAMES             0x8000000
+
+
+/* Run of blocks holding bitmaps, inode tables or group descriptors */
+struct pack_extent {
+    uint64_t start;
+    uint64_t len;
+};
+
+/* Seek table entry */
+struct pack_frame {
+    uint32_t compressed_size;
+    uint32_t size;
+};
+
+struct pack_builder {
+    struct pack_extent *metadata;   /* Sorted by start */
+    uint32_t n_metadata;
+    uint8_t *kinds;                 /* How each block of a group is packed */
+    uint8_t *bitmap;
+    struct pack_frame *frames;
+    uint32_t n_frames, max_frames;
+    uint8_t *in;
+    uint8_t *out;
+    size_t out_size;
+    uint8_t *zeros;
+    ZSTD_CCtx *cctx;
+    FILE *file;
+};
+
+
+
+static int pack_extent_cmp(const void *a, const void *b)
+{
+    const struct pack_extent *x = a, *y = b;
+    return (x->start > y->start) - (x->start < y->start);
+}
+
+static void pack_add_extent(struct pack_builder *b, uint64_t start, uint64_t len)
+{
+    if (start == 0 || len == 0) return;
+
+    b->metadata[b->n_metadata].start = start;
+    b->metadata[b->n_metadata].len = len;
+    b->n_metadata++;
+}
+
+/* Finds the metadata of every group, which may live in other groups with
+ * flex_bg */
+static int pack_find_metadata(struct pack_builder *b)
+{
+    uint32_t n_groups = super_n_block_groups();
+    uint64_t table_blocks = BYTES2BLOCKS((uint64_t)super_inodes_per_group() * super_inode_size());
+
+    b->metadata = malloc(sizeof(struct pack_extent) * (3 * (size_t)n_groups + 1));
+    if (b->metadata == NULL) return -1;
+
+    /* Boot block, superblock and group descriptors */
+    b->metadata[0].start = 0;
+    b->metadata[0].len = super_first_data_block() + 1 + super_group_desc_blocks();
+    b->n_metadata = 1;
+
+    for (uint32_t i = 0; i < n_groups; i++) {
+        pack_add_extent(b, super_group_block_bitmap(i), 1);
+        pack_add_extent(b, super_group_inode_bitmap(i), 1);
+        pack_add_extent(b, super_group_inode_table(i), table_blocks);
+    }
+
+    qsort(b->metadata, b->n_metadata, sizeof(struct pack_extent), pack_extent_cmp);
+    return 0;
+}
+
+/* Blocks [start, end) of a group.  Blocks before the first data block,
+ * the boot block of 1 KiB block filesystems, go with the first group. */
+static void pack_group_range(uint32_t group, uint64_t *start, uint64_t *end)
+{
+    uint64_t first = super_first_data_block() + (uint64_t)group * super_blocks_per_group();
+
+    *start = group ? first : 0;
+    *end = MIN(first + super_blocks_per_group(), super_blocks_count());
+}
+
+/* Works out how each block of a group is packed.  Groups whose bitmap was
+ * never initialized, and filesystems whose bitmaps count clusters rather
+ * than blocks, are kept whole. */
+static int pack_group_kinds(struct pack_builder *b, uint32_t group, uint64_t start, uint64_t end)
+{
+    uint64_t first = super_first_data_block() + (uint64_t)group * super_blocks_per_group();
+    uint64_t bitmap = super_group_block_bitmap(group);
+
+    memset(b->kinds, PACK_BLOCK_DATA, end - start);
+
+    if (bitmap && !(super_feature_ro_compat() & EXT4_FEATURE_RO_COMPAT_BIGALLOC)) {
+        if (disk_read_block(bitmap, b->bitmap) != (int)BLOCK_SIZE) return -1;
+
+        for (uint64_t block = first; block < end; block++) {
+            uint64_t bit = block - first;
+            if (!(b->bitmap[bit / 8] & (1 << (bit % 8)))) {
+                b->kinds[block - start] = PACK_BLOCK_UNUSED;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < b->n_metadata && b->metadata[i].start < end; i++) {
+        uint64_t from = b->metadata[i].start > start ? b->metadata[i].start : start;
+        uint64_t to = MIN(b->metadata[i].start + b->metadata[i].len, end);
+
+        if (from < to) memset(&b->kinds[from - start], PACK_BLOCK_METADATA, to - from);
+    }
+
+    return 0;
+}
+
+static void pack_put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+/* Compresses one frame and appends it to the pack */
+static int pack_write_frame(struct pack_builder *b, const uint8_t *data, size_t size, int level)
+{
+    if (b->n_frames == b->max_frames) {
+        uint32_t new_max = b->max_frames ? 2 * b->max_frames : PACK_INITIAL_FRAMES;
+        if (new_max > PACK_MAX_FRAMES) return -1;
+
+        struct pack_frame *p = realloc(b->frames, sizeof(struct pack_frame) * new_max);
+        if (p == NULL) return -1;
+
+        b->frames = p;
+        b->max_frames = new_max;
+    }
+
+    size_t ret = ZSTD_compressCCtx(b->cctx, b->out, b->out_size, data, size, level);
+    if (ZSTD_isError(ret)) {
+        ERR("Unable to compress frame: %s", ZSTD_getErrorName(ret));
+        return -1;
+    }
+    if (fwrite(b->out, 1, ret, b->file) != ret) return -1;
+
+    b->frames[b->n_frames].compressed_size = ret;
+    b->frames[b->n_frames].size = size;
+    b->n_frames++;
+    return 0;
+}
+
+/* Packs a group as runs of blocks of the same kind, each run in frames of
+ * at most the size for that kind */
+static int pack_group(struct pack_builder *b, uint32_t group, int level, struct pack_stats *stats)
+{
+    uint64_t start, end;
+
+    pack_group_range(group, &start, &end);
+    if (pack_group_kinds(b, group, start, end) < 0) return -1;
+
+    for (uint64_t i = 0; i < end - start; ) {
+        uint8_t kind = b->kinds[i];
+        uint64_t limit = (kind == PACK_BLOCK_METADATA ? PACK_METADATA_FRAME_SIZE : PACK_DATA_FRAME_SIZE) / BLOCK_SIZE;
+        uint64_t j = i + 1;
+
+        if (limit == 0) limit = 1;
+        while (j < end - start && b->kinds[j] == kind && j - i < limit) j++;
+
+        const uint8_t *data = b->zeros;
+        size_t size = BLOCKS2BYTES(j - i);
+
+        if (kind != PACK_BLOCK_UNUSED) {
+            if (disk_read(BLOCKS2BYTES(start + i), size, b->in) != (int)size) return -1;
+            data = b->in;
+        }
+        if (pack_write_frame(b, data, size, level) < 0) return -1;
+
+        if (kind == PACK_BLOCK_UNUSED) {
+            stats->unused_frames++;
+            stats->unused_blocks += j - i;
+        } else if (kind == PACK_BLOCK_METADATA) {
+            stats->metadata_frames++;
+        } else {
+            stats->data_frames++;
+        }
+
+        i = j;
+    }
+
+    return 0;
+}
+
+/* The seek table goes in a skippable frame after all the others */
+static int pack_write_seek_table(struct pack_builder *b)
+{
+    size_t size = 8 + (size_t)b->n_frames * PACK_SEEK_ENTRY_SIZE + PACK_SEEK_FOOTER_SIZE;
+    uint8_t *table = malloc(size);
+    uint8_t *p = table;
+    int ret = 0;
+
+    if (table == NULL) return -1;
+
+    pack_put_le32(p, PACK_SKIPPABLE_MAGIC);
+    pack_put_le32(p + 4, size - 8);
+    p += 8;
+
+    for (uint32_t i = 0; i < b->n_frames; i++) {
+        pack_put_le32(p, b->frames[i].compressed_size);
+        pack_put_le32(p + 4, b->frames[i].size);
+        p += PACK_SEEK_ENTRY_SIZE;
+    }
+
+    /* No checksums */
+    pack_put_le32(p, b->n_frames);
+    p[4] = 0;
+    pack_put_le32(p + 5, PACK_SEEKABLE_MAGIC);
+
+    if (fwrite(table, 1, size, b->file) != size) ret = -1;
+    free(table);
+    return ret;
+}
+
+static void pack_builder_free(struct pack_builder *b)
+{
+    free(b->metadata);
+    free(b->kinds);
+    free(b->bitmap);
+    free(b->frames);
+    free(b->in);
+    free(b->out);
+    free(b->zeros);
+    ZSTD_freeCCtx(b->cctx);
+}
+
+static int pack_builder_init(struct pack_builder *b)
+{
+    memset(b, 0, sizeof(struct pack_builder));
+
+    b->out_size = ZSTD_compressBound(PACK_DATA_FRAME_SIZE);
+    b->kinds = malloc(super_blocks_per_group());
+    b->bitmap = malloc(BLOCK_SIZE);
+    b->in = malloc(PACK_DATA_FRAME_SIZE);
+    b->out = malloc(b->out_size);
+    b->zeros = calloc(1, PACK_DATA_FRAME_SIZE);
+    b->cctx = ZSTD_createCCtx();
+
+    if (b->kinds == NULL || b->bitmap == NULL || b->in == NULL || b->out == NULL ||
+        b->zeros == NULL || b->cctx == NULL || pack_find_metadata(b) < 0) {
+        pack_builder_free(b);
+        return -1;
+    }
+    return 0;
+}
+
+/* Recompresses the filesystem of the open image into a pack at path.
+ * Returns 0, or -1 with errno set. */
+int pack_write(const char *path, int level, struct pack_stats *stats)
+{
+    struct pack_builder b;
+    int ret = -1;
+
+    memset(stats, 0, sizeof(struct pack_stats));
+    errno = 0;
+
+    if (level < 1 || level > ZSTD_maxCLevel()) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (pack_builder_init(&b) < 0) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    b.file = fopen(path, "wb");
+    if (b.file == NULL) goto out;
+
+    for (uint32_t i = 0; i < super_n_block_groups(); i++) {
+        if (pack_group(&b, i, level, stats) < 0) goto out;
+    }
+    if (pack_write_seek_table(&b) < 0) goto out;
+
+    long size = ftell(b.file);
+    if (size < 0) goto out;
+
+    stats->image_size = BLOCKS2BYTES(super_blocks_count());
+    stats->pack_size = size;
+
+    INFO("Pack of %u frames written to %s", b.n_frames, path);
+    ret = 0;
+
+out:
+    if (ret < 0 && errno == 0) errno = EIO;
+    if (b.file && fclose(b.file) != 0) ret = -1;
+    pack_builder_free(&b);
+    return ret;
+}
+
+static double pack_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1e6 + (to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static int pack_double_cmp(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void pack_latency_fill(struct pack_latency *latency, double *us, uint32_t n)
+{
+    double total = 0;
+
+    qsort(us, n, sizeof(double), pack_double_cmp);
+    for (uint32_t i = 0; i < n; i++) total += us[i];
+
+    latency->samples = n;
+    latency->mean_us = n ? total / n : 0;
+    latency->p99_us = n ? us[(uint64_t)n * 99 / 100] : 0;
+}
+
+/* Picks blocks in use at random, the same ones every time */
+static uint32_t pack_sample_blocks(struct pack_builder *b, uint64_t *blocks, uint32_t n)
+{
+    unsigned int seed = PACK_LATENCY_SEED;
+    uint32_t count = 0;
+
+    for (uint32_t tries = 0; count < n && tries < 16 * n; tries++) {
+        uint64_t block = (((uint64_t)rand_r(&seed) << 31) | rand_r(&seed)) % super_blocks_count();
+        uint32_t group = block < super_first_data_block() ? 0 :
+            (block - super_first_data_block()) / super_blocks_per_group();
+        uint64_t start, end;
+
+        pack_group_range(group, &start, &end);
+        if (pack_group_kinds(b, group, start, end) < 0) break;
+        if (b->kinds[block - start] != PACK_BLOCK_UNUSED) blocks[count++] = block;
+    }
+
+    return count;
+}
+
+/* Times reads of single blocks in use, from the open image and then from
+ * the pack at path.  Returns 0, or -1 with errno set. */
+int pack_measure(const char *path, struct pack_latency *image, struct pack_latency *pack)
+{
+    struct pack_builder b;
+    struct timespec from, to;
+    uint64_t *blocks = malloc(sizeof(uint64_t) * PACK_LATENCY_SAMPLES);
+    double *us = malloc(sizeof(double) * PACK_LATENCY_SAMPLES);
+    CompressionReader *reader = NULL;
+    FILE *file = NULL;
+    uint32_t n;
+    int ret = -1;
+
+    memset(image, 0, sizeof(struct pack_latency));
+    memset(pack, 0, sizeof(struct pack_latency));
+
+    if (blocks == NULL || us == NULL || pack_builder_init(&b) < 0) {
+        free(blocks);
+        free(us);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    n = pack_sample_blocks(&b, blocks, PACK_LATENCY_SAMPLES);
+
+    for (uint32_t i = 0; i < n; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        disk_read_block(blocks[i], b.in);
+        clock_gettime(CLOCK_MONOTONIC, &to);
+        us[i] = pack_elapsed_us(&from, &to);
+    }
+    pack_latency_fill(image, us, n);
+
+    file = fopen(path, "rb");
+    if (file == NULL) goto out;
+
+    reader = compression_reader_alloc(file);
+    if (reader == NULL) {
+        errno = EINVAL;
+        goto out;
+    }
+
+    for (uint32_t i = 0; i < n; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &from);
+        int64_t read = compression_read(reader, b.in, BLOCKS2BYTES(blocks[i]), BLOCK_SIZE);
+        clock_gettime(CLOCK_MONOTONIC, &to);
+
+        if (read != (int64_t)BLOCK_SIZE) {
+            errno = EIO;
+            goto out;
+        }
+        us[i] = pack_elapsed_us(&from, &to);
+    }
+    pack_latency_fill(pack, us, n);
+    ret = 0;
+
+out:
+    if (reader) compression_reader_free(reader);
+    if (file) fclose(file);
+    pack_builder_free(&b);
+    free(blocks);
+    free(us);
+    return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef PACK_H
+#define PACK_H
+
+#include <stdint.h>
+
+/* A pack is a copy of an image recompressed as seekable zstd, written by
+ * spotlight-pack and mounted like any other image.  Frames never cross a
+ * block group, bitmaps and inode tables sit in small frames and the rest in
+ * large ones, and blocks the bitmaps mark free are packed as zeros, which
+ * cost next to nothing to store or decompress.  The seek table at the end
+ * is the index the zstd reader opens it with. */
+
+#define PACK_METADATA_FRAME_SIZE    (64 * 1024)
+#define PACK_DATA_FRAME_SIZE        (1024 * 1024)
+#define PACK_DEFAULT_LEVEL          9
+#define PACK_LATENCY_SAMPLES        1000
+
+struct pack_stats {
+    uint64_t image_size;        /* Bytes of the filesystem packed */
+    uint64_t pack_size;         /* Bytes of the pack written */
+    uint32_t metadata_frames;
+    uint32_t data_frames;
+    uint32_t unused_frames;
+    uint64_t unused_blocks;     /* Free blocks packed as zeros */
+};
+
+/* Time taken by reads of one block, at random used blocks */
+struct pack_latency {
+    uint32_t samples;
+    double mean_us;
+    double p99_us;
+};
+
+int pack_write(const char *path, int level, struct pack_stats *stats);
+int pack_measure(const char *path, struct pack_latency *image, struct pack_latency *pack);
+
+#endif
@@ -0,0 +1,766 @@
+/*
+ * Copyright (c) 2010, Gerard Lledó Vives, gerard.lledo@gmail.com
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation. See README and COPYING for
+ * more details.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "dirlist.h"
+#include "extents.h"
+#include "inode.h"
+#include "logging.h"
+#include "snapshot.h"
+#include "super.h"
+
+#include "types/ext4_super.h"
+
+#define SNAPSHOT_INITIAL_ENTRIES    256
+#define SNAPSHOT_MAX_EXTENT_DEPTH   5
+/* Symlinks up to this size keep their target in i_block */
+#define SNAPSHOT_FAST_SYMLINK_SIZE  60
+#define SNAPSHOT_ALIGN              8
+
+#define FNV_OFFSET                  14695981039346656037ULL
+#define FNV_PRIME                   1099511628211ULL
+
+
+/* Directory listed while walking the namespace */
+struct snapshot_dir {
+    uint32_t ino;
+    uint32_t first;
+    uint32_t count;
+    uint32_t names;
+};
+
+struct snapshot_builder {
+    uint32_t *inos;                 /* Every inode reached, with repeats */
+    uint32_t n_inos, max_inos;
+    struct snapshot_dir *dirs;
+    uint32_t n_dirs, max_dirs;
+    struct dirlist_entry *dentries;
+    uint32_t n_dentries, max_dentries;
+    char *names;
+    uint32_t names_size, max_names;
+    struct snapshot_path *paths;
+    uint32_t n_paths, max_paths;
+    struct snapshot_extent *extents;
+    uint32_t n_extents, max_extents;
+    struct snapshot_inode *inodes;
+    uint32_t n_inodes;
+};
+
+/* The snapshot in use, mapped at mount */
+static struct {
+    char *path;
+    uint8_t *base;
+    size_t size;
+    const struct snapshot_header *header;
+    const struct snapshot_inode *inodes;
+    const struct dirlist_entry *dentries;
+    const char *names;
+    const struct snapshot_extent *extents;
+    const struct snapshot_path *paths;
+} snapshot;
+
+
+
+static uint64_t snapshot_hash(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t hash = FNV_OFFSET;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t snapshot_path_hash(const char *path, size_t len)
+{
+    uint64_t hash = snapshot_hash(path, len);
+    return hash ? hash : 1;
+}
+
+/* Ties a snapshot to an image.  The superblock holds the UUID, the mount
+ * and write times and the free counts, so any change to the image shows. */
+static uint64_t snapshot_fingerprint(void)
+{
+    struct ext4_super_block super;
+
+    disk_read(BOOT_SECTOR_SIZE, sizeof(struct ext4_super_block), &super);
+    return snapshot_hash(&super, sizeof(struct ext4_super_block));
+}
+
+/* Makes room for one more element in a growing array */
+static int snapshot_reserve(void **array, uint32_t *max, uint32_t n, size_t size)
+{
+    if (n < *max) return 0;
+
+    uint32_t new_max = *max ? 2 * *max : SNAPSHOT_INITIAL_ENTRIES;
+    if (new_max <= *max) return -1;
+
+    void *p = realloc(*array, (size_t)new_max * size);
+    if (p == NULL) return -1;
+
+    *array = p;
+    *max = new_max;
+    return 0;
+}
+
+/* Appends bytes to names, returning their offset or -1 */
+static int64_t snapshot_add_names(struct snapshot_builder *b, const char *names, uint32_t len)
+{
+    uint32_t off = b->names_size;
+
+    if (len == 0) return off;
+    if (len > UINT32_MAX - off) return -1;
+    while (off + len > b->max_names) {
+        uint32_t max_names = b->max_names ? 2 * b->max_names : SNAPSHOT_INITIAL_ENTRIES;
+        if (max_names <= b->max_names) max_names = UINT32_MAX;
+
+        char *p = realloc(b->names, max_names);
+        if (p == NULL) return -1;
+        b->names = p;
+        b->max_names = max_names;
+    }
+
+    memcpy(b->names + off, names, len);
+    b->names_size += len;
+    return off;
+}
+
+static int snapshot_add_extent(struct snapshot_builder *b, uint32_t lblock, uint32_t len,
+                               uint64_t pblock, uint32_t first)
+{
+    if (len == 0 || pblock == 0) return 0;
+
+    if (b->n_extents > first) {
+        struct snapshot_extent *last = &b->extents[b->n_extents - 1];
+
+        if (last->lblock + last->len == lblock && last->pblock + last->len == pblock) {
+            last->len += len;
+            return 0;
+        }
+    }
+
+    if (snapshot_reserve((void **)&b->extents, &b->max_extents, b->n_extents,
+                         sizeof(struct snapshot_extent)) < 0) {
+        return -1;
+    }
+
+    b->extents[b->n_extents].lblock = lblock;
+    b->extents[b->n_extents].len = len;
+    b->extents[b->n_extents].pblock = pblock;
+    b->n_extents++;
+    return 0;
+}
+
+/* Collects the extents below a node of an extent tree, in lblock order */
+static int snapshot_add_extent_tree(struct snapshot_builder *b, struct ext4_extent_header *eh,
+                                    uint32_t max_entries, uint32_t first)
+{
+    uint32_t n_entries = MIN((uint32_t)eh->eh_entries, max_entries);
+    int ret = 0;
+
+    if (eh->eh_magic != EXT4_EXT_MAGIC || eh->eh_depth > SNAPSHOT_MAX_EXTENT_DEPTH) {
+        WARNING("Bad extent header, skipping it");
+        return 0;
+    }
+
+    if (eh->eh_depth == 0) {
+        struct ext4_extent *ee = (struct ext4_extent *)(eh + 1);
+
+        for (uint32_t i = 0; i < n_entries && ret == 0; i++) {
+            /* Unwritten extents read as zeros, same as holes */
+            if (ee[i].ee_len > EXT_INIT_MAX_LEN) continue;
+
+            uint64_t pblock = ((uint64_t)ee[i].ee_start_hi << 32) | ee[i].ee_start_lo;
+            ret = snapshot_add_extent(b, ee[i].ee_block, ee[i].ee_len, pblock, first);
+        }
+        return ret;
+    }
+
+    struct ext4_extent_idx *ei = (struct ext4_extent_idx *)(eh + 1);
+    uint8_t *block = MALLOC_BLOCKS(1);
+    if (block == NULL) return -1;
+
+    for (uint32_t i = 0; i < n_entries && ret == 0; i++) {
+        struct ext4_extent_header *child = (struct ext4_extent_header *)block;
+        uint64_t leaf = ((uint64_t)ei[i].ei_leaf_hi << 32) | ei[i].ei_leaf_lo;
+
+        disk_read_block(leaf, block);
+        if (child->eh_depth + 1 != eh->eh_depth) continue;
+        ret = snapshot_add_extent_tree(b, child, (BLOCK_SIZE - sizeof(*child)) / sizeof(*ei), first);
+    }
+
+    free(block);
+    return ret;
+}
+
+static int snapshot_add_file(struct snapshot_builder *b, struct snapshot_inode *si)
+{
+    struct ext4_inode *inode = &si->inode;
+
+    si->first = b->n_extents;
+
+    if (inode->i_flags & EXT4_EXTENTS_FL) {
+        uint32_t max_entries = (sizeof(inode->i_block) - sizeof(struct ext4_extent_header)) /
+                               sizeof(struct ext4_extent);
+
+        if (snapshot_add_extent_tree(b, (struct ext4_extent_header *)inode->i_block,
+                                     max_entries, si->first) < 0) {
+            return -1;
+        }
+    } else {
+        uint32_t n_blocks = BYTES2BLOCKS(inode_get_size(inode));
+        uint32_t extent_len;
+
+        for (uint32_t lblock = 0; lblock < n_blocks; lblock += extent_len) {
+            uint64_t pblock = inode_get_data_pblock(inode, lblock, &extent_len);
+
+            extent_len = MIN(extent_len, n_blocks - lblock);
+            if (extent_len == 0) extent_len = 1;
+
+            if (snapshot_add_extent(b, lblock, extent_len, pblock, si->first) < 0) return -1;
+        }
+    }
+
+    si->count = b->n_extents - si->first;
+    return 0;
+}
+
+static int snapshot_add_link(struct snapshot_builder *b, struct snapshot_inode *si)
+{
+    uint64_t size = inode_get_size(&si->inode);
+    uint64_t pblock = inode_get_data_pblock(&si->inode, 0, NULL);
+
+    if (size <= SNAPSHOT_FAST_SYMLINK_SIZE || pblock == 0) return 0;
+
+    char *block = MALLOC_BLOCKS(1);
+    if (block == NULL) return -1;
+
+    disk_read_block(pblock, (uint8_t *)block);
+    size = MIN(size, (uint64_t)BLOCK_SIZE - 1);
+    block[size] = 0;
+
+    int64_t off = snapshot_add_names(b, block, size + 1);
+    free(block);
+    if (off < 0) return -1;
+
+    si->names = off;
+    si->count = size;
+    return 0;
+}
+
+/* Lists a directory and everything below it.  path holds the absolute path
+ * of the directory, without the trailing slash. */
+static int snapshot_walk(struct snapshot_builder *b, uint32_t dir_idx, char *path, size_t path_len)
+{
+    struct dirlist *dl = dirlist_get(dir_idx);
+    uint32_t *numbers = NULL;
+    int ret = -1;
+
+    if (dl == NULL) {
+        WARNING("Cannot list directory %d, leaving it out", dir_idx);
+        return 0;
+    }
+
+    uint32_t names_len = 0;
+    if (dl->n_entries) {
+        struct dirlist_entry *last = &dl->entries[dl->n_entries - 1];
+        names_len = last->name_off + last->name_len + 1;
+    }
+
+    int64_t names = snapshot_add_names(b, dl->names, names_len);
+    if (names < 0) goto out;
+
+    if (snapshot_reserve((void **)&b->dirs, &b->max_dirs, b->n_dirs,
+                         sizeof(struct snapshot_dir)) < 0) {
+        goto out;
+    }
+    b->dirs[b->n_dirs].ino = dir_idx;
+    b->dirs[b->n_dirs].first = b->n_dentries;
+    b->dirs[b->n_dirs].count = dl->n_entries;
+    b->dirs[b->n_dirs].names = names;
+    b->n_dirs++;
+
+    numbers = malloc((dl->n_entries + 1) * sizeof(uint32_t));
+    if (numbers == NULL) goto out;
+
+    for (uint32_t i = 0; i < dl->n_entries; i++) {
+        if (snapshot_reserve((void **)&b->dentries, &b->max_dentries, b->n_dentries,
+                             sizeof(struct dirlist_entry)) < 0) {
+            goto out;
+        }
+        b->dentries[b->n_dentries++] = dl->entries[i];
+        numbers[i] = dl->entries[i].inode;
+    }
+    inode_prefetch(numbers, dl->n_entries);
+
+    for (uint32_t i = 0; i < dl->n_entries; i++) {
+        const char *name = dirlist_name(dl, i);
+        uint8_t name_len = dl->entries[i].name_len;
+        uint32_t ino = dl->entries[i].inode;
+        struct ext4_inode inode;
+
+        if (!strcmp(name, ".") || !strcmp(name, "..")) continue;
+
+        if (path_len + 1 + name_len >= PATH_MAX) {
+            path[path_len] = 0;
+            WARNING("Path too long under %s, leaving %s out", path, name);
+            continue;
+        }
+        path[path_len] = '/';
+        memcpy(&path[path_len + 1], name, name_len);
+        path[path_len + 1 + name_len] = 0;
+
+        if (snapshot_reserve((void **)&b->inos, &b->max_inos, b->n_inos, sizeof(uint32_t)) < 0 ||
+            snapshot_reserve((void **)&b->paths, &b->max_paths, b->n_paths,
+                             sizeof(struct snapshot_path)) < 0) {
+            goto out;
+        }
+        b->inos[b->n_inos++] = ino;
+        b->paths[b->n_paths].hash = snapshot_path_hash(path, path_len + 1 + name_len);
+        b->paths[b->n_paths].ino = ino;
+        b->paths[b->n_paths].name = names + dl->entries[i].name_off;
+        b->n_paths++;
+
+        if (inode_get_by_number(ino, &inode) < 0) continue;
+        if (S_ISDIR(inode.i_mode)) {
+            if (snapshot_walk(b, ino, path, path_len + 1 + name_len) < 0) goto out;
+        }
+    }
+    path[path_len] = 0;
+    ret = 0;
+
+out:
+    free(numbers);
+    dirlist_put(dl);
+    return ret;
+}
+
+static int snapshot_u32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int snapshot_dir_cmp(const void *a, const void *b)
+{
+    return snapshot_u32_cmp(&((const struct snapshot_dir *)a)->ino,
+                            &((const struct snapshot_dir *)b)->ino);
+}
+
+/* Fills in the inode records, once per inode no matter how many links it
+ * has.  Directories come first in the walk, so their dentries are known. */
+static int snapshot_add_inodes(struct snapshot_builder *b)
+{
+    qsort(b->inos, b->n_inos, sizeof(uint32_t), snapshot_u32_cmp);
+    qsort(b->dirs, b->n_dirs, sizeof(struct snapshot_dir), snapshot_dir_cmp);
+
+    b->inodes = malloc((b->n_inos + 1) * sizeof(struct snapshot_inode));
+    if (b->inodes == NULL) return -1;
+
+    uint32_t dir = 0;
+    for (uint32_t i = 0; i < b->n_inos; i++) {
+        if (i && b->inos[i] == b->inos[i - 1]) continue;
+
+        struct snapshot_inode *si = &b->inodes[b->n_inodes];
+        memset(si, 0, sizeof(struct snapshot_inode));
+        si->ino = b->inos[i];
+        if (inode_get_by_number(si->ino, &si->inode) < 0) continue;
+        b->n_inodes++;
+
+        while (dir < b->n_dirs && b->dirs[dir].ino < si->ino) dir++;
+
+        if (S_ISDIR(si->inode.i_mode)) {
+            if (dir < b->n_dirs && b->dirs[dir].ino == si->ino) {
+                si->first = b->dirs[dir].first;
+                si->count = b->dirs[dir].count;
+                si->names = b->dirs[dir].names;
+            }
+        } else if (S_ISREG(si->inode.i_mode)) {
+            if (snapshot_add_file(b, si) < 0) return -1;
+        } else if (S_ISLNK(si->inode.i_mode)) {
+            if (snapshot_add_link(b, si) < 0) return -1;
+        }
+    }
+
+    return 0;
+}
+
+/* Lays the paths out in an open addressing table, at most half full */
+static struct snapshot_path *snapshot_path_table(struct snapshot_builder *b, uint32_t *n_slots)
+{
+    uint32_t size = 1;
+
+    while (size < 2 * b->n_paths) size <<= 1;
+
+    struct snapshot_path *table = calloc(size, sizeof(struct snapshot_path));
+    if (table == NULL) return NULL;
+
+    for (uint32_t i = 0; i < b->n_paths; i++) {
+        uint32_t slot = b->paths[i].hash & (size - 1);
+
+        while (table[slot].hash) slot = (slot + 1) & (size - 1);
+        table[slot] = b->paths[i];
+    }
+
+    *n_slots = size;
+    return table;
+}
+
+static int snapshot_write_section(FILE *out, uint64_t *off, const void *data, size_t size)
+{
+    static const uint8_t zeros[SNAPSHOT_ALIGN];
+    long pos = ftell(out);
+
+    if (pos < 0) return -1;
+    if (pos % SNAPSHOT_ALIGN) {
+        size_t pad = SNAPSHOT_ALIGN - pos % SNAPSHOT_ALIGN;
+        if (fwrite(zeros, 1, pad, out) != pad) return -1;
+        pos += pad;
+    }
+
+    *off = pos;
+    if (size && fwrite(data, 1, size, out) != size) return -1;
+    return 0;
+}
+
+static void snapshot_builder_free(struct snapshot_builder *b)
+{
+    free(b->inos);
+    free(b->dirs);
+    free(b->dentries);
+    free(b->names);
+    free(b->paths);
+    free(b->extents);
+    free(b->inodes);
+}
+
+/* Walks the whole namespace of the open image and writes it to path.
+ * Returns 0, or -1 with errno set. */
+int snapshot_write(const char *path)
+{
+    struct snapshot_builder b;
+    struct snapshot_header header;
+    struct snapshot_path *table = NULL;
+    char walk_path[PATH_MAX] = "";
+    FILE *out = NULL;
+    int ret = -1;
+
+    memset(&b, 0, sizeof(struct snapshot_builder));
+    memset(&header, 0, sizeof(struct snapshot_header));
+
+    if (snapshot_reserve((void **)&b.inos, &b.max_inos, 0, sizeof(uint32_t)) < 0) goto nomem;
+    b.inos[b.n_inos++] = ROOT_INODE_N;
+
+    if (snapshot_walk(&b, ROOT_INODE_N, walk_path, 0) < 0) goto nomem;
+    if (snapshot_add_inodes(&b) < 0) goto nomem;
+
+    table = snapshot_path_table(&b, &header.n_paths);
+    if (table == NULL) goto nomem;
+
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.block_size = BLOCK_SIZE;
+    header.fingerprint = snapshot_fingerprint();
+    header.n_inodes = b.n_inodes;
+    header.n_dentries = b.n_dentries;
+    header.n_extents = b.n_extents;
+    header.names_size = b.names_size;
+
+    out = fopen(path, "wb");
+    if (out == NULL) goto out;
+
+    if (fwrite(&header, sizeof(header), 1, out) != 1 ||
+        snapshot_write_section(out, &header.inodes_off, b.inodes,
+                               b.n_inodes * sizeof(struct snapshot_inode)) < 0 ||
+        snapshot_write_section(out, &header.dentries_off, b.dentries,
+                               b.n_dentries * sizeof(struct dirlist_entry)) < 0 ||
+        snapshot_write_section(out, &header.names_off, b.names, b.names_size) < 0 ||
+        snapshot_write_section(out, &header.extents_off, b.extents,
+                               b.n_extents * sizeof(struct snapshot_extent)) < 0 ||
+        snapshot_write_section(out, &header.paths_off, table,
+                               header.n_paths * sizeof(struct snapshot_path)) < 0) {
+        goto out;
+    }
+
+    /* The header goes in last, once the offsets are known */
+    if (fseek(out, 0, SEEK_SET) < 0 || fwrite(&header, sizeof(header), 1, out) != 1) {
+        goto out;
+    }
+
+    INFO("Snapshot of %d inodes, %d dentries and %d extents written to %s",
+         b.n_inodes, b.n_dentries, b.n_extents, path);
+    ret = 0;
+    goto out;
+
+nomem:
+    errno = ENOMEM;
+out:
+    if (out && fclose(out) != 0) ret = -1;
+    free(table);
+    snapshot_builder_free(&b);
+    return ret;
+}
+
+/* Uses the snapshot at path from the next snapshot_load on */
+void snapshot_enable(const char *path)
+{
+    free(snapshot.path);
+    snapshot.path = path ? strdup(path) : NULL;
+}
+
+static int snapshot_section_ok(uint64_t off, uint64_t count, size_t size)
+{
+    if (off % SNAPSHOT_ALIGN || off > snapshot.size) return 0;
+    return count <= (snapshot.size - off) / size;
+}
+
+/* Maps the snapshot given to snapshot_enable, once the superblock is loaded.
+ * A snapshot that does not match the image is left alone. */
+int snapshot_load(void)
+{
+    const struct snapshot_header *header;
+    struct stat st;
+
+    if (snapshot.path == NULL || snapshot.base) return 0;
+
+    int fd = open(snapshot.path, O_RDONLY);
+    if (fd < 0) {
+        WARNING("Cannot open snapshot %s: %s", snapshot.path, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct snapshot_header)) {
+        WARNING("Snapshot %s is truncated, ignoring it", snapshot.path);
+        close(fd);
+        return -1;
+    }
+
+    snapshot.size = st.st_size;
+    snapshot.base = mmap(NULL, snapshot.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (snapshot.base == MAP_FAILED) {
+        WARNING("Cannot map snapshot %s: %s", snapshot.path, strerror(errno));
+        snapshot.base = NULL;
+        return -1;
+    }
+
+    header = (const struct snapshot_header *)snapshot.base;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) ||
+        header->version != SNAPSHOT_VERSION ||
+        header->block_size != BLOCK_SIZE) {
+        WARNING("%s is not a snapshot this version can use, ignoring it", snapshot.path);
+        goto fail;
+    }
+
+    if (header->fingerprint != snapshot_fingerprint()) {
+        WARNING("Snapshot %s was made from another image, ignoring it", snapshot.path);
+        goto fail;
+    }
+
+    if (!snapshot_section_ok(header->inodes_off, header->n_inodes, sizeof(struct snapshot_inode)) ||
+        !snapshot_section_ok(header->dentries_off, header->n_dentries, sizeof(struct dirlist_entry)) ||
+        !snapshot_section_ok(header->names_off, header->names_size, 1) ||
+        !snapshot_section_ok(header->extents_off, header->n_extents, sizeof(struct snapshot_extent)) ||
+        !snapshot_section_ok(header->paths_off, header->n_paths, sizeof(struct snapshot_path)) ||
+        header->n_paths == 0 || (header->n_paths & (header->n_paths - 1)) ||
+        (header->names_size && snapshot.base[header->names_off + header->names_size - 1])) {
+        WARNING("Snapshot %s is corrupted, ignoring it", snapshot.path);
+        goto fail;
+    }
+
+    snapshot.header = header;
+    snapshot.inodes = (const void *)(snapshot.base + header->inodes_off);
+    snapshot.dentries = (const void *)(snapshot.base + header->dentries_off);
+    snapshot.names = (const char *)(snapshot.base + header->names_off);
+    snapshot.extents = (const void *)(snapshot.base + header->extents_off);
+    snapshot.paths = (const void *)(snapshot.base + header->paths_off);
+
+    INFO("Using snapshot %s: %d inodes, %d dentries", snapshot.path,
+         header->n_inodes, header->n_dentries);
+    return 0;
+
+fail:
+    snapshot_unload();
+    return -1;
+}
+
+void snapshot_unload(void)
+{
+    if (snapshot.base) {
+        munmap(snapshot.base, snapshot.size);
+    }
+    snapshot.base = NULL;
+    snapshot.header = NULL;
+}
+
+int snapshot_loaded(void)
+{
+    return snapshot.header != NULL;
+}
+
+static const struct snapshot_inode *snapshot_find_inode(uint32_t n)
+{
+    uint32_t lo = 0, hi;
+
+    if (snapshot.header == NULL) return NULL;
+
+    hi = snapshot.header->n_inodes;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (snapshot.inodes[mid].ino < n) lo = mid + 1;
+        else hi = mid;
+    }
+
+    if (lo == snapshot.header->n_inodes || snapshot.inodes[lo].ino != n) return NULL;
+    return &snapshot.inodes[lo];
+}
+
+/* Resolves an absolute path from the path table.  Returns 0 if there is no
+ * snapshot to answer, otherwise 1 with inode_idx set, to 0 if there is no
+ * such path. */
+int snapshot_lookup_path(const char *path, uint32_t *inode_idx)
+{
+    size_t len = strlen(path);
+
+    if (snapshot.header == NULL) return 0;
+
+    /* Only canonical paths were hashed */
+    if (path[0] != '/' || strstr(path, "//")) return 0;
+    if (len == 1) {
+        *inode_idx = ROOT_INODE_N;
+        return 1;
+    }
+    if (path[len - 1] == '/') return 0;
+
+    const char *name = strrchr(path, '/') + 1;
+    uint32_t mask = snapshot.header->n_paths - 1;
+    uint64_t hash = snapshot_path_hash(path, len);
+
+    *inode_idx = 0;
+    for (uint32_t slot = hash & mask; snapshot.paths[slot].hash; slot = (slot + 1) & mask) {
+        const struct snapshot_path *entry = &snapshot.paths[slot];
+
+        if (entry->hash != hash || entry->name >= snapshot.header->names_size) continue;
+        if (strcmp(&snapshot.names[entry->name], name)) continue;
+
+        *inode_idx = entry->ino;
+        break;
+    }
+
+    return 1;
+}
+
+int snapshot_get_inode(uint32_t n, struct ext4_inode *inode)
+{
+    const struct snapshot_inode *si = snapshot_find_inode(n);
+
+    if (si == NULL) return 0;
+
+    memcpy(inode, &si->inode, sizeof(struct ext4_inode));
+    return 1;
+}
+
+/* Same as inode_get_data_pblock, from the block map of a regular file */
+int snapshot_get_data_pblock(uint32_t n, uint32_t lblock, uint32_t *extent_len, uint64_t *pblock)
+{
+    const struct snapshot_inode *si = snapshot_find_inode(n);
+
+    if (si == NULL || !S_ISREG(si->inode.i_mode)) return 0;
+    if (si->first > snapshot.header->n_extents ||
+        si->count > snapshot.header->n_extents - si->first) {
+        return 0;
+    }
+
+    /* Find the first extent ending past lblock */
+    const struct snapshot_extent *extents = &snapshot.extents[si->first];
+    uint32_t lo = 0, hi = si->count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if ((uint64_t)extents[mid].lblock + extents[mid].len <= lblock) lo = mid + 1;
+        else hi = mid;
+    }
+
+    uint32_t len;
+    if (lo == si->count) {
+        /* Hole up to the end of the file */
+        *pblock = 0;
+        len = UINT32_MAX - lblock;
+    } else if (extents[lo].lblock > lblock) {
+        *pblock = 0;
+        len = extents[lo].lblock - lblock;
+    } else {
+        *pblock = extents[lo].pblock + (lblock - extents[lo].lblock);
+        len = extents[lo].lblock + extents[lo].len - lblock;
+    }
+
+    if (extent_len) *extent_len = len ? len : 1;
+    return 1;
+}
+
+/* Hands out the listing of a directory.  The names of the entries are
+ * relative to names, as in a dirlist. */
+int snapshot_get_dir(uint32_t n, const struct dirlist_entry **entries, uint32_t *n_entries,
+                     const char **names, uint32_t *names_len)
+{
+    const struct snapshot_inode *si = snapshot_find_inode(n);
+    uint64_t len = 0;
+
+    if (si == NULL || !S_ISDIR(si->inode.i_mode)) return 0;
+    if (si->first > snapshot.header->n_dentries ||
+        si->count > snapshot.header->n_dentries - si->first) {
+        return 0;
+    }
+
+    if (si->count) {
+        const struct dirlist_entry *last = &snapshot.dentries[si->first + si->count - 1];
+        len = (uint64_t)last->name_off + last->name_len + 1;
+    }
+    if (si->names > snapshot.header->names_size || len > snapshot.header->names_size - si->names) {
+        return 0;
+    }
+
+    *entries = &snapshot.dentries[si->first];
+    *n_entries = si->count;
+    *names = &snapshot.names[si->names];
+    *names_len = len;
+    return 1;
+}
+
+/* Copies the target of a symlink too long for i_block */
+int snapshot_get_link(uint32_t n, char *buf, size_t bufsize)
+{
+    const struct snapshot_inode *si = snapshot_find_inode(n);
+
+    if (si == NULL || !S_ISLNK(si->inode.i_mode) || bufsize == 0) return 0;
+    if (inode_get_size((struct ext4_inode *)&si->inode) <= SNAPSHOT_FAST_SYMLINK_SIZE) return 0;
+    if (si->names > snapshot.header->names_size ||
+        si->count >= snapshot.header->names_size - si->names) {
+        return 0;
+    }
+
+    size_t len = MIN((size_t)si->count, bufsize - 1);
+    memcpy(buf, &snapshot.names[si->names], len);
+    buf[len] = 0;
+    return 1;
+}
@@ -0,0 +1,77 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "dirlist.h"
+#include "types/ext4_inode.h"
+
+/* A snapshot is a sidecar file holding the whole namespace of an image:
+ * every directory listing, every inode reachable from the root, the block
+ * maps of regular files and a table of path hashes.  It is written once by
+ * spotlight-snapshot and mapped at mount with -o snapshot=PATH, after which
+ * lookups, getattr, readdir and readlink never reach the decompressor.  The
+ * superblock fingerprint ties it to the image it was made from. */
+
+#define SNAPSHOT_MAGIC              "E4FSNAP"
+#define SNAPSHOT_VERSION            1
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t block_size;
+    uint64_t fingerprint;   /* Hash of the image superblock */
+    uint32_t n_inodes;
+    uint32_t n_dentries;
+    uint32_t n_extents;
+    uint32_t n_paths;       /* Slots in the path table, a power of two */
+    uint64_t names_size;
+    uint64_t inodes_off;    /* Sorted by inode number */
+    uint64_t dentries_off;  /* Grouped by directory, in on-disk order */
+    uint64_t names_off;
+    uint64_t extents_off;   /* Grouped by file, sorted by lblock */
+    uint64_t paths_off;
+};
+
+/* Directories point at their dentries, whose name_off are relative to the
+ * directory's names, just like in a dirlist.  Regular files point at their
+ * extents, symlinks too long for i_block at their target in names. */
+struct snapshot_inode {
+    uint32_t ino;
+    uint32_t first;         /* First dentry or extent */
+    uint32_t count;         /* Number of dentries or extents */
+    uint32_t names;         /* Offset in names of the directory's names or link target */
+    struct ext4_inode inode;
+};
+
+/* A run of mapped blocks.  Holes and unwritten extents are left out. */
+struct snapshot_extent {
+    uint32_t lblock;
+    uint32_t len;
+    uint64_t pblock;
+};
+
+/* Open addressing slot, keyed by the hash of an absolute path.  The last
+ * component is kept to check the name, hash 0 marks a free slot. */
+struct snapshot_path {
+    uint64_t hash;
+    uint32_t ino;
+    uint32_t name;          /* Offset in names of the last component */
+};
+
+int snapshot_write(const char *path);
+
+void snapshot_enable(const char *path);
+int snapshot_load(void);
+void snapshot_unload(void);
+int snapshot_loaded(void);
+
+int snapshot_lookup_path(const char *path, uint32_t *inode_idx);
+int snapshot_get_inode(uint32_t n, struct ext4_inode *inode);
+int snapshot_get_data_pblock(uint32_t n, uint32_t lblock, uint32_t *extent_len, uint64_t *pblock);
+int snapshot_get_dir(uint32_t n, const struct dirlist_entry **entries, uint32_t *n_entries,
+                     const char **names, uint32_t *names_len);
+int snapshot_get_link(uint32_t n, char *buf, size_t bufsize);
+
+#endif
@@ -25,9 +25,12 @@ static uint64_t super_block_group_size(void)
     return BLOCKS2BYTES(super.s_blocks_per_group);
 }
 
-static uint32_t super_n_block_groups(void)
+/* The last group may be shorter than the others */
+uint32_t super_n_block_groups(void)
 {
-    uint32_t n = super.s_blocks_count_lo / super.s_blocks_per_group;
+    uint32_t blocks = super.s_blocks_count_lo - super.s_first_data_block;
+    uint32_t n = blocks / super.s_blocks_per_group;
+    if (blocks % super.s_blocks_per_group) n++;
     return n ? n : 1;
 }
 
@@ -37,6 +40,34 @@ static uint32_t super_group_desc_size(void)
     else return sizeof(struct ext4_group_desc);
 }
 
+uint64_t super_blocks_count(void)
+{
+    return super.s_blocks_count_lo;
+}
+
+uint32_t super_blocks_per_group(void)
+{
+    return super.s_blocks_per_group;
+}
+
+uint32_t super_first_data_block(void)
+{
+    return super.s_first_data_block;
+}
+
+uint32_t super_feature_ro_compat(void)
+{
+    return super.s_feature_ro_compat;
+}
+
+/* Blocks after the superblock taken by the group descriptors, and those
+ * reserved for them to grow into */
+uint32_t super_group_desc_blocks(void)
+{
+    uint64_t size = (uint64_t)super_n_block_groups() * super_group_desc_size();
+    return BYTES2BLOCKS(size) + super.s_reserved_gdt_blocks;
+}
+
 uint32_t super_block_size(void) {
     return ((uint64_t)1) << (super.s_log_block_size + 10);
 }
@@ -51,6 +82,11 @@ uint32_t super_inode_size(void)
     return super.s_inode_size;
 }
 
+uint32_t super_first_inode(void)
+{
+    return super.s_first_ino;
+}
+
 
 int super_fill(void)
 {
@@ -74,6 +110,30 @@ off_t super_group_inode_table_offset(uint32_t inode_num)
     return BLOCKS2BYTES(gdesc_table[n_group].bg_inode_table_lo);
 }
 
+uint64_t super_group_inode_table(uint32_t group)
+{
+    ASSERT(group < super_n_block_groups());
+    return gdesc_table[group].bg_inode_table_lo;
+}
+
+/* Returns 0 if the group's inode bitmap was never initialized, in which case
+ * none of its inodes is in use */
+uint64_t super_group_inode_bitmap(uint32_t group)
+{
+    ASSERT(group < super_n_block_groups());
+    if (gdesc_table[group].bg_flags & EXT4_BG_INODE_UNINIT) return 0;
+    return gdesc_table[group].bg_inode_bitmap_lo;
+}
+
+/* Returns 0 if the group's block bitmap was never initialized, in which case
+ * it has to be worked out from the group's metadata */
+uint64_t super_group_block_bitmap(uint32_t group)
+{
+    ASSERT(group < super_n_block_groups());
+    if (gdesc_table[group].bg_flags & EXT4_BG_BLOCK_UNINIT) return 0;
+    return gdesc_table[group].bg_block_bitmap_lo;
+}
+
 /* struct ext4_group_desc might be bigger than on disk structure, if we are not
  * using big ones.  That info is in the superblock.  Be careful when allocating
  * or manipulating this pointers. */
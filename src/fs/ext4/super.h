@@ -21,10 +21,20 @@
 uint32_t super_block_size(void);
 uint32_t super_inodes_per_group(void);
 uint32_t super_inode_size(void);
+uint32_t super_first_inode(void);
+uint32_t super_n_block_groups(void);
+uint64_t super_blocks_count(void);
+uint32_t super_blocks_per_group(void);
+uint32_t super_first_data_block(void);
+uint32_t super_feature_ro_compat(void);
+uint32_t super_group_desc_blocks(void);
 int super_fill(void);
 
 /* struct ext4_group_desc */
 off_t super_group_inode_table_offset(uint32_t inode_num);
+uint64_t super_group_inode_table(uint32_t group);
+uint64_t super_group_inode_bitmap(uint32_t group);
+uint64_t super_group_block_bitmap(uint32_t group);
 int super_group_fill(void);
 
 #endif
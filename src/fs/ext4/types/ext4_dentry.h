@@ -32,6 +32,17 @@
 
 #define EXT4_NAME_LEN 255
 
+/* Values of file_type, with the filetype feature.  Without it, file_type
+ * is the high byte of name_len and reads as EXT4_FT_UNKNOWN. */
+#define EXT4_FT_UNKNOWN         0
+#define EXT4_FT_REG_FILE        1
+#define EXT4_FT_DIR             2
+#define EXT4_FT_CHRDEV          3
+#define EXT4_FT_BLKDEV          4
+#define EXT4_FT_FIFO            5
+#define EXT4_FT_SOCK            6
+#define EXT4_FT_SYMLINK         7
+
 struct ext4_dir_entry_2 {
     __le32  inode;          /* Inode number */
     __le16  rec_len;        /* Directory entry length */
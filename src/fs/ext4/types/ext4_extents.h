@@ -29,6 +29,12 @@
 
 #define EXT4_EXT_MAGIC          0xf30a
 
+/*
+ * ee_len above this marks an unwritten extent, which reads as zeros and
+ * covers ee_len - EXT_INIT_MAX_LEN blocks.
+ */
+#define EXT_INIT_MAX_LEN        (1UL << 15)
+
 /*
  * This is the extent on-disk structure.
  * It's used at the bottom of the tree.
@@ -27,6 +27,17 @@
 
 #include "ext4_basic.h"
 
+/*
+ * Block group flags
+ */
+#define EXT4_BG_INODE_UNINIT	0x0001	/* Inode table/bitmap not in use */
+#define EXT4_BG_BLOCK_UNINIT	0x0002	/* Block bitmap not in use */
+
+/*
+ * Read-only compatible features
+ */
+#define EXT4_FEATURE_RO_COMPAT_BIGALLOC	0x0200	/* Bitmaps count clusters */
+
 /*
  * Structure of a blocks group descriptor
  */
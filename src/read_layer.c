@@ -1,29 +1,131 @@
 #include "read_layer.h"
+#include "readahead.h"
 
 #define FAILED_TO_ALLOC (-1)
 
 static CompressionReader *compression_reader = NULL;
+static pthread_mutex_t compression_reader_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Returns the compression reader, allocating it on first use.  Readers are
+ * thread safe, so once it is published reads only need an acquire load of
+ * it, and the lock only covers the allocation */
+static CompressionReader *check_and_alloc_reader(FILE *file) {
+    CompressionReader *reader = __atomic_load_n(&compression_reader,
+            __ATOMIC_ACQUIRE);
+    if (reader != NULL) {
+        return reader;
+    }
+
+    pthread_mutex_lock(&compression_reader_lock);
+    reader = compression_reader;
+    if (reader == NULL) {
+        reader = compression_reader_alloc(file);
+
+        assert(reader != NULL);
+
+        if (reader != NULL) {
+            readahead_start(reader);
+            __atomic_store_n(&compression_reader, reader, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&compression_reader_lock);
+
+    return reader;
+}
 
 /* Read wrapper */
 extern int64_t read_wrapper(FILE *file, uint8_t *buf, off_t offset,
         size_t length) {
 
-    if (compression_reader == NULL) {
-        compression_reader = compression_reader_alloc(file);
+    CompressionReader *reader = check_and_alloc_reader(file);
+    if (reader == NULL) {
+        return FAILED_TO_ALLOC;
+    }
+
+    /* Plain reads are mostly metadata, scattered and from many threads at
+     * once, so only the data reads below are followed by readahead */
+    return compression_read(reader, buf, offset, length);
+}
+
+/* Vectored read wrapper */
+extern int64_t read_wrapper_v(FILE *file, CompressionSegment *segments,
+        size_t count) {
 
-        assert(compression_reader != NULL);
-        if (compression_reader == NULL) {
-            return FAILED_TO_ALLOC;
+    CompressionReader *reader = check_and_alloc_reader(file);
+    if (reader == NULL) {
+        return FAILED_TO_ALLOC;
+    }
+
+    /* Readahead follows the span of the whole read */
+    if (count > 0) {
+        off_t start = segments[0].offset;
+        off_t end = segments[0].offset + segments[0].length;
+
+        for (size_t i = 1; i < count; i++) {
+            if (segments[i].offset < start) {
+                start = segments[i].offset;
+            }
+            if (segments[i].offset + (off_t) segments[i].length > end) {
+                end = segments[i].offset + segments[i].length;
+            }
         }
+        readahead_note(start, end - start);
+    }
+
+    return compression_readv(reader, segments, count);
+}
+
+/* Reference wrapper */
+extern int64_t read_ref_wrapper(FILE *file, off_t offset, size_t length,
+        CompressionRef *ref) {
+
+    CompressionReader *reader = check_and_alloc_reader(file);
+    if (reader == NULL) {
+        return FAILED_TO_ALLOC;
     }
 
-    return compression_read(compression_reader, buf, offset, length);
+    readahead_note(offset, length);
+
+    return compression_read_ref(reader, offset, length, ref);
+}
+
+/* Releases a reference from read_ref_wrapper */
+extern void release_ref_wrapper(CompressionRef *ref) {
+    CompressionReader *reader = __atomic_load_n(&compression_reader,
+            __ATOMIC_ACQUIRE);
+    if (reader != NULL) {
+        compression_release_ref(reader, ref);
+    }
+}
+
+/* Prefetch wrapper */
+extern void prefetch_wrapper(FILE *file, off_t offset, size_t length) {
+    if (check_and_alloc_reader(file) != NULL) {
+        readahead_hint(offset, length);
+    }
+}
+
+/* Counters wrapper */
+extern void read_stats_wrapper(CompressionStats *stats) {
+    pthread_mutex_lock(&compression_reader_lock);
+    if (compression_reader != NULL) {
+        compression_get_stats(compression_reader, stats);
+    } else {
+        stats->decoded = 0;
+        stats->coalesced = 0;
+    }
+    pthread_mutex_unlock(&compression_reader_lock);
 }
 
 /* Frees read wrapper */
 extern void free_read_wrapper() {
-    if (compression_reader != NULL) {
-        compression_reader_free(compression_reader);
-        compression_reader = NULL;
+    readahead_stop();
+
+    pthread_mutex_lock(&compression_reader_lock);
+    CompressionReader *reader = compression_reader;
+    if (reader != NULL) {
+        __atomic_store_n(&compression_reader, NULL, __ATOMIC_RELEASE);
+        compression_reader_free(reader);
     }
+    pthread_mutex_unlock(&compression_reader_lock);
 }
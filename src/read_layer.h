@@ -1,3 +1,4 @@
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -21,6 +22,49 @@
 extern int64_t read_wrapper(FILE *file, uint8_t *buf, off_t offset,
         size_t length);
 
+/** Vectored read wrapper, handles state
+ *
+ *  @param file File to read
+ *  @param segments Segments to read, may be reordered
+ *  @param count Number of segments
+ *
+ *  @returns Total number of bytes read or -1 if error
+ */
+extern int64_t read_wrapper_v(FILE *file, CompressionSegment *segments,
+        size_t count);
+
+/** Reference wrapper, handles state
+ *
+ *  @param file File to read
+ *  @param offset Decompressed address to reference
+ *  @param length Number of bytes wanted
+ *  @param ref Reference to fill in, released with release_ref_wrapper
+ *
+ *  @returns Number of bytes referenced or -1 if not possible
+ */
+extern int64_t read_ref_wrapper(FILE *file, off_t offset, size_t length,
+        CompressionRef *ref);
+
+/** Releases a reference from read_ref_wrapper
+ *
+ *  @param ref Reference to release
+ */
+extern void release_ref_wrapper(CompressionRef *ref);
+
+/** Prefetch wrapper, handles state
+ *
+ *  @param file File to read
+ *  @param offset Decompressed address about to be read
+ *  @param length Number of bytes about to be read
+ */
+extern void prefetch_wrapper(FILE *file, off_t offset, size_t length);
+
+/** Counters wrapper, all zero before the first read
+ *
+ *  @param stats Counters to fill in
+ */
+extern void read_stats_wrapper(CompressionStats *stats);
+
 /** Free read wrapper
  */
 extern void free_read_wrapper();
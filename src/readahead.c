@@ -0,0 +1,321 @@
+#include "readahead.h"
+#include "compression/compression_reader.h"
+
+#define MIN(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a < _b ? _a : _b; })
+
+#define MAX(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _a : _b; })
+
+/* Readahead state, shared by every caller of the read layer.  Streams are
+ * told apart by where their reads land, since callers do not identify
+ * themselves. */
+static struct {
+
+    /* Reader prefetched into, NULL when stopped.  Written with lock held,
+     * and read without it to skip the lock while readahead is off */
+    CompressionReader *reader;
+
+    /* Protects everything below, and wakes up the prefetch threads */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+
+    /* Prefetch threads, started once there is something to prefetch */
+    pthread_t threads[READAHEAD_THREADS];
+    uint32_t num_threads;
+    uint8_t stopping;
+
+    /* Largest window, 0 if readahead is disabled.  Read without the lock
+     * like reader */
+    size_t max_window;
+
+    /* Streams being followed */
+    ReadaheadStream streams[READAHEAD_STREAMS];
+    uint64_t clock;
+
+    /* Ranges waiting for a prefetch thread */
+    ReadaheadJob queue[READAHEAD_QUEUE];
+    uint32_t queue_head;
+    uint32_t queue_length;
+
+} readahead = {
+    .reader = NULL,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+    .max_window = READAHEAD_MAX_WINDOW,
+};
+
+/*****************************************************************************/
+/***************************** Prefetch threads ******************************/
+/*****************************************************************************/
+
+/* Takes queued ranges and prefetches them until stopped */
+static void *prefetch_thread(void *arg) {
+    (void) arg;
+
+    pthread_mutex_lock(&readahead.lock);
+    while (!readahead.stopping) {
+        if (readahead.queue_length == 0) {
+            pthread_cond_wait(&readahead.wake, &readahead.lock);
+            continue;
+        }
+
+        ReadaheadJob job = readahead.queue[readahead.queue_head];
+        readahead.queue_head = (readahead.queue_head + 1) % READAHEAD_QUEUE;
+        readahead.queue_length--;
+        pthread_mutex_unlock(&readahead.lock);
+
+        /* Readers stop short rather than evict what is yet to be read, so
+         * whatever is not prefetched now is left to the next window */
+        compression_prefetch(readahead.reader, job.offset, job.length);
+
+        pthread_mutex_lock(&readahead.lock);
+    }
+    pthread_mutex_unlock(&readahead.lock);
+
+    return NULL;
+}
+
+/* Queues a range, dropped if the queue is full.  Threads are only started
+ * here, so that a process forking after its first reads (such as a FUSE
+ * daemon going to the background) does not lose them.  Must be called with
+ * lock held */
+static void queue_job(off_t offset, size_t length) {
+    while (readahead.num_threads < READAHEAD_THREADS) {
+        if (pthread_create(&readahead.threads[readahead.num_threads], NULL,
+                    prefetch_thread, NULL) != 0) {
+            break;
+        }
+        readahead.num_threads++;
+    }
+
+    if (readahead.num_threads == 0
+            || readahead.queue_length == READAHEAD_QUEUE) {
+        return;
+    }
+
+    uint32_t tail = (readahead.queue_head + readahead.queue_length)
+        % READAHEAD_QUEUE;
+    readahead.queue[tail].offset = offset;
+    readahead.queue[tail].length = length;
+    readahead.queue_length++;
+
+    pthread_cond_signal(&readahead.wake);
+}
+
+/*****************************************************************************/
+/***************************** Stream detection ******************************/
+/*****************************************************************************/
+
+/* Finds the stream a read continues, NULL if none.  A read continues a
+ * stream if it starts within its last read or right after it, which allows
+ * for reads served slightly out of order, or if it is one stride further.
+ * The same read again, as happens when several callers want the same data,
+ * is found but does not continue the stream */
+static ReadaheadStream *find_stream(off_t offset) {
+    for (uint32_t i = 0; i < READAHEAD_STREAMS; i++) {
+        ReadaheadStream *stream = &readahead.streams[i];
+        off_t next = stream->last_offset + stream->last_length;
+
+        if (stream->last_used && offset == stream->last_offset) {
+            return stream;
+        }
+
+        if (stream->last_used && offset > stream->last_offset
+                && offset <= next + (off_t) stream->last_length) {
+            stream->stride = 0;
+            return stream;
+        }
+    }
+
+    for (uint32_t i = 0; i < READAHEAD_STREAMS; i++) {
+        ReadaheadStream *stream = &readahead.streams[i];
+
+        if (stream->last_used && stream->stride
+                && offset == stream->last_offset + stream->stride) {
+            return stream;
+        }
+    }
+
+    return NULL;
+}
+
+/* Starts following a new stream in place of the least recently used one.
+ * The distance from the last read is kept as a possible stride, which the
+ * next read confirms or not */
+static void new_stream(off_t offset, size_t length) {
+    ReadaheadStream *victim = &readahead.streams[0];
+    ReadaheadStream *latest = NULL;
+
+    for (uint32_t i = 0; i < READAHEAD_STREAMS; i++) {
+        ReadaheadStream *stream = &readahead.streams[i];
+
+        if (stream->last_used < victim->last_used) {
+            victim = stream;
+        }
+        if (stream->last_used && (latest == NULL
+                    || stream->last_used > latest->last_used)) {
+            latest = stream;
+        }
+    }
+
+    off_t stride = 0;
+    if (latest && offset > latest->last_offset
+            && offset - latest->last_offset <= READAHEAD_MAX_STRIDE) {
+        stride = offset - latest->last_offset;
+    }
+
+    memset(victim, 0, sizeof(ReadaheadStream));
+    victim->last_offset = offset;
+    victim->last_length = length;
+    victim->stride = stride;
+    victim->last_used = ++readahead.clock;
+}
+
+/* Asks for the next window once the reader gets into the previous one, so
+ * that one window is prefetched while the other is read.  Each window is
+ * twice the previous one, as long as the reader keeps up */
+static void issue_sequential(ReadaheadStream *stream, off_t offset,
+        size_t length) {
+    off_t end = offset + length;
+
+    if (stream->window == 0) {
+        stream->window = MIN(MAX((size_t) READAHEAD_MIN_WINDOW, 2 * length),
+                readahead.max_window);
+    }
+
+    /* The reader got ahead of readahead, carry on from where it is */
+    if (stream->issued_end < end) {
+        stream->issued_end = end;
+        stream->trigger = end;
+    }
+
+    if (end >= stream->trigger) {
+        queue_job(stream->issued_end, stream->window);
+        stream->trigger = stream->issued_end;
+        stream->issued_end += stream->window;
+        stream->window = MIN(2 * stream->window, readahead.max_window);
+    }
+}
+
+/* Asks for the next few reads of a strided stream */
+static void issue_strided(ReadaheadStream *stream, off_t offset,
+        size_t length) {
+    off_t limit = offset + READAHEAD_STRIDES * stream->stride;
+
+    if (stream->issued_end <= offset) {
+        stream->issued_end = offset + stream->stride;
+    }
+
+    while (stream->issued_end <= limit) {
+        queue_job(stream->issued_end, length);
+        stream->issued_end += stream->stride;
+    }
+}
+
+/* Whether readahead is on, checked without the lock so that reads do not
+ * take it for nothing.  Callers check again with the lock held */
+static uint8_t readahead_enabled() {
+    return __atomic_load_n(&readahead.reader, __ATOMIC_ACQUIRE) != NULL
+        && __atomic_load_n(&readahead.max_window, __ATOMIC_ACQUIRE) != 0;
+}
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/* Starts background prefetching for a reader */
+extern void readahead_start(CompressionReader *reader) {
+    pthread_mutex_lock(&readahead.lock);
+    if (readahead.reader == NULL && compression_can_prefetch(reader)) {
+        __atomic_store_n(&readahead.reader, reader, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&readahead.lock);
+}
+
+/* Records a read, and asks for readahead if it continues a stream */
+extern void readahead_note(off_t offset, size_t length) {
+    if (length == 0 || !readahead_enabled()) {
+        return;
+    }
+
+    pthread_mutex_lock(&readahead.lock);
+
+    if (readahead.reader == NULL || readahead.max_window == 0
+            || length == 0) {
+        pthread_mutex_unlock(&readahead.lock);
+        return;
+    }
+
+    ReadaheadStream *stream = find_stream(offset);
+    if (stream == NULL) {
+        new_stream(offset, length);
+        pthread_mutex_unlock(&readahead.lock);
+        return;
+    }
+
+    stream->last_used = ++readahead.clock;
+    if (offset == stream->last_offset) {
+        pthread_mutex_unlock(&readahead.lock);
+        return;
+    }
+
+    /* Reads close to each other now and then are not a stream yet */
+    if (++stream->hits >= READAHEAD_MIN_HITS) {
+        if (stream->stride) {
+            issue_strided(stream, offset, length);
+        } else {
+            issue_sequential(stream, offset, length);
+        }
+    }
+
+    stream->last_offset = offset;
+    stream->last_length = length;
+
+    pthread_mutex_unlock(&readahead.lock);
+}
+
+/* Prefetches a range the caller knows is about to be read */
+extern void readahead_hint(off_t offset, size_t length) {
+    if (length == 0 || !readahead_enabled()) {
+        return;
+    }
+
+    pthread_mutex_lock(&readahead.lock);
+    if (readahead.reader != NULL && readahead.max_window != 0 && length) {
+        queue_job(offset, MIN(length, readahead.max_window));
+    }
+    pthread_mutex_unlock(&readahead.lock);
+}
+
+/* Sets the largest readahead window */
+extern void readahead_set_window(size_t max_window) {
+    pthread_mutex_lock(&readahead.lock);
+    __atomic_store_n(&readahead.max_window, max_window, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&readahead.lock);
+}
+
+/* Stops background prefetching */
+extern void readahead_stop() {
+    pthread_mutex_lock(&readahead.lock);
+    readahead.stopping = TRUE;
+    pthread_cond_broadcast(&readahead.wake);
+    pthread_mutex_unlock(&readahead.lock);
+
+    for (uint32_t i = 0; i < readahead.num_threads; i++) {
+        pthread_join(readahead.threads[i], NULL);
+    }
+
+    pthread_mutex_lock(&readahead.lock);
+    readahead.num_threads = 0;
+    readahead.stopping = FALSE;
+    __atomic_store_n(&readahead.reader, NULL, __ATOMIC_RELEASE);
+    readahead.queue_head = 0;
+    readahead.queue_length = 0;
+    memset(readahead.streams, 0, sizeof(readahead.streams));
+    pthread_mutex_unlock(&readahead.lock);
+}
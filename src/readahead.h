@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#define READAHEAD_STREAMS       8           /* Streams tracked at once */
+#define READAHEAD_QUEUE         32          /* Pending readahead ranges */
+#define READAHEAD_THREADS       2           /* Background prefetch threads */
+#define READAHEAD_STRIDES       4           /* Strided reads prefetched ahead */
+#define READAHEAD_MIN_HITS      2           /* Reads in a row before readahead */
+
+#define READAHEAD_MIN_WINDOW    131072      /* First window of a stream */
+#define READAHEAD_MAX_WINDOW    4194304     /* Default largest window */
+
+/* Farthest apart two reads can be to be taken for a strided stream */
+#define READAHEAD_MAX_STRIDE    (16 * READAHEAD_MAX_WINDOW)
+
+#define TRUE            1
+#define FALSE           0
+
+/*****************************************************************************/
+/********************************** Structs **********************************/
+/*****************************************************************************/
+
+/* Sequential or strided stream of reads */
+typedef struct ReadaheadStream {
+
+    /* Start and length of the last read */
+    off_t last_offset;
+    size_t last_length;
+
+    /* Distance between the starts of reads, 0 if sequential */
+    off_t stride;
+
+    /* Reads that followed the stream */
+    uint32_t hits;
+
+    /* End of the data readahead has been asked for */
+    off_t issued_end;
+
+    /* Reading past this asks for the next window */
+    off_t trigger;
+
+    /* Size of the next window, doubled each time the reader catches up */
+    size_t window;
+
+    /* Clock value at last use, the least recently used stream is replaced */
+    uint64_t last_used;
+
+} ReadaheadStream;
+
+/* Range to prefetch */
+typedef struct ReadaheadJob {
+
+    /* Decompressed address to prefetch from */
+    off_t offset;
+
+    /* Number of bytes to prefetch */
+    size_t length;
+
+} ReadaheadJob;
+
+/* Defined in compression_reader.h */
+struct CompressionReader;
+
+/*****************************************************************************/
+/***************************** Public functions ******************************/
+/*****************************************************************************/
+
+/** Starts background prefetching for a reader, if it gains anything from it
+ *
+ *  @param reader CompressionReader that has been allocated
+ */
+extern void readahead_start(struct CompressionReader *reader);
+
+/** Records a read, and asks for readahead if it continues a stream
+ *
+ *  @param offset Decompressed address read from
+ *  @param length Number of bytes read
+ */
+extern void readahead_note(off_t offset, size_t length);
+
+/** Prefetches a range the caller knows is about to be read, such as the
+ *  next extent of a file being read sequentially
+ *
+ *  @param offset Decompressed address to prefetch from
+ *  @param length Number of bytes to prefetch, capped to the largest window
+ */
+extern void readahead_hint(off_t offset, size_t length);
+
+/** Sets the largest readahead window
+ *
+ *  @param max_window Largest window in bytes, 0 disables readahead
+ */
+extern void readahead_set_window(size_t max_window);
+
+/** Stops background prefetching, waiting for prefetches in progress
+ */
+extern void readahead_stop();
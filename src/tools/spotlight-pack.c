@@ -0,0 +1,87 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "../fs/ext4/disk.h"
+#include "../fs/ext4/pack.h"
+#include "../fs/ext4/super.h"
+#include "../fs/ext4/types/ext4_super.h"
+
+#define MIB(__bytes)    ((__bytes) / (1024.0 * 1024.0))
+
+/* Recompresses an image, in any format spotlight reads, into a pack laid
+ * out for random access, and reports what that gained */
+int main(int argc, char *argv[]) {
+
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s Disk Pack [Level]\n", argv[0]);
+        return 1;
+    }
+
+    int level = PACK_DEFAULT_LEVEL;
+    if (argc == 4) {
+        char *end;
+        level = strtol(argv[3], &end, 10);
+        if (*end != '\0' || level < 1) {
+            fprintf(stderr, "Error: Invalid compression level '%s'\n", argv[3]);
+            return 1;
+        }
+    }
+
+    struct stat st;
+    if (stat(argv[1], &st) != 0 || disk_open(argv[1]) < 0) {
+        fprintf(stderr, "Error: Unable to open disk '%s'\n", argv[1]);
+        return 1;
+    }
+
+    uint16_t magic;
+    disk_read(BOOT_SECTOR_SIZE + offsetof(struct ext4_super_block, s_magic),
+              sizeof(magic), &magic);
+    if (magic != 0xEF53) {
+        fprintf(stderr, "Error: '%s' doesn't contain an EXT4 filesystem\n", argv[1]);
+        disk_close();
+        return 1;
+    }
+
+    if (super_fill() != 0 || super_group_fill() != 0) {
+        fprintf(stderr, "Error: Unable to read the filesystem in '%s'\n", argv[1]);
+        disk_close();
+        return 1;
+    }
+
+    struct pack_stats stats;
+    if (pack_write(argv[2], level, &stats) != 0) {
+        fprintf(stderr, "Error: Unable to write pack '%s': %s\n", argv[2],
+                strerror(errno));
+        disk_close();
+        return 1;
+    }
+
+    printf("Packed %.1f MiB filesystem from %.1f MiB '%s' into %.1f MiB '%s'\n",
+           MIB(stats.image_size), MIB(st.st_size), argv[1], MIB(stats.pack_size), argv[2]);
+    printf("Pack ratio: %.3f of the filesystem, %.3f of the input\n",
+           stats.image_size ? (double)stats.pack_size / stats.image_size : 0,
+           st.st_size ? (double)stats.pack_size / st.st_size : 0);
+    printf("Frames: %u metadata, %u data, %u unused holding %ju free blocks\n",
+           stats.metadata_frames, stats.data_frames, stats.unused_frames,
+           (uintmax_t)stats.unused_blocks);
+
+    struct pack_latency before, after;
+    if (pack_measure(argv[2], &before, &after) != 0) {
+        fprintf(stderr, "Error: Unable to read pack '%s': %s\n", argv[2],
+                strerror(errno));
+        disk_close();
+        return 1;
+    }
+
+    printf("Random %u byte reads of %u used blocks: input %.1f us mean, %.1f us p99; "
+           "pack %.1f us mean, %.1f us p99\n",
+           BLOCK_SIZE, after.samples, before.mean_us, before.p99_us,
+           after.mean_us, after.p99_us);
+
+    disk_close();
+    return 0;
+}
@@ -0,0 +1,51 @@
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../fs/ext4/disk.h"
+#include "../fs/ext4/inode.h"
+#include "../fs/ext4/snapshot.h"
+#include "../fs/ext4/super.h"
+#include "../fs/ext4/types/ext4_super.h"
+
+/* Walks an image once and writes the sidecar that -o snapshot=PATH mounts
+ * it with */
+int main(int argc, char *argv[]) {
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s Disk Snapshot\n", argv[0]);
+        return 1;
+    }
+
+    if (disk_open(argv[1]) < 0) {
+        fprintf(stderr, "Error: Unable to open disk '%s'\n", argv[1]);
+        return 1;
+    }
+
+    uint16_t magic;
+    disk_read(BOOT_SECTOR_SIZE + offsetof(struct ext4_super_block, s_magic),
+              sizeof(magic), &magic);
+    if (magic != 0xEF53) {
+        fprintf(stderr, "Error: '%s' doesn't contain an EXT4 filesystem\n", argv[1]);
+        disk_close();
+        return 1;
+    }
+
+    if (super_fill() != 0 || super_group_fill() != 0 || inode_init() != 0) {
+        fprintf(stderr, "Error: Unable to read the filesystem in '%s'\n", argv[1]);
+        disk_close();
+        return 1;
+    }
+
+    if (snapshot_write(argv[2]) != 0) {
+        fprintf(stderr, "Error: Unable to write snapshot '%s': %s\n", argv[2],
+                strerror(errno));
+        disk_close();
+        return 1;
+    }
+
+    disk_close();
+    return 0;
+}
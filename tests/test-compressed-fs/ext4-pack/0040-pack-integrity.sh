@@ -0,0 +1,40 @@
+#!/bin/bash
+function t0040 {
+    FUSE_MD5=$(md5sum $MOUNTPOINT/`basename $TMP_FILE` | cut -d\  -f1)
+    PACK_MD5=$(./compression-reader ${FS}.zst 0 $FS_SIZE | md5sum | cut -d\  -f1)
+}
+
+function t0040-check {
+    [ "$FUSE_MD5" = "$FILE_MD5" ] && [ "$PACK_MD5" = "$FS_MD5" ]
+}
+
+set -e
+source `dirname $0`/lib.sh
+
+# Make a random file, and store the md5
+TMP_FILE=`mktemp`
+dd if=/dev/urandom of=$TMP_FILE bs=1024 count=$((1024 * 16)) &> /dev/null
+FILE_MD5=`md5sum $TMP_FILE | cut -d\  -f1`
+
+e4test_make_LOGFILE
+e4test_make_FS ${PACK_FS_SIZE_MB:-32}
+
+# Copy the file to the FS
+e4test_debugfs_write $TMP_FILE
+
+# Free blocks are packed as zeros, which is all they hold in a new FS, so
+# the whole pack reads back as the image
+FS_SIZE=`stat -c %s $FS`
+FS_MD5=`md5sum $FS | cut -d\  -f1`
+
+# Check the md5 of the file through fuse, and of the image through the
+# compression reader, on the pack
+e4test_make_MOUNTPOINT
+e4test_fuse_mount
+e4test_run t0040
+e4test_fuse_umount
+
+rm $FS
+rm $TMP_FILE
+
+e4test_end t0040-check
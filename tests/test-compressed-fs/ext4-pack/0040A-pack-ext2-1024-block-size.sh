@@ -0,0 +1,8 @@
+#!/bin/bash
+export TEST_MKE2FS_USE_EXT2=1
+export MKE2FS_EXTRA_OPTIONS="-b 1024"
+
+set -e
+source `dirname $0`/lib.sh
+
+source `dirname $0`/0040-pack-integrity.sh
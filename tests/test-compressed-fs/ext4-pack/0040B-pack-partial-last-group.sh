@@ -0,0 +1,9 @@
+#!/bin/bash
+# 40 MiB of 4 KiB blocks in groups of 4096 blocks, the last holding 2048
+export MKE2FS_EXTRA_OPTIONS="-b 4096 -g 4096"
+export PACK_FS_SIZE_MB=40
+
+set -e
+source `dirname $0`/lib.sh
+
+source `dirname $0`/0040-pack-integrity.sh
@@ -0,0 +1,177 @@
+MKE2FS=`which mke2fs || echo /sbin/mke2fs`
+DEBUGFS=`which debugfs || echo /sbin/debugfs`
+
+# Default to ext4
+MKE2FS_TYPE=ext4
+[ -n "$TEST_MKE2FS_USE_EXT2" ] && MKE2FS_TYPE=ext2
+[ -n "$TEST_MKE2FS_USE_EXT3" ] && MKE2FS_TYPE=ext3
+
+function e4test_init {
+    echo -n `basename $0`
+    TIMING_SLEEP=0
+}
+
+function e4test_declare_slow {
+    if [ -n "$SKIP_SLOW_TESTS" ] ; then
+        echo ": SKIPPED"
+        exit 0
+    fi
+}
+
+function e4test_sleep {
+    sleep $1
+    if [ -n "$TIMING_START" -a -z "$TIMING_END" ] ; then
+        TIMING_SLEEP=$(($TIMING_SLEEP + $1 * 1000000000))
+    fi
+}
+
+function e4test_make_LOGFILE {
+    export LOGFILE="logs/ext4-zstd/`basename $0 | cut -d\- -f1`-`date +%y%m%d-%H:%M.%S`"
+    mkdir -p `dirname $LOGFILE`
+}
+
+function e4test_make_MOUNTPOINT {
+    [ ! -f "$FS" ] && echo "No FS"
+    export MOUNTPOINT="$FS-mount"
+}
+
+function e4test_make_FS {
+    if test ! -f $MKE2FS
+    then
+        echo ": SKIPPED (no mke2fs binary found)"
+        exit 0
+    fi
+    export FS=`mktemp /tmp/spotlight-test.XXXXXXXX`
+    dd if=/dev/zero of=$FS bs=$((1024 * 1024)) count=$1 &> /dev/null
+    $MKE2FS $MKE2FS_EXTRA_OPTIONS -F -t $MKE2FS_TYPE $FS &> /dev/null
+}
+
+function e4test_mount {
+    mkdir $MOUNTPOINT
+    sudo mount -o loop -t $MKE2FS_TYPE $FS $MOUNTPOINT
+    sudo chown $USER $MOUNTPOINT
+}
+
+function __e4test_debugfs_precheck {
+    if test ! -f $DEBUGFS
+    then
+        echo ": SKIPPED (no debugfs binary found)"
+        exit 0
+    fi
+}
+
+function e4test_debugfs_write {
+    __e4test_debugfs_precheck
+    $DEBUGFS -w $FS -R "write $1 `basename $1`" &> /dev/null
+}
+
+# Writes a 32-bit value in little-endian order
+function zstd_le32 {
+    printf '\\x%02x\\x%02x\\x%02x\\x%02x' $(($1 & 255)) $(($1 >> 8 & 255)) \
+        $(($1 >> 16 & 255)) $(($1 >> 24 & 255))
+}
+
+# Compresses $1 into $1.zst in the zstd seekable format, as frames of $2
+# bytes each followed by a seek table
+function zstd_seekable {
+    local frames=`mktemp -d`
+    local table=""
+    local count=0
+
+    split -b $2 -a 6 -d "$1" "$frames/frame."
+    : > "$1.zst"
+    for F in "$frames"/frame.*; do
+        zstd -q -f -9 "$F" -o "$F.zst"
+        cat "$F.zst" >> "$1.zst"
+        table="$table`zstd_le32 $(stat -c %s "$F.zst")`"
+        table="$table`zstd_le32 $(stat -c %s "$F")`"
+        count=$(($count + 1))
+    done
+
+    # Seek table skippable frame, with a footer of no checksums
+    printf "`zstd_le32 0x184D2A5E``zstd_le32 $((8 * $count + 9))`$table" \
+        >> "$1.zst"
+    printf "`zstd_le32 $count`\\x00`zstd_le32 0x8F92EAB1`" >> "$1.zst"
+    rm -rf "$frames"
+}
+
+function e4test_fuse_mount {
+    mkdir $MOUNTPOINT
+    zstd_seekable $FS 262144
+    if [ -z "$LOGFILE" ]
+    then
+        ./spotlight ${FS}.zst $MOUNTPOINT 2>> "$LOGFILE"
+    else
+        ./spotlight ${FS}.zst $MOUNTPOINT -o logfile=$LOGFILE 2>> "$LOGFILE"
+    fi
+}
+
+function e4test_fuse_mount_callgrind {
+    mkdir $MOUNTPOINT
+    zstd_seekable $FS 262144
+    if [ -z "$LOGFILE" ]
+    then
+        valgrind --tool=callgrind ./spotlight ${FS}.zst $MOUNTPOINT
+    else
+        valgrind --tool=callgrind ./spotlight ${FS}.zst $MOUNTPOINT -o logfile=$LOGFILE
+    fi
+}
+
+function e4test_umount {
+    while ! sudo umount $MOUNTPOINT 2> /dev/null
+    do
+        sleep .1
+    done
+    rmdir $MOUNTPOINT
+}
+
+function e4test_fuse_umount {
+    while ! fusermount -u $MOUNTPOINT 2> /dev/null
+    do
+        sleep .1
+    done
+    sleep 0.2           # Dirty hack: sometimes rmdir comes to fast...
+    rmdir $MOUNTPOINT
+    rm -f ${FS}.zst
+}
+
+function e4test_mountpoint_struct_md5 {
+    # Here we skip lost+found since user doesn't normally have permission to
+    # read it.  find(1) sure has a trippy syntax...
+    find $MOUNTPOINT -name lost+found -prune -o -name \* | sort | md5sum | cut -d\  -f1
+}
+
+function e4test_run {
+    echo -n ': '
+    TEST_TIMES=10
+    TIMING_START=`date +%s%N`
+    for i in `seq 1 $TEST_TIMES`
+    do
+        $1
+    done
+    TIMING_END=`date +%s%N`
+    TIMING_DIFF=$(($TIMING_END - $TIMING_START))
+    TIMING_DIFF=$(($TIMING_DIFF - $TIMING_SLEEP))
+    TIMING_DIFF=$(($TIMING_DIFF / $TEST_TIMES))
+    TIMING_DIFF_SECS=$((TIMING_DIFF / 1000000000))
+    TIMING_DIFF_NSECS=$((TIMING_DIFF % 1000000000))
+    TIMING_DIFF_MSECS=$((TIMING_DIFF_NSECS / 1000000))
+}
+
+function e4test_end {
+    if [ ! -z "$1" ] ; then
+        if ! $1 ; then
+            echo FAIL
+            return 1
+        fi
+    fi
+
+    if test -n "$LOGFILE" && grep ASSERT $LOGFILE ; then
+        echo FAIL
+        return 1
+    fi
+
+    printf "PASS [%d.%03ds]\n" $TIMING_DIFF_SECS $TIMING_DIFF_MSECS
+}
+
+e4test_init
@@ -0,0 +1,37 @@
+#!/usr/bin/env bash
+
+echo -n "`basename $0`: "
+
+BINARY="./compression-reader"
+TEST_DATA_BZIP2="test-compression/bzip2/test-data-10mb.bin.bz2"
+
+TEST_DATA="test-compression/test-data-10mb.bin"
+
+function check {
+    # Unsorted, adjacent and far apart ranges, read in one go
+    ranges="5000000 65536 123456 4096 127552 300000 9000000 777 0 1"
+
+    # Missing data would otherwise compare equal to missing output
+    [ -s "$TEST_DATA" -a -s "$TEST_DATA_BZIP2" ] || return 1
+
+    "${BINARY}" "${TEST_DATA_BZIP2}" $ranges > "$temp_file" 2> "$LOGFILE" || return 1
+
+    set -- $ranges
+    while [ $# -gt 0 ]; do
+        tail -c +$(($1 + 1)) "$TEST_DATA" | head -c $2
+        shift 2
+    done > "$expected_file"
+
+    cmp -s "$temp_file" "$expected_file"
+}
+
+export LOGFILE="logs/bzip2/`basename $0 | cut -d\- -f1`-`date +%y%m%d-%H:%M.%S`"
+mkdir -p `dirname $LOGFILE`
+temp_file=$(mktemp)
+expected_file=$(mktemp)
+ if [ ! -z check ] && ! check; then
+     echo "FAIL"
+ else
+     echo "PASS"
+ fi
+rm "$temp_file" "$expected_file"
@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+
+echo -n "`basename $0`: "
+
+BINARY="./compression-reader"
+
+TEST_DATA="test-compression/test-data-1mb.bin"
+
+function check {
+    # Data with long runs of zeros, as in the free space of images
+    {
+        cat "$TEST_DATA"
+        head -c 3145728 /dev/zero
+        cat "$TEST_DATA"
+        head -c 2000000 /dev/zero
+        head -c 4096 "$TEST_DATA"
+    } > "$data_file"
+    xz -c --block-size=1MiB "$data_file" > "$compressed_file"
+
+    # Ranges in, across and between runs, read in one go and then one by one
+    ranges="1048000 4096 1100000 65536 1048576 3145728 4000000 500000 5242000 2000000 0 7246976"
+
+    "${BINARY}" "$compressed_file" $ranges > "$temp_file" 2> "$LOGFILE"
+    set -- $ranges
+    while [ $# -gt 0 ]; do
+        "${BINARY}" "$compressed_file" $1 $2 >> "$temp_file" 2>> "$LOGFILE"
+        shift 2
+    done
+
+    for pass in 1 2; do
+        set -- $ranges
+        while [ $# -gt 0 ]; do
+            tail -c +$(($1 + 1)) "$data_file" | head -c $2
+            shift 2
+        done
+    done > "$expected_file"
+
+    cmp -s "$temp_file" "$expected_file"
+}
+
+export LOGFILE="logs/xz/`basename $0 | cut -d\- -f1`-`date +%y%m%d-%H:%M.%S`"
+mkdir -p `dirname $LOGFILE`
+temp_file=$(mktemp)
+expected_file=$(mktemp)
+data_file=$(mktemp)
+compressed_file=$(mktemp)
+ if [ ! -z check ] && ! check; then
+     echo "FAIL"
+ else
+     echo "PASS"
+ fi
+rm "$temp_file" "$expected_file" "$data_file" "$compressed_file"
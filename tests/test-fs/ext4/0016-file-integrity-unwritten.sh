@@ -0,0 +1,57 @@
+#!/bin/bash
+function t0016 {
+    FUSE_MD5=$(md5sum $MOUNTPOINT/`basename $TMP_FILE` | cut -d\  -f1)
+    FUSE_HOLES_MD5=$(md5sum $MOUNTPOINT/`basename $TMP_FILE.holes` | cut -d\  -f1)
+}
+
+function t0016-check {
+    [ "$FUSE_MD5" = "$FILE_MD5" -a "$FUSE_HOLES_MD5" = "$HOLES_MD5" ]
+}
+
+set -e
+source `dirname $0`/lib.sh
+
+# Make a 4MB file that is zeros but for 4k in the middle, and a file of 40
+# 4k pieces with 8k holes between them, and store the md5s
+TMP_FILE=`mktemp`
+dd if=/dev/urandom of=$TMP_FILE.rnd bs=1024 count=4 &> /dev/null
+dd if=/dev/zero of=$TMP_FILE bs=1024 seek=4096 count=0 &> /dev/null
+dd if=$TMP_FILE.rnd of=$TMP_FILE bs=1024 seek=2048 conv=notrunc &> /dev/null
+FILE_MD5=`md5sum $TMP_FILE | cut -d\  -f1`
+for x in `seq 0 39`; do
+    dd if=$TMP_FILE.rnd of=$TMP_FILE.holes bs=1024 seek=$((x * 12)) conv=notrunc &> /dev/null
+done
+HOLES_MD5=`md5sum $TMP_FILE.holes | cut -d\  -f1`
+
+e4test_make_LOGFILE
+e4test_make_FS 8
+e4test_make_MOUNTPOINT
+
+e4test_mount
+
+# Leave random data behind in the free blocks
+dd if=/dev/urandom of=$MOUNTPOINT/filler bs=1024 count=6144 &> /dev/null || true
+rm $MOUNTPOINT/filler
+sync
+
+# Test A: preallocate, so that all but what is written stays unwritten
+NEWTMP=$MOUNTPOINT/`basename $TMP_FILE`
+fallocate -l 4194304 $NEWTMP
+dd if=$TMP_FILE.rnd of=$NEWTMP bs=1024 seek=2048 conv=notrunc &> /dev/null
+
+# Test B: enough extents, holes between them, for an extent tree of depth 1
+cp --sparse=always $TMP_FILE.holes $MOUNTPOINT
+
+e4test_umount
+
+# Check the md5s after mount using fuse
+e4test_fuse_mount
+e4test_run t0016
+e4test_fuse_umount
+
+rm $FS
+rm $TMP_FILE
+rm $TMP_FILE.rnd
+rm $TMP_FILE.holes
+
+e4test_end t0016-check
@@ -0,0 +1,7 @@
+#!/bin/bash
+export TEST_FUSE_USE_SNAPSHOT=1
+
+set -e
+source `dirname $0`/lib.sh
+
+source `dirname $0`/0010-file-integrity.sh
@@ -0,0 +1,42 @@
+#!/bin/bash
+function t0042 {
+    FUSE_MD5=$(md5sum $MOUNTPOINT/`basename $TMP_FILE` | cut -d\  -f1)
+}
+
+function t0042-check {
+    [ "$FUSE_MD5" = "$FILE_MD5" ]
+}
+
+set -e
+source `dirname $0`/lib.sh
+
+TMP_FILE=`mktemp`
+
+e4test_make_LOGFILE
+
+# Snapshot an image holding a file of the same name but other data
+dd if=/dev/urandom of=$TMP_FILE bs=1024 count=1024 &> /dev/null
+e4test_make_FS 32
+e4test_debugfs_write $TMP_FILE
+OTHER_FS=$FS
+./spotlight-snapshot $OTHER_FS $OTHER_FS.snap > /dev/null
+
+# Make a random file, and store the md5
+dd if=/dev/urandom of=$TMP_FILE bs=1024 count=$((1024 * 16)) &> /dev/null
+FILE_MD5=`md5sum $TMP_FILE | cut -d\  -f1`
+
+e4test_make_FS 32
+e4test_debugfs_write $TMP_FILE
+
+# The snapshot must be ignored, its block map would read the other data
+e4test_make_MOUNTPOINT
+e4test_fuse_mount -o snapshot=$OTHER_FS.snap
+e4test_run t0042
+e4test_fuse_umount
+
+rm $FS
+rm $OTHER_FS
+rm $OTHER_FS.snap
+rm $TMP_FILE
+
+e4test_end t0042-check
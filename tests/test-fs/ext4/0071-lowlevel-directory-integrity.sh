@@ -0,0 +1,7 @@
+#!/bin/bash
+export TEST_FUSE_OPTIONS="-o lowlevel"
+
+set -e
+source `dirname $0`/lib.sh
+
+source `dirname $0`/0020-directory-integrity
@@ -65,13 +65,21 @@ function e4test_debugfs_write {
     $DEBUGFS -w $FS -R "write $1 `basename $1`" &> /dev/null
 }
 
+# Mounts $FS with any options given, e.g. "-o hydrate", and those in
+# $TEST_FUSE_OPTIONS.  With $TEST_FUSE_USE_SNAPSHOT set, $FS is snapshotted
+# first and mounted with the snapshot.
 function e4test_fuse_mount {
     mkdir $MOUNTPOINT
+    if [ -n "$TEST_FUSE_USE_SNAPSHOT" ]
+    then
+        ./spotlight-snapshot $FS $FS.snap > /dev/null
+        set -- "$@" -o snapshot=$FS.snap
+    fi
     if [ -z "$LOGFILE" ]
     then
-        ./spotlight $FS $MOUNTPOINT
+        ./spotlight $FS $MOUNTPOINT $TEST_FUSE_OPTIONS "$@"
     else
-        ./spotlight $FS $MOUNTPOINT -o logfile=$LOGFILE
+        ./spotlight $FS $MOUNTPOINT -o logfile=$LOGFILE $TEST_FUSE_OPTIONS "$@"
     fi
 }
 
@@ -100,6 +108,7 @@ function e4test_fuse_umount {
     done
     sleep 0.2           # Dirty hack: sometimes rmdir comes to fast...
     rmdir $MOUNTPOINT
+    rm -f $FS.snap
 }
 
 function e4test_mountpoint_struct_md5 {